@@ -0,0 +1,339 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements EPT-based code coverage functions.
+
+#include "coverage.h"
+#include <ntimage.h>
+#define NTSTRSAFE_NO_CB_FUNCTIONS
+#include <ntstrsafe.h>
+#include "../HyperPlatform/HyperPlatform/kernel_stl.h"
+#include <vector>
+#include <algorithm>
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#include "../HyperPlatform/HyperPlatform/util.h"
+#include "../HyperPlatform/HyperPlatform/ept.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A value of first_offsets for pages not executed yet
+static const USHORT kCovpNotExecuted = 0xffff;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Represents a page monitored for coverage
+struct CoveredPage {
+  ULONG64 pa_base;
+  ULONG index;  // An index of the page from an image base
+};
+
+// Holds coverage of an image
+struct CoverageData {
+  void* image_base;
+  ULONG size_of_image;
+  ULONG time_date_stamp;
+  ULONG page_count;
+  char image_name[32];
+
+  // Monitored pages sorted by pa_base for binary search on VM-exit
+  std::vector<CoveredPage> pages;
+
+  std::vector<UCHAR> bitmap;
+  std::vector<USHORT> first_offsets;
+  volatile LONG executed_pages;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool CovpIsCoverableSection(
+    _In_ const IMAGE_SECTION_HEADER& section);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    CovpWriteCoverageFile(_In_ const CoverageData& data,
+                          _In_ const wchar_t* file_path);
+
+static const CoveredPage* CovpFindCoveredPageByPa(
+    _In_ const CoverageData& data, _In_ ULONG64 pa);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, CovInitialization)
+#pragma alloc_text(INIT, CovStart)
+#pragma alloc_text(INIT, CovpIsCoverableSection)
+#pragma alloc_text(PAGE, CovTermination)
+#pragma alloc_text(PAGE, CovpWriteCoverageFile)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Coverage of a target image. It is not modified after CovStart() except for
+// the bitmap and offsets, so VM-exit handlers access it without a lock. They
+// read it only once since it is cleared by CovTermination().
+static CoverageData* g_covp_data;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Collects executable pages of the image to monitor. Only pages present at
+// this moment are monitored since paged-out pages may later be mapped to
+// different physical addresses.
+_Use_decl_annotations_ EXTERN_C NTSTATUS
+CovInitialization(void* image_base, const char* image_name) {
+  PAGED_CODE();
+
+  const auto base = reinterpret_cast<ULONG_PTR>(image_base);
+  const auto dos = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+  const auto nt = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos->e_lfanew);
+
+  auto data = new CoverageData();
+  data->image_base = image_base;
+  data->size_of_image = nt->OptionalHeader.SizeOfImage;
+  data->time_date_stamp = nt->FileHeader.TimeDateStamp;
+  data->page_count = BYTES_TO_PAGES(data->size_of_image);
+  RtlStringCchCopyNA(data->image_name, RTL_NUMBER_OF(data->image_name),
+                     image_name, RTL_NUMBER_OF(data->image_name) - 1);
+  // Allocate in a unit of LONG for InterlockedBitTestAndSet()
+  data->bitmap.resize((data->page_count + 31) / 32 * sizeof(LONG));
+  data->first_offsets.resize(data->page_count, kCovpNotExecuted);
+
+  const auto sections = IMAGE_FIRST_SECTION(nt);
+  for (auto i = 0ul; i < nt->FileHeader.NumberOfSections; ++i) {
+    const auto& section = sections[i];
+    if (!CovpIsCoverableSection(section)) {
+      continue;
+    }
+
+    const auto first_index = section.VirtualAddress >> PAGE_SHIFT;
+    const auto pages = BYTES_TO_PAGES(section.Misc.VirtualSize);
+    for (auto index = first_index; index < first_index + pages; ++index) {
+      const auto va = reinterpret_cast<void*>(base + index * PAGE_SIZE);
+      if (!UtilIsAccessibleAddress(va)) {
+        continue;
+      }
+      data->pages.push_back({UtilPaFromVa(va), index});
+    }
+  }
+  if (data->pages.empty()) {
+    delete data;
+    return STATUS_NOT_FOUND;
+  }
+
+  std::sort(data->pages.begin(), data->pages.end(),
+            [](const auto& lhs, const auto& rhs) {
+              return lhs.pa_base < rhs.pa_base;
+            });
+
+  HYPERPLATFORM_LOG_INFO("Coverage for %s (%p) covers %lu of %lu pages.",
+                         data->image_name, image_base,
+                         static_cast<ULONG>(data->pages.size()),
+                         data->page_count);
+  g_covp_data = data;
+  return STATUS_SUCCESS;
+}
+
+// Starts monitoring execution of the pages
+_Use_decl_annotations_ EXTERN_C NTSTATUS CovStart() {
+  PAGED_CODE();
+
+  const auto status =
+      UtilVmCall(HypercallNumber::kDdimonEnableCoverage, g_covp_data);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  // Other processors may still execute the pages with cached translations
+  return EptFlushTranslations();
+}
+
+// Stops monitoring and saves coverage to the file if specified
+_Use_decl_annotations_ EXTERN_C void CovTermination(const wchar_t* file_path) {
+  PAGED_CODE();
+
+  auto data = g_covp_data;
+  if (!data) {
+    return;
+  }
+
+  auto status = UtilVmCall(HypercallNumber::kDdimonDisableCoverage, data);
+  NT_VERIFY(NT_SUCCESS(status));
+  status = EptFlushTranslations();
+  NT_VERIFY(NT_SUCCESS(status));
+
+  // Stop handlers from seeing the data, and wait until ones that may have seen
+  // it return
+  g_covp_data = nullptr;
+  status = UtilWaitForQuiescence();
+  NT_VERIFY(NT_SUCCESS(status));
+
+  HYPERPLATFORM_LOG_INFO("Coverage for %s: %ld of %lu pages executed.",
+                         data->image_name, data->executed_pages,
+                         static_cast<ULONG>(data->pages.size()));
+  if (file_path) {
+    status = CovpWriteCoverageFile(*data, file_path);
+    if (!NT_SUCCESS(status)) {
+      HYPERPLATFORM_LOG_ERROR("Failed to save coverage (%08x).", status);
+    }
+  }
+  delete data;
+}
+
+// Removes execute permission from the pages so that the first execution of
+// each page causes EPT violation
+_Use_decl_annotations_ void CovVmCallEnableCoverage(EptData* ept_data,
+                                                    void* context) {
+  HYPERPLATFORM_COMMON_DBG_BREAK();
+  const auto data = reinterpret_cast<CoverageData*>(context);
+  for (const auto& page : data->pages) {
+    const auto ept_pt_entry = EptGetEptPtEntry(ept_data, page.pa_base);
+    ept_pt_entry->fields.execute_access = false;
+  }
+  EptCommitChange(ept_data);
+}
+
+// Restores execute permission of the pages
+_Use_decl_annotations_ void CovVmCallDisableCoverage(EptData* ept_data,
+                                                     void* context) {
+  HYPERPLATFORM_COMMON_DBG_BREAK();
+  const auto data = reinterpret_cast<CoverageData*>(context);
+  for (const auto& page : data->pages) {
+    const auto ept_pt_entry = EptGetEptPtEntry(ept_data, page.pa_base);
+    ept_pt_entry->fields.execute_access = true;
+  }
+  EptCommitChange(ept_data);
+}
+
+// Handles EPT violation VM-exit due to execution. Returns false if the fault
+// is not on any of monitored pages. Otherwise, records the page as executed and
+// restores execute permission so that each page costs only one VM-exit.
+_Use_decl_annotations_ bool CovHandleEptViolation(EptData* ept_data,
+                                                  void* fault_va,
+                                                  ULONG64 fault_pa) {
+  const auto data = g_covp_data;
+  if (!data) {
+    return false;
+  }
+  const auto page = CovpFindCoveredPageByPa(*data, fault_pa);
+  if (!page) {
+    return false;
+  }
+
+  const auto bitmap = reinterpret_cast<LONG*>(data->bitmap.data());
+  if (!InterlockedBitTestAndSet(bitmap + page->index / 32, page->index % 32)) {
+    data->first_offsets[page->index] =
+        static_cast<USHORT>(BYTE_OFFSET(fault_va));
+    InterlockedIncrement(&data->executed_pages);
+  }
+
+  const auto ept_pt_entry = EptGetEptPtEntry(ept_data, page->pa_base);
+  ept_pt_entry->fields.execute_access = true;
+  EptCommitChange(ept_data);
+  return true;
+}
+
+// Returns true if the section is executable and stays on memory
+_Use_decl_annotations_ static bool CovpIsCoverableSection(
+    const IMAGE_SECTION_HEADER& section) {
+  PAGED_CODE();
+
+  if (!FlagOn(section.Characteristics, IMAGE_SCN_MEM_EXECUTE) ||
+      FlagOn(section.Characteristics, IMAGE_SCN_MEM_DISCARDABLE)) {
+    return false;
+  }
+  // Pageable code may be moved to other physical pages
+  if (RtlCompareMemory(section.Name, "PAGE", 4) == 4) {
+    return false;
+  }
+  return true;
+}
+
+// Writes coverage to the file in the format described in coverage.h
+_Use_decl_annotations_ static NTSTATUS CovpWriteCoverageFile(
+    const CoverageData& data, const wchar_t* file_path) {
+  PAGED_CODE();
+
+  UNICODE_STRING file_path_u = {};
+  RtlInitUnicodeString(&file_path_u, file_path);
+
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, &file_path_u,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+
+  HANDLE file = nullptr;
+  IO_STATUS_BLOCK io_status = {};
+  auto status = ZwCreateFile(
+      &file, GENERIC_WRITE | SYNCHRONIZE, &oa, &io_status, nullptr,
+      FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  CoverageFileHeader header = {};
+  header.magic = kCoverageFileMagic;
+  header.version = kCoverageFileVersion;
+  header.time_date_stamp = data.time_date_stamp;
+  header.size_of_image = data.size_of_image;
+  header.image_base = reinterpret_cast<ULONG_PTR>(data.image_base);
+  header.page_count = data.page_count;
+  header.covered_pages = static_cast<ULONG>(data.pages.size());
+  header.executed_pages = data.executed_pages;
+  static_assert(sizeof(header.image_name) == sizeof(data.image_name),
+                "Size check");
+  RtlCopyMemory(header.image_name, data.image_name, sizeof(header.image_name));
+
+  struct {
+    const void* buffer;
+    ULONG size;
+  } const chunks[] = {
+      {&header, sizeof(header)},
+      {data.bitmap.data(), (data.page_count + 7) / 8},
+      {data.first_offsets.data(),
+       static_cast<ULONG>(data.first_offsets.size() * sizeof(USHORT))},
+  };
+  for (const auto& chunk : chunks) {
+    status = ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+                         const_cast<void*>(chunk.buffer), chunk.size, nullptr,
+                         nullptr);
+    if (!NT_SUCCESS(status)) {
+      break;
+    }
+  }
+  ZwClose(file);
+  return status;
+}
+
+// Finds a covered page by a physical address
+_Use_decl_annotations_ static const CoveredPage* CovpFindCoveredPageByPa(
+    const CoverageData& data, ULONG64 pa) {
+  const auto pa_base = pa & ~static_cast<ULONG64>(PAGE_SIZE - 1);
+  const auto& pages = data.pages;
+  const auto found = std::lower_bound(
+      pages.cbegin(), pages.cend(), pa_base,
+      [](const auto& page, ULONG64 value) { return page.pa_base < value; });
+  if (found == pages.cend() || found->pa_base != pa_base) {
+    return nullptr;
+  }
+  return &*found;
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to EPT-based code coverage functions.
+
+#ifndef DDIMON_COVERAGE_H_
+#define DDIMON_COVERAGE_H_
+
+#include <fltKernel.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// 'DCOV'; a magic value of a coverage file
+static const ULONG kCoverageFileMagic = 'VOCD';
+
+// A version of a coverage file format
+static const ULONG kCoverageFileVersion = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct EptData;
+
+// A header of a coverage file. A file is laid out as below, and all values are
+// little endian:
+//
+//   CoverageFileHeader
+//   UCHAR  bitmap[(page_count + 7) / 8]    // bit N is set if page N executed
+//   USHORT first_offsets[page_count]       // an offset of the first executed
+//                                          // byte on each page, or 0xffff
+//
+// Page N is the N-th page from image_base. Files of the same image (ie, the
+// same time_date_stamp and size_of_image) can be merged by OR-ing bitmaps.
+#include <pshpack1.h>
+struct CoverageFileHeader {
+  ULONG magic;            // kCoverageFileMagic
+  ULONG version;          // kCoverageFileVersion
+  ULONG time_date_stamp;  // IMAGE_FILE_HEADER::TimeDateStamp of the image
+  ULONG size_of_image;    // IMAGE_OPTIONAL_HEADER::SizeOfImage of the image
+  ULONG64 image_base;     // A base address of the image when recorded
+  ULONG page_count;       // A number of pages in size_of_image
+  ULONG covered_pages;    // A number of pages monitored for coverage
+  ULONG executed_pages;   // A number of pages executed
+  char image_name[32];    // A null-terminated image name
+};
+#include <poppack.h>
+static_assert(sizeof(CoverageFileHeader) == 68, "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+    CovInitialization(_In_ void* image_base, _In_ const char* image_name);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS CovStart();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void CovTermination(
+    _In_opt_ const wchar_t* file_path);
+
+_IRQL_requires_min_(DISPATCH_LEVEL) void CovVmCallEnableCoverage(
+    _In_ EptData* ept_data, _In_ void* context);
+
+_IRQL_requires_min_(DISPATCH_LEVEL) void CovVmCallDisableCoverage(
+    _In_ EptData* ept_data, _In_ void* context);
+
+_IRQL_requires_min_(DISPATCH_LEVEL) bool CovHandleEptViolation(
+    _In_ EptData* ept_data, _In_ void* fault_va, _In_ ULONG64 fault_pa);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_COVERAGE_H_
@@ -6,6 +6,7 @@
 /// Implements DdiMon functions.
 
 #include "ddi_mon.h"
+#include <intrin.h>
 #include <ntimage.h>
 #define NTSTRSAFE_NO_CB_FUNCTIONS
 #include <ntstrsafe.h>
@@ -15,6 +16,13 @@
 #include "../HyperPlatform/HyperPlatform/ept.h"
 #include "shadow_bp.h"
 #include "shadow_bp_internal.h"
+#include "watchpoint.h"
+#include "coverage.h"
+#include "hook_cache.h"
+#include "hook_policy.h"
+#include "integrity.h"
+#include "module_snapshot.h"
+#include "lock_profiler.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -26,6 +34,34 @@
 // constants and macros
 //
 
+// A name of a registry value naming a driver to collect code coverage
+static const wchar_t kDdimonpCoverageTargetValueName[] = L"CoverageTarget";
+
+// A path of a file to save code coverage
+static const wchar_t kDdimonpCoverageFilePath[] = L"\\SystemRoot\\DdiMon.cov";
+
+// A name of a registry value listing images to monitor integrity of code,
+// separated by semicolons (eg, "hal.dll;CI.dll"). ntoskrnl.exe should not be
+// listed since pages with shadow breakpoints are managed by shadow_bp.
+static const wchar_t kDdimonpIntegrityTargetsValueName[] = L"IntegrityTargets";
+
+// A name of a registry value overriding an interval to check integrity of code
+static const wchar_t kDdimonpIntegrityIntervalValueName[] =
+    L"IntegrityInterval";
+
+// A default interval to check integrity of code in seconds
+static const ULONG kDdimonpIntegrityCheckInterval = 10;
+
+// A path of a file to save loaded images to symbolize logs offline
+static const wchar_t kDdimonpModuleSnapshotFilePath[] =
+    L"\\SystemRoot\\DdiMon.mod";
+
+// A name of a registry value enabling the lock profiler
+static const wchar_t kDdimonpLockProfilerValueName[] = L"LockProfiler";
+
+// A name of a registry value enabling the example data watchpoint
+static const wchar_t kDdimonpWatchpointValueName[] = L"WatchKdDebuggerEnabled";
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
@@ -51,6 +87,7 @@ struct LdrDataTableEntry {
   void* entry_point;
   ULONG size_of_image;
   UNICODE_STRING full_dll_name;
+  UNICODE_STRING base_dll_name;
   // ...
 };
 
@@ -84,6 +121,9 @@ _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C static NTSTATUS
 
 static void* DdimonpPcToFileHeader(_In_ void* address);
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static void* DdimonpFindImageBaseByName(
+    _In_ const wchar_t* image_name);
+
 static PVOID NTAPI DdimonpUnsafePcToFileHeader(_In_ PVOID pc_value,
                                                _In_ PVOID* base_of_image);
 
@@ -104,41 +144,71 @@ static ULONG_PTR DdimonpGetCallParameter(_In_ const GpRegisters& gp_regs,
 
 static std::array<char, 5> DdimonpTagToString(_In_ ULONG tag_value);
 
-static void DdimonpPreExQueueWorkItemHandler(_In_ const PatchInformation& info,
-                                             _In_ EptData* ept_data,
-                                             _In_ GpRegisters* gp_regs,
-                                             _In_ ULONG_PTR guest_sp);
+_IRQL_requires_max_(PASSIVE_LEVEL) static std::vector<BreakpointTarget>
+    DdimonpCreateTargetsFromPolicy();
+
+static PredVerdict DdimonpEvaluatePolicy(_In_ const BreakpointHandlerSlot& slot,
+                                         _In_opt_ void* caller,
+                                         _In_ const GpRegisters& gp_regs,
+                                         _In_ ULONG_PTR guest_sp);
+
+static void DdimonpPreExQueueWorkItemHandler(
+    _In_ const PatchInformation& info, _In_ const BreakpointHandlerSlot& slot,
+    _In_ EptData* ept_data, _In_ GpRegisters* gp_regs,
+    _In_ ULONG_PTR guest_sp);
 
 static void DdimonpPreExAllocatePoolWithTagHandler(
-    _In_ const PatchInformation& info, _In_ EptData* ept_data,
-    _In_ GpRegisters* gp_regs, _In_ ULONG_PTR guest_sp);
+    _In_ const PatchInformation& info, _In_ const BreakpointHandlerSlot& slot,
+    _In_ EptData* ept_data, _In_ GpRegisters* gp_regs,
+    _In_ ULONG_PTR guest_sp);
 
 static void DdimonpPostExAllocatePoolWithTagHandler(
-    _In_ const PatchInformation& info, _In_ EptData* ept_data,
-    _In_ GpRegisters* gp_regs, _In_ ULONG_PTR guest_sp);
+    _In_ const PatchInformation& info, _In_ const BreakpointHandlerSlot& slot,
+    _In_ EptData* ept_data, _In_ GpRegisters* gp_regs,
+    _In_ ULONG_PTR guest_sp);
 
-static void DdimonpPreExFreePoolHandler(_In_ const PatchInformation& info,
-                                        _In_ EptData* ept_data,
-                                        _In_ GpRegisters* gp_regs,
-                                        _In_ ULONG_PTR guest_sp);
+static void DdimonpPreExFreePoolHandler(
+    _In_ const PatchInformation& info, _In_ const BreakpointHandlerSlot& slot,
+    _In_ EptData* ept_data, _In_ GpRegisters* gp_regs,
+    _In_ ULONG_PTR guest_sp);
 
 static void DdimonpPreExFreePoolWithTagHandler(
-    _In_ const PatchInformation& info, _In_ EptData* ept_data,
-    _In_ GpRegisters* gp_regs, _In_ ULONG_PTR guest_sp);
+    _In_ const PatchInformation& info, _In_ const BreakpointHandlerSlot& slot,
+    _In_ EptData* ept_data, _In_ GpRegisters* gp_regs,
+    _In_ ULONG_PTR guest_sp);
 
 static void DdimonpPreNtQuerySystemInformationHandler(
-    _In_ const PatchInformation& info, _In_ EptData* ept_data,
-    _In_ GpRegisters* gp_regs, _In_ ULONG_PTR guest_sp);
+    _In_ const PatchInformation& info, _In_ const BreakpointHandlerSlot& slot,
+    _In_ EptData* ept_data, _In_ GpRegisters* gp_regs,
+    _In_ ULONG_PTR guest_sp);
 
 static void DdimonpPostNtQuerySystemInformationHandler(
-    _In_ const PatchInformation& info, _In_ EptData* ept_data,
-    _In_ GpRegisters* gp_regs, _In_ ULONG_PTR guest_sp);
+    _In_ const PatchInformation& info, _In_ const BreakpointHandlerSlot& slot,
+    _In_ EptData* ept_data, _In_ GpRegisters* gp_regs,
+    _In_ ULONG_PTR guest_sp);
+
+static void DdimonpPreKeAcquireSpinLockHandler(
+    _In_ const PatchInformation& info, _In_ const BreakpointHandlerSlot& slot,
+    _In_ EptData* ept_data, _In_ GpRegisters* gp_regs,
+    _In_ ULONG_PTR guest_sp);
+
+static void DdimonpPreKeReleaseSpinLockHandler(
+    _In_ const PatchInformation& info, _In_ const BreakpointHandlerSlot& slot,
+    _In_ EptData* ept_data, _In_ GpRegisters* gp_regs,
+    _In_ ULONG_PTR guest_sp);
+
+static void DdimonpPreKeReleaseInStackQueuedSpinLockHandler(
+    _In_ const PatchInformation& info, _In_ const BreakpointHandlerSlot& slot,
+    _In_ EptData* ept_data, _In_ GpRegisters* gp_regs,
+    _In_ ULONG_PTR guest_sp);
 
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(INIT, DdimonInitialization)
 #pragma alloc_text(INIT, DdimonpInitializePcToFileHeader)
+#pragma alloc_text(INIT, DdimonpFindImageBaseByName)
 #pragma alloc_text(INIT, DdimonpEnumExportedSymbols)
 #pragma alloc_text(INIT, DdimonpEnumExportedSymbolsCallback)
+#pragma alloc_text(INIT, DdimonpCreateTargetsFromPolicy)
 #pragma alloc_text(PAGE, DdimonTermination)
 #endif
 
@@ -150,6 +220,21 @@ static void DdimonpPostNtQuerySystemInformationHandler(
 // An address of PsLoadedModuleList
 static LIST_ENTRY* g_ddimonp_PsLoadedModuleList;
 
+// Handlers that a hook policy manifest can bind by PolicyHandlerId
+static const BreakpointHandlerType kDdimonpPolicyHandlers[][2] = {
+    {nullptr, nullptr},
+    {DdimonpPreExQueueWorkItemHandler, nullptr},
+    {DdimonpPreExAllocatePoolWithTagHandler,
+     DdimonpPostExAllocatePoolWithTagHandler},
+    {DdimonpPreExFreePoolHandler, nullptr},
+    {DdimonpPreExFreePoolWithTagHandler, nullptr},
+    {DdimonpPreNtQuerySystemInformationHandler,
+     DdimonpPostNtQuerySystemInformationHandler},
+};
+static_assert(RTL_NUMBER_OF(kDdimonpPolicyHandlers) ==
+                  static_cast<ULONG>(PolicyHandlerId::kMaximum),
+              "Size check");
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // implementations
@@ -157,7 +242,8 @@ static LIST_ENTRY* g_ddimonp_PsLoadedModuleList;
 
 // Initializes DdiMon
 _Use_decl_annotations_ EXTERN_C NTSTATUS
-DdimonInitialization(PDRIVER_OBJECT driver_object) {
+DdimonInitialization(PDRIVER_OBJECT driver_object,
+                     PUNICODE_STRING registry_path) {
   // Defines where to set breakpoints and their handlers
   //
   // Because of simplified imlementation of DdiMon, it is unable to handle any
@@ -209,6 +295,32 @@ DdimonInitialization(PDRIVER_OBJECT driver_object) {
       },
   };
 
+  // Defines acquire and release DDIs of spin locks used in the lock profiler
+  // mode. Only DDIs that are never called above DISPATCH_LEVEL are listed.
+  // Locks acquired at DISPATCH_LEVEL with KeAcquireSpinLockAtDpcLevel() and
+  // ones acquired by inlined code are not observed.
+  BreakpointTarget lock_profiler_targets[] = {
+      {
+          RTL_CONSTANT_STRING(L"KEACQUIRESPINLOCKRAISETODPC"),
+          DdimonpPreKeAcquireSpinLockHandler, nullptr,
+      },
+      {
+          RTL_CONSTANT_STRING(L"KEACQUIREINSTACKQUEUEDSPINLOCK"),
+          DdimonpPreKeAcquireSpinLockHandler, nullptr,
+      },
+      {
+          RTL_CONSTANT_STRING(L"KERELEASESPINLOCK"),
+          DdimonpPreKeReleaseSpinLockHandler, nullptr,
+      },
+      {
+          RTL_CONSTANT_STRING(L"KERELEASEINSTACKQUEUEDSPINLOCK"),
+          DdimonpPreKeReleaseInStackQueuedSpinLockHandler, nullptr,
+      },
+      {
+          {}, nullptr, nullptr,  // end of targets
+      },
+  };
+
   HYPERPLATFORM_COMMON_DBG_BREAK();
 
   // Make DdimonpPcToFileHeader() avaialable for use
@@ -223,24 +335,179 @@ DdimonInitialization(PDRIVER_OBJECT driver_object) {
     return STATUS_UNSUCCESSFUL;
   }
 
+  // Use a hook policy manifest instead of the above targets if it is given
+  // via the HookPolicy value under the registry key of the driver
+  std::vector<BreakpointTarget> policy_targets;
+  status = PolicyInitialization(registry_path);
+  if (NT_SUCCESS(status)) {
+    policy_targets = DdimonpCreateTargetsFromPolicy();
+  } else if (status != STATUS_NOT_FOUND) {
+    return status;
+  }
+
+  // Profile spin locks instead of monitoring the above targets if it is
+  // enabled via the LockProfiler value under the registry key of the driver
+  auto targets =
+      (policy_targets.empty()) ? breakpoint_targets : policy_targets.data();
+  if (UtilQueryRegistryDword(registry_path, kDdimonpLockProfilerValueName)) {
+    status = LockprofInitialization();
+    if (!NT_SUCCESS(status)) {
+      PolicyTermination();
+      return status;
+    }
+    targets = lock_profiler_targets;
+  }
+
   status = SbpInitialization();
   if (!NT_SUCCESS(status)) {
+    LockprofTermination();
+    PolicyTermination();
     return status;
   }
 
-  // Initialize a container of breakpoint objects and create them by enumerating
-  // exported symbols by ntoskrnl
-  status = DdimonpEnumExportedSymbols(reinterpret_cast<ULONG_PTR>(nt_base),
-                                      DdimonpEnumExportedSymbolsCallback,
-                                      breakpoint_targets);
+  // Create breakpoint objects from the hook resolution cache if ntoskrnl and
+  // the targets are unchanged since the cache was saved. Otherwise, create
+  // them by enumerating exported symbols by ntoskrnl and save the cache.
+  status = HookcacheInitialization(registry_path, nt_base, targets);
+  if (NT_SUCCESS(status) && !HookcacheCreateBreakpoints()) {
+    status = DdimonpEnumExportedSymbols(reinterpret_cast<ULONG_PTR>(nt_base),
+                                        DdimonpEnumExportedSymbolsCallback,
+                                        targets);
+    if (NT_SUCCESS(status)) {
+      const auto save_status = HookcacheSave();
+      if (!NT_SUCCESS(save_status)) {
+        HYPERPLATFORM_LOG_WARN("Failed to save a hook resolution cache (%08x).",
+                               save_status);
+      }
+    }
+  }
+  HookcacheTermination();
   if (!NT_SUCCESS(status)) {
     SbpTermination();
+    LockprofTermination();
+    PolicyTermination();
     return status;
   }
 
   status = SbpStart();
   if (!NT_SUCCESS(status)) {
     SbpTermination();
+    LockprofTermination();
+    PolicyTermination();
+    return status;
+  }
+
+  // Watch write access to KdDebuggerEnabled as an example of a data watchpoint
+  // if it is enabled via the WatchKdDebuggerEnabled value under the registry
+  // key of the driver
+  status = WpInitialization();
+  if (!NT_SUCCESS(status)) {
+    SbpTermination();
+    LockprofTermination();
+    PolicyTermination();
+    return status;
+  }
+  if (UtilQueryRegistryDword(registry_path, kDdimonpWatchpointValueName)) {
+    status = WpCreateWatchpoint(KdDebuggerEnabled, sizeof(*KdDebuggerEnabled),
+                                WatchpointAccess::kWrite, nullptr,
+                                "KdDebuggerEnabled");
+  }
+  if (NT_SUCCESS(status)) {
+    status = WpStart();
+  }
+  if (!NT_SUCCESS(status)) {
+    WpTermination();
+    SbpTermination();
+    LockprofTermination();
+    PolicyTermination();
+    return status;
+  }
+
+  // Collect code coverage of a driver if its name is given via the
+  // CoverageTarget value under the registry key of the driver and it is loaded
+  wchar_t coverage_target_name[32] = {};
+  const auto coverage_target =
+      (UtilQueryRegistryString(registry_path, kDdimonpCoverageTargetValueName,
+                               coverage_target_name,
+                               sizeof(coverage_target_name)))
+          ? DdimonpFindImageBaseByName(coverage_target_name)
+          : nullptr;
+  if (coverage_target) {
+    char image_name[32] = {};
+    RtlStringCchPrintfA(image_name, RTL_NUMBER_OF(image_name), "%S",
+                        coverage_target_name);
+    status = CovInitialization(coverage_target, image_name);
+    if (NT_SUCCESS(status)) {
+      status = CovStart();
+      if (!NT_SUCCESS(status)) {
+        CovTermination(nullptr);
+      }
+    }
+    if (!NT_SUCCESS(status)) {
+      WpTermination();
+      SbpTermination();
+      LockprofTermination();
+      PolicyTermination();
+      return status;
+    }
+  }
+
+  // Monitor integrity of code of images if they are listed in the
+  // IntegrityTargets value under the registry key of the driver
+  wchar_t integrity_target_names[128] = {};
+  const auto integrity_enabled = UtilQueryRegistryString(
+      registry_path, kDdimonpIntegrityTargetsValueName, integrity_target_names,
+      sizeof(integrity_target_names));
+  if (integrity_enabled) {
+    auto check_interval = UtilQueryRegistryDword(
+        registry_path, kDdimonpIntegrityIntervalValueName);
+    if (!check_interval) {
+      check_interval = kDdimonpIntegrityCheckInterval;
+    }
+    status = IntegInitialization(check_interval);
+    for (auto target_name = integrity_target_names;
+         target_name && NT_SUCCESS(status);) {
+      const auto separator = wcschr(target_name, L';');
+      if (separator) {
+        *separator = L'\0';
+      }
+      const auto target = DdimonpFindImageBaseByName(target_name);
+      if (target) {
+        char image_name[32] = {};
+        RtlStringCchPrintfA(image_name, RTL_NUMBER_OF(image_name), "%S",
+                            target_name);
+        status = IntegAddImage(target, image_name);
+      }
+      target_name = (separator) ? separator + 1 : nullptr;
+    }
+  }
+  if (integrity_enabled && NT_SUCCESS(status)) {
+    status = IntegStart();
+    if (status == STATUS_NOT_FOUND) {
+      // None of the target images is loaded
+      IntegTermination();
+      status = STATUS_SUCCESS;
+    }
+  }
+  if (!NT_SUCCESS(status)) {
+    IntegTermination();
+    CovTermination(nullptr);
+    WpTermination();
+    SbpTermination();
+    LockprofTermination();
+    PolicyTermination();
+    return status;
+  }
+
+  // Record loaded images so that addresses in logs can be symbolized offline
+  status = ModsnapInitialization(kDdimonpModuleSnapshotFilePath);
+  if (!NT_SUCCESS(status)) {
+    IntegTermination();
+    CovTermination(nullptr);
+    WpTermination();
+    SbpTermination();
+    LockprofTermination();
+    PolicyTermination();
     return status;
   }
 
@@ -252,7 +519,13 @@ DdimonInitialization(PDRIVER_OBJECT driver_object) {
 _Use_decl_annotations_ EXTERN_C void DdimonTermination() {
   PAGED_CODE();
   HYPERPLATFORM_COMMON_DBG_BREAK();
+  ModsnapTermination();
+  IntegTermination();
+  CovTermination(kDdimonpCoverageFilePath);
+  WpTermination();
   SbpTermination();
+  LockprofTermination();
+  PolicyTermination();
 }
 
 // Saves PsLoadedModuleList that is referenced by DdimonpUnsafePcToFileHeader().
@@ -276,6 +549,26 @@ _Use_decl_annotations_ static void* DdimonpPcToFileHeader(void* address) {
   return DdimonpUnsafePcToFileHeader(address, &base);
 }
 
+// Returns a base address of a loaded image with the name, or nullptr. It is as
+// unsafe as DdimonpUnsafePcToFileHeader().
+_Use_decl_annotations_ static void* DdimonpFindImageBaseByName(
+    const wchar_t* image_name) {
+  PAGED_CODE();
+
+  UNICODE_STRING image_name_u = {};
+  RtlInitUnicodeString(&image_name_u, image_name);
+
+  const auto head = g_ddimonp_PsLoadedModuleList;
+  for (auto current = head->Flink; current != head; current = current->Flink) {
+    const auto module =
+        CONTAINING_RECORD(current, LdrDataTableEntry, in_load_order_links);
+    if (RtlEqualUnicodeString(&module->base_dll_name, &image_name_u, TRUE)) {
+      return module->dll_base;
+    }
+  }
+  return nullptr;
+}
+
 // A fake RtlPcToFileHeader without accquireing PsLoadedModuleSpinLock. Thus, it
 // is unsafe and should be updated if we can locate PsLoadedModuleSpinLock.
 _Use_decl_annotations_ static PVOID NTAPI
@@ -360,6 +653,7 @@ _Use_decl_annotations_ EXTERN_C static bool DdimonpEnumExportedSymbolsCallback(
   }
   UNICODE_STRING name_u = {};
   RtlInitUnicodeString(&name_u, name);
+  const auto name_hash = PolicyHashName(export_name);
 
   // Check if the export name is listed in kDdimonpBreakpointTargets
   auto targets = reinterpret_cast<BreakpointTarget*>(context);
@@ -369,19 +663,89 @@ _Use_decl_annotations_ EXTERN_C static bool DdimonpEnumExportedSymbolsCallback(
       break;
     }
 
-    if (!FsRtlIsNameInExpression(&target.target_name, &name_u, TRUE, nullptr)) {
+    if (target.name_hash) {
+      // Prehashed; compare names only to resolve collision
+      if (target.name_hash != name_hash ||
+          !RtlEqualUnicodeString(&target.target_name, &name_u, TRUE)) {
+        continue;
+      }
+    } else if (!FsRtlIsNameInExpression(&target.target_name, &name_u, TRUE,
+                                        nullptr)) {
       continue;
     }
 
     // Yes, create a new breakpoint
     SbpCreatePreBreakpoint(reinterpret_cast<void*>(export_address), target,
                            export_name);
+    HookcacheRecord(export_address, i, export_name);
     HYPERPLATFORM_LOG_INFO("Breakpoint has been set to %p %s.", export_address,
                            export_name);
   }
   return true;
 }
 
+// Creates breakpoint targets from rules of a hook policy manifest. The last
+// element is an empty terminator.
+_Use_decl_annotations_ static std::vector<BreakpointTarget>
+DdimonpCreateTargetsFromPolicy() {
+  PAGED_CODE();
+
+  std::vector<BreakpointTarget> targets;
+  for (auto i = 0ul; i < PolicyGetRuleCount(); ++i) {
+    const auto rule = PolicyGetRule(i);
+    const auto& handlers = kDdimonpPolicyHandlers[rule->entry->handler_id];
+    targets.push_back({rule->pattern, handlers[0], handlers[1],
+                       rule->entry->name_hash, rule});
+  }
+  targets.push_back({});
+  return targets;
+}
+
+// Applies a hook policy of the breakpoint to a call and decides how the call
+// is handled. When no policy is given, only calls from where not backed by any
+// image are logged as before. caller can be nullptr not to filter calls by a
+// caller. A call that a predicate wants to log but exceeds sampling or a rate
+// limit is only counted.
+_Use_decl_annotations_ static PredVerdict DdimonpEvaluatePolicy(
+    const BreakpointHandlerSlot& slot, void* caller, const GpRegisters& gp_regs,
+    ULONG_PTR guest_sp) {
+  const auto rule = reinterpret_cast<PolicyRule*>(slot.context);
+  const auto include_image_callers =
+      rule && (rule->entry->flags & kPolicyFlagIncludeImageCallers);
+  if (caller && !include_image_callers && DdimonpPcToFileHeader(caller)) {
+    return PredVerdict::kDrop;
+  }
+  if (!rule) {
+    return PredVerdict::kLogAndArmPost;
+  }
+
+  auto verdict = PredVerdict::kLogAndArmPost;
+  if (rule->program) {
+    PredContext context = {};
+    for (auto i = 0ul; i < 4; ++i) {
+      context.fields[static_cast<ULONG>(PredField::kArgument1) + i] =
+          DdimonpGetCallParameter(gp_regs, guest_sp, i + 1);
+    }
+    context.fields[static_cast<ULONG>(PredField::kReturnAddress)] =
+        *reinterpret_cast<ULONG_PTR*>(guest_sp);
+    context.fields[static_cast<ULONG>(PredField::kCr3)] = __readcr3();
+    context.fields[static_cast<ULONG>(PredField::kProcessId)] =
+        reinterpret_cast<ULONG_PTR>(PsGetCurrentProcessId());
+    context.fields[static_cast<ULONG>(PredField::kThreadId)] =
+        reinterpret_cast<ULONG_PTR>(PsGetCurrentThreadId());
+    context.fields[static_cast<ULONG>(PredField::kTimestamp)] = __rdtsc();
+    verdict =
+        PredExecute(rule->program, rule->entry->program_count, context);
+  }
+  if (verdict >= PredVerdict::kLog && !PolicyShouldHandle(rule)) {
+    verdict = PredVerdict::kCount;
+  }
+  if (verdict == PredVerdict::kCount) {
+    InterlockedIncrement(&rule->counted);
+  }
+  return verdict;
+}
+
 // Returns a function parameter from a stack pointer
 _Use_decl_annotations_ static ULONG_PTR DdimonpGetCallParameter(
     const GpRegisters& gp_regs, ULONG_PTR guest_sp, ULONG n_th_parameter) {
@@ -432,14 +796,15 @@ _Use_decl_annotations_ static std::array<char, 5> DdimonpTagToString(
 // Pre-ExQueueWorkItem. Logs if a WorkerRoutine points to where not backed by
 // any image.
 _Use_decl_annotations_ static void DdimonpPreExQueueWorkItemHandler(
-    const PatchInformation& info, EptData* ept_data, GpRegisters* gp_regs,
-    ULONG_PTR guest_sp) {
+    const PatchInformation& info, const BreakpointHandlerSlot& slot,
+    EptData* ept_data, GpRegisters* gp_regs, ULONG_PTR guest_sp) {
   UNREFERENCED_PARAMETER(ept_data);
 
-  // Is inside image?
+  // Is inside image, or filtered out by a hook policy?
   auto workitem = reinterpret_cast<WORK_QUEUE_ITEM*>(
       DdimonpGetCallParameter(*gp_regs, guest_sp, 1));
-  if (DdimonpPcToFileHeader(workitem->WorkerRoutine)) {
+  if (DdimonpEvaluatePolicy(slot, workitem->WorkerRoutine, *gp_regs,
+                            guest_sp) < PredVerdict::kLog) {
     return;
   }
 
@@ -454,11 +819,13 @@ _Use_decl_annotations_ static void DdimonpPreExQueueWorkItemHandler(
 // Pre-ExAllocatePoolWithTag. Logs if the DDI is called from where not backed by
 // any image and sets post breakpoint if so.
 _Use_decl_annotations_ static void DdimonpPreExAllocatePoolWithTagHandler(
-    const PatchInformation& info, EptData* ept_data, GpRegisters* gp_regs,
-    ULONG_PTR guest_sp) {
-  // Is inside image?
+    const PatchInformation& info, const BreakpointHandlerSlot& slot,
+    EptData* ept_data, GpRegisters* gp_regs, ULONG_PTR guest_sp) {
+  // Is inside image, or filtered out by a hook policy?
   auto return_addr = *reinterpret_cast<void**>(guest_sp);
-  if (DdimonpPcToFileHeader(return_addr)) {
+  const auto verdict =
+      DdimonpEvaluatePolicy(slot, return_addr, *gp_regs, guest_sp);
+  if (verdict < PredVerdict::kLog) {
     return;
   }
 
@@ -471,18 +838,23 @@ _Use_decl_annotations_ static void DdimonpPreExAllocatePoolWithTagHandler(
       "%s(POOL_TYPE= %08x, NumberOfBytes= %08X, Tag= %s) returning to %p",
       info.name.data(), pool_type, number_of_bytes,
       DdimonpTagToString(tag).data(), return_addr);
+  if (verdict != PredVerdict::kLogAndArmPost) {
+    return;
+  }
 
   // Capture parameters and set post breakpoint
   CapturedParameters params = {
       static_cast<ULONG_PTR>(pool_type), number_of_bytes, tag,
   };
-  SbpCreateAndEnablePostBreakpoint(return_addr, info, params, ept_data);
+  SbpCreateAndEnablePostBreakpoint(return_addr, info, slot, params,
+                                   ept_data);
 }
 
 // Post-ExAllocatePoolWithTag. Logs a return value of the DDI
 _Use_decl_annotations_ static void DdimonpPostExAllocatePoolWithTagHandler(
-    const PatchInformation& info, EptData* ept_data, GpRegisters* gp_regs,
-    ULONG_PTR guest_sp) {
+    const PatchInformation& info, const BreakpointHandlerSlot& slot,
+    EptData* ept_data, GpRegisters* gp_regs, ULONG_PTR guest_sp) {
+  UNREFERENCED_PARAMETER(slot);
   UNREFERENCED_PARAMETER(ept_data);
   UNREFERENCED_PARAMETER(guest_sp);
 
@@ -491,13 +863,14 @@ _Use_decl_annotations_ static void DdimonpPostExAllocatePoolWithTagHandler(
 
 // Pre-ExFreePool. Logs if the DDI is called from where not backed by any image
 _Use_decl_annotations_ static void DdimonpPreExFreePoolHandler(
-    const PatchInformation& info, EptData* ept_data, GpRegisters* gp_regs,
-    ULONG_PTR guest_sp) {
+    const PatchInformation& info, const BreakpointHandlerSlot& slot,
+    EptData* ept_data, GpRegisters* gp_regs, ULONG_PTR guest_sp) {
   UNREFERENCED_PARAMETER(ept_data);
 
-  // Is inside image?
+  // Is inside image, or filtered out by a hook policy?
   auto return_addr = *reinterpret_cast<void**>(guest_sp);
-  if (DdimonpPcToFileHeader(return_addr)) {
+  if (DdimonpEvaluatePolicy(slot, return_addr, *gp_regs, guest_sp) <
+      PredVerdict::kLog) {
     return;
   }
 
@@ -509,13 +882,14 @@ _Use_decl_annotations_ static void DdimonpPreExFreePoolHandler(
 // Pre-ExFreePoolWithTag. Logs if the DDI is called from where not backed by
 // any image
 _Use_decl_annotations_ static void DdimonpPreExFreePoolWithTagHandler(
-    const PatchInformation& info, EptData* ept_data, GpRegisters* gp_regs,
-    ULONG_PTR guest_sp) {
+    const PatchInformation& info, const BreakpointHandlerSlot& slot,
+    EptData* ept_data, GpRegisters* gp_regs, ULONG_PTR guest_sp) {
   UNREFERENCED_PARAMETER(ept_data);
 
-  // Is inside image?
+  // Is inside image, or filtered out by a hook policy?
   auto return_addr = *reinterpret_cast<void**>(guest_sp);
-  if (DdimonpPcToFileHeader(return_addr)) {
+  if (DdimonpEvaluatePolicy(slot, return_addr, *gp_regs, guest_sp) <
+      PredVerdict::kLog) {
     return;
   }
 
@@ -529,14 +903,16 @@ _Use_decl_annotations_ static void DdimonpPreExFreePoolWithTagHandler(
 // Pre-NtQuerySystemInformation. Sets post breakpoint if it is quering a list
 // of processes.
 _Use_decl_annotations_ static void DdimonpPreNtQuerySystemInformationHandler(
-    const PatchInformation& info, EptData* ept_data, GpRegisters* gp_regs,
-    ULONG_PTR guest_sp) {
+    const PatchInformation& info, const BreakpointHandlerSlot& slot,
+    EptData* ept_data, GpRegisters* gp_regs, ULONG_PTR guest_sp) {
   UNREFERENCED_PARAMETER(ept_data);
   UNREFERENCED_PARAMETER(gp_regs);
 
   auto system_information_class = static_cast<SystemInformationClass>(
       DdimonpGetCallParameter(*gp_regs, guest_sp, 1));
-  if (system_information_class != kSystemProcessInformation) {
+  if (system_information_class != kSystemProcessInformation ||
+      DdimonpEvaluatePolicy(slot, nullptr, *gp_regs, guest_sp) !=
+          PredVerdict::kLogAndArmPost) {
     return;
   }
 
@@ -551,14 +927,16 @@ _Use_decl_annotations_ static void DdimonpPreNtQuerySystemInformationHandler(
       static_cast<ULONG_PTR>(system_information_class), system_information,
       system_information_length, return_length,
   };
-  SbpCreateAndEnablePostBreakpoint(return_addr, info, params, ept_data);
+  SbpCreateAndEnablePostBreakpoint(return_addr, info, slot, params,
+                                   ept_data);
 }
 
 // Post-NtQuerySystemInformation. Unlinks an entry for cmd.exe from a returned
 // result.
 _Use_decl_annotations_ static void DdimonpPostNtQuerySystemInformationHandler(
-    const PatchInformation& info, EptData* ept_data, GpRegisters* gp_regs,
-    ULONG_PTR guest_sp) {
+    const PatchInformation& info, const BreakpointHandlerSlot& slot,
+    EptData* ept_data, GpRegisters* gp_regs, ULONG_PTR guest_sp) {
+  UNREFERENCED_PARAMETER(info);
   UNREFERENCED_PARAMETER(ept_data);
   UNREFERENCED_PARAMETER(guest_sp);
 
@@ -566,7 +944,7 @@ _Use_decl_annotations_ static void DdimonpPostNtQuerySystemInformationHandler(
     return;
   }
 
-  auto next = reinterpret_cast<SystemProcessInformation*>(info.parameters[1]);
+  auto next = reinterpret_cast<SystemProcessInformation*>(slot.parameters[1]);
 
   // Workaround for issue #2.
   if (!UtilIsAccessibleAddress(next)) {
@@ -593,3 +971,56 @@ _Use_decl_annotations_ static void DdimonpPostNtQuerySystemInformationHandler(
     }
   }
 }
+
+// Pre-KeAcquireSpinLockRaiseToDpc and Pre-KeAcquireInStackQueuedSpinLock.
+// Starts measuring the lock without a post breakpoint, which would cost an
+// allocation and page shadowing on every acquisition. The caller is keyed by
+// the image containing it.
+_Use_decl_annotations_ static void DdimonpPreKeAcquireSpinLockHandler(
+    const PatchInformation& info, const BreakpointHandlerSlot& slot,
+    EptData* ept_data, GpRegisters* gp_regs, ULONG_PTR guest_sp) {
+  UNREFERENCED_PARAMETER(info);
+  UNREFERENCED_PARAMETER(slot);
+  UNREFERENCED_PARAMETER(ept_data);
+
+  const auto acquire_tsc = __rdtsc();
+  auto return_addr = *reinterpret_cast<void**>(guest_sp);
+  auto lock = DdimonpGetCallParameter(*gp_regs, guest_sp, 1);
+  const auto caller_base = DdimonpPcToFileHeader(return_addr);
+  LockprofAcquiring(lock,
+                    (caller_base) ? reinterpret_cast<ULONG_PTR>(caller_base)
+                                  : MAXULONG_PTR,
+                    acquire_tsc);
+}
+
+// Pre-KeReleaseSpinLock
+_Use_decl_annotations_ static void DdimonpPreKeReleaseSpinLockHandler(
+    const PatchInformation& info, const BreakpointHandlerSlot& slot,
+    EptData* ept_data, GpRegisters* gp_regs, ULONG_PTR guest_sp) {
+  UNREFERENCED_PARAMETER(info);
+  UNREFERENCED_PARAMETER(slot);
+  UNREFERENCED_PARAMETER(ept_data);
+
+  LockprofReleasing(DdimonpGetCallParameter(*gp_regs, guest_sp, 1), __rdtsc());
+}
+
+// Pre-KeReleaseInStackQueuedSpinLock. Takes an address of the lock from a lock
+// handle, whose low two bits are used as flags.
+_Use_decl_annotations_ static void
+DdimonpPreKeReleaseInStackQueuedSpinLockHandler(
+    const PatchInformation& info, const BreakpointHandlerSlot& slot,
+    EptData* ept_data, GpRegisters* gp_regs, ULONG_PTR guest_sp) {
+  UNREFERENCED_PARAMETER(info);
+  UNREFERENCED_PARAMETER(slot);
+  UNREFERENCED_PARAMETER(ept_data);
+
+  const auto release_tsc = __rdtsc();
+  auto lock_handle = reinterpret_cast<KLOCK_QUEUE_HANDLE*>(
+      DdimonpGetCallParameter(*gp_regs, guest_sp, 1));
+  if (!UtilIsAccessibleAddress(lock_handle)) {
+    return;
+  }
+  const auto lock = reinterpret_cast<ULONG_PTR>(lock_handle->LockQueue.Lock) &
+                    ~static_cast<ULONG_PTR>(3);
+  LockprofReleasing(lock, release_tsc);
+}
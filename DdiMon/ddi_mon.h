@@ -31,7 +31,8 @@
 //
 
 _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
-    DdimonInitialization(PDRIVER_OBJECT driver_object);
+    DdimonInitialization(PDRIVER_OBJECT driver_object,
+                         PUNICODE_STRING registry_path);
 
 _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void DdimonTermination();
 
@@ -0,0 +1,342 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements hook resolution cache functions.
+
+#include "hook_cache.h"
+#include <ntimage.h>
+#define NTSTRSAFE_NO_CB_FUNCTIONS
+#include <ntstrsafe.h>
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#include "hook_policy.h"
+#include "shadow_bp_internal.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A name of a registry value holding a cache
+static const wchar_t kHookcachepValueName[] = L"HookCache";
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Identity of the image and targets, a cache read from the registry and
+// entries recorded to save a new cache
+struct HookCacheData {
+  PUNICODE_STRING registry_path;
+  ULONG_PTR image_base;
+  const BreakpointTarget* targets;
+  ULONG target_count;
+  HookCacheHeader identity;              // entry_count is not used
+  KEY_VALUE_PARTIAL_INFORMATION* value;  // nullptr if not given
+  std::vector<HookCacheEntry> entries;
+  bool has_long_name;  // A recorded name does not fit in HookCacheEntry
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS HookcachepReadCache(
+    _In_ PUNICODE_STRING registry_path,
+    _Outptr_result_maybenull_ KEY_VALUE_PARTIAL_INFORMATION** value);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool HookcachepIsValidCache(
+    _In_ const HookCacheData& data);
+
+static ULONG HookcachepHashBytes(_In_ ULONG hash,
+                                 _In_reads_bytes_(size) const void* bytes,
+                                 _In_ ULONG size);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, HookcacheInitialization)
+#pragma alloc_text(INIT, HookcacheTermination)
+#pragma alloc_text(INIT, HookcacheCreateBreakpoints)
+#pragma alloc_text(INIT, HookcacheRecord)
+#pragma alloc_text(INIT, HookcacheSave)
+#pragma alloc_text(INIT, HookcachepReadCache)
+#pragma alloc_text(INIT, HookcachepIsValidCache)
+#pragma alloc_text(INIT, HookcachepHashBytes)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static HookCacheData* g_hookcachep_data;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Computes identity of the image and targets, and reads a cache if it is given.
+// The registry path must be valid until HookcacheTermination().
+_Use_decl_annotations_ EXTERN_C NTSTATUS
+HookcacheInitialization(PUNICODE_STRING registry_path, void* image_base,
+                        const BreakpointTarget* targets) {
+  PAGED_CODE();
+
+  const auto base = reinterpret_cast<ULONG_PTR>(image_base);
+  const auto dos = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+  const auto nt = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos->e_lfanew);
+
+  auto data = new (std::nothrow) HookCacheData();
+  if (!data) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  data->registry_path = registry_path;
+  data->image_base = base;
+  data->targets = targets;
+  data->identity.magic = kHookCacheMagic;
+  data->identity.version = kHookCacheVersion;
+  data->identity.entry_size = sizeof(HookCacheEntry);
+  data->identity.time_date_stamp = nt->FileHeader.TimeDateStamp;
+  data->identity.size_of_image = nt->OptionalHeader.SizeOfImage;
+  data->identity.check_sum = nt->OptionalHeader.CheckSum;
+
+  // Handlers are not hashed as they are bound by an index on each load
+  auto hash = kPolicyFnvOffsetBasis;
+  for (; targets[data->target_count].pre_handler; ++data->target_count) {
+    const auto& target = targets[data->target_count];
+    hash = HookcachepHashBytes(hash, target.target_name.Buffer,
+                               target.target_name.Length);
+    hash = HookcachepHashBytes(hash, &target.name_hash,
+                               sizeof(target.name_hash));
+  }
+  data->identity.targets_hash = HookcachepHashBytes(
+      hash, &data->target_count, sizeof(data->target_count));
+
+  auto status = HookcachepReadCache(registry_path, &data->value);
+  if (!NT_SUCCESS(status) && status != STATUS_NOT_FOUND) {
+    HYPERPLATFORM_LOG_WARN("Failed to read a hook resolution cache (%08x).",
+                           status);
+  }
+  g_hookcachep_data = data;
+  return STATUS_SUCCESS;
+}
+
+// Frees the cache and recorded entries
+_Use_decl_annotations_ EXTERN_C void HookcacheTermination() {
+  PAGED_CODE();
+
+  const auto data = g_hookcachep_data;
+  if (!data) {
+    return;
+  }
+  g_hookcachep_data = nullptr;
+
+  if (data->value) {
+    ExFreePoolWithTag(data->value, kHyperPlatformCommonPoolTag);
+  }
+  delete data;
+}
+
+// Creates breakpoints from the cache if it is valid
+_Use_decl_annotations_ EXTERN_C bool HookcacheCreateBreakpoints() {
+  PAGED_CODE();
+
+  const auto data = g_hookcachep_data;
+  if (!data || !HookcachepIsValidCache(*data)) {
+    return false;
+  }
+
+  const auto header = reinterpret_cast<HookCacheHeader*>(data->value->Data);
+  const auto entries = reinterpret_cast<const HookCacheEntry*>(header + 1);
+  for (auto i = 0ul; i < header->entry_count; ++i) {
+    const auto& entry = entries[i];
+    const auto address = data->image_base + entry.rva;
+    SbpCreatePreBreakpoint(reinterpret_cast<void*>(address),
+                           data->targets[entry.target_index], entry.name);
+    HYPERPLATFORM_LOG_INFO("Breakpoint has been set to %p %s.", address,
+                           entry.name);
+  }
+  HYPERPLATFORM_LOG_INFO("Resolved %lu hooks from the cache.",
+                         header->entry_count);
+  return true;
+}
+
+// Records the breakpoint to save it with HookcacheSave(). A name that does not
+// fit in an entry is not truncated; it makes the cache unsaveable instead, as
+// the cache has to create the same breakpoints as resolving exports does.
+_Use_decl_annotations_ EXTERN_C void HookcacheRecord(ULONG_PTR address,
+                                                     ULONG target_index,
+                                                     const char* name) {
+  PAGED_CODE();
+
+  const auto data = g_hookcachep_data;
+  if (!data) {
+    return;
+  }
+
+  HookCacheEntry entry = {};
+  entry.rva = static_cast<ULONG>(address - data->image_base);
+  entry.target_index = target_index;
+  if (!NT_SUCCESS(
+          RtlStringCchCopyA(entry.name, RTL_NUMBER_OF(entry.name), name))) {
+    data->has_long_name = true;
+    return;
+  }
+  data->entries.push_back(entry);
+}
+
+// Writes the HookCache value with the identity and recorded entries
+_Use_decl_annotations_ EXTERN_C NTSTATUS HookcacheSave() {
+  PAGED_CODE();
+
+  const auto data = g_hookcachep_data;
+  if (!data) {
+    return STATUS_UNSUCCESSFUL;
+  }
+  if (data->has_long_name) {
+    return STATUS_NAME_TOO_LONG;
+  }
+
+  const auto entries_size = static_cast<ULONG>(sizeof(HookCacheEntry) *
+                                               data->entries.size());
+  const auto cache_size = sizeof(HookCacheHeader) + entries_size;
+  const auto cache = reinterpret_cast<HookCacheHeader*>(ExAllocatePoolWithTag(
+      PagedPool, cache_size, kHyperPlatformCommonPoolTag));
+  if (!cache) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  *cache = data->identity;
+  cache->entry_count = static_cast<ULONG>(data->entries.size());
+  if (entries_size) {
+    RtlCopyMemory(cache + 1, data->entries.data(), entries_size);
+  }
+
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, data->registry_path,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+  HANDLE key = nullptr;
+  auto status = ZwOpenKey(&key, KEY_SET_VALUE, &oa);
+  if (NT_SUCCESS(status)) {
+    UNICODE_STRING value_name = RTL_CONSTANT_STRING(kHookcachepValueName);
+    status = ZwSetValueKey(key, &value_name, 0, REG_BINARY, cache,
+                           static_cast<ULONG>(cache_size));
+    ZwClose(key);
+  }
+  ExFreePoolWithTag(cache, kHyperPlatformCommonPoolTag);
+  return status;
+}
+
+// Reads the HookCache value. Returns STATUS_NOT_FOUND if it is not given.
+_Use_decl_annotations_ static NTSTATUS HookcachepReadCache(
+    PUNICODE_STRING registry_path, KEY_VALUE_PARTIAL_INFORMATION** value) {
+  PAGED_CODE();
+
+  *value = nullptr;
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, registry_path,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+  HANDLE key = nullptr;
+  auto status = ZwOpenKey(&key, KEY_READ, &oa);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  UNICODE_STRING value_name = RTL_CONSTANT_STRING(kHookcachepValueName);
+  ULONG size = 0;
+  status = ZwQueryValueKey(key, &value_name, KeyValuePartialInformation,
+                           nullptr, 0, &size);
+  if (status == STATUS_OBJECT_NAME_NOT_FOUND) {
+    ZwClose(key);
+    return STATUS_NOT_FOUND;
+  }
+  if (status != STATUS_BUFFER_TOO_SMALL &&
+      status != STATUS_BUFFER_OVERFLOW) {
+    ZwClose(key);
+    return status;
+  }
+
+  // The cache is used only during initialization
+  const auto buffer =
+      reinterpret_cast<KEY_VALUE_PARTIAL_INFORMATION*>(ExAllocatePoolWithTag(
+          PagedPool, size, kHyperPlatformCommonPoolTag));
+  if (!buffer) {
+    ZwClose(key);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  status = ZwQueryValueKey(key, &value_name, KeyValuePartialInformation,
+                           buffer, size, &size);
+  ZwClose(key);
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(buffer, kHyperPlatformCommonPoolTag);
+    return status;
+  }
+  if (buffer->Type != REG_BINARY) {
+    ExFreePoolWithTag(buffer, kHyperPlatformCommonPoolTag);
+    return STATUS_OBJECT_TYPE_MISMATCH;
+  }
+
+  *value = buffer;
+  return STATUS_SUCCESS;
+}
+
+// Checks that the cache was saved for the same image and targets, and all
+// entries are within the image and targets and have null-terminated names
+_Use_decl_annotations_ static bool HookcachepIsValidCache(
+    const HookCacheData& data) {
+  PAGED_CODE();
+
+  if (!data.value || data.value->DataLength < sizeof(HookCacheHeader)) {
+    return false;
+  }
+
+  const auto header = reinterpret_cast<HookCacheHeader*>(data.value->Data);
+  const auto& identity = data.identity;
+  if (header->magic != identity.magic || header->version != identity.version ||
+      header->entry_size != identity.entry_size ||
+      header->time_date_stamp != identity.time_date_stamp ||
+      header->size_of_image != identity.size_of_image ||
+      header->check_sum != identity.check_sum ||
+      header->targets_hash != identity.targets_hash) {
+    return false;
+  }
+  const auto entries_size = data.value->DataLength - sizeof(HookCacheHeader);
+  if (entries_size % sizeof(HookCacheEntry) ||
+      entries_size / sizeof(HookCacheEntry) != header->entry_count) {
+    return false;
+  }
+
+  const auto entries = reinterpret_cast<const HookCacheEntry*>(header + 1);
+  for (auto i = 0ul; i < header->entry_count; ++i) {
+    const auto& entry = entries[i];
+    if (entry.rva >= identity.size_of_image ||
+        entry.target_index >= data.target_count ||
+        !NT_SUCCESS(RtlStringCchLengthA(entry.name, RTL_NUMBER_OF(entry.name),
+                                        nullptr))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Updates FNV-1a of bytes
+_Use_decl_annotations_ static ULONG HookcachepHashBytes(ULONG hash,
+                                                        const void* bytes,
+                                                        ULONG size) {
+  const auto p = reinterpret_cast<const UCHAR*>(bytes);
+  for (auto i = 0ul; i < size; ++i) {
+    hash ^= p[i];
+    hash *= kPolicyFnvPrime;
+  }
+  return hash;
+}
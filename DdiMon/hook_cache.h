@@ -0,0 +1,97 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to hook resolution cache functions.
+
+#ifndef DDIMON_HOOK_CACHE_H_
+#define DDIMON_HOOK_CACHE_H_
+
+#include <fltKernel.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// 'DDHC'; a magic value of a hook resolution cache
+static const ULONG kHookCacheMagic = 'CHDD';
+
+// A version of a cache format
+static const USHORT kHookCacheVersion = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct BreakpointTarget;
+
+// A cache is a REG_BINARY value named HookCache under the registry key of the
+// driver, and consists of HookCacheHeader and entry_count of HookCacheEntry in
+// order that breakpoints were created. It is used only when the identity of
+// the image and targets recorded in the header match the current ones. All
+// values are little endian.
+#include <pshpack1.h>
+struct HookCacheHeader {
+  ULONG magic;            // kHookCacheMagic
+  USHORT version;         // kHookCacheVersion
+  USHORT entry_size;      // sizeof(HookCacheEntry)
+  ULONG entry_count;      // A number of entries following this header
+  ULONG time_date_stamp;  // IMAGE_FILE_HEADER::TimeDateStamp of the image
+  ULONG size_of_image;    // IMAGE_OPTIONAL_HEADER::SizeOfImage of the image
+  ULONG check_sum;        // IMAGE_OPTIONAL_HEADER::CheckSum of the image
+  ULONG targets_hash;     // FNV-1a of names of all BreakpointTarget
+};
+static_assert(sizeof(HookCacheHeader) == 28, "Size check");
+
+// An export resolved to a breakpoint target
+struct HookCacheEntry {
+  ULONG rva;           // An RVA of the export
+  ULONG target_index;  // An index of BreakpointTarget matched the export
+  char name[64];       // A null-terminated export name
+};
+static_assert(sizeof(HookCacheEntry) == 72, "Size check");
+#include <poppack.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+    HookcacheInitialization(_In_ PUNICODE_STRING registry_path,
+                            _In_ void* image_base,
+                            _In_ const BreakpointTarget* targets);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void HookcacheTermination();
+
+// Creates breakpoints from the cache and returns true if it is valid for the
+// image and targets given to HookcacheInitialization(). Otherwise, returns
+// false, and exports should be resolved and reported with HookcacheRecord().
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C bool HookcacheCreateBreakpoints();
+
+// Records that a breakpoint was created at the address for the target
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void HookcacheRecord(
+    _In_ ULONG_PTR address, _In_ ULONG target_index, _In_ const char* name);
+
+// Saves recorded entries as the cache for the next load
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS HookcacheSave();
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_HOOK_CACHE_H_
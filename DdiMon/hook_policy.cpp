@@ -0,0 +1,303 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements hook policy manifest functions.
+
+#include "hook_policy.h"
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A name of a registry value holding a manifest
+static const wchar_t kPolicypValueName[] = L"HookPolicy";
+
+// A length of a rate limiting window in 100 nanoseconds
+static const LONG64 kPolicypWindowLength = 10 * 1000 * 1000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS PolicypReadManifest(
+    _In_ PUNICODE_STRING registry_path,
+    _Outptr_result_maybenull_ KEY_VALUE_PARTIAL_INFORMATION** value);
+
+static bool PolicypIsValidManifest(_In_reads_bytes_(size) const UCHAR* manifest,
+                                   _In_ ULONG size);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, PolicyInitialization)
+#pragma alloc_text(INIT, PolicypReadManifest)
+#pragma alloc_text(INIT, PolicypIsValidManifest)
+#pragma alloc_text(PAGE, PolicyTermination)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// A registry value holding a manifest. Entries and strings are referenced in
+// place.
+static KEY_VALUE_PARTIAL_INFORMATION* g_policyp_value;
+
+// Rules in order of entries of the manifest
+static PolicyRule* g_policyp_rules;
+
+// A number of elements in g_policyp_rules
+static ULONG g_policyp_rule_count;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Reads a manifest from the registry and builds rules referencing it. Returns
+// STATUS_NOT_FOUND if the manifest is not given.
+_Use_decl_annotations_ EXTERN_C NTSTATUS
+PolicyInitialization(PUNICODE_STRING registry_path) {
+  PAGED_CODE();
+
+  KEY_VALUE_PARTIAL_INFORMATION* value = nullptr;
+  auto status = PolicypReadManifest(registry_path, &value);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+  if (!PolicypIsValidManifest(value->Data, value->DataLength)) {
+    HYPERPLATFORM_LOG_ERROR("The hook policy manifest is malformed.");
+    ExFreePoolWithTag(value, kHyperPlatformCommonPoolTag);
+    return STATUS_INVALID_IMAGE_FORMAT;
+  }
+
+  const auto header = reinterpret_cast<PolicyManifestHeader*>(value->Data);
+  const auto entries =
+      reinterpret_cast<const PolicyManifestEntry*>(header + 1);
+  const auto strings = value->Data + header->strings_offset;
+  const auto rules_size = sizeof(PolicyRule) * header->entry_count;
+  const auto rules = reinterpret_cast<PolicyRule*>(ExAllocatePoolWithTag(
+      NonPagedPool, rules_size, kHyperPlatformCommonPoolTag));
+  if (!rules) {
+    ExFreePoolWithTag(value, kHyperPlatformCommonPoolTag);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(rules, rules_size);
+  for (auto i = 0ul; i < header->entry_count; ++i) {
+    const auto& entry = entries[i];
+    rules[i].entry = &entry;
+    rules[i].pattern.Buffer =
+        reinterpret_cast<wchar_t*>(strings + entry.pattern_offset);
+    rules[i].pattern.Length = entry.pattern_size;
+    rules[i].pattern.MaximumLength = entry.pattern_size;
+    if (entry.program_count) {
+      rules[i].program = reinterpret_cast<const PredInstruction*>(
+          strings + entry.program_offset);
+    }
+  }
+
+  g_policyp_value = value;
+  g_policyp_rules = rules;
+  g_policyp_rule_count = header->entry_count;
+  HYPERPLATFORM_LOG_INFO("Loaded %lu hook policy rules.", g_policyp_rule_count);
+  return STATUS_SUCCESS;
+}
+
+// Frees rules and the manifest
+_Use_decl_annotations_ EXTERN_C void PolicyTermination() {
+  PAGED_CODE();
+
+  for (auto i = 0ul; i < g_policyp_rule_count; ++i) {
+    const auto& rule = g_policyp_rules[i];
+    if (rule.counted) {
+      HYPERPLATFORM_LOG_INFO("%wZ: %ld calls were counted.", &rule.pattern,
+                             rule.counted);
+    }
+  }
+  if (g_policyp_rules) {
+    ExFreePoolWithTag(g_policyp_rules, kHyperPlatformCommonPoolTag);
+    g_policyp_rules = nullptr;
+  }
+  if (g_policyp_value) {
+    ExFreePoolWithTag(g_policyp_value, kHyperPlatformCommonPoolTag);
+    g_policyp_value = nullptr;
+  }
+  g_policyp_rule_count = 0;
+}
+
+// Returns a number of rules, or 0 if a manifest is not loaded
+/*_Use_decl_annotations_*/ EXTERN_C ULONG PolicyGetRuleCount() {
+  return g_policyp_rule_count;
+}
+
+// Returns a rule
+_Use_decl_annotations_ EXTERN_C PolicyRule* PolicyGetRule(ULONG index) {
+  NT_ASSERT(index < g_policyp_rule_count);
+  return &g_policyp_rules[index];
+}
+
+// Computes FNV-1a of an upper-case name as a compiler of a manifest does
+_Use_decl_annotations_ EXTERN_C ULONG PolicyHashName(const char* name) {
+  auto hash = kPolicyFnvOffsetBasis;
+  for (auto p = name; *p; ++p) {
+    hash ^= static_cast<UCHAR>(RtlUpperChar(*p));
+    hash *= kPolicyFnvPrime;
+  }
+  return hash;
+}
+
+// Applies sampling and a rate limit of the rule to a call. Returns true if the
+// call should be handled.
+_Use_decl_annotations_ EXTERN_C bool PolicyShouldHandle(PolicyRule* rule) {
+  const auto entry = rule->entry;
+  if (entry->sample_every > 1) {
+    const auto calls = static_cast<ULONG>(InterlockedIncrement(&rule->calls));
+    if (calls % entry->sample_every) {
+      return false;
+    }
+  }
+
+  if (entry->max_per_second) {
+    const auto now = static_cast<LONG64>(KeQueryInterruptTime());
+    const auto window_start = rule->window_start;
+    if (now - window_start >= kPolicypWindowLength &&
+        InterlockedCompareExchange64(&rule->window_start, now,
+                                     window_start) == window_start) {
+      InterlockedExchange(&rule->handled_in_window, 0);
+    }
+    const auto handled =
+        static_cast<ULONG>(InterlockedIncrement(&rule->handled_in_window));
+    if (handled > entry->max_per_second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads the HookPolicy value into a non-paged buffer
+_Use_decl_annotations_ static NTSTATUS PolicypReadManifest(
+    PUNICODE_STRING registry_path, KEY_VALUE_PARTIAL_INFORMATION** value) {
+  PAGED_CODE();
+
+  *value = nullptr;
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, registry_path,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+  HANDLE key = nullptr;
+  auto status = ZwOpenKey(&key, KEY_READ, &oa);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  UNICODE_STRING value_name = RTL_CONSTANT_STRING(kPolicypValueName);
+  ULONG size = 0;
+  status = ZwQueryValueKey(key, &value_name, KeyValuePartialInformation,
+                           nullptr, 0, &size);
+  if (status == STATUS_OBJECT_NAME_NOT_FOUND) {
+    ZwClose(key);
+    return STATUS_NOT_FOUND;
+  }
+  if (status != STATUS_BUFFER_TOO_SMALL &&
+      status != STATUS_BUFFER_OVERFLOW) {
+    ZwClose(key);
+    return status;
+  }
+
+  // The manifest is referenced from the VMM and must be non-paged
+  const auto buffer =
+      reinterpret_cast<KEY_VALUE_PARTIAL_INFORMATION*>(ExAllocatePoolWithTag(
+          NonPagedPool, size, kHyperPlatformCommonPoolTag));
+  if (!buffer) {
+    ZwClose(key);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  status = ZwQueryValueKey(key, &value_name, KeyValuePartialInformation,
+                           buffer, size, &size);
+  ZwClose(key);
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(buffer, kHyperPlatformCommonPoolTag);
+    return status;
+  }
+  if (buffer->Type != REG_BINARY) {
+    ExFreePoolWithTag(buffer, kHyperPlatformCommonPoolTag);
+    return STATUS_OBJECT_TYPE_MISMATCH;
+  }
+
+  *value = buffer;
+  return STATUS_SUCCESS;
+}
+
+// Checks that the header is known and all offsets are within the manifest
+_Use_decl_annotations_ static bool PolicypIsValidManifest(
+    const UCHAR* manifest, ULONG size) {
+  PAGED_CODE();
+
+  if (size < sizeof(PolicyManifestHeader)) {
+    return false;
+  }
+  const auto header = reinterpret_cast<const PolicyManifestHeader*>(manifest);
+  if (header->magic != kPolicyManifestMagic ||
+      header->version != kPolicyManifestVersion ||
+      header->entry_size != sizeof(PolicyManifestEntry) ||
+      header->total_size != size || !header->entry_count ||
+      header->strings_offset % sizeof(wchar_t)) {
+    return false;
+  }
+
+  // Use 64-bit arithmetic so that no value in the manifest overflows them
+  const auto entries_end = sizeof(PolicyManifestHeader) +
+                           static_cast<ULONG64>(header->entry_count) *
+                               sizeof(PolicyManifestEntry);
+  const auto strings_end = static_cast<ULONG64>(header->strings_offset) +
+                           header->strings_size;
+  if (entries_end > header->strings_offset || strings_end > size) {
+    return false;
+  }
+
+  const auto entries =
+      reinterpret_cast<const PolicyManifestEntry*>(header + 1);
+  for (auto i = 0ul; i < header->entry_count; ++i) {
+    const auto& entry = entries[i];
+    const auto pattern_end =
+        static_cast<ULONG64>(entry.pattern_offset) + entry.pattern_size;
+    if (!entry.pattern_size || entry.pattern_size % sizeof(wchar_t) ||
+        entry.pattern_offset % sizeof(wchar_t) ||
+        pattern_end > header->strings_size) {
+      return false;
+    }
+    if (!entry.handler_id ||
+        entry.handler_id >= static_cast<USHORT>(PolicyHandlerId::kMaximum)) {
+      return false;
+    }
+    if (!entry.program_count) {
+      continue;
+    }
+    const auto program_end =
+        static_cast<ULONG64>(entry.program_offset) +
+        static_cast<ULONG64>(entry.program_count) * sizeof(PredInstruction);
+    if (program_end > header->strings_size ||
+        !PredVerify(reinterpret_cast<const PredInstruction*>(
+                        manifest + header->strings_offset +
+                        entry.program_offset),
+                    entry.program_count)) {
+      return false;
+    }
+  }
+  return true;
+}
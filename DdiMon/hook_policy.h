@@ -0,0 +1,137 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to hook policy manifest functions.
+
+#ifndef DDIMON_HOOK_POLICY_H_
+#define DDIMON_HOOK_POLICY_H_
+
+#include <fltKernel.h>
+#include "predicate.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// 'DDHP'; a magic value of a hook policy manifest
+static const ULONG kPolicyManifestMagic = 'PHDD';
+
+// A version of a manifest format
+static const USHORT kPolicyManifestVersion = 2;
+
+// FNV-1a parameters used to prehash export names
+static const ULONG kPolicyFnvOffsetBasis = 2166136261ul;
+static const ULONG kPolicyFnvPrime = 16777619ul;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A manifest is a REG_BINARY value named HookPolicy under the registry key of
+// the driver, and consists of PolicyManifestHeader, entry_count of
+// PolicyManifestEntry and a string table holding patterns and predicate
+// programs. It is produced offline and used in place without parsing; the
+// driver only checks that all offsets are in bounds and programs pass
+// PredVerify(). All values are little endian.
+#include <pshpack1.h>
+struct PolicyManifestHeader {
+  ULONG magic;           // kPolicyManifestMagic
+  USHORT version;        // kPolicyManifestVersion
+  USHORT entry_size;     // sizeof(PolicyManifestEntry)
+  ULONG entry_count;     // A number of entries following this header
+  ULONG strings_offset;  // An offset to the string table from the header
+  ULONG strings_size;    // A size of the string table in bytes
+  ULONG total_size;      // A size of the manifest in bytes
+};
+static_assert(sizeof(PolicyManifestHeader) == 24, "Size check");
+
+// A rule to hook exports matching a name pattern
+struct PolicyManifestEntry {
+  // FNV-1a of an upper-case export name in ASCII, or 0 for a wildcard rule
+  ULONG name_hash;
+
+  // An upper-case pattern in UTF-16 in the string table. Used as an expression
+  // of FsRtlIsNameInExpression() for a wildcard rule, and to resolve hash
+  // collisions otherwise.
+  ULONG pattern_offset;  // An offset from the string table
+  USHORT pattern_size;   // A size in bytes without a terminating null
+
+  USHORT handler_id;     // PolicyHandlerId
+  ULONG flags;           // PolicyFlags
+  ULONG sample_every;    // Handles one of N calls; 0 or 1 to handle all
+  ULONG max_per_second;  // A rate limit of handled calls; 0 for no limit
+
+  // A predicate program in the string table evaluated on each call. A call is
+  // logged and a post breakpoint is set when program_count is 0.
+  ULONG program_offset;  // An offset from the string table
+  ULONG program_count;   // A number of PredInstruction
+};
+static_assert(sizeof(PolicyManifestEntry) == 32, "Size check");
+#include <poppack.h>
+
+// Handlers that can be bound to a rule
+enum class PolicyHandlerId : USHORT {
+  kExQueueWorkItem = 1,
+  kExAllocatePoolWithTag,
+  kExFreePool,
+  kExFreePoolWithTag,
+  kNtQuerySystemInformation,
+  kMaximum,
+};
+
+// Filters applied to a rule
+enum PolicyFlags : ULONG {
+  // Handles calls from inside images too. By default, only calls from where
+  // not backed by any image are handled.
+  kPolicyFlagIncludeImageCallers = 1 << 0,
+};
+
+// A rule with runtime state of sampling and rate limiting
+struct PolicyRule {
+  const PolicyManifestEntry* entry;
+  UNICODE_STRING pattern;
+  const PredInstruction* program;  // nullptr if not given
+  volatile LONG counted;           // Calls judged as PredVerdict::kCount
+  volatile LONG calls;
+  volatile LONG handled_in_window;
+  volatile LONG64 window_start;  // Interrupt time when the window started
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+    PolicyInitialization(_In_ PUNICODE_STRING registry_path);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void PolicyTermination();
+
+EXTERN_C ULONG PolicyGetRuleCount();
+
+EXTERN_C PolicyRule* PolicyGetRule(_In_ ULONG index);
+
+EXTERN_C ULONG PolicyHashName(_In_ const char* name);
+
+EXTERN_C bool PolicyShouldHandle(_Inout_ PolicyRule* rule);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_HOOK_POLICY_H_
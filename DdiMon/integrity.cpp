@@ -0,0 +1,460 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements code integrity hashing functions.
+
+#include "integrity.h"
+#include <intrin.h>
+#include <ntimage.h>
+#define NTSTRSAFE_NO_CB_FUNCTIONS
+#include <ntstrsafe.h>
+#include "../HyperPlatform/HyperPlatform/kernel_stl.h"
+#include <vector>
+#include <algorithm>
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#include "../HyperPlatform/HyperPlatform/util.h"
+#include "../HyperPlatform/HyperPlatform/ept.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Primes used by xxHash64
+static const ULONG64 kIntegpPrime1 = 0x9E3779B185EBCA87ull;
+static const ULONG64 kIntegpPrime2 = 0xC2B2AE3D27D4EB4Full;
+static const ULONG64 kIntegpPrime3 = 0x165667B19E3779F9ull;
+static const ULONG64 kIntegpPrime4 = 0x85EBCA77C2B2AE63ull;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Represents an image whose code pages are monitored
+struct IntegrityImage {
+  void* image_base;
+  char image_name[32];
+};
+
+// Represents a code page monitored for modification
+struct IntegrityPage {
+  ULONG64 pa_base;
+  void* va_base;
+  ULONG64 baseline_hash;  // A hash of the page when monitoring started
+  bool modified;          // true if the last hash did not match the baseline
+  ULONG image_index;      // An index of IntegrityData::images
+};
+
+// Holds monitored pages and the state of a check thread
+struct IntegrityData {
+  ULONG check_interval;  // In seconds
+  KEVENT stop_event;
+  HANDLE check_thread_handle;
+  std::vector<IntegrityImage> images;
+
+  // Monitored pages sorted by pa_base for binary search on VM-exit
+  std::vector<IntegrityPage> pages;
+
+  // Bit N is set when pages[N] was written since it was last hashed
+  std::vector<LONG> written_pages;
+
+  volatile LONG write_violations;
+  ULONG rehashed_pages;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool IntegpIsHashableSection(
+    _In_ const IMAGE_SECTION_HEADER& section);
+
+static KSTART_ROUTINE IntegpCheckThreadRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void IntegpCheckWrittenPages(
+    _Inout_ IntegrityData* data);
+
+static ULONG64 IntegpHashPage(_In_ const void* page);
+
+static ULONG64 IntegpHashRound(_In_ ULONG64 accumulator, _In_ ULONG64 input);
+
+static ULONG64 IntegpHashMergeRound(_In_ ULONG64 accumulator,
+                                    _In_ ULONG64 value);
+
+static IntegrityPage* IntegpFindPageByPa(_In_ IntegrityData* data,
+                                         _In_ ULONG64 pa);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, IntegInitialization)
+#pragma alloc_text(INIT, IntegAddImage)
+#pragma alloc_text(INIT, IntegStart)
+#pragma alloc_text(INIT, IntegpIsHashableSection)
+#pragma alloc_text(PAGE, IntegTermination)
+#pragma alloc_text(PAGE, IntegpCheckThreadRoutine)
+#pragma alloc_text(PAGE, IntegpCheckWrittenPages)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Monitored pages. It is not modified after IntegStart() except for
+// written_pages and statistics, so VM-exit handlers access it without a lock.
+static IntegrityData* g_integp_data;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Prepares an empty set of monitored pages
+_Use_decl_annotations_ EXTERN_C NTSTATUS
+IntegInitialization(ULONG check_interval) {
+  PAGED_CODE();
+
+  if (!check_interval) {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  auto data = new IntegrityData();
+  data->check_interval = check_interval;
+  KeInitializeEvent(&data->stop_event, NotificationEvent, FALSE);
+  g_integp_data = data;
+  return STATUS_SUCCESS;
+}
+
+// Collects code pages of the image to monitor. Only pages present at this
+// moment are monitored since paged-out pages may later be mapped to different
+// physical addresses.
+_Use_decl_annotations_ EXTERN_C NTSTATUS
+IntegAddImage(void* image_base, const char* image_name) {
+  PAGED_CODE();
+
+  auto& data = *g_integp_data;
+  const auto base = reinterpret_cast<ULONG_PTR>(image_base);
+  const auto dos = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+  const auto nt = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos->e_lfanew);
+
+  IntegrityImage image = {image_base};
+  RtlStringCchCopyNA(image.image_name, RTL_NUMBER_OF(image.image_name),
+                     image_name, RTL_NUMBER_OF(image.image_name) - 1);
+  const auto image_index = static_cast<ULONG>(data.images.size());
+  data.images.push_back(image);
+
+  const auto pages_before = data.pages.size();
+  const auto sections = IMAGE_FIRST_SECTION(nt);
+  for (auto i = 0ul; i < nt->FileHeader.NumberOfSections; ++i) {
+    const auto& section = sections[i];
+    if (!IntegpIsHashableSection(section)) {
+      continue;
+    }
+
+    const auto first_index = section.VirtualAddress >> PAGE_SHIFT;
+    const auto pages = BYTES_TO_PAGES(section.Misc.VirtualSize);
+    for (auto index = first_index; index < first_index + pages; ++index) {
+      const auto va = reinterpret_cast<void*>(base + index * PAGE_SIZE);
+      if (!UtilIsAccessibleAddress(va)) {
+        continue;
+      }
+      data.pages.push_back({UtilPaFromVa(va), va, 0, false, image_index});
+    }
+  }
+  HYPERPLATFORM_LOG_INFO("Code integrity of %s (%p) covers %lu pages.",
+                         image.image_name, image_base,
+                         static_cast<ULONG>(data.pages.size() - pages_before));
+  return STATUS_SUCCESS;
+}
+
+// Write-protects the pages, takes their baseline hashes and starts a check
+// thread
+_Use_decl_annotations_ EXTERN_C NTSTATUS IntegStart() {
+  PAGED_CODE();
+
+  auto& data = *g_integp_data;
+  if (data.pages.empty()) {
+    return STATUS_NOT_FOUND;
+  }
+
+  std::sort(data.pages.begin(), data.pages.end(),
+            [](const auto& lhs, const auto& rhs) {
+              return lhs.pa_base < rhs.pa_base;
+            });
+  data.written_pages.resize((data.pages.size() + 31) / 32);
+
+  // Protect the pages on all processors before hashing them so that a write
+  // made while or after a page is hashed is always recorded and checked by the
+  // check thread
+  auto status = UtilVmCall(HypercallNumber::kDdimonEnableIntegrity, &data);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+  status = EptFlushTranslations();
+  if (!NT_SUCCESS(status)) {
+    UtilVmCall(HypercallNumber::kDdimonDisableIntegrity, &data);
+    return status;
+  }
+  for (auto& page : data.pages) {
+    page.baseline_hash = IntegpHashPage(page.va_base);
+  }
+
+  status = PsCreateSystemThread(&data.check_thread_handle, GENERIC_ALL,
+                                nullptr, nullptr, nullptr,
+                                IntegpCheckThreadRoutine, &data);
+  if (!NT_SUCCESS(status)) {
+    // IntegTermination() waits for handlers that may still reference the data
+    UtilVmCall(HypercallNumber::kDdimonDisableIntegrity, &data);
+    return status;
+  }
+  return status;
+}
+
+// Stops the check thread and monitoring, and reports statistics
+_Use_decl_annotations_ EXTERN_C void IntegTermination() {
+  PAGED_CODE();
+
+  auto data = g_integp_data;
+  if (!data) {
+    return;
+  }
+
+  if (data->check_thread_handle) {
+    KeSetEvent(&data->stop_event, IO_NO_INCREMENT, FALSE);
+    auto status =
+        ZwWaitForSingleObject(data->check_thread_handle, FALSE, nullptr);
+    NT_VERIFY(NT_SUCCESS(status));
+    ZwClose(data->check_thread_handle);
+
+    status = UtilVmCall(HypercallNumber::kDdimonDisableIntegrity, data);
+    NT_VERIFY(NT_SUCCESS(status));
+    status = EptFlushTranslations();
+    NT_VERIFY(NT_SUCCESS(status));
+  }
+
+  // Make sure that no processor is still running IntegHandleEptViolation()
+  // with the data before freeing it
+  g_integp_data = nullptr;
+  auto status = UtilWaitForQuiescence();
+  NT_VERIFY(NT_SUCCESS(status));
+
+  auto modified_pages = 0ul;
+  for (const auto& page : data->pages) {
+    if (page.modified) {
+      modified_pages++;
+    }
+  }
+  HYPERPLATFORM_LOG_INFO(
+      "Code integrity: %lu of %lu pages modified, %ld write violations, %lu "
+      "pages rehashed.",
+      modified_pages, static_cast<ULONG>(data->pages.size()),
+      data->write_violations, data->rehashed_pages);
+  delete data;
+}
+
+// Returns true if the section is executable and stays on memory
+_Use_decl_annotations_ static bool IntegpIsHashableSection(
+    const IMAGE_SECTION_HEADER& section) {
+  PAGED_CODE();
+
+  if (!FlagOn(section.Characteristics, IMAGE_SCN_MEM_EXECUTE) ||
+      FlagOn(section.Characteristics, IMAGE_SCN_MEM_DISCARDABLE)) {
+    return false;
+  }
+  // Pageable code may be moved to other physical pages
+  if (RtlCompareMemory(section.Name, "PAGE", 4) == 4) {
+    return false;
+  }
+  return true;
+}
+
+// Periodically rehashes written pages until the stop event is signaled
+_Use_decl_annotations_ static VOID IntegpCheckThreadRoutine(
+    void* start_context) {
+  PAGED_CODE();
+
+  const auto data = reinterpret_cast<IntegrityData*>(start_context);
+  LARGE_INTEGER interval = {};
+  interval.QuadPart = -(10000000ll * data->check_interval);  // sec
+
+  while (KeWaitForSingleObject(&data->stop_event, Executive, KernelMode, FALSE,
+                               &interval) == STATUS_TIMEOUT) {
+    IntegpCheckWrittenPages(data);
+  }
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Rehashes only pages written since the last check, and reports pages whose
+// hashes changed from or returned to the baseline
+_Use_decl_annotations_ static void IntegpCheckWrittenPages(
+    IntegrityData* data) {
+  PAGED_CODE();
+
+  // Write-protect pages again before hashing so that writes made during or
+  // after hashing are caught by the next check
+  std::vector<ULONG> indexes;
+  for (auto i = 0ul; i < data->pages.size(); ++i) {
+    if (InterlockedBitTestAndReset(&data->written_pages[i / 32], i % 32)) {
+      indexes.push_back(i);
+    }
+  }
+  if (indexes.empty()) {
+    return;
+  }
+  auto status = UtilVmCall(HypercallNumber::kDdimonEnableIntegrity, data);
+  NT_VERIFY(NT_SUCCESS(status));
+  status = EptFlushTranslations();
+  NT_VERIFY(NT_SUCCESS(status));
+
+  for (const auto index : indexes) {
+    auto& page = data->pages[index];
+    const auto hash = IntegpHashPage(page.va_base);
+    data->rehashed_pages++;
+
+    const auto modified = (hash != page.baseline_hash);
+    if (modified == page.modified) {
+      continue;
+    }
+    page.modified = modified;
+
+    const auto& image = data->images[page.image_index];
+    const auto offset = reinterpret_cast<ULONG_PTR>(page.va_base) -
+                        reinterpret_cast<ULONG_PTR>(image.image_base);
+    if (modified) {
+      HYPERPLATFORM_LOG_WARN(
+          "Code modified: %s+%05Ix (VA=%p, PA=%016llx) %016llx -> %016llx",
+          image.image_name, offset, page.va_base, page.pa_base,
+          page.baseline_hash, hash);
+    } else {
+      HYPERPLATFORM_LOG_INFO(
+          "Code restored: %s+%05Ix (VA=%p, PA=%016llx) %016llx",
+          image.image_name, offset, page.va_base, page.pa_base, hash);
+    }
+  }
+}
+
+// Computes xxHash64 of a page with a seed of zero. Four independent lanes let
+// the processor overlap multiplications.
+_Use_decl_annotations_ static ULONG64 IntegpHashPage(const void* page) {
+  static const auto kStripeSize = sizeof(ULONG64) * 4;
+  static_assert(PAGE_SIZE % kStripeSize == 0, "Size check");
+
+  const auto input = reinterpret_cast<const ULONG64*>(page);
+  auto v1 = kIntegpPrime1 + kIntegpPrime2;
+  auto v2 = kIntegpPrime2;
+  auto v3 = 0ull;
+  auto v4 = 0ull - kIntegpPrime1;
+  for (auto i = 0ul; i < PAGE_SIZE / sizeof(ULONG64); i += 4) {
+    v1 = IntegpHashRound(v1, input[i]);
+    v2 = IntegpHashRound(v2, input[i + 1]);
+    v3 = IntegpHashRound(v3, input[i + 2]);
+    v4 = IntegpHashRound(v4, input[i + 3]);
+  }
+
+  auto hash = _rotl64(v1, 1) + _rotl64(v2, 7) + _rotl64(v3, 12) +
+              _rotl64(v4, 18);
+  hash = IntegpHashMergeRound(hash, v1);
+  hash = IntegpHashMergeRound(hash, v2);
+  hash = IntegpHashMergeRound(hash, v3);
+  hash = IntegpHashMergeRound(hash, v4);
+  hash += PAGE_SIZE;
+
+  hash ^= hash >> 33;
+  hash *= kIntegpPrime2;
+  hash ^= hash >> 29;
+  hash *= kIntegpPrime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+// Mixes 8 bytes of input into an accumulator of xxHash64
+_Use_decl_annotations_ static ULONG64 IntegpHashRound(ULONG64 accumulator,
+                                                      ULONG64 input) {
+  accumulator += input * kIntegpPrime2;
+  accumulator = _rotl64(accumulator, 31);
+  accumulator *= kIntegpPrime1;
+  return accumulator;
+}
+
+// Merges a lane into an accumulator of xxHash64
+_Use_decl_annotations_ static ULONG64 IntegpHashMergeRound(ULONG64 accumulator,
+                                                           ULONG64 value) {
+  accumulator ^= IntegpHashRound(0, value);
+  accumulator = accumulator * kIntegpPrime1 + kIntegpPrime4;
+  return accumulator;
+}
+
+// Removes write permission from the pages so that the first write to each page
+// causes EPT violation
+_Use_decl_annotations_ void IntegVmCallProtectPages(EptData* ept_data,
+                                                    void* context) {
+  const auto data = reinterpret_cast<IntegrityData*>(context);
+  for (const auto& page : data->pages) {
+    const auto ept_pt_entry = EptGetEptPtEntry(ept_data, page.pa_base);
+    ept_pt_entry->fields.write_access = false;
+  }
+  EptCommitChange(ept_data);
+}
+
+// Restores write permission of the pages
+_Use_decl_annotations_ void IntegVmCallUnprotectPages(EptData* ept_data,
+                                                      void* context) {
+  const auto data = reinterpret_cast<IntegrityData*>(context);
+  for (const auto& page : data->pages) {
+    const auto ept_pt_entry = EptGetEptPtEntry(ept_data, page.pa_base);
+    ept_pt_entry->fields.write_access = true;
+  }
+  EptCommitChange(ept_data);
+}
+
+// Handles EPT violation VM-exit due to write. Returns false if the fault is not
+// on any of monitored pages. Otherwise, marks the page as written and restores
+// write permission so that each page costs only one VM-exit until the next
+// check.
+_Use_decl_annotations_ bool IntegHandleEptViolation(EptData* ept_data,
+                                                    void* fault_va,
+                                                    ULONG64 fault_pa) {
+  UNREFERENCED_PARAMETER(fault_va);
+
+  // Read the pointer only once since IntegTermination() may clear it
+  const auto data = g_integp_data;
+  if (!data || data->written_pages.empty()) {
+    return false;
+  }
+  const auto page = IntegpFindPageByPa(data, fault_pa);
+  if (!page) {
+    return false;
+  }
+
+  const auto index = static_cast<ULONG>(page - data->pages.data());
+  InterlockedBitTestAndSet(&data->written_pages[index / 32], index % 32);
+  InterlockedIncrement(&data->write_violations);
+
+  const auto ept_pt_entry = EptGetEptPtEntry(ept_data, page->pa_base);
+  ept_pt_entry->fields.write_access = true;
+  EptCommitChange(ept_data);
+  return true;
+}
+
+// Finds a monitored page by a physical address
+_Use_decl_annotations_ static IntegrityPage* IntegpFindPageByPa(
+    IntegrityData* data, ULONG64 pa) {
+  const auto pa_base = pa & ~static_cast<ULONG64>(PAGE_SIZE - 1);
+  auto& pages = data->pages;
+  const auto found = std::lower_bound(
+      pages.begin(), pages.end(), pa_base,
+      [](const auto& page, ULONG64 value) { return page.pa_base < value; });
+  if (found == pages.end() || found->pa_base != pa_base) {
+    return nullptr;
+  }
+  return &*found;
+}
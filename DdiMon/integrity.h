@@ -0,0 +1,64 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to code integrity hashing functions.
+
+#ifndef DDIMON_INTEGRITY_H_
+#define DDIMON_INTEGRITY_H_
+
+#include <fltKernel.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct EptData;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+    IntegInitialization(_In_ ULONG check_interval);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+    IntegAddImage(_In_ void* image_base, _In_ const char* image_name);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS IntegStart();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void IntegTermination();
+
+_IRQL_requires_min_(DISPATCH_LEVEL) void IntegVmCallProtectPages(
+    _In_ EptData* ept_data, _In_ void* context);
+
+_IRQL_requires_min_(DISPATCH_LEVEL) void IntegVmCallUnprotectPages(
+    _In_ EptData* ept_data, _In_ void* context);
+
+_IRQL_requires_min_(DISPATCH_LEVEL) bool IntegHandleEptViolation(
+    _In_ EptData* ept_data, _In_ void* fault_va, _In_ ULONG64 fault_pa);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_INTEGRITY_H_
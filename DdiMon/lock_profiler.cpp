@@ -0,0 +1,475 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements spin lock profiler functions.
+
+#include "lock_profiler.h"
+#include <intrin.h>
+#define NTSTRSAFE_NO_CB_FUNCTIONS
+#include <ntstrsafe.h>
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A number of buckets of a histogram. A bucket n counts durations in
+// [2^n, 2^(n+1)) cycles, and the last bucket counts all longer durations.
+static const ULONG kLockprofpHistogramBuckets = 24;
+
+// How many locks can be held by a processor at once
+static const ULONG kLockprofpMaxHeldLocks = 16;
+
+// How many distinct locks and caller modules are tracked by a processor.
+// Durations for others are dropped.
+static const ULONG kLockprofpMaxLocks = 128;
+static const ULONG kLockprofpMaxModules = 64;
+
+// How many distinct locks have their last release time tracked. Wait time of
+// others is not measured and counted as zero.
+static const ULONG kLockprofpMaxReleaseTimes = 1024;
+
+// How many locks and modules are reported
+static const ULONG kLockprofpMaxReports = 16;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A distribution of durations in TSC cycles
+struct LockprofHistogram {
+  ULONG64 count;
+  ULONG64 total_cycles;
+  ULONG64 max_cycles;
+  ULONG64 buckets[kLockprofpHistogramBuckets];
+};
+
+// Durations observed for a lock or for a caller module
+struct LockprofStats {
+  ULONG_PTR key;  // An address of a lock or a module base, or 0 if unused
+  LockprofHistogram hold;
+  LockprofHistogram wait;
+};
+
+// A lock being acquired or held by a processor
+struct LockprofHeldLock {
+  ULONG_PTR lock;
+  ULONG_PTR caller_base;
+  ULONG64 acquire_tsc;
+};
+
+// When a lock was last released. It is shared among processors and updated
+// only by a processor releasing the lock.
+struct LockprofReleaseTime {
+  void* volatile lock;  // nullptr if unused
+  volatile LONG64 release_tsc;
+};
+
+// Bounded tables of a processor. They are only updated by the processor in
+// VMX-root mode and need no lock.
+struct LockprofProcessorData {
+  ULONG held_count;
+  LockprofHeldLock held[kLockprofpMaxHeldLocks];
+  LockprofStats locks[kLockprofpMaxLocks];
+  LockprofStats modules[kLockprofpMaxModules];
+  ULONG64 dropped;  // A number of events not recorded as tables were full
+};
+
+// Global state of the lock profiler
+struct LockprofData {
+  LockprofReleaseTime release_times[kLockprofpMaxReleaseTimes];
+  ULONG processor_count;
+  LockprofProcessorData* processors[1];  // Has processor_count elements
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static LockprofStats* LockprofpFindStats(_Inout_updates_(table_size)
+                                             LockprofStats* table,
+                                         _In_ ULONG table_size,
+                                         _In_ ULONG_PTR key);
+
+static LockprofReleaseTime* LockprofpFindReleaseTime(_Inout_ LockprofData* data,
+                                                     _In_ ULONG_PTR lock);
+
+static void LockprofpRemoveHeldLock(
+    _Inout_ LockprofProcessorData* processor_data, _In_ ULONG index);
+
+static void LockprofpAddSample(_Inout_ LockprofHistogram* histogram,
+                               _In_ ULONG64 cycles);
+
+static void LockprofpMergeHistogram(_Inout_ LockprofHistogram* histogram,
+                                    _In_ const LockprofHistogram& source);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LockprofpReport(
+    _In_ const LockprofData& data);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LockprofpReportStats(
+    _In_ const char* kind,
+    _Inout_updates_(stats_count) LockprofStats* stats,
+    _In_ ULONG stats_count);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LockprofpReportHistogram(
+    _In_ const char* name, _In_ const LockprofHistogram& histogram);
+
+static void LockprofpFreeData(_In_ LockprofData* data);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, LockprofInitialization)
+#pragma alloc_text(PAGE, LockprofTermination)
+#pragma alloc_text(PAGE, LockprofpReport)
+#pragma alloc_text(PAGE, LockprofpReportStats)
+#pragma alloc_text(PAGE, LockprofpReportHistogram)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Lock profiler state. It is set before breakpoints are enabled and cleared
+// after they are disabled.
+static LockprofData* g_lockprofp_data;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates tables of all processors
+_Use_decl_annotations_ EXTERN_C NTSTATUS LockprofInitialization() {
+  PAGED_CODE();
+
+  const auto processor_count =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto data_size = sizeof(LockprofData) +
+                         sizeof(LockprofProcessorData*) * (processor_count - 1);
+  const auto data = reinterpret_cast<LockprofData*>(ExAllocatePoolWithTag(
+      NonPagedPool, data_size, kHyperPlatformCommonPoolTag));
+  if (!data) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(data, data_size);
+  data->processor_count = processor_count;
+  for (auto i = 0ul; i < processor_count; ++i) {
+    const auto processor_data =
+        reinterpret_cast<LockprofProcessorData*>(ExAllocatePoolWithTag(
+            NonPagedPool, sizeof(LockprofProcessorData),
+            kHyperPlatformCommonPoolTag));
+    if (!processor_data) {
+      LockprofpFreeData(data);
+      return STATUS_MEMORY_NOT_ALLOCATED;
+    }
+    RtlZeroMemory(processor_data, sizeof(LockprofProcessorData));
+    data->processors[i] = processor_data;
+  }
+
+  g_lockprofp_data = data;
+  return STATUS_SUCCESS;
+}
+
+// Reports and frees tables. Handlers must have been stopped.
+_Use_decl_annotations_ EXTERN_C void LockprofTermination() {
+  PAGED_CODE();
+
+  const auto data = g_lockprofp_data;
+  if (!data) {
+    return;
+  }
+  g_lockprofp_data = nullptr;
+
+  LockprofpReport(*data);
+  LockprofpFreeData(data);
+}
+
+// Starts measuring wait and hold time of the lock. Acquisition may have not
+// raised IRQL yet, so the thread can be moved to another processor before it
+// gets the lock. Such an entry is left behind and reused or dropped later.
+_Use_decl_annotations_ EXTERN_C void LockprofAcquiring(ULONG_PTR lock,
+                                                       ULONG_PTR caller_base,
+                                                       ULONG64 acquire_tsc) {
+  const auto data = g_lockprofp_data;
+  if (!data) {
+    return;
+  }
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  if (processor >= data->processor_count) {
+    return;
+  }
+  auto& processor_data = *data->processors[processor];
+
+  // A spin lock is not acquired recursively, so an existing entry for the lock
+  // is a stale one. Otherwise, drop the oldest entry when all are used, as it
+  // is the most likely to be stale.
+  LockprofHeldLock* held = nullptr;
+  for (auto i = 0ul; i < processor_data.held_count; ++i) {
+    if (processor_data.held[i].lock == lock) {
+      held = &processor_data.held[i];
+      break;
+    }
+  }
+  if (!held) {
+    if (processor_data.held_count == kLockprofpMaxHeldLocks) {
+      LockprofpRemoveHeldLock(&processor_data, 0);
+      processor_data.dropped++;
+    }
+    held = &processor_data.held[processor_data.held_count++];
+  }
+  held->lock = lock;
+  held->caller_base = caller_base;
+  held->acquire_tsc = acquire_tsc;
+}
+
+// Records wait and hold time of the lock. The lock was acquired when another
+// processor released it last if that happened after this processor started
+// acquiring it, or right away otherwise. TSC is assumed to be synchronized
+// among processors. A lock acquired before profiling started is ignored.
+_Use_decl_annotations_ EXTERN_C void LockprofReleasing(ULONG_PTR lock,
+                                                       ULONG64 release_tsc) {
+  const auto data = g_lockprofp_data;
+  if (!data) {
+    return;
+  }
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  if (processor >= data->processor_count) {
+    return;
+  }
+  auto& processor_data = *data->processors[processor];
+
+  // Publish the release time for processors waiting for the lock. No other
+  // processor updates it while this processor holds the lock.
+  const auto release_time = LockprofpFindReleaseTime(data, lock);
+  const auto last_release_tsc =
+      (release_time) ? static_cast<ULONG64>(InterlockedExchange64(
+                           &release_time->release_tsc, release_tsc))
+                     : 0;
+
+  // Search from the most recently acquired one as locks are usually released
+  // in reverse order
+  for (auto i = processor_data.held_count; i > 0; --i) {
+    const auto held = processor_data.held[i - 1];
+    if (held.lock != lock) {
+      continue;
+    }
+    LockprofpRemoveHeldLock(&processor_data, i - 1);
+
+    const auto acquired_tsc = (last_release_tsc > held.acquire_tsc &&
+                               last_release_tsc < release_tsc)
+                                  ? last_release_tsc
+                                  : held.acquire_tsc;
+    const auto wait_cycles = acquired_tsc - held.acquire_tsc;
+    const auto hold_cycles = release_tsc - acquired_tsc;
+
+    // Record durations to either table even when the other one is full
+    const auto lock_stats =
+        LockprofpFindStats(processor_data.locks, kLockprofpMaxLocks, lock);
+    const auto module_stats = LockprofpFindStats(
+        processor_data.modules, kLockprofpMaxModules, held.caller_base);
+    if (lock_stats) {
+      LockprofpAddSample(&lock_stats->wait, wait_cycles);
+      LockprofpAddSample(&lock_stats->hold, hold_cycles);
+    }
+    if (module_stats) {
+      LockprofpAddSample(&module_stats->wait, wait_cycles);
+      LockprofpAddSample(&module_stats->hold, hold_cycles);
+    }
+    if (!lock_stats || !module_stats) {
+      processor_data.dropped++;
+    }
+    return;
+  }
+}
+
+// Returns the last release time of the lock, adding an entry if it is not
+// found, or nullptr if the table is full. Entries are never removed.
+_Use_decl_annotations_ static LockprofReleaseTime* LockprofpFindReleaseTime(
+    LockprofData* data, ULONG_PTR lock) {
+  const auto key = reinterpret_cast<void*>(lock);
+  const auto start =
+      static_cast<ULONG>((lock >> 4) % kLockprofpMaxReleaseTimes);
+  for (auto i = 0ul; i < kLockprofpMaxReleaseTimes; ++i) {
+    auto& entry = data->release_times[(start + i) % kLockprofpMaxReleaseTimes];
+    const auto current =
+        InterlockedCompareExchangePointer(&entry.lock, key, nullptr);
+    if (!current || current == key) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+// Removes an entry of held locks keeping the order of others
+_Use_decl_annotations_ static void LockprofpRemoveHeldLock(
+    LockprofProcessorData* processor_data, ULONG index) {
+  for (auto i = index + 1; i < processor_data->held_count; ++i) {
+    processor_data->held[i - 1] = processor_data->held[i];
+  }
+  processor_data->held_count--;
+}
+
+// Returns stats for the key in an open addressing table, adding an entry if it
+// is not found, or nullptr if the table is full
+_Use_decl_annotations_ static LockprofStats* LockprofpFindStats(
+    LockprofStats* table, ULONG table_size, ULONG_PTR key) {
+  const auto start = static_cast<ULONG>((key >> 4) % table_size);
+  for (auto i = 0ul; i < table_size; ++i) {
+    auto& stats = table[(start + i) % table_size];
+    if (stats.key == key) {
+      return &stats;
+    }
+    if (!stats.key) {
+      stats.key = key;
+      return &stats;
+    }
+  }
+  return nullptr;
+}
+
+// Adds a duration to the histogram
+_Use_decl_annotations_ static void LockprofpAddSample(
+    LockprofHistogram* histogram, ULONG64 cycles) {
+  ULONG index = 0;
+  if (cycles) {
+    _BitScanReverse64(&index, cycles);
+  }
+  histogram->buckets[min(index, kLockprofpHistogramBuckets - 1)]++;
+  histogram->count++;
+  histogram->total_cycles += cycles;
+  histogram->max_cycles = max(histogram->max_cycles, cycles);
+}
+
+// Adds all durations in the source to the histogram
+_Use_decl_annotations_ static void LockprofpMergeHistogram(
+    LockprofHistogram* histogram, const LockprofHistogram& source) {
+  for (auto i = 0ul; i < kLockprofpHistogramBuckets; ++i) {
+    histogram->buckets[i] += source.buckets[i];
+  }
+  histogram->count += source.count;
+  histogram->total_cycles += source.total_cycles;
+  histogram->max_cycles = max(histogram->max_cycles, source.max_cycles);
+}
+
+// Merges tables of all processors and reports locks and caller modules with
+// the longest total hold time
+_Use_decl_annotations_ static void LockprofpReport(const LockprofData& data) {
+  PAGED_CODE();
+
+  const auto stats_count =
+      max(kLockprofpMaxLocks, kLockprofpMaxModules) * data.processor_count;
+  const auto stats_size = sizeof(LockprofStats) * stats_count;
+  const auto stats = reinterpret_cast<LockprofStats*>(ExAllocatePoolWithTag(
+      PagedPool, stats_size, kHyperPlatformCommonPoolTag));
+  if (!stats) {
+    return;
+  }
+
+  ULONG64 dropped = 0;
+  for (auto i = 0ul; i < data.processor_count; ++i) {
+    dropped += data.processors[i]->dropped;
+  }
+  HYPERPLATFORM_LOG_INFO("Lock profile (%I64u events dropped):", dropped);
+
+  // Merge locks of all processors
+  RtlZeroMemory(stats, stats_size);
+  for (auto i = 0ul; i < data.processor_count; ++i) {
+    for (const auto& source : data.processors[i]->locks) {
+      if (!source.key) {
+        continue;
+      }
+      const auto merged = LockprofpFindStats(stats, stats_count, source.key);
+      LockprofpMergeHistogram(&merged->hold, source.hold);
+      LockprofpMergeHistogram(&merged->wait, source.wait);
+    }
+  }
+  LockprofpReportStats("Lock", stats, stats_count);
+
+  // Merge caller modules of all processors
+  RtlZeroMemory(stats, stats_size);
+  for (auto i = 0ul; i < data.processor_count; ++i) {
+    for (const auto& source : data.processors[i]->modules) {
+      if (!source.key) {
+        continue;
+      }
+      const auto merged = LockprofpFindStats(stats, stats_count, source.key);
+      LockprofpMergeHistogram(&merged->hold, source.hold);
+      LockprofpMergeHistogram(&merged->wait, source.wait);
+    }
+  }
+  LockprofpReportStats("Module", stats, stats_count);
+
+  ExFreePoolWithTag(stats, kHyperPlatformCommonPoolTag);
+}
+
+// Reports stats with the longest total hold time in descending order. Stats
+// are reordered. A module not backed by any image is shown as ffff...ffff.
+_Use_decl_annotations_ static void LockprofpReportStats(const char* kind,
+                                                        LockprofStats* stats,
+                                                        ULONG stats_count) {
+  PAGED_CODE();
+
+  for (auto i = 0ul; i < min(kLockprofpMaxReports, stats_count); ++i) {
+    auto longest = i;
+    for (auto j = i + 1; j < stats_count; ++j) {
+      if (stats[j].hold.total_cycles > stats[longest].hold.total_cycles) {
+        longest = j;
+      }
+    }
+    if (!stats[longest].key) {
+      break;
+    }
+    const auto temp = stats[i];
+    stats[i] = stats[longest];
+    stats[longest] = temp;
+
+    const auto& current = stats[i];
+    HYPERPLATFORM_LOG_INFO(
+        "%-6s %p: %I64u acquisitions, hold %I64u (max %I64u), wait %I64u "
+        "(max %I64u) cycles",
+        kind, current.key, current.wait.count, current.hold.total_cycles,
+        current.hold.max_cycles, current.wait.total_cycles,
+        current.wait.max_cycles);
+    LockprofpReportHistogram("hold", current.hold);
+    LockprofpReportHistogram("wait", current.wait);
+  }
+}
+
+// Prints non-empty buckets of the histogram as pairs of the log2 of the lower
+// bound in cycles and a count
+_Use_decl_annotations_ static void LockprofpReportHistogram(
+    const char* name, const LockprofHistogram& histogram) {
+  PAGED_CODE();
+
+  char line[256] = {};
+  for (auto i = 0ul; i < kLockprofpHistogramBuckets; ++i) {
+    if (!histogram.buckets[i]) {
+      continue;
+    }
+    const auto length = strlen(line);
+    RtlStringCchPrintfA(line + length, RTL_NUMBER_OF(line) - length,
+                        " 2^%lu:%I64u", i, histogram.buckets[i]);
+  }
+  HYPERPLATFORM_LOG_INFO("  %s:%s", name, line);
+}
+
+// Frees LockprofData and all tables referenced from it
+_Use_decl_annotations_ static void LockprofpFreeData(LockprofData* data) {
+  for (auto i = 0ul; i < data->processor_count; ++i) {
+    if (data->processors[i]) {
+      ExFreePoolWithTag(data->processors[i], kHyperPlatformCommonPoolTag);
+    }
+  }
+  ExFreePoolWithTag(data, kHyperPlatformCommonPoolTag);
+}
@@ -0,0 +1,57 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to spin lock profiler functions.
+
+#ifndef DDIMON_LOCK_PROFILER_H_
+#define DDIMON_LOCK_PROFILER_H_
+
+#include <fltKernel.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS LockprofInitialization();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void LockprofTermination();
+
+// Records that the lock is being acquired at acquire_tsc by a call from the
+// image at caller_base, or MAXULONG_PTR if the caller is not backed by any
+// image. It is called before the call and needs no post breakpoint.
+EXTERN_C void LockprofAcquiring(_In_ ULONG_PTR lock, _In_ ULONG_PTR caller_base,
+                                _In_ ULONG64 acquire_tsc);
+
+// Records that the lock is being released at release_tsc. It must be called on
+// the processor that called LockprofAcquiring() for the lock.
+EXTERN_C void LockprofReleasing(_In_ ULONG_PTR lock, _In_ ULONG64 release_tsc);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_LOCK_PROFILER_H_
@@ -0,0 +1,392 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements module snapshot functions.
+
+#include "module_snapshot.h"
+#include <ntimage.h>
+#define NTSTRSAFE_NO_CB_FUNCTIONS
+#include <ntstrsafe.h>
+#include "../HyperPlatform/HyperPlatform/kernel_stl.h"
+#include <vector>
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#include "../HyperPlatform/HyperPlatform/util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// SystemModuleInformation for ZwQuerySystemInformation()
+static const ULONG kModsnappSystemModuleInformation = 11;
+
+// 'RSDS'; a signature of a CodeView record with a PDB 7.0 file
+static const ULONG kModsnappCodeViewSignature = 'SDSR';
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// dt nt!_RTL_PROCESS_MODULE_INFORMATION
+struct ModsnapSystemModule {
+  HANDLE section;
+  void* mapped_base;
+  void* image_base;
+  ULONG image_size;
+  ULONG flags;
+  USHORT load_order_index;
+  USHORT init_order_index;
+  USHORT load_count;
+  USHORT offset_to_file_name;
+  UCHAR full_path_name[256];
+};
+
+// dt nt!_RTL_PROCESS_MODULES
+struct ModsnapSystemModules {
+  ULONG number_of_modules;
+  ModsnapSystemModule modules[1];
+};
+
+// A CodeView record pointed by IMAGE_DEBUG_DIRECTORY
+struct ModsnapCodeViewRecord {
+  ULONG signature;  // kModsnappCodeViewSignature
+  GUID guid;
+  ULONG age;
+  char pdb_path[1];  // A null-terminated path of a PDB
+};
+
+// Records of loaded images and a lock for them
+struct ModuleSnapshotData {
+  const wchar_t* file_path;
+  LONG64 start_time;
+  FAST_MUTEX records_lock;
+  std::vector<ModuleSnapshotRecord> records;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+NTSYSAPI NTSTATUS NTAPI
+ZwQuerySystemInformation(_In_ ULONG system_information_class,
+                         _Out_writes_bytes_opt_(system_information_length)
+                             PVOID system_information,
+                         _In_ ULONG system_information_length,
+                         _Out_opt_ PULONG return_length);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    ModsnappCollectLoadedImages(_Inout_ ModuleSnapshotData* data);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ModsnappLoadImageNotifyRoutine(
+    _In_opt_ PUNICODE_STRING full_image_name, _In_ HANDLE process_id,
+    _In_ PIMAGE_INFO image_info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ModsnappFillRecord(
+    _In_ void* image_base, _In_ ULONG size_of_image, _In_ LONG64 load_time,
+    _In_ ULONG flags, _Out_ ModuleSnapshotRecord* record);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    ModsnappWriteSnapshotFile(_Inout_ ModuleSnapshotData* data);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, ModsnapInitialization)
+#pragma alloc_text(INIT, ModsnappCollectLoadedImages)
+#pragma alloc_text(PAGE, ModsnapTermination)
+#pragma alloc_text(PAGE, ModsnappLoadImageNotifyRoutine)
+#pragma alloc_text(PAGE, ModsnappFillRecord)
+#pragma alloc_text(PAGE, ModsnappWriteSnapshotFile)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static ModuleSnapshotData* g_modsnapp_data;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Records currently loaded images, starts recording images loaded later and
+// writes the snapshot so that logs can be symbolized even if the system
+// crashes before ModsnapTermination()
+_Use_decl_annotations_ EXTERN_C NTSTATUS
+ModsnapInitialization(const wchar_t* file_path) {
+  PAGED_CODE();
+
+  auto data = new ModuleSnapshotData();
+  data->file_path = file_path;
+  LARGE_INTEGER now = {};
+  KeQuerySystemTime(&now);
+  data->start_time = now.QuadPart;
+  ExInitializeFastMutex(&data->records_lock);
+
+  auto status = ModsnappCollectLoadedImages(data);
+  if (!NT_SUCCESS(status)) {
+    delete data;
+    return status;
+  }
+
+  const auto preloaded_count = static_cast<ULONG>(data->records.size());
+  g_modsnapp_data = data;
+  status = PsSetLoadImageNotifyRoutine(ModsnappLoadImageNotifyRoutine);
+  if (!NT_SUCCESS(status)) {
+    g_modsnapp_data = nullptr;
+    delete data;
+    return status;
+  }
+
+  status = ModsnappWriteSnapshotFile(data);
+  if (!NT_SUCCESS(status)) {
+    HYPERPLATFORM_LOG_WARN("Failed to write a module snapshot (%08x).",
+                           status);
+  }
+  HYPERPLATFORM_LOG_INFO("Recorded %lu loaded images.", preloaded_count);
+  return STATUS_SUCCESS;
+}
+
+// Stops recording and writes all records including images loaded after
+// ModsnapInitialization()
+_Use_decl_annotations_ EXTERN_C void ModsnapTermination() {
+  PAGED_CODE();
+
+  if (!g_modsnapp_data) {
+    return;
+  }
+
+  // No callback is running after PsRemoveLoadImageNotifyRoutine() returned
+  NT_VERIFY(NT_SUCCESS(
+      PsRemoveLoadImageNotifyRoutine(ModsnappLoadImageNotifyRoutine)));
+  const auto data = g_modsnapp_data;
+  g_modsnapp_data = nullptr;
+
+  const auto status = ModsnappWriteSnapshotFile(data);
+  if (!NT_SUCCESS(status)) {
+    HYPERPLATFORM_LOG_WARN("Failed to write a module snapshot (%08x).",
+                           status);
+  }
+  delete data;
+}
+
+// Records images loaded into the kernel address space
+_Use_decl_annotations_ static NTSTATUS ModsnappCollectLoadedImages(
+    ModuleSnapshotData* data) {
+  PAGED_CODE();
+
+  // Take a snapshot of the module list. It may grow between calls.
+  ULONG buffer_size = 0;
+  void* buffer = nullptr;
+  auto status = STATUS_INFO_LENGTH_MISMATCH;
+  while (status == STATUS_INFO_LENGTH_MISMATCH) {
+    if (buffer) {
+      ExFreePoolWithTag(buffer, kHyperPlatformCommonPoolTag);
+    }
+    buffer_size += PAGE_SIZE * 4;
+    buffer = ExAllocatePoolWithTag(PagedPool, buffer_size,
+                                   kHyperPlatformCommonPoolTag);
+    if (!buffer) {
+      return STATUS_MEMORY_NOT_ALLOCATED;
+    }
+    status = ZwQuerySystemInformation(kModsnappSystemModuleInformation,
+                                      buffer, buffer_size, &buffer_size);
+  }
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(buffer, kHyperPlatformCommonPoolTag);
+    return status;
+  }
+
+  const auto modules = reinterpret_cast<ModsnapSystemModules*>(buffer);
+  data->records.reserve(modules->number_of_modules);
+  for (auto i = 0ul; i < modules->number_of_modules; ++i) {
+    const auto& module = modules->modules[i];
+    ModuleSnapshotRecord record = {};
+    ModsnappFillRecord(module.image_base, module.image_size, data->start_time,
+                       kModuleSnapshotFlagPreloaded, &record);
+    RtlStringCchCopyA(
+        record.image_name, RTL_NUMBER_OF(record.image_name),
+        reinterpret_cast<const char*>(module.full_path_name +
+                                      module.offset_to_file_name));
+    data->records.push_back(record);
+  }
+  ExFreePoolWithTag(buffer, kHyperPlatformCommonPoolTag);
+  return STATUS_SUCCESS;
+}
+
+// Records a kernel image being loaded. User-mode images are ignored.
+_Use_decl_annotations_ static void ModsnappLoadImageNotifyRoutine(
+    PUNICODE_STRING full_image_name, HANDLE process_id,
+    PIMAGE_INFO image_info) {
+  PAGED_CODE();
+  UNREFERENCED_PARAMETER(process_id);
+
+  const auto data = g_modsnapp_data;
+  if (!data || !image_info->SystemModeImage) {
+    return;
+  }
+
+  LARGE_INTEGER now = {};
+  KeQuerySystemTime(&now);
+  ModuleSnapshotRecord record = {};
+  ModsnappFillRecord(image_info->ImageBase,
+                     static_cast<ULONG>(image_info->ImageSize), now.QuadPart,
+                     0, &record);
+
+  // Take a file name from the full path
+  if (full_image_name && full_image_name->Buffer) {
+    const auto length = full_image_name->Length / sizeof(wchar_t);
+    auto name_start = 0ul;
+    for (auto i = 0ul; i < length; ++i) {
+      if (full_image_name->Buffer[i] == L'\\') {
+        name_start = i + 1;
+      }
+    }
+    RtlStringCchPrintfA(record.image_name, RTL_NUMBER_OF(record.image_name),
+                        "%.*S", static_cast<int>(length - name_start),
+                        full_image_name->Buffer + name_start);
+  }
+
+  ExAcquireFastMutex(&data->records_lock);
+  data->records.push_back(record);
+  ExReleaseFastMutex(&data->records_lock);
+}
+
+// Fills a record with the time stamp and PDB information of the image. PDB
+// information is left empty when the debug directory is not accessible, for
+// example, when it was in a discarded section.
+_Use_decl_annotations_ static void ModsnappFillRecord(
+    void* image_base, ULONG size_of_image, LONG64 load_time, ULONG flags,
+    ModuleSnapshotRecord* record) {
+  PAGED_CODE();
+
+  RtlZeroMemory(record, sizeof(*record));
+  record->load_time = load_time;
+  record->image_base = reinterpret_cast<ULONG_PTR>(image_base);
+  record->size_of_image = size_of_image;
+  record->flags = flags;
+
+  const auto base = reinterpret_cast<ULONG_PTR>(image_base);
+  const auto dos = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+  if (!UtilIsAccessibleAddress(dos) || dos->e_magic != IMAGE_DOS_SIGNATURE) {
+    return;
+  }
+  const auto nt = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos->e_lfanew);
+  if (!UtilIsAccessibleAddress(nt) || nt->Signature != IMAGE_NT_SIGNATURE) {
+    return;
+  }
+  record->time_date_stamp = nt->FileHeader.TimeDateStamp;
+
+  const auto& dir =
+      nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_DEBUG];
+  if (!dir.VirtualAddress || dir.Size < sizeof(IMAGE_DEBUG_DIRECTORY) ||
+      dir.VirtualAddress + dir.Size > size_of_image) {
+    return;
+  }
+  const auto debug_dirs =
+      reinterpret_cast<PIMAGE_DEBUG_DIRECTORY>(base + dir.VirtualAddress);
+  const auto count = dir.Size / sizeof(IMAGE_DEBUG_DIRECTORY);
+  for (auto i = 0ul; i < count; ++i) {
+    if (!UtilIsAccessibleAddress(&debug_dirs[i])) {
+      break;
+    }
+    const auto& debug_dir = debug_dirs[i];
+    if (debug_dir.Type != IMAGE_DEBUG_TYPE_CODEVIEW ||
+        !debug_dir.AddressOfRawData ||
+        debug_dir.SizeOfData < sizeof(ModsnapCodeViewRecord) ||
+        debug_dir.AddressOfRawData + debug_dir.SizeOfData > size_of_image) {
+      continue;
+    }
+    const auto codeview = reinterpret_cast<ModsnapCodeViewRecord*>(
+        base + debug_dir.AddressOfRawData);
+    if (!UtilIsAccessibleAddress(codeview) ||
+        !UtilIsAccessibleAddress(reinterpret_cast<UCHAR*>(codeview) +
+                                 debug_dir.SizeOfData - 1) ||
+        codeview->signature != kModsnappCodeViewSignature) {
+      continue;
+    }
+
+    // Keep only a file name of the PDB path since it is how symbol servers
+    // index PDBs
+    const auto path_length =
+        debug_dir.SizeOfData - FIELD_OFFSET(ModsnapCodeViewRecord, pdb_path);
+    auto name_start = 0ul;
+    for (auto j = 0ul; j < path_length && codeview->pdb_path[j]; ++j) {
+      if (codeview->pdb_path[j] == '\\') {
+        name_start = j + 1;
+      }
+    }
+    RtlStringCchCopyNA(record->pdb_name, RTL_NUMBER_OF(record->pdb_name),
+                       codeview->pdb_path + name_start,
+                       path_length - name_start);
+    record->pdb_guid = codeview->guid;
+    record->pdb_age = codeview->age;
+    record->flags |= kModuleSnapshotFlagHasPdbInfo;
+    break;
+  }
+}
+
+// Writes records to the file in the format described in module_snapshot.h
+_Use_decl_annotations_ static NTSTATUS ModsnappWriteSnapshotFile(
+    ModuleSnapshotData* data) {
+  PAGED_CODE();
+
+  UNICODE_STRING file_path_u = {};
+  RtlInitUnicodeString(&file_path_u, data->file_path);
+
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, &file_path_u,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+
+  HANDLE file = nullptr;
+  IO_STATUS_BLOCK io_status = {};
+  auto status = ZwCreateFile(
+      &file, GENERIC_WRITE | SYNCHRONIZE, &oa, &io_status, nullptr,
+      FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  // Copy records since a file cannot be written while holding a fast mutex
+  ExAcquireFastMutex(&data->records_lock);
+  const auto records = data->records;
+  ExReleaseFastMutex(&data->records_lock);
+
+  ModuleSnapshotFileHeader header = {};
+  header.magic = kModuleSnapshotFileMagic;
+  header.version = kModuleSnapshotFileVersion;
+  header.record_size = sizeof(ModuleSnapshotRecord);
+  header.record_count = static_cast<ULONG>(records.size());
+  header.start_time = data->start_time;
+
+  struct {
+    const void* buffer;
+    ULONG size;
+  } const chunks[] = {
+      {&header, sizeof(header)},
+      {records.data(),
+       static_cast<ULONG>(records.size() * sizeof(ModuleSnapshotRecord))},
+  };
+  for (const auto& chunk : chunks) {
+    status = ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+                         const_cast<void*>(chunk.buffer), chunk.size, nullptr,
+                         nullptr);
+    if (!NT_SUCCESS(status)) {
+      break;
+    }
+  }
+  ZwClose(file);
+  return status;
+}
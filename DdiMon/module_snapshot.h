@@ -0,0 +1,99 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to module snapshot functions.
+
+#ifndef DDIMON_MODULE_SNAPSHOT_H_
+#define DDIMON_MODULE_SNAPSHOT_H_
+
+#include <fltKernel.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// 'DMSP'; a magic value of a module snapshot file
+static const ULONG kModuleSnapshotFileMagic = 'PSMD';
+
+// A version of a module snapshot file format
+static const ULONG kModuleSnapshotFileVersion = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A header of a module snapshot file. A file is laid out as below, and all
+// values are little endian:
+//
+//   ModuleSnapshotFileHeader
+//   ModuleSnapshotRecord records[record_count]   // in order of load_time
+//
+// Addresses in logs are resolved by finding a record whose range contains the
+// address and whose load_time is the latest one not after a time of a log
+// entry. Records with kModuleSnapshotFlagPreloaded match entries of any time.
+// Symbols are located with pdb_guid, pdb_age and pdb_name.
+#include <pshpack1.h>
+struct ModuleSnapshotFileHeader {
+  ULONG magic;         // kModuleSnapshotFileMagic
+  ULONG version;       // kModuleSnapshotFileVersion
+  ULONG record_size;   // sizeof(ModuleSnapshotRecord)
+  ULONG record_count;  // A number of records following this header
+  LONG64 start_time;   // System time when the snapshot started
+};
+static_assert(sizeof(ModuleSnapshotFileHeader) == 24, "Size check");
+
+// Attributes of a record
+enum ModuleSnapshotFlags : ULONG {
+  // The image was already loaded when the snapshot started. load_time is
+  // start_time of the header.
+  kModuleSnapshotFlagPreloaded = 1 << 0,
+
+  // pdb_guid, pdb_age and pdb_name are valid
+  kModuleSnapshotFlagHasPdbInfo = 1 << 1,
+};
+
+// A kernel image loaded at some point
+struct ModuleSnapshotRecord {
+  LONG64 load_time;       // System time when the image was loaded
+  ULONG64 image_base;     // A base address of the image
+  ULONG size_of_image;    // IMAGE_OPTIONAL_HEADER::SizeOfImage of the image
+  ULONG time_date_stamp;  // IMAGE_FILE_HEADER::TimeDateStamp of the image
+  ULONG flags;            // ModuleSnapshotFlags
+  ULONG pdb_age;          // An age in the CodeView record
+  GUID pdb_guid;          // A signature in the CodeView record
+  char pdb_name[64];      // A null-terminated file name of a PDB
+  char image_name[32];    // A null-terminated image name
+};
+static_assert(sizeof(ModuleSnapshotRecord) == 144, "Size check");
+#include <poppack.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+    ModsnapInitialization(_In_ const wchar_t* file_path);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void ModsnapTermination();
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_MODULE_SNAPSHOT_H_
@@ -0,0 +1,164 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements predicate bytecode functions.
+
+#include "predicate.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Checks that a program is safe to execute without any runtime check: all
+// operands are in range, all jumps are forward and land on an instruction, and
+// the last instruction is kReturn so that execution never runs off the end.
+_Use_decl_annotations_ EXTERN_C bool PredVerify(
+    const PredInstruction* program, ULONG count) {
+  if (!count || count > kPredMaxInstructions) {
+    return false;
+  }
+  if (program[count - 1].opcode != PredOpcode::kReturn) {
+    return false;
+  }
+
+  for (auto pc = 0ul; pc < count; ++pc) {
+    const auto& insn = program[pc];
+    if (insn.dst >= kPredNumberOfRegisters ||
+        insn.src >= kPredNumberOfRegisters || insn.reserved) {
+      return false;
+    }
+    switch (insn.opcode) {
+      case PredOpcode::kLoadContext:
+        if (insn.imm < 0 ||
+            insn.imm >= static_cast<LONG>(PredField::kMaximum)) {
+          return false;
+        }
+        break;
+      case PredOpcode::kLoadImmediate:
+      case PredOpcode::kAdd:
+      case PredOpcode::kSub:
+      case PredOpcode::kAnd:
+      case PredOpcode::kOr:
+      case PredOpcode::kXor:
+      case PredOpcode::kShiftLeft:
+      case PredOpcode::kShiftRight:
+        break;
+      case PredOpcode::kJumpIfEqual:
+      case PredOpcode::kJumpIfNotEqual:
+      case PredOpcode::kJumpIfAbove:
+      case PredOpcode::kJumpIfBelow:
+      case PredOpcode::kJump:
+        if (insn.imm < 0 || pc + 1 + insn.imm >= count) {
+          return false;
+        }
+        break;
+      case PredOpcode::kReturn:
+        if (insn.imm < 0 ||
+            insn.imm >= static_cast<LONG>(PredVerdict::kMaximum)) {
+          return false;
+        }
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+// Interprets a program verified by PredVerify(). Because the program is
+// verified, no bounds are checked here.
+_Use_decl_annotations_ EXTERN_C PredVerdict PredExecute(
+    const PredInstruction* program, ULONG count,
+    const PredContext& context) {
+  UNREFERENCED_PARAMETER(count);
+
+  ULONG64 r[kPredNumberOfRegisters] = {};
+  for (auto pc = 0ul; /**/; ++pc) {
+    const auto& insn = program[pc];
+    auto& dst = r[insn.dst];
+    const auto src = r[insn.src];
+    switch (insn.opcode) {
+      case PredOpcode::kLoadContext:
+        dst = context.fields[insn.imm];
+        break;
+      case PredOpcode::kLoadImmediate:
+        dst = static_cast<ULONG64>(static_cast<LONG64>(insn.imm));
+        break;
+      case PredOpcode::kAdd:
+        dst += src;
+        break;
+      case PredOpcode::kSub:
+        dst -= src;
+        break;
+      case PredOpcode::kAnd:
+        dst &= src;
+        break;
+      case PredOpcode::kOr:
+        dst |= src;
+        break;
+      case PredOpcode::kXor:
+        dst ^= src;
+        break;
+      case PredOpcode::kShiftLeft:
+        dst <<= (src & 63);
+        break;
+      case PredOpcode::kShiftRight:
+        dst >>= (src & 63);
+        break;
+      case PredOpcode::kJumpIfEqual:
+        if (dst == src) {
+          pc += insn.imm;
+        }
+        break;
+      case PredOpcode::kJumpIfNotEqual:
+        if (dst != src) {
+          pc += insn.imm;
+        }
+        break;
+      case PredOpcode::kJumpIfAbove:
+        if (dst > src) {
+          pc += insn.imm;
+        }
+        break;
+      case PredOpcode::kJumpIfBelow:
+        if (dst < src) {
+          pc += insn.imm;
+        }
+        break;
+      case PredOpcode::kJump:
+        pc += insn.imm;
+        break;
+      case PredOpcode::kReturn:
+      default:
+        return static_cast<PredVerdict>(insn.imm);
+    }
+  }
+}
@@ -0,0 +1,118 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to predicate bytecode functions.
+
+#ifndef DDIMON_PREDICATE_H_
+#define DDIMON_PREDICATE_H_
+
+#include <fltKernel.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A maximum number of instructions in a program
+static const ULONG kPredMaxInstructions = 64;
+
+// A number of registers
+static const ULONG kPredNumberOfRegisters = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Operations of an instruction. Each instruction operates on 64-bit registers
+// r0 to r3 that are initialized to 0.
+enum class PredOpcode : UCHAR {
+  kLoadContext = 1,  // r[dst] = context[imm]
+  kLoadImmediate,    // r[dst] = sign-extended imm
+  kAdd,              // r[dst] += r[src]
+  kSub,              // r[dst] -= r[src]
+  kAnd,              // r[dst] &= r[src]
+  kOr,               // r[dst] |= r[src]
+  kXor,              // r[dst] ^= r[src]
+  kShiftLeft,        // r[dst] <<= r[src] & 63
+  kShiftRight,       // r[dst] >>= r[src] & 63
+  kJumpIfEqual,      // if (r[dst] == r[src]) skip imm instructions
+  kJumpIfNotEqual,   // if (r[dst] != r[src]) skip imm instructions
+  kJumpIfAbove,      // if (r[dst] > r[src]) skip imm instructions (unsigned)
+  kJumpIfBelow,      // if (r[dst] < r[src]) skip imm instructions (unsigned)
+  kJump,             // skip imm instructions
+  kReturn,           // return imm as PredVerdict
+  kMaximum,
+};
+
+// An instruction. Jumps are forward only so that every program terminates
+// within a number of its instructions.
+#include <pshpack1.h>
+struct PredInstruction {
+  PredOpcode opcode;
+  UCHAR dst;  // A destination register index
+  UCHAR src;  // A source register index
+  UCHAR reserved;
+  LONG imm;
+};
+static_assert(sizeof(PredInstruction) == 8, "Size check");
+#include <poppack.h>
+
+// Values a program can load with kLoadContext
+enum class PredField : ULONG {
+  kArgument1,
+  kArgument2,
+  kArgument3,
+  kArgument4,
+  kReturnAddress,
+  kCr3,
+  kProcessId,
+  kThreadId,
+  kTimestamp,
+  kMaximum,
+};
+
+// Values of fields given to a program
+struct PredContext {
+  ULONG64 fields[static_cast<ULONG>(PredField::kMaximum)];
+};
+
+// Decisions of a program
+enum class PredVerdict : ULONG {
+  kDrop,            // Ignore the call
+  kCount,           // Only count the call
+  kLog,             // Log the call
+  kLogAndArmPost,   // Log the call and set a post breakpoint if any
+  kMaximum,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+EXTERN_C bool PredVerify(_In_reads_(count) const PredInstruction* program,
+                         _In_ ULONG count);
+
+EXTERN_C PredVerdict PredExecute(
+    _In_reads_(count) const PredInstruction* program, _In_ ULONG count,
+    _In_ const PredContext& context);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_PREDICATE_H_
@@ -14,6 +14,8 @@
 #include "../HyperPlatform/HyperPlatform/log.h"
 #include "../HyperPlatform/HyperPlatform/util.h"
 #include "../HyperPlatform/HyperPlatform/ept.h"
+#include "../HyperPlatform/HyperPlatform/memory_usage.h"
+#include "../HyperPlatform/HyperPlatform/span_trace.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -25,6 +27,15 @@
 // constants and macros
 //
 
+// A size of a cache line, which is a unit of synchronization of shadow pages
+static const auto kSbppCacheLineSize = 64ul;
+
+static const auto kSbppCacheLinesPerPage = PAGE_SIZE / kSbppCacheLineSize;
+static_assert(kSbppCacheLinesPerPage <= 64, "Lines must fit in ULONG64");
+
+// How many hooks are reported on termination
+static const auto kSbppMaxReports = 16ul;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
@@ -37,6 +48,17 @@ struct Page {
   ~Page();
 };
 
+// Hot fields of breakpoints laid out as structure of arrays so that lookups
+// scan only densely packed addresses instead of whole PatchInformation. An
+// element at an index corresponds to a breakpoint at the same index of
+// g_sbpp_breakpoints, which owns cold fields such as names, parameters and
+// shadow pages.
+struct BreakpointIndex {
+  std::vector<void*> patch_addresses;
+  std::vector<HANDLE> target_tids;
+  std::vector<BreakpointType> types;
+};
+
 // Scoped lock
 class ScopedSpinLockAtDpc {
  public:
@@ -48,6 +70,17 @@ class ScopedSpinLockAtDpc {
   KLOCK_QUEUE_HANDLE lock_handle_;
 };
 
+// Scoped increment of the in-flight counter of the current processor
+class ScopedInFlightAtDpc {
+ public:
+  ScopedInFlightAtDpc();
+
+  ~ScopedInFlightAtDpc();
+
+ private:
+  volatile LONG* in_flight_count_;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
@@ -59,7 +92,7 @@ static std::unique_ptr<PatchInformation> SbppCreatePreBreakpoint(
 
 static std::unique_ptr<PatchInformation> SbppCreatePostBreakpoint(
     _In_ void* address, _In_ const PatchInformation& info,
-    _In_ HANDLE target_tid, _In_ const CapturedParameters& parameters);
+    _In_ HANDLE target_tid, _In_ const BreakpointHandlerSlot& slot);
 
 static std::unique_ptr<PatchInformation> SbppCreateBreakpoint(
     _In_ void* address);
@@ -82,6 +115,8 @@ static void SbppEnablePageShadowingForRW(_In_ const PatchInformation& info,
 static void SbppDisablePageShadowing(_In_ const PatchInformation& info,
                                      _In_ EptData* ept_data);
 
+static void SbppSyncShadowPageForExec(_In_ const PatchInformation& info);
+
 static bool SbppIsShadowBreakpoint(_In_ const PatchInformation& info);
 
 static void SbppSetMonitorTrapFlag(_In_ bool enable);
@@ -92,15 +127,26 @@ static const PatchInformation* SbppRestoreLastPatchInfo();
 
 static bool SbppIsSbpActive();
 
+static volatile LONG* SbppGetInFlightCount();
+
+static BreakpointCounters* SbppGetCounters(_In_ const PatchInformation& info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void SbppReportHookMetrics();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void SbppWaitForQuiescence();
+
 static void SbppAddBreakpointToList(
     _In_ std::unique_ptr<PatchInformation> info);
 
-static void SbppDeleteBreakpointFromList(_In_ const PatchInformation& info);
+static std::unique_ptr<PatchInformation> SbppRemoveBreakpointFromList(
+    _In_ const PatchInformation& info);
 
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(INIT, SbpInitialization)
 #pragma alloc_text(INIT, SbpStart)
 #pragma alloc_text(PAGE, SbpTermination)
+#pragma alloc_text(PAGE, SbppWaitForQuiescence)
+#pragma alloc_text(PAGE, SbppReportHookMetrics)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -111,7 +157,10 @@ static void SbppDeleteBreakpointFromList(_In_ const PatchInformation& info);
 // Holds all currently installed breakpoints
 static std::vector<std::unique_ptr<PatchInformation>>* g_sbpp_breakpoints;
 
-// Spin lock for g_sbpp_breakpoints
+// Hot fields of g_sbpp_breakpoints
+static BreakpointIndex* g_sbpp_index;
+
+// Spin lock for g_sbpp_breakpoints and g_sbpp_index
 static KSPIN_LOCK g_sbpp_breakpoints_skinlock;
 
 // Remember a breakpoint hit last
@@ -120,6 +169,16 @@ static const PatchInformation* g_sbpp_last_breakpoint;
 // Remember a value of guests eflags.IT
 static bool g_sbpp_previouse_guest_interrupt_flag;
 
+// Remember if the last breakpoint was hit by write access to a shadowed page
+static bool g_sbpp_last_access_was_write;
+
+// Per-processor counts of shadow breakpoint handlers being executed and MTF
+// pending after those handlers. A processor is quiescent when its count is 0.
+static volatile LONG* g_sbpp_in_flight_counts;
+
+// A number of elements in g_sbpp_in_flight_counts
+static ULONG g_sbpp_processor_count;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // implementations
@@ -129,15 +188,53 @@ static bool g_sbpp_previouse_guest_interrupt_flag;
 _Use_decl_annotations_ EXTERN_C NTSTATUS SbpInitialization() {
   KeInitializeSpinLock(&g_sbpp_breakpoints_skinlock);
 
+  const auto processor_count =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto counts_size = sizeof(LONG) * processor_count;
+  g_sbpp_in_flight_counts = reinterpret_cast<volatile LONG*>(
+      ExAllocatePoolWithTag(NonPagedPool, counts_size,
+                            kHyperPlatformCommonPoolTag));
+  if (!g_sbpp_in_flight_counts) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(const_cast<LONG*>(g_sbpp_in_flight_counts), counts_size);
+  g_sbpp_processor_count = processor_count;
+
   g_sbpp_breakpoints = new std::vector<std::unique_ptr<PatchInformation>>();
+  g_sbpp_index = new BreakpointIndex();
 
   return STATUS_SUCCESS;
 }
 
+// Embeds all breakpoints created so far into shadow pages as one batch, and
+// enables page shadowing for them
 _Use_decl_annotations_ EXTERN_C NTSTATUS SbpStart() {
-  // Enables page shadowing for all breakpoints
+  LARGE_INTEGER frequency = {};
+  const auto begin_time = KeQueryPerformanceCounter(&frequency);
+
+  // Shadow pages for exec are not exposed to a guest yet. Write breakpoints
+  // to them directly, and make them visible to all processors at once.
+  for (const auto& info : *g_sbpp_breakpoints) {
+    SbppEmbedBreakpoint(info->shadow_page_base_for_exec->page +
+                        BYTE_OFFSET(info->patch_address));
+  }
+  KeInvalidateAllCaches();
+
+  // Enables page shadowing for all breakpoints, and lets all processors see the
+  // shadow pages for exec rather than original pages cached in their TLBs
   auto status = UtilVmCall(HypercallNumber::kDdimonEnablePageShadowing,
                            g_sbpp_breakpoints);
+  if (NT_SUCCESS(status)) {
+    status = EptFlushTranslations();
+  }
+
+  const auto elapsed_ticks = static_cast<ULONG64>(
+      KeQueryPerformanceCounter(nullptr).QuadPart - begin_time.QuadPart);
+  const auto elapsed_us = elapsed_ticks * 1000000 / frequency.QuadPart;
+  const auto count = static_cast<ULONG64>(g_sbpp_breakpoints->size());
+  HYPERPLATFORM_LOG_INFO(
+      "Installed %llu breakpoints in %llu us (%llu breakpoints/s).", count,
+      elapsed_us, (elapsed_us) ? count * 1000000 / elapsed_us : 0);
   return status;
 }
 
@@ -159,13 +256,21 @@ _Use_decl_annotations_ NTSTATUS SbpVmCallEnablePageShadowing(EptData* ept_data,
 _Use_decl_annotations_ EXTERN_C void SbpTermination() {
   PAGED_CODE();
 
+  SbppReportHookMetrics();
+
   auto ptrs = g_sbpp_breakpoints;
   auto status = UtilVmCall(HypercallNumber::kDdimonDisablePageShadowing, ptrs);
   NT_VERIFY(NT_SUCCESS(status));
-  UtilSleep(500);
+  status = EptFlushTranslations();
+  NT_VERIFY(NT_SUCCESS(status));
+  SbppWaitForQuiescence();
 
-  g_sbpp_breakpoints = nullptr;
   delete ptrs;
+  delete g_sbpp_index;
+  g_sbpp_index = nullptr;
+  ExFreePoolWithTag(const_cast<LONG*>(g_sbpp_in_flight_counts),
+                    kHyperPlatformCommonPoolTag);
+  g_sbpp_in_flight_counts = nullptr;
 }
 
 // Disables page shadowing for all breakpoints
@@ -191,11 +296,21 @@ _Use_decl_annotations_ bool SbpHandleBreakpoint(EptData* ept_data,
   if (!SbppIsSbpActive()) {
     return false;
   }
+  ScopedInFlightAtDpc scoped_in_flight;
 
-  const auto info = SbppFindPatchInfoByAddress(guest_ip);
+  // Prefer a post breakpoint of the current thread when threads returning to
+  // the same address have their own ones
+  auto info = SbppFindPatchInfoByAddress(guest_ip);
   if (!info) {
     return false;
   }
+  if (info->type == BreakpointType::kPost) {
+    const auto own_info =
+        SbppFindDuplicatedPostPatchInfo(guest_ip, PsGetCurrentThreadId());
+    if (own_info) {
+      info = own_info;
+    }
+  }
 
   if (!SbppIsShadowBreakpoint(*info)) {
     return false;
@@ -215,11 +330,22 @@ _Use_decl_annotations_ bool SbpHandleBreakpoint(EptData* ept_data,
   // inaccessible from a VMM ending up with a bug check.
   const auto guest_cr3 = UtilVmRead(VmcsField::kGuestCr3);
   const auto vmm_cr3 = __readcr3();
+  const auto guest_sp = UtilVmRead(VmcsField::kGuestRsp);
+  const auto counters = SbppGetCounters(*info);
 
   if (info->type == BreakpointType::kPre) {
     // Pre breakpoint
+    counters->pre_hits++;
     __writecr3(guest_cr3);
-    info->handler(*info, ept_data, gp_regs, UtilVmRead(VmcsField::kGuestRsp));
+    const auto begin_tsc = __rdtsc();
+    {
+      const SpanScope span("SbpPreHandler", SpanKind::kPreHandler,
+                           reinterpret_cast<ULONG_PTR>(info->patch_address));
+      for (const auto& slot : info->handlers) {
+        slot.handler(*info, slot, ept_data, gp_regs, guest_sp);
+      }
+    }
+    counters->handler_cycles += __rdtsc() - begin_tsc;
     __writecr3(vmm_cr3);
     SbppEnablePageShadowingForRW(*info, ept_data);
     SbppSetMonitorTrapFlag(true);
@@ -230,17 +356,35 @@ _Use_decl_annotations_ bool SbpHandleBreakpoint(EptData* ept_data,
     if (info->target_tid == PsGetCurrentThreadId()) {
       // It is a target thread. Execute the post handler and let it continue
       // subsequence instructions.
+      counters->post_hits++;
       __writecr3(guest_cr3);
-      info->handler(*info, ept_data, gp_regs, UtilVmRead(VmcsField::kGuestRsp));
+      const auto begin_tsc = __rdtsc();
+      {
+        const SpanScope span("SbpPostHandler", SpanKind::kPostHandler,
+                             reinterpret_cast<ULONG_PTR>(info->patch_address));
+        for (const auto& slot : info->handlers) {
+          slot.handler(*info, slot, ept_data, gp_regs, guest_sp);
+        }
+      }
+      counters->handler_cycles += __rdtsc() - begin_tsc;
       __writecr3(vmm_cr3);
-      SbppDeleteBreakpointFromList(*info);
+      counters->pending_posts--;
+      // Keep the breakpoint object alive until the page view is updated
+      const auto removed_info = SbppRemoveBreakpointFromList(*info);
+      NT_ASSERT(removed_info.get() == info);
       // If there is another breakpoint on the same page, mamory shadowing for
-      // the page cannot be deleted.
+      // the page cannot be deleted. Then, the original byte is restored unless
+      // another breakpoint is at the same address.
       if (!SbppFindPatchInfoByPage(guest_ip)) {
         SbppDisablePageShadowing(*info, ept_data);
+      } else if (!SbppFindPatchInfoByAddress(guest_ip)) {
+        const auto offset = BYTE_OFFSET(info->patch_address);
+        info->shadow_page_base_for_exec->page[offset] =
+            info->shadow_page_base_for_rw->page[offset];
       }
     } else {
       // It is not. Let it allow to run one instruction without breakpoint
+      counters->foreign_post_hits++;
       SbppEnablePageShadowingForRW(*info, ept_data);
       SbppSetMonitorTrapFlag(true);
       SbppSaveLastPatchInfo(*info);
@@ -253,56 +397,108 @@ _Use_decl_annotations_ bool SbpHandleBreakpoint(EptData* ept_data,
 
 // Handles MTF VM-exit. Restores the last breakpoint event, re-enables stealth
 // breakpoint and clears MTF;
-_Use_decl_annotations_ void SbpHandleMonitorTrapFlag(EptData* ept_data) {
-  NT_VERIFY(SbppIsSbpActive());
+_Use_decl_annotations_ bool SbpHandleMonitorTrapFlag(EptData* ept_data) {
+  // Do not check SbppIsSbpActive() so that MTF pending while shadow breakpoints
+  // are being deactivated completes and SbppWaitForQuiescence() returns
+  if (!g_sbpp_last_breakpoint) {
+    // Not set by shadow breakpoint
+    return false;
+  }
+  ScopedInFlightAtDpc scoped_in_flight;
 
   const auto info = SbppRestoreLastPatchInfo();
+  SbppGetCounters(*info)->mtf_steps++;
+  if (g_sbpp_last_access_was_write) {
+    // A guest may have modified code (eg, hot-patching). Reflect it to the
+    // page for exec so that a guest does not keep executing stale code.
+    g_sbpp_last_access_was_write = false;
+    SbppSyncShadowPageForExec(*info);
+  }
   SbppEnablePageShadowingForExec(*info, ept_data);
   SbppSetMonitorTrapFlag(false);
+  return true;
 }
 
-// Handles EPT violation VM-exit.
-_Use_decl_annotations_ void SbpHandleEptViolation(EptData* ept_data,
-                                                  void* fault_va) {
+// Handles EPT violation VM-exit. Returns false if the fault is not on any of
+// shadowed pages.
+_Use_decl_annotations_ bool SbpHandleEptViolation(EptData* ept_data,
+                                                  void* fault_va,
+                                                  bool is_write) {
   if (!SbppIsSbpActive()) {
-    return;
+    return false;
   }
+  ScopedInFlightAtDpc scoped_in_flight;
+
   const auto info = SbppFindPatchInfoByPage(fault_va);
   if (!info) {
-    return;
+    return false;
   }
 
   // EPT violation was caused because a guest tried to read or write to a page
   // where currently set as execute only for protecting breakpoint. Let a guest
   // read or write a page from read/write shadow page and run a single
   // instruction.
+  SbppGetCounters(*info)->rw_violations++;
   SbppEnablePageShadowingForRW(*info, ept_data);
   SbppSetMonitorTrapFlag(true);
   SbppSaveLastPatchInfo(*info);
+  g_sbpp_last_access_was_write = is_write;
+  return true;
 }
 
-// Creates Pre breakpoint object and adds it to the list
+// Creates Pre breakpoint object and adds it to the list. When a breakpoint
+// already exists at the address, the handlers are chained to it instead so
+// that all targets matching the address share a single #BP.
 _Use_decl_annotations_ void SbpCreatePreBreakpoint(
     void* address, const BreakpointTarget& target, const char* name) {
+  const auto existing_info = SbppFindPatchInfoByAddress(address);
+  if (existing_info && existing_info->type == BreakpointType::kPre) {
+    existing_info->handlers.push_back(
+        {target.pre_handler, target.post_handler, {}, target.context});
+    return;
+  }
+
   auto info =
       SbppCreatePreBreakpoint(reinterpret_cast<void*>(address), target, name);
   SbppAddBreakpointToList(std::move(info));
 }
 
-// Creats Post breakpoint object, adds it to the list and enables it
+// Creats Post breakpoint object, adds it to the list and enables it. slot is
+// the one of the pre-handler requesting it. When the thread already has a post
+// breakpoint at the exact address, the post handler is chained to it instead,
+// or its parameters are updated if the handler is already there. It happens
+// when several pre-handlers of a call request one, or when an earlier call
+// from the same site has not returned, such as on recursion. Post breakpoints
+// at other addresses on the page are separate ones.
 _Use_decl_annotations_ void SbpCreateAndEnablePostBreakpoint(
     void* address, const PatchInformation& info,
-    const CapturedParameters& parameters, EptData* ept_data) {
+    const BreakpointHandlerSlot& slot, const CapturedParameters& parameters,
+    EptData* ept_data) {
+  const BreakpointHandlerSlot slot_for_post = {
+      slot.post_handler, nullptr, parameters, slot.context,
+  };
   auto duplicated_info =
       SbppFindDuplicatedPostPatchInfo(address, PsGetCurrentThreadId());
   if (duplicated_info) {
-    duplicated_info->parameters = parameters;
+    for (auto& existing_slot : duplicated_info->handlers) {
+      if (existing_slot.handler == slot_for_post.handler &&
+          existing_slot.context == slot_for_post.context) {
+        existing_slot.parameters = parameters;
+        return;
+      }
+    }
+    duplicated_info->handlers.push_back(slot_for_post);
     return;
   }
   auto info_for_post = SbppCreatePostBreakpoint(
-      address, info, PsGetCurrentThreadId(), parameters);
+      address, info, PsGetCurrentThreadId(), slot_for_post);
   auto ptr = info_for_post.get();
   SbppAddBreakpointToList(std::move(info_for_post));
+  SbppGetCounters(info)->pending_posts++;
+
+  // No cache flush is needed since VM-entry serializes instruction fetch
+  SbppEmbedBreakpoint(ptr->shadow_page_base_for_exec->page +
+                      BYTE_OFFSET(address));
   SbppEnablePageShadowingForExec(*ptr, ept_data);
 }
 
@@ -312,26 +508,25 @@ SbppCreatePreBreakpoint(void* address, const BreakpointTarget& target,
                         const char* name) {
   auto info_for_pre = SbppCreateBreakpoint(address);
   info_for_pre->type = BreakpointType::kPre;
-  info_for_pre->handler = target.pre_handler;
-  info_for_pre->post_handler = target.post_handler;
+  info_for_pre->handlers.push_back(
+      {target.pre_handler, target.post_handler, {}, target.context});
   info_for_pre->target_tid = nullptr;
-  info_for_pre->parameters = {};
   memcpy(info_for_pre->name.data(), name, info_for_pre->name.size() - 1);
+  info_for_pre->metrics =
+      std::make_shared<BreakpointMetrics>(g_sbpp_processor_count);
   return info_for_pre;
 }
 
 // Creats Post breakpoint object
 _Use_decl_annotations_ static std::unique_ptr<PatchInformation>
 SbppCreatePostBreakpoint(void* address, const PatchInformation& info,
-                         HANDLE target_tid,
-                         const CapturedParameters& parameters) {
+                         HANDLE target_tid, const BreakpointHandlerSlot& slot) {
   auto info_for_post = SbppCreateBreakpoint(address);
   info_for_post->type = BreakpointType::kPost;
-  info_for_post->handler = info.post_handler;
-  info_for_post->post_handler = nullptr;
+  info_for_post->handlers.push_back(slot);
   info_for_post->target_tid = target_tid;
-  info_for_post->parameters = parameters;
   info_for_post->name = info.name;
+  info_for_post->metrics = info.metrics;
   return info_for_post;
 }
 
@@ -362,9 +557,8 @@ SbppCreateBreakpoint(void* address) {
   info->pa_base_for_exec =
       UtilPaFromVa(info->shadow_page_base_for_exec.get()->page);
 
-  // Set an actual breakpoint (0xcc) onto the shadow page for EXEC
-  SbppEmbedBreakpoint(info->shadow_page_base_for_exec.get()->page +
-                      BYTE_OFFSET(address));
+  // An actual breakpoint (0xcc) is set onto the shadow page for EXEC by a
+  // caller with SbppEmbedBreakpoint()
   return info;
 }
 
@@ -375,14 +569,14 @@ _Use_decl_annotations_ static PatchInformation* SbppFindPatchInfoByPage(
   auto ptrs = g_sbpp_breakpoints;
   NT_ASSERT(ptrs);
 
-  const auto found =
-      std::find_if(ptrs->begin(), ptrs->end(), [address](const auto& info) {
-        return PAGE_ALIGN(info->patch_address) == PAGE_ALIGN(address);
-      });
-  if (found == ptrs->cend()) {
-    return nullptr;
+  const auto& addresses = g_sbpp_index->patch_addresses;
+  const auto page_base = PAGE_ALIGN(address);
+  for (auto i = 0u; i < addresses.size(); ++i) {
+    if (PAGE_ALIGN(addresses[i]) == page_base) {
+      return (*ptrs)[i].get();
+    }
   }
-  return found->get();
+  return nullptr;
 }
 
 // Find a breakpoint object that are on the same page as the address and its
@@ -393,42 +587,40 @@ _Use_decl_annotations_ static PatchInformation* SbppFindPatchInfoByAddress(
   auto ptrs = g_sbpp_breakpoints;
   NT_ASSERT(ptrs);
 
-  auto found = std::find_if(
-      ptrs->begin(), ptrs->end(),
-      [address](const auto& info) { return info->patch_address == address; });
-  if (found == ptrs->cend()) {
-    return nullptr;
+  const auto& addresses = g_sbpp_index->patch_addresses;
+  for (auto i = 0u; i < addresses.size(); ++i) {
+    if (addresses[i] == address) {
+      return (*ptrs)[i].get();
+    }
   }
-  return found->get();
+  return nullptr;
 }
 
-// Find a duplicated post breakpoint object. It is a workaround for the issue
-// #2.
+// Find a post breakpoint object of the thread at the address. It is a
+// workaround for the issue #2. Only the exact address is matched, since a post
+// breakpoint elsewhere on the page belongs to another call.
 _Use_decl_annotations_ static PatchInformation* SbppFindDuplicatedPostPatchInfo(
     void* address, HANDLE target_tid) {
   ScopedSpinLockAtDpc scoped_lock(&g_sbpp_breakpoints_skinlock);
   auto ptrs = g_sbpp_breakpoints;
   NT_ASSERT(ptrs);
 
-  const auto found = std::find_if(
-      ptrs->begin(), ptrs->end(), [address, target_tid](const auto& info) {
-        return (info->type == BreakpointType::kPost &&
-                PAGE_ALIGN(info->patch_address) == PAGE_ALIGN(address) &&
-                info->target_tid == target_tid);
-      });
-  if (found == ptrs->cend()) {
-    return nullptr;
+  const auto& index = *g_sbpp_index;
+  for (auto i = 0u; i < index.target_tids.size(); ++i) {
+    if (index.target_tids[i] == target_tid &&
+        index.types[i] == BreakpointType::kPost &&
+        index.patch_addresses[i] == address) {
+      return (*ptrs)[i].get();
+    }
   }
-  return found->get();
+  return nullptr;
 }
 
-// Sets a breakpoint to the address
+// Sets a breakpoint to the address on a shadow page for exec. The page is
+// allocated by DdiMon and writable without mapping it with MDL. A caller is
+// responsible for making the modification visible to execution.
 _Use_decl_annotations_ static void SbppEmbedBreakpoint(void* address) {
-  static const UCHAR kBreakpoint[1] = {
-      0xcc,
-  };
-  UtilForceCopyMemory(address, kBreakpoint, sizeof(kBreakpoint));
-  KeInvalidateAllCaches();
+  *reinterpret_cast<UCHAR*>(address) = 0xcc;
 }
 
 // Show a shadowed page for execution
@@ -446,7 +638,7 @@ _Use_decl_annotations_ static void SbppEnablePageShadowingForExec(
   // that has an actual breakpoint to the guest.
   ept_pt_entry->fields.physial_address = UtilPfnFromPa(info.pa_base_for_exec);
 
-  UtilInveptAll();
+  EptCommitChange(ept_data);
 }
 
 // Show a shadowed page for read and write
@@ -462,7 +654,7 @@ _Use_decl_annotations_ static void SbppEnablePageShadowingForRW(
   ept_pt_entry->fields.read_access = true;
   ept_pt_entry->fields.physial_address = UtilPfnFromPa(info.pa_base_for_rw);
 
-  UtilInveptAll();
+  EptCommitChange(ept_data);
 }
 
 // Stop showing a shadow page
@@ -475,7 +667,50 @@ _Use_decl_annotations_ static void SbppDisablePageShadowing(
   ept_pt_entry->fields.write_access = true;
   ept_pt_entry->fields.read_access = true;
   ept_pt_entry->fields.physial_address = UtilPfnFromPa(pa_base);
-  UtilInveptAll();
+  EptCommitChange(ept_data);
+}
+
+// Reflects modification made on the page for read/write to the page for exec.
+// Only cache lines that differ are copied, and breakpoints on those lines are
+// re-embedded. Lines holding breakpoints always differ and are copied too, but
+// it costs only a few lines per page. Comparison is done with 64-bit integers
+// rather than SIMD since guest's XMM registers are not saved on VM-exit.
+_Use_decl_annotations_ static void SbppSyncShadowPageForExec(
+    const PatchInformation& info) {
+  static const auto kQwordsPerLine = kSbppCacheLineSize / sizeof(ULONG64);
+
+  const auto rw_page =
+      reinterpret_cast<const ULONG64*>(info.shadow_page_base_for_rw->page);
+  const auto exec_page =
+      reinterpret_cast<ULONG64*>(info.shadow_page_base_for_exec->page);
+
+  ULONG64 synced_lines = 0;
+  for (auto line = 0ul; line < kSbppCacheLinesPerPage; ++line) {
+    const auto rw_line = rw_page + line * kQwordsPerLine;
+    const auto exec_line = exec_page + line * kQwordsPerLine;
+    ULONG64 difference = 0;
+    for (auto i = 0ul; i < kQwordsPerLine; ++i) {
+      difference |= rw_line[i] ^ exec_line[i];
+    }
+    if (!difference) {
+      continue;
+    }
+    RtlCopyMemory(exec_line, rw_line, kSbppCacheLineSize);
+    synced_lines |= 1ull << line;
+  }
+
+  // Re-embed breakpoints on the lines overwritten above. The page for exec is
+  // allocated by DdiMon and writable without mapping it with MDL.
+  ScopedSpinLockAtDpc scoped_lock(&g_sbpp_breakpoints_skinlock);
+  for (const auto& info2 : *g_sbpp_breakpoints) {
+    if (info2->shadow_page_base_for_exec != info.shadow_page_base_for_exec) {
+      continue;
+    }
+    const auto offset = BYTE_OFFSET(info2->patch_address);
+    if (synced_lines & (1ull << (offset / kSbppCacheLineSize))) {
+      info.shadow_page_base_for_exec->page[offset] = 0xcc;
+    }
+  }
 }
 
 // Checks if #BP is caused by the read write copy page. If so, that breakpoint
@@ -516,6 +751,9 @@ _Use_decl_annotations_ static void SbppSaveLastPatchInfo(
     const PatchInformation& info) {
   NT_ASSERT(!g_sbpp_last_breakpoint);
   g_sbpp_last_breakpoint = &info;
+
+  // The processor is not quiescent until MTF VM-exit restores the info
+  InterlockedIncrement(SbppGetInFlightCount());
 }
 
 // Retrieves the last info
@@ -524,6 +762,7 @@ SbppRestoreLastPatchInfo() {
   const auto info = g_sbpp_last_breakpoint;
   NT_ASSERT(info);
   g_sbpp_last_breakpoint = nullptr;
+  InterlockedDecrement(SbppGetInFlightCount());
   return info;
 }
 
@@ -532,34 +771,144 @@ SbppRestoreLastPatchInfo() {
   return !!(g_sbpp_breakpoints);
 }
 
+// Returns the in-flight counter of the current processor
+/*_Use_decl_annotations_*/ static volatile LONG* SbppGetInFlightCount() {
+  return &g_sbpp_in_flight_counts[KeGetCurrentProcessorNumberEx(nullptr)];
+}
+
+// Returns counters of the current processor for a DDI of the breakpoint
+_Use_decl_annotations_ static BreakpointCounters* SbppGetCounters(
+    const PatchInformation& info) {
+  return &info.metrics->counters[KeGetCurrentProcessorNumberEx(nullptr)];
+}
+
+// Sums counters of all processors for each hooked DDI and sorts them by cost
+_Use_decl_annotations_ EXTERN_C NTSTATUS SbpQueryHookMetrics(
+    SbpHookMetrics* metrics, ULONG capacity, ULONG* count) {
+  *count = 0;
+  if (!SbppIsSbpActive()) {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  std::vector<SbpHookMetrics> table;
+  const auto old_irql = KeRaiseIrqlToDpcLevel();
+  {
+    ScopedSpinLockAtDpc scoped_lock(&g_sbpp_breakpoints_skinlock);
+    for (const auto& info : *g_sbpp_breakpoints) {
+      // kPost breakpoints share counters with kPre ones
+      if (info->type != BreakpointType::kPre) {
+        continue;
+      }
+      SbpHookMetrics entry = {};
+      RtlCopyMemory(entry.name, info->name.data(), sizeof(entry.name));
+      entry.address = info->patch_address;
+      for (auto i = 0ul; i < info->metrics->counter_count; ++i) {
+        const auto& counters = info->metrics->counters[i];
+        entry.pre_hits += counters.pre_hits;
+        entry.post_hits += counters.post_hits;
+        entry.foreign_post_hits += counters.foreign_post_hits;
+        entry.rw_violations += counters.rw_violations;
+        entry.mtf_steps += counters.mtf_steps;
+        entry.handler_cycles += counters.handler_cycles;
+        entry.pending_posts += counters.pending_posts;
+      }
+      table.push_back(entry);
+    }
+  }
+  KeLowerIrql(old_irql);
+
+  std::sort(table.begin(), table.end(),
+            [](const SbpHookMetrics& lhs, const SbpHookMetrics& rhs) {
+              return lhs.handler_cycles > rhs.handler_cycles;
+            });
+  for (auto i = 0ul; i < capacity && i < table.size(); ++i) {
+    metrics[i] = table[i];
+  }
+  *count = static_cast<ULONG>(table.size());
+  return (capacity < table.size()) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+// Prints out hooks with the most handler cycles
+_Use_decl_annotations_ static void SbppReportHookMetrics() {
+  PAGED_CODE();
+
+  std::vector<SbpHookMetrics> metrics(kSbppMaxReports);
+  ULONG count = 0;
+  SbpQueryHookMetrics(metrics.data(), kSbppMaxReports, &count);
+  HYPERPLATFORM_LOG_INFO("%lu hooks in descending order of handler cycles:",
+                         count);
+  for (auto i = 0ul; i < count && i < kSbppMaxReports; ++i) {
+    const auto& entry = metrics[i];
+    HYPERPLATFORM_LOG_INFO(
+        "  %-32s cycles= %10llu pre= %8llu post= %8llu foreign= %6llu "
+        "rw= %6llu mtf= %8llu pending= %lld",
+        entry.name, entry.handler_cycles, entry.pre_hits, entry.post_hits,
+        entry.foreign_post_hits, entry.rw_violations, entry.mtf_steps,
+        entry.pending_posts);
+  }
+}
+
+// Deactivates shadow breakpoints, and then waits until no processor is
+// executing shadow breakpoint handlers or pending MTF. Page shadowing must have
+// been disabled so that no new breakpoint is hit.
+_Use_decl_annotations_ static void SbppWaitForQuiescence() {
+  PAGED_CODE();
+
+  // Stop accepting new handler executions. A processor may have passed
+  // SbppIsSbpActive() but not yet incremented its counter, so make every
+  // processor run guest code once. Since handlers run in VMX-root mode, this
+  // guarantees that all handlers started before this point have returned, and
+  // that MTF they set is counted.
+  g_sbpp_breakpoints = nullptr;
+  const auto status = UtilWaitForQuiescence();
+  NT_VERIFY(NT_SUCCESS(status));
+
+  // Let pending MTF VM-exits complete. Each of them comes after a single
+  // instruction of a guest, so this loop usually ends in microseconds.
+  for (auto i = 0ul; i < g_sbpp_processor_count; ++i) {
+    while (g_sbpp_in_flight_counts[i]) {
+      YieldProcessor();
+    }
+  }
+}
+
 // Adds a breakpoint info to the list
 _Use_decl_annotations_ static void SbppAddBreakpointToList(
     std::unique_ptr<PatchInformation> info) {
   ScopedSpinLockAtDpc scoped_lock(&g_sbpp_breakpoints_skinlock);
   NT_ASSERT(g_sbpp_breakpoints);
+  g_sbpp_index->patch_addresses.push_back(info->patch_address);
+  g_sbpp_index->target_tids.push_back(info->target_tid);
+  g_sbpp_index->types.push_back(info->type);
   g_sbpp_breakpoints->push_back(std::move(info));
 }
 
-// Deletes a breakpoint info from the list if exists
-_Use_decl_annotations_ static void SbppDeleteBreakpointFromList(
-    const PatchInformation& info) {
+// Removes a breakpoint info from the list and returns it, or nullptr if it
+// does not exist
+_Use_decl_annotations_ static std::unique_ptr<PatchInformation>
+SbppRemoveBreakpointFromList(const PatchInformation& info) {
   ScopedSpinLockAtDpc scoped_lock(&g_sbpp_breakpoints_skinlock);
   auto ptrs = g_sbpp_breakpoints;
   NT_ASSERT(ptrs);
-  auto iter =
-      std::find_if(ptrs->begin(), ptrs->end(), [info](const auto& info2) {
-        return (info.patch_address == info2->patch_address &&
-                info.target_tid == info2->target_tid);
-      });
-  if (iter != ptrs->end()) {
-    ptrs->erase(iter);
+  auto& index = *g_sbpp_index;
+  for (auto i = 0u; i < index.patch_addresses.size(); ++i) {
+    if (index.patch_addresses[i] == info.patch_address &&
+        index.target_tids[i] == info.target_tid) {
+      index.patch_addresses.erase(index.patch_addresses.begin() + i);
+      index.target_tids.erase(index.target_tids.begin() + i);
+      index.types.erase(index.types.begin() + i);
+      auto removed_info = std::move((*ptrs)[i]);
+      ptrs->erase(ptrs->begin() + i);
+      return removed_info;
+    }
   }
+  return nullptr;
 }
 
 // Allocates a non-paged, page-alined page. Issues bug check on failure
 Page::Page()
-    : page(reinterpret_cast<UCHAR*>(ExAllocatePoolWithTag(
-          NonPagedPool, PAGE_SIZE, kHyperPlatformCommonPoolTag))) {
+    : page(reinterpret_cast<UCHAR*>(MemUsageAllocate(
+          NonPagedPool, PAGE_SIZE, MemUsageSubsystem::kShadowPage))) {
   if (!page) {
     HYPERPLATFORM_COMMON_BUG_CHECK(
         HyperPlatformBugCheck::kCritialPoolAllocationFailure, 0, 0, 0);
@@ -567,7 +916,33 @@ Page::Page()
 }
 
 // De-allocates the allocated page
-Page::~Page() { ExFreePoolWithTag(page, kHyperPlatformCommonPoolTag); }
+Page::~Page() {
+  MemUsageFree(page, PAGE_SIZE, MemUsageSubsystem::kShadowPage);
+}
+
+// Allocates zeroed counters for each processor. An allocation of a page or
+// more is page aligned, so counters never share a cache line with other data.
+// Issues bug check on failure.
+BreakpointMetrics::BreakpointMetrics(_In_ ULONG processor_count)
+    : counters(reinterpret_cast<BreakpointCounters*>(MemUsageAllocate(
+          NonPagedPool,
+          ROUND_TO_PAGES(sizeof(BreakpointCounters) * processor_count),
+          MemUsageSubsystem::kShadowPage))),
+      counter_count(processor_count) {
+  if (!counters) {
+    HYPERPLATFORM_COMMON_BUG_CHECK(
+        HyperPlatformBugCheck::kCritialPoolAllocationFailure, 0, 0, 0);
+  }
+  RtlZeroMemory(counters,
+                ROUND_TO_PAGES(sizeof(BreakpointCounters) * counter_count));
+}
+
+// De-allocates the counters
+BreakpointMetrics::~BreakpointMetrics() {
+  MemUsageFree(counters,
+               ROUND_TO_PAGES(sizeof(BreakpointCounters) * counter_count),
+               MemUsageSubsystem::kShadowPage);
+}
 
 // Acquires a spin lock
 ScopedSpinLockAtDpc::ScopedSpinLockAtDpc(_In_ PKSPIN_LOCK spin_lock) {
@@ -578,3 +953,14 @@ ScopedSpinLockAtDpc::ScopedSpinLockAtDpc(_In_ PKSPIN_LOCK spin_lock) {
 ScopedSpinLockAtDpc::~ScopedSpinLockAtDpc() {
   KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle_);
 }
+
+// Marks the current processor as executing a handler
+ScopedInFlightAtDpc::ScopedInFlightAtDpc()
+    : in_flight_count_(SbppGetInFlightCount()) {
+  InterlockedIncrement(in_flight_count_);
+}
+
+// Marks the current processor as having left the handler
+ScopedInFlightAtDpc::~ScopedInFlightAtDpc() {
+  InterlockedDecrement(in_flight_count_);
+}
@@ -27,6 +27,19 @@
 
 struct EptData;
 
+// Counters of a hooked DDI summed over all processors
+struct SbpHookMetrics {
+  char name[64];              // A null-terminated DDI name
+  void* address;              // An address of the pre breakpoint
+  ULONG64 pre_hits;           // Pre breakpoints hit
+  ULONG64 post_hits;          // Post breakpoints hit by target threads
+  ULONG64 foreign_post_hits;  // Post breakpoints hit by other threads
+  ULONG64 rw_violations;      // EPT violations to show pages for read/write
+  ULONG64 mtf_steps;          // Instructions single-stepped with MTF
+  ULONG64 handler_cycles;     // TSC cycles spent in pre and post handlers
+  LONG64 pending_posts;       // Post breakpoints not hit yet
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
@@ -47,11 +60,17 @@ _IRQL_requires_min_(DISPATCH_LEVEL) NTSTATUS
 _IRQL_requires_min_(DISPATCH_LEVEL) bool SbpHandleBreakpoint(
     _In_ EptData* ept_data, _In_ void* guest_ip, _In_ GpRegisters* gp_regs);
 
-_IRQL_requires_min_(DISPATCH_LEVEL) void SbpHandleMonitorTrapFlag(
+_IRQL_requires_min_(DISPATCH_LEVEL) bool SbpHandleMonitorTrapFlag(
     _In_ EptData* ept_data);
 
-_IRQL_requires_min_(DISPATCH_LEVEL) void SbpHandleEptViolation(
-    _In_ EptData* ept_data, _In_ void* fault_va);
+_IRQL_requires_min_(DISPATCH_LEVEL) bool SbpHandleEptViolation(
+    _In_ EptData* ept_data, _In_ void* fault_va, _In_ bool is_write);
+
+// Fills metrics with up to capacity hooks in descending order of handler
+// cycles, and returns a number of all hooks with count
+_IRQL_requires_max_(DISPATCH_LEVEL) EXTERN_C NTSTATUS
+    SbpQueryHookMetrics(_Out_writes_opt_(capacity) SbpHookMetrics* metrics,
+                        _In_ ULONG capacity, _Out_ ULONG* count);
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -34,9 +34,12 @@
 struct EptData;
 struct Page;
 struct PatchInformation;
+struct BreakpointHandlerSlot;
 
-// Breakpoint handler type
+// Breakpoint handler type. slot is the one through which the handler is called
+// and holds state of the handler.
 using BreakpointHandlerType = void (*)(const PatchInformation& info,
+                                       const BreakpointHandlerSlot& slot,
                                        EptData* ept_data, GpRegisters* gp_reg,
                                        ULONG_PTR guest_sp);
 
@@ -45,6 +48,12 @@ struct BreakpointTarget {
   UNICODE_STRING target_name;
   BreakpointHandlerType pre_handler;
   BreakpointHandlerType post_handler;
+
+  // A prehashed name when target_name is not an expression, or 0
+  ULONG name_hash;
+
+  // Handler specific data passed through BreakpointHandlerSlot
+  void* context;
 };
 
 // A type of breakpoint
@@ -56,7 +65,52 @@ enum class BreakpointType {
 // Holds at most 16 function paramaters
 using CapturedParameters = std::array<ULONG_PTR, 16>;
 
-// Represents shadow breakpoint
+// A handler chained to a breakpoint and its own state
+struct BreakpointHandlerSlot {
+  // Hanlder to be called
+  BreakpointHandlerType handler;
+
+  // If type of a breakpoint is kPre, this is used to create kPost breakpoint on
+  // hit of the breakpoint as needed. If type is kPost, it is always nullptr
+  // because a handler is saved to and called via handler.
+  BreakpointHandlerType post_handler;
+
+  // If type of a breakpoint is kPre, it is ignored. If type is kPost, it can
+  // hold function parameters inspected in a pre-handler of this slot.
+  CapturedParameters parameters;
+
+  // Handler specific data given with BreakpointTarget
+  void* context;
+};
+
+// Counters of a hooked DDI updated only by the owner processor in VMX-root
+// mode. It is a cache line long so that processors do not share lines.
+struct BreakpointCounters {
+  ULONG64 pre_hits;
+  ULONG64 post_hits;
+  ULONG64 foreign_post_hits;
+  ULONG64 rw_violations;
+  ULONG64 mtf_steps;
+  ULONG64 handler_cycles;
+  LONG64 pending_posts;  // May be negative when posts are hit on others
+  ULONG64 reserved;
+};
+static_assert(sizeof(BreakpointCounters) == 64, "Size check");
+
+// Counters of a hooked DDI for each processor. Shared by a kPre breakpoint and
+// kPost breakpoints created from it. Counters are allocated in whole pages so
+// that each of them starts at a cache line boundary.
+struct BreakpointMetrics {
+  BreakpointCounters* counters;  // Indexed by a processor number
+  ULONG counter_count;
+  explicit BreakpointMetrics(_In_ ULONG processor_count);
+  ~BreakpointMetrics();
+  BreakpointMetrics(const BreakpointMetrics&) = delete;
+  BreakpointMetrics& operator=(const BreakpointMetrics&) = delete;
+};
+
+// Represents shadow breakpoint. patch_address, type and target_tid are
+// immutable and mirrored to a lookup index for fast scanning.
 struct PatchInformation {
   BreakpointType type;
   void* patch_address;  // An address of breakpoint
@@ -71,25 +125,23 @@ struct PatchInformation {
   ULONG64 pa_base_for_rw;
   ULONG64 pa_base_for_exec;
 
-  // Hanlder to be called
-  BreakpointHandlerType handler;
-
-  // If type is kPre, this is used to create kPost breakpoint on hit of the
-  // breakpoint as needed. If type is kPost, it is always nullptr because
-  // a handler is saved to and called via handler.
-  BreakpointHandlerType post_handler;
+  // Handlers called in order on a hit of the breakpoint. If type is kPre, it
+  // has a slot for each BreakpointTarget matching the address so that all of
+  // them share a single #BP. If type is kPost, it has a slot for each
+  // pre-handler that requested the kPost breakpoint at the address for the
+  // thread.
+  std::vector<BreakpointHandlerSlot> handlers;
 
   // If type is kPre, it is ignored. If type is kPost, it is used to determine
   // a thread hitting the breakpoint is the same thread as one hit a
   // corresponding kPre breakpoint.
   HANDLE target_tid;
 
-  // If type is kPre, it is ignored. If type is kPost, it can hold function
-  // parameters inspected in a pre-handler.
-  CapturedParameters parameters;
-
   // A name of breakpont (a DDI name)
   std::array<char, 64> name;
+
+  // Counters of a DDI this breakpoint is set for
+  std::shared_ptr<BreakpointMetrics> metrics;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -103,6 +155,7 @@ void SbpCreatePreBreakpoint(_In_ void* address,
 
 _IRQL_requires_min_(DISPATCH_LEVEL) void SbpCreateAndEnablePostBreakpoint(
     _In_ void* address, _In_ const PatchInformation& info,
+    _In_ const BreakpointHandlerSlot& slot,
     _In_ const CapturedParameters& parameters, _In_ EptData* ept_data);
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,412 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements EPT-based data watchpoint functions.
+
+#include "watchpoint.h"
+#include "../HyperPlatform/HyperPlatform/kernel_stl.h"
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <array>
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#include "../HyperPlatform/HyperPlatform/util.h"
+#include "../HyperPlatform/HyperPlatform/ept.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// How many watched ranges can be set on a single page
+static const auto kWppMaxRangesPerPage = 8ul;
+
+// The largest size of a single data access assumed by the range check. An
+// EPT violation only tells the first byte being accessed, so an access
+// starting up to this many bytes before a range is also treated as a hit.
+static const auto kWppMaxAccessSize = 8ul;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Represents a watched range within a page
+struct WatchRange {
+  ULONG begin;  // An offset of the first byte watched
+  ULONG end;    // An offset of the last byte watched
+  WatchpointAccess access;
+  WatchpointHandlerType handler;
+  std::array<char, 32> name;
+};
+
+// Represents a page protected by EPT and ranges watched on it
+struct WatchedPage {
+  void* va_base;
+  ULONG64 pa_base;
+
+  // The strongest access type among ranges. Decides EPT permissions.
+  WatchpointAccess access;
+
+  ULONG range_count;
+  std::array<WatchRange, kWppMaxRangesPerPage> ranges;
+
+  // Statistics; number of EPT violations on this page, and number of them hit
+  // a watched range. exit_count - hit_count is the number of false positives.
+  volatile LONG64 exit_count;
+  volatile LONG64 hit_count;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static WatchedPage* WppFindWatchedPageByPa(
+    _In_ const std::vector<std::unique_ptr<WatchedPage>>& pages,
+    _In_ ULONG64 pa);
+
+static const WatchRange* WppFindWatchRange(_In_ const WatchedPage& page,
+                                           _In_ ULONG offset,
+                                           _In_ bool is_write);
+
+static void WppProtectPage(_In_ const WatchedPage& page,
+                           _In_ EptData* ept_data);
+
+static void WppUnprotectPage(_In_ const WatchedPage& page,
+                             _In_ EptData* ept_data);
+
+static void WppSetMonitorTrapFlag(_In_ bool enable);
+
+static void WppDefaultHandler(_In_ const char* name, _In_ void* fault_va,
+                              _In_ bool is_write, _In_ ULONG_PTR guest_ip);
+
+static void WppReportStatistics(
+    _In_ const std::vector<std::unique_ptr<WatchedPage>>& pages);
+
+static bool WppIsWpActive();
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, WpInitialization)
+#pragma alloc_text(INIT, WpStart)
+#pragma alloc_text(INIT, WpCreateWatchpoint)
+#pragma alloc_text(PAGE, WpTermination)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Holds all watched pages. It is only modified before WpStart(), so handlers
+// access it without a lock. Handlers read it only once since it is cleared by
+// WpTermination().
+static std::vector<std::unique_ptr<WatchedPage>>* g_wpp_pages;
+
+// Remember a page being accessed with single stepping
+static const WatchedPage* g_wpp_last_page;
+
+// Remember a value of guests eflags.IT
+static bool g_wpp_previouse_guest_interrupt_flag;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Initializes watchpoint functions
+_Use_decl_annotations_ EXTERN_C NTSTATUS WpInitialization() {
+  PAGED_CODE();
+
+  g_wpp_pages = new std::vector<std::unique_ptr<WatchedPage>>();
+  return STATUS_SUCCESS;
+}
+
+// Protects all watched pages
+_Use_decl_annotations_ EXTERN_C NTSTATUS WpStart() {
+  PAGED_CODE();
+
+  if (g_wpp_pages->empty()) {
+    return STATUS_SUCCESS;
+  }
+  const auto status =
+      UtilVmCall(HypercallNumber::kDdimonEnableWatchpoints, g_wpp_pages);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  // Make accesses through translations cached on other processors trap too
+  return EptFlushTranslations();
+}
+
+// Terminates watchpoint functions
+_Use_decl_annotations_ EXTERN_C void WpTermination() {
+  PAGED_CODE();
+
+  auto pages = g_wpp_pages;
+  if (!pages) {
+    return;
+  }
+  if (!pages->empty()) {
+    auto status = UtilVmCall(HypercallNumber::kDdimonDisableWatchpoints, pages);
+    NT_VERIFY(NT_SUCCESS(status));
+    status = EptFlushTranslations();
+    NT_VERIFY(NT_SUCCESS(status));
+  }
+
+  // Stop handlers from seeing pages, and wait until ones that may have seen
+  // them return. A processor with pending MTF has interrupts disabled and is
+  // scheduled only after the MTF VM-exit restores them, so g_wpp_last_page is
+  // also cleared by then.
+  g_wpp_pages = nullptr;
+  auto status = UtilWaitForQuiescence();
+  NT_VERIFY(NT_SUCCESS(status));
+  NT_ASSERT(!g_wpp_last_page);
+
+  WppReportStatistics(*pages);
+  delete pages;
+}
+
+// Registers a range to watch. A range spanning multiple pages is split into
+// per-page ranges. It must be called before WpStart().
+_Use_decl_annotations_ NTSTATUS
+WpCreateWatchpoint(void* address, SIZE_T size, WatchpointAccess access,
+                   WatchpointHandlerType handler, const char* name) {
+  PAGED_CODE();
+
+  if (!size || !UtilIsAccessibleAddress(address)) {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  // Check that all pages have room for a range first so that a watchpoint is
+  // never set only to some of them
+  const auto begin = reinterpret_cast<ULONG_PTR>(address);
+  const auto end = begin + size;  // exclusive
+  for (auto current = begin; current < end;
+       current = reinterpret_cast<ULONG_PTR>(PAGE_ALIGN(current)) + PAGE_SIZE) {
+    const auto page = WppFindWatchedPageByPa(
+        *g_wpp_pages, UtilPaFromVa(PAGE_ALIGN(current)));
+    if (page && page->range_count == kWppMaxRangesPerPage) {
+      return STATUS_INSUFFICIENT_RESOURCES;
+    }
+  }
+
+  auto current = begin;
+  while (current < end) {
+    const auto va_base = PAGE_ALIGN(current);
+    const auto page_end = reinterpret_cast<ULONG_PTR>(va_base) + PAGE_SIZE;
+    const auto range_end = min(end, page_end);
+    const auto pa_base = UtilPaFromVa(va_base);
+
+    // Find an existing page object or create new one
+    auto page = WppFindWatchedPageByPa(*g_wpp_pages, pa_base);
+    if (!page) {
+      auto new_page = std::make_unique<WatchedPage>();
+      RtlZeroMemory(new_page.get(), sizeof(WatchedPage));
+      new_page->va_base = va_base;
+      new_page->pa_base = pa_base;
+      new_page->access = access;
+      page = new_page.get();
+      g_wpp_pages->push_back(std::move(new_page));
+    }
+    if (access == WatchpointAccess::kReadWrite) {
+      page->access = WatchpointAccess::kReadWrite;
+    }
+
+    auto& range = page->ranges[page->range_count++];
+    range.begin = BYTE_OFFSET(current);
+    range.end = BYTE_OFFSET(range_end - 1);
+    range.access = access;
+    range.handler = (handler) ? handler : WppDefaultHandler;
+    strncpy(range.name.data(), name, range.name.size() - 1);
+
+    HYPERPLATFORM_LOG_INFO("Watchpoint has been set to %p (+%03x-%03x) %s.",
+                           va_base, range.begin, range.end, name);
+    current = range_end;
+  }
+  return STATUS_SUCCESS;
+}
+
+// Protects all watched pages
+_Use_decl_annotations_ void WpVmCallEnableWatchpoints(EptData* ept_data,
+                                                      void* context) {
+  HYPERPLATFORM_COMMON_DBG_BREAK();
+  const auto pages =
+      reinterpret_cast<std::vector<std::unique_ptr<WatchedPage>>*>(context);
+  for (auto& page : *pages) {
+    WppProtectPage(*page, ept_data);
+  }
+}
+
+// Unprotects all watched pages
+_Use_decl_annotations_ void WpVmCallDisableWatchpoints(EptData* ept_data,
+                                                       void* context) {
+  HYPERPLATFORM_COMMON_DBG_BREAK();
+  const auto pages =
+      reinterpret_cast<std::vector<std::unique_ptr<WatchedPage>>*>(context);
+  for (auto& page : *pages) {
+    WppUnprotectPage(*page, ept_data);
+  }
+}
+
+// Handles EPT violation VM-exit. Returns false if the fault is not on any of
+// watched pages. Otherwise, runs a handler if a watched range is accessed, and
+// lets a guest run a single instruction with the page unprotected regardless.
+// Access to unwatched offsets only costs a range check and a MTF VM-exit.
+_Use_decl_annotations_ bool WpHandleEptViolation(EptData* ept_data,
+                                                 void* fault_va,
+                                                 ULONG64 fault_pa,
+                                                 bool is_write) {
+  const auto pages = g_wpp_pages;
+  if (!pages) {
+    return false;
+  }
+  const auto page = WppFindWatchedPageByPa(*pages, fault_pa);
+  if (!page) {
+    return false;
+  }
+
+  InterlockedIncrement64(&page->exit_count);
+  const auto offset = static_cast<ULONG>(fault_pa & (PAGE_SIZE - 1));
+  const auto range = WppFindWatchRange(*page, offset, is_write);
+  if (range) {
+    InterlockedIncrement64(&page->hit_count);
+    range->handler(range->name.data(), fault_va, is_write,
+                   UtilVmRead(VmcsField::kGuestRip));
+  }
+
+  WppUnprotectPage(*page, ept_data);
+  WppSetMonitorTrapFlag(true);
+  NT_ASSERT(!g_wpp_last_page);
+  g_wpp_last_page = page;
+  return true;
+}
+
+// Handles MTF VM-exit. Returns false if MTF was not set by this module.
+// Otherwise, protects the last accessed page again and clears MTF.
+_Use_decl_annotations_ bool WpHandleMonitorTrapFlag(EptData* ept_data) {
+  const auto page = g_wpp_last_page;
+  if (!page) {
+    return false;
+  }
+  g_wpp_last_page = nullptr;
+
+  if (WppIsWpActive()) {
+    WppProtectPage(*page, ept_data);
+  }
+  WppSetMonitorTrapFlag(false);
+  return true;
+}
+
+// Finds a watched page object by a physical address
+_Use_decl_annotations_ static WatchedPage* WppFindWatchedPageByPa(
+    const std::vector<std::unique_ptr<WatchedPage>>& pages, ULONG64 pa) {
+  const auto pa_base = pa & ~static_cast<ULONG64>(PAGE_SIZE - 1);
+  const auto found = std::find_if(
+      pages.begin(), pages.end(),
+      [pa_base](const auto& page) { return page->pa_base == pa_base; });
+  if (found == pages.cend()) {
+    return nullptr;
+  }
+  return found->get();
+}
+
+// Finds a watched range that the access at the offset may touch
+_Use_decl_annotations_ static const WatchRange* WppFindWatchRange(
+    const WatchedPage& page, ULONG offset, bool is_write) {
+  const auto access_end = offset + kWppMaxAccessSize - 1;
+  for (auto i = 0ul; i < page.range_count; ++i) {
+    const auto& range = page.ranges[i];
+    if (offset > range.end || access_end < range.begin) {
+      continue;
+    }
+    if (!is_write && range.access == WatchpointAccess::kWrite) {
+      continue;
+    }
+    return &range;
+  }
+  return nullptr;
+}
+
+// Denies access to be watched to the page
+_Use_decl_annotations_ static void WppProtectPage(const WatchedPage& page,
+                                                  EptData* ept_data) {
+  const auto ept_pt_entry = EptGetEptPtEntry(ept_data, page.pa_base);
+  ept_pt_entry->fields.write_access = false;
+  if (page.access == WatchpointAccess::kReadWrite) {
+    ept_pt_entry->fields.read_access = false;
+  }
+  EptCommitChange(ept_data);
+}
+
+// Allows all access to the page
+_Use_decl_annotations_ static void WppUnprotectPage(const WatchedPage& page,
+                                                    EptData* ept_data) {
+  const auto ept_pt_entry = EptGetEptPtEntry(ept_data, page.pa_base);
+  ept_pt_entry->fields.write_access = true;
+  ept_pt_entry->fields.read_access = true;
+  EptCommitChange(ept_data);
+}
+
+// Set MTF on the current processor, and modifies guest's TF accordingly. See
+// SbppSetMonitorTrapFlag() for why IF is cleared.
+_Use_decl_annotations_ static void WppSetMonitorTrapFlag(bool enable) {
+  VmxProcessorBasedControls vm_procctl = {
+      static_cast<unsigned int>(UtilVmRead(VmcsField::kCpuBasedVmExecControl))};
+  vm_procctl.fields.monitor_trap_flag = enable;
+  UtilVmWrite(VmcsField::kCpuBasedVmExecControl, vm_procctl.all);
+
+  FlagRegister flags = {UtilVmRead(VmcsField::kGuestRflags)};
+  if (enable) {
+    // clear IF
+    g_wpp_previouse_guest_interrupt_flag = flags.fields.intf;
+    flags.fields.intf = false;
+  } else {
+    // restore IF
+    flags.fields.intf = g_wpp_previouse_guest_interrupt_flag;
+  }
+  UtilVmWrite(VmcsField::kGuestRflags, flags.all);
+}
+
+// Logs access to a watched range
+_Use_decl_annotations_ static void WppDefaultHandler(const char* name,
+                                                     void* fault_va,
+                                                     bool is_write,
+                                                     ULONG_PTR guest_ip) {
+  HYPERPLATFORM_LOG_INFO_SAFE("%s %s %p from %p", (is_write) ? "Write" : "Read",
+                              name, fault_va, guest_ip);
+}
+
+// Prints out the number of exits and false positive ratios of each page so that
+// hot pages can be identified
+_Use_decl_annotations_ static void WppReportStatistics(
+    const std::vector<std::unique_ptr<WatchedPage>>& pages) {
+  if (pages.empty()) {
+    return;
+  }
+
+  HYPERPLATFORM_LOG_INFO("%-31s,%-18s,%20s,%20s,%15s", "Name", "Page", "Exits",
+                         "Hits", "False Positive");
+  for (const auto& page : pages) {
+    const auto exits = static_cast<ULONG64>(page->exit_count);
+    const auto hits = static_cast<ULONG64>(page->hit_count);
+    const auto false_positive_ratio =
+        (exits) ? (exits - hits) * 100 / exits : 0;
+    HYPERPLATFORM_LOG_INFO("%-31s,%p,%20I64u,%20I64u,%14I64u%%",
+                           page->ranges[0].name.data(), page->va_base, exits,
+                           hits, false_positive_ratio);
+  }
+}
+
+// Checks if watchpoints are already initialized
+/*_Use_decl_annotations_*/ static bool WppIsWpActive() {
+  return !!(g_wpp_pages);
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to EPT-based data watchpoint functions.
+
+#ifndef DDIMON_WATCHPOINT_H_
+#define DDIMON_WATCHPOINT_H_
+
+#include "../HyperPlatform/HyperPlatform/ia32_type.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct EptData;
+
+// A type of access to be watched
+enum class WatchpointAccess {
+  kWrite,      // Only write access is reported
+  kReadWrite,  // Both read and write access are reported
+};
+
+// Watchpoint handler type. Called for access inside a watched range.
+using WatchpointHandlerType = void (*)(const char* name, void* fault_va,
+                                       bool is_write, ULONG_PTR guest_ip);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS WpInitialization();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS WpStart();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void WpTermination();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    WpCreateWatchpoint(_In_ void* address, _In_ SIZE_T size,
+                       _In_ WatchpointAccess access,
+                       _In_opt_ WatchpointHandlerType handler,
+                       _In_ const char* name);
+
+_IRQL_requires_min_(DISPATCH_LEVEL) void WpVmCallEnableWatchpoints(
+    _In_ EptData* ept_data, _In_ void* context);
+
+_IRQL_requires_min_(DISPATCH_LEVEL) void WpVmCallDisableWatchpoints(
+    _In_ EptData* ept_data, _In_ void* context);
+
+_IRQL_requires_min_(DISPATCH_LEVEL) bool WpHandleEptViolation(
+    _In_ EptData* ept_data, _In_ void* fault_va, _In_ ULONG64 fault_pa,
+    _In_ bool is_write);
+
+_IRQL_requires_min_(DISPATCH_LEVEL) bool WpHandleMonitorTrapFlag(
+    _In_ EptData* ept_data);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_WATCHPOINT_H_
@@ -0,0 +1,499 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements per-process VM-exit attribution functions.
+
+#include "attribution.h"
+#include <intrin.h>
+#include <ntstrsafe.h>
+#include "common.h"
+#include "log.h"
+#include "util.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// How many CR3 values can be tracked per a processor in a report interval. It
+// must be a power of two. VM-exits with other CR3 values are accounted to an
+// overflow entry.
+static const auto kAttrpNumberOfEntries = 64ul;
+static_assert((kAttrpNumberOfEntries & (kAttrpNumberOfEntries - 1)) == 0,
+              "Must be a power of two");
+
+// A number of basic exit reasons (see VmxExitReason)
+static const auto kAttrpNumberOfExitReasons = 65ul;
+
+// How many processes are reported
+static const auto kAttrpTopN = 10ul;
+
+// How many exit reasons are reported for each process
+static const auto kAttrpTopExitReasons = 3ul;
+
+// A CR3 value used for the overflow entry
+static const ULONG_PTR kAttrpOverflowCr3 = MAXULONG_PTR;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Statistics of a CR3 value
+struct AttrEntry {
+  ULONG_PTR cr3;  // 0 if the entry is unused
+  ULONG64 exit_count;
+  ULONG64 cycles;
+  ULONG exit_counts[kAttrpNumberOfExitReasons];
+};
+
+// A fixed size hash table of AttrEntry keyed by CR3
+struct AttrTable {
+  AttrEntry entries[kAttrpNumberOfEntries];
+  AttrEntry overflow;
+};
+
+// Tables of a processor. A VMM updates tables[active_index] while a report
+// thread reads and clears the other.
+struct AttrProcessorData {
+  volatile long active_index;
+  AttrTable tables[2];
+};
+
+// Global state of attribution
+struct AttrData {
+  ULONG report_interval;  // In seconds
+  KEVENT stop_event;
+  HANDLE report_thread_handle;
+  AttrTable interval;  // Statistics since the last report
+  ULONG processor_count;
+  AttrProcessorData* processors[1];  // Has processor_count elements
+};
+
+// Information of a process resolved from a CR3 value
+struct AttrProcessInfo {
+  HANDLE pid;
+  char image_name[16];
+};
+
+// dt nt!_SYSTEM_PROCESS_INFORMATION (partial)
+struct AttrSystemProcessInformation {
+  ULONG next_entry_offset;
+  ULONG number_of_threads;
+  LARGE_INTEGER working_set_private_size;
+  ULONG hard_fault_count;
+  ULONG number_of_threads_high_watermark;
+  ULONG64 cycle_time;
+  LARGE_INTEGER create_time;
+  LARGE_INTEGER user_time;
+  LARGE_INTEGER kernel_time;
+  UNICODE_STRING image_name;
+  LONG base_priority;
+  HANDLE unique_process_id;
+  // omitted
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+NTKERNELAPI UCHAR* NTAPI PsGetProcessImageFileName(_In_ PEPROCESS process);
+
+NTSYSAPI NTSTATUS NTAPI
+ZwQuerySystemInformation(_In_ ULONG system_information_class,
+                         _Out_writes_bytes_opt_(system_information_length)
+                             PVOID system_information,
+                         _In_ ULONG system_information_length,
+                         _Out_opt_ PULONG return_length);
+
+static KSTART_ROUTINE AttrpReportThreadRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void AttrpCollect(
+    _Inout_ AttrData* data);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void AttrpReport(
+    _In_ const AttrTable& table);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void AttrpResolveProcesses(
+    _In_reads_(count) const ULONG_PTR* cr3s, _In_ ULONG count,
+    _Out_writes_(count) AttrProcessInfo* infos);
+
+static void AttrpMergeEntry(_Inout_ AttrTable* table,
+                            _In_ const AttrEntry& entry);
+
+static AttrEntry* AttrpFindEntry(_Inout_ AttrTable* table,
+                                 _In_ ULONG_PTR cr3);
+
+static ULONG_PTR AttrpNormalizeCr3(_In_ ULONG_PTR cr3);
+
+static void AttrpFreeAttrData(_In_ AttrData* data);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, AttrInitialization)
+#pragma alloc_text(PAGE, AttrTermination)
+#pragma alloc_text(PAGE, AttrpReportThreadRoutine)
+#pragma alloc_text(PAGE, AttrpCollect)
+#pragma alloc_text(PAGE, AttrpReport)
+#pragma alloc_text(PAGE, AttrpResolveProcesses)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Attribution state referenced by a VMM
+static AttrData* g_attrp_data;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates per-processor tables and starts a report thread
+_Use_decl_annotations_ NTSTATUS AttrInitialization(ULONG report_interval) {
+  PAGED_CODE();
+
+  if (!report_interval) {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  const auto processor_count =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto data_size =
+      sizeof(AttrData) + sizeof(AttrProcessorData*) * (processor_count - 1);
+  const auto data = reinterpret_cast<AttrData*>(ExAllocatePoolWithTag(
+      NonPagedPoolNx, data_size, kHyperPlatformCommonPoolTag));
+  if (!data) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(data, data_size);
+  data->report_interval = report_interval;
+  data->processor_count = processor_count;
+  KeInitializeEvent(&data->stop_event, NotificationEvent, FALSE);
+  for (auto i = 0ul; i < processor_count; ++i) {
+    const auto processor_data =
+        reinterpret_cast<AttrProcessorData*>(ExAllocatePoolWithTag(
+            NonPagedPoolNx, sizeof(AttrProcessorData),
+            kHyperPlatformCommonPoolTag));
+    if (!processor_data) {
+      AttrpFreeAttrData(data);
+      return STATUS_MEMORY_NOT_ALLOCATED;
+    }
+    RtlZeroMemory(processor_data, sizeof(AttrProcessorData));
+    data->processors[i] = processor_data;
+  }
+
+  auto status = PsCreateSystemThread(&data->report_thread_handle, GENERIC_ALL,
+                                     nullptr, nullptr, nullptr,
+                                     AttrpReportThreadRoutine, data);
+  if (!NT_SUCCESS(status)) {
+    AttrpFreeAttrData(data);
+    return status;
+  }
+
+  g_attrp_data = data;
+  return status;
+}
+
+// Stops the report thread, prints out the last report and frees tables
+_Use_decl_annotations_ void AttrTermination() {
+  PAGED_CODE();
+
+  const auto data = g_attrp_data;
+  if (!data) {
+    return;
+  }
+
+  KeSetEvent(&data->stop_event, IO_NO_INCREMENT, FALSE);
+  auto status = ZwWaitForSingleObject(data->report_thread_handle, FALSE,
+                                      nullptr);
+  NT_VERIFY(NT_SUCCESS(status));
+  ZwClose(data->report_thread_handle);
+
+  // Stop recording and make sure that no processor is still referencing data
+  g_attrp_data = nullptr;
+  status = UtilWaitForQuiescence();
+  NT_VERIFY(NT_SUCCESS(status));
+
+  AttrpCollect(data);
+  HYPERPLATFORM_LOG_INFO("VM-exit attribution since the last report:");
+  AttrpReport(data->interval);
+  AttrpFreeAttrData(data);
+}
+
+// Accounts the VM-exit to an entry of the CR3 on the current processor
+_Use_decl_annotations_ void AttrRecordVmExit(ULONG_PTR guest_cr3,
+                                             USHORT exit_reason,
+                                             ULONG64 cycles) {
+  const auto data = g_attrp_data;
+  if (!data) {
+    return;
+  }
+
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  auto& processor_data = *data->processors[processor];
+  auto& table = processor_data.tables[processor_data.active_index];
+  auto entry = AttrpFindEntry(&table, AttrpNormalizeCr3(guest_cr3));
+  entry->exit_count++;
+  entry->cycles += cycles;
+  if (exit_reason < kAttrpNumberOfExitReasons) {
+    entry->exit_counts[exit_reason]++;
+  }
+}
+
+// Periodically collects per-processor tables and reports them
+_Use_decl_annotations_ static VOID AttrpReportThreadRoutine(
+    void* start_context) {
+  PAGED_CODE();
+
+  const auto data = reinterpret_cast<AttrData*>(start_context);
+  LARGE_INTEGER interval = {};
+  interval.QuadPart = -(10000000ll * data->report_interval);  // sec
+
+  while (KeWaitForSingleObject(&data->stop_event, Executive, KernelMode, FALSE,
+                               &interval) == STATUS_TIMEOUT) {
+    AttrpCollect(data);
+    HYPERPLATFORM_LOG_INFO("VM-exit attribution in the last %lu seconds:",
+                           data->report_interval);
+    AttrpReport(data->interval);
+
+    // Start the next interval with an empty table so that processes that
+    // exited do not occupy entries forever
+    RtlZeroMemory(&data->interval, sizeof(data->interval));
+  }
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Swaps tables of all processors and merges ones no longer updated into the
+// table of the interval
+_Use_decl_annotations_ static void AttrpCollect(AttrData* data) {
+  PAGED_CODE();
+
+  for (auto i = 0ul; i < data->processor_count; ++i) {
+    auto& processor_data = *data->processors[i];
+    InterlockedExchange(&processor_data.active_index,
+                        !processor_data.active_index);
+  }
+
+  // Once each processor resumes a guest, no VM-exit handler that started
+  // before the swap is running, and inactive tables can be accessed safely.
+  UtilWaitForQuiescence();
+
+  for (auto i = 0ul; i < data->processor_count; ++i) {
+    auto& processor_data = *data->processors[i];
+    auto& table = processor_data.tables[!processor_data.active_index];
+    for (const auto& entry : table.entries) {
+      if (entry.cr3) {
+        AttrpMergeEntry(&data->interval, entry);
+      }
+    }
+    if (table.overflow.exit_count) {
+      AttrpMergeEntry(&data->interval, table.overflow);
+    }
+    RtlZeroMemory(&table, sizeof(table));
+  }
+}
+
+// Prints out processes with the most handler cycles along with their most
+// frequent exit reasons
+_Use_decl_annotations_ static void AttrpReport(const AttrTable& table) {
+  PAGED_CODE();
+
+  // Select top N entries by cycles
+  const AttrEntry* top_entries[kAttrpTopN] = {};
+  auto top_count = 0ul;
+  for (const auto& entry : table.entries) {
+    if (!entry.cr3) {
+      continue;
+    }
+    auto position = top_count;
+    while (position && top_entries[position - 1]->cycles < entry.cycles) {
+      if (position < kAttrpTopN) {
+        top_entries[position] = top_entries[position - 1];
+      }
+      position--;
+    }
+    if (position < kAttrpTopN) {
+      top_entries[position] = &entry;
+      top_count = min(top_count + 1, kAttrpTopN);
+    }
+  }
+
+  ULONG_PTR cr3s[kAttrpTopN] = {};
+  for (auto i = 0ul; i < top_count; ++i) {
+    cr3s[i] = top_entries[i]->cr3;
+  }
+  AttrProcessInfo infos[kAttrpTopN] = {};
+  AttrpResolveProcesses(cr3s, top_count, infos);
+
+  HYPERPLATFORM_LOG_INFO("%4s,%16s,%6s,%-15s,%15s,%20s,%s", "Rank", "CR3",
+                         "PID", "Image", "Exits", "Cycles",
+                         "Top Exit Reasons (Reason:Count)");
+  for (auto i = 0ul; i < top_count; ++i) {
+    const auto& entry = *top_entries[i];
+
+    // Select top exit reasons of the entry
+    char reasons[64] = {};
+    ULONG64 printed_below = MAXULONG64;
+    for (auto n = 0ul; n < kAttrpTopExitReasons; ++n) {
+      auto best_reason = kAttrpNumberOfExitReasons;
+      for (auto reason = 0ul; reason < kAttrpNumberOfExitReasons; ++reason) {
+        const auto count = entry.exit_counts[reason];
+        if (count && count < printed_below &&
+            (best_reason == kAttrpNumberOfExitReasons ||
+             count > entry.exit_counts[best_reason])) {
+          best_reason = reason;
+        }
+      }
+      if (best_reason == kAttrpNumberOfExitReasons) {
+        break;
+      }
+      printed_below = entry.exit_counts[best_reason];
+      const auto length = strlen(reasons);
+      RtlStringCchPrintfA(reasons + length, RTL_NUMBER_OF(reasons) - length,
+                          "%s%lu:%lu", (length) ? " " : "", best_reason,
+                          entry.exit_counts[best_reason]);
+    }
+
+    HYPERPLATFORM_LOG_INFO("%4lu,%16Ix,%6Iu,%-15s,%15I64u,%20I64u,%s", i + 1,
+                           entry.cr3, infos[i].pid, infos[i].image_name,
+                           entry.exit_count, entry.cycles, reasons);
+  }
+  if (table.overflow.exit_count) {
+    HYPERPLATFORM_LOG_INFO("%4s,%16s,%6s,%-15s,%15I64u,%20I64u,", "-", "-",
+                           "-", "(untracked)", table.overflow.exit_count,
+                           table.overflow.cycles);
+  }
+}
+
+// Finds processes whose CR3 values are the given ones. Processes are not found
+// when they have already exited, or when VM-exits occurred with user-mode CR3
+// under kernel virtual address shadowing.
+_Use_decl_annotations_ static void AttrpResolveProcesses(
+    const ULONG_PTR* cr3s, ULONG count, AttrProcessInfo* infos) {
+  PAGED_CODE();
+
+  static const ULONG kSystemProcessInformation = 5;
+
+  for (auto i = 0ul; i < count; ++i) {
+    infos[i].pid = nullptr;
+    RtlStringCchCopyA(infos[i].image_name, RTL_NUMBER_OF(infos[i].image_name),
+                      "(unknown)");
+  }
+
+  // Take a snapshot of the process list. It may grow between calls.
+  ULONG buffer_size = 0;
+  void* buffer = nullptr;
+  auto status = STATUS_INFO_LENGTH_MISMATCH;
+  while (status == STATUS_INFO_LENGTH_MISMATCH) {
+    if (buffer) {
+      ExFreePoolWithTag(buffer, kHyperPlatformCommonPoolTag);
+    }
+    buffer_size += PAGE_SIZE * 4;
+    buffer = ExAllocatePoolWithTag(PagedPool, buffer_size,
+                                   kHyperPlatformCommonPoolTag);
+    if (!buffer) {
+      return;
+    }
+    status = ZwQuerySystemInformation(kSystemProcessInformation, buffer,
+                                      buffer_size, &buffer_size);
+  }
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(buffer, kHyperPlatformCommonPoolTag);
+    return;
+  }
+
+  auto info = reinterpret_cast<AttrSystemProcessInformation*>(buffer);
+  for (;;) {
+    PEPROCESS process = nullptr;
+    if (info->unique_process_id &&
+        NT_SUCCESS(PsLookupProcessByProcessId(info->unique_process_id,
+                                              &process))) {
+      // Read CR3 of the process by attaching to it
+      KAPC_STATE apc_state = {};
+      KeStackAttachProcess(process, &apc_state);
+      const auto cr3 = AttrpNormalizeCr3(__readcr3());
+      KeUnstackDetachProcess(&apc_state);
+
+      for (auto i = 0ul; i < count; ++i) {
+        if (cr3s[i] != cr3) {
+          continue;
+        }
+        infos[i].pid = info->unique_process_id;
+        RtlStringCchCopyA(infos[i].image_name,
+                          RTL_NUMBER_OF(infos[i].image_name),
+                          reinterpret_cast<const char*>(
+                              PsGetProcessImageFileName(process)));
+      }
+      ObDereferenceObject(process);
+    }
+
+    if (!info->next_entry_offset) {
+      break;
+    }
+    info = reinterpret_cast<AttrSystemProcessInformation*>(
+        reinterpret_cast<UCHAR*>(info) + info->next_entry_offset);
+  }
+  ExFreePoolWithTag(buffer, kHyperPlatformCommonPoolTag);
+}
+
+// Adds statistics of the entry to the table
+_Use_decl_annotations_ static void AttrpMergeEntry(AttrTable* table,
+                                                   const AttrEntry& entry) {
+  auto merged = AttrpFindEntry(table, entry.cr3);
+  merged->exit_count += entry.exit_count;
+  merged->cycles += entry.cycles;
+  for (auto i = 0ul; i < kAttrpNumberOfExitReasons; ++i) {
+    merged->exit_counts[i] += entry.exit_counts[i];
+  }
+}
+
+// Returns an entry for the CR3 by allocating one if needed. Returns the
+// overflow entry if the table is full.
+_Use_decl_annotations_ static AttrEntry* AttrpFindEntry(AttrTable* table,
+                                                        ULONG_PTR cr3) {
+  if (cr3 == kAttrpOverflowCr3) {
+    return &table->overflow;
+  }
+
+  const auto hash = static_cast<ULONG>(cr3 >> PAGE_SHIFT);
+  for (auto i = 0ul; i < kAttrpNumberOfEntries; ++i) {
+    auto& entry = table->entries[(hash + i) & (kAttrpNumberOfEntries - 1)];
+    if (entry.cr3 == cr3) {
+      return &entry;
+    }
+    if (!entry.cr3) {
+      entry.cr3 = cr3;
+      return &entry;
+    }
+  }
+  table->overflow.cr3 = kAttrpOverflowCr3;
+  return &table->overflow;
+}
+
+// Clears PCID and flag bits so that CR3 values can be compared
+/*_Use_decl_annotations_*/ static ULONG_PTR AttrpNormalizeCr3(ULONG_PTR cr3) {
+  return cr3 & ~static_cast<ULONG_PTR>(PAGE_SIZE - 1);
+}
+
+// Frees AttrData and all tables referenced from it
+_Use_decl_annotations_ static void AttrpFreeAttrData(AttrData* data) {
+  for (auto i = 0ul; i < data->processor_count; ++i) {
+    if (data->processors[i]) {
+      ExFreePoolWithTag(data->processors[i], kHyperPlatformCommonPoolTag);
+    }
+  }
+  ExFreePoolWithTag(data, kHyperPlatformCommonPoolTag);
+}
+
+}  // extern "C"
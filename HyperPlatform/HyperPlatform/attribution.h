@@ -0,0 +1,66 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to per-process VM-exit attribution functions.
+
+#ifndef HYPERPLATFORM_ATTRIBUTION_H_
+#define HYPERPLATFORM_ATTRIBUTION_H_
+
+#include <fltKernel.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Starts attributing VM-exits to guest CR3 values
+/// @param report_interval  An interval to report top processes in seconds
+/// @return STATUS_SUCCESS on success
+///
+/// A report thread periodically resolves CR3 values with the most handler
+/// cycles to process IDs and names, and prints them out. A driver must call
+/// AttrTermination() when this function succeeded.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    AttrInitialization(_In_ ULONG report_interval);
+
+/// Prints out the last report and stops attributing VM-exits
+_IRQL_requires_max_(PASSIVE_LEVEL) void AttrTermination();
+
+/// Accounts a VM-exit to the guest CR3
+/// @param guest_cr3  A guest CR3 value when the VM-exit occurred
+/// @param exit_reason  A basic exit reason of the VM-exit
+/// @param cycles   TSC cycles spent to handle the VM-exit
+_IRQL_requires_min_(DISPATCH_LEVEL) void AttrRecordVmExit(
+    _In_ ULONG_PTR guest_cr3, _In_ USHORT exit_reason, _In_ ULONG64 cycles);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_ATTRIBUTION_H_
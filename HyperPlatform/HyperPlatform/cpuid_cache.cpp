@@ -0,0 +1,206 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements CPUID cache functions.
+
+#include "cpuid_cache.h"
+#include <intrin.h>
+#include "common.h"
+#include "ia32_type.h"
+#include "log.h"
+#include "util.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// How many leaves are cached in each of basic and extended ranges
+static const auto kCpuidCachepLeavesPerRange = 0x20ul;
+
+// The first leaf of the extended range
+static const auto kCpuidCachepExtendedBase = 0x80000000ul;
+
+// CR4.PKE and CPUID.(EAX=07H,ECX=0):ECX.OSPKE
+static const ULONG_PTR kCpuidCachepCr4Pke = 1ul << 22;
+static const unsigned int kCpuidCachepOspke = 1u << 4;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A result of CPUID for a leaf
+struct CpuidCacheEntry {
+  bool valid;
+  unsigned int cpu_info[4];
+};
+
+// Cached results of CPUID on a processor
+struct CpuidCache {
+  CpuidCacheEntry basic[kCpuidCachepLeavesPerRange];
+  CpuidCacheEntry extended[kCpuidCachepLeavesPerRange];
+  ULONG64 hits;
+  ULONG64 misses;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static bool CpuidCachepIsCacheable(_In_ ULONG function_id,
+                                   _In_ ULONG sub_function_id);
+
+static CpuidCacheEntry* CpuidCachepGetEntry(_In_ CpuidCache* cache,
+                                            _In_ ULONG function_id);
+
+static void CpuidCachepFillRange(_Inout_ CpuidCache* cache,
+                                 _In_ ULONG base_function_id);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates a cache and fills it with results of CPUID on the current
+// processor. Results are stored as returned by the processor, and masked with
+// CpuidCacheMaskLeaf() on each query since the mask depends on guest state.
+_Use_decl_annotations_ CpuidCache* CpuidCacheInitialization() {
+  const auto cache = reinterpret_cast<CpuidCache*>(ExAllocatePoolWithTag(
+      NonPagedPoolNx, sizeof(CpuidCache), kHyperPlatformCommonPoolTag));
+  if (!cache) {
+    return nullptr;
+  }
+  RtlZeroMemory(cache, sizeof(CpuidCache));
+
+  CpuidCachepFillRange(cache, 0);
+  CpuidCachepFillRange(cache, kCpuidCachepExtendedBase);
+  return cache;
+}
+
+// Reports a hit rate and de-allocates the cache
+_Use_decl_annotations_ void CpuidCacheTermination(CpuidCache* cache) {
+  const auto total = cache->hits + cache->misses;
+  HYPERPLATFORM_LOG_INFO(
+      "CPUID cache: %llu hits, %llu misses (%llu%% hit rate)", cache->hits,
+      cache->misses, (total) ? cache->hits * 100 / total : 0);
+  ExFreePoolWithTag(cache, kHyperPlatformCommonPoolTag);
+}
+
+// Returns a cached result of CPUID passed through CpuidCacheMaskLeaf()
+_Use_decl_annotations_ bool CpuidCacheQuery(CpuidCache* cache, int function_id,
+                                            int sub_function_id,
+                                            unsigned int* cpu_info) {
+  const auto leaf = static_cast<ULONG>(function_id);
+  const auto entry = CpuidCachepGetEntry(cache, leaf);
+  if (!entry || !entry->valid ||
+      !CpuidCachepIsCacheable(leaf, static_cast<ULONG>(sub_function_id))) {
+    cache->misses++;
+    return false;
+  }
+  cache->hits++;
+  RtlCopyMemory(cpu_info, entry->cpu_info, sizeof(entry->cpu_info));
+  CpuidCacheMaskLeaf(function_id, sub_function_id, cpu_info);
+  return true;
+}
+
+// Adjusts a result of CPUID. Add masks of leaves the VMM hides from a guest
+// here; none is masked currently.
+_Use_decl_annotations_ void CpuidCacheMaskLeaf(int function_id,
+                                               int sub_function_id,
+                                               unsigned int* cpu_info) {
+  // OSXSAVE and OSPKE reflect CR4 that a guest may change at any time
+  const auto leaf = static_cast<ULONG>(function_id);
+  if (leaf == 1) {
+    const Cr4 cr4 = {UtilVmRead(VmcsField::kGuestCr4)};
+    CpuFeaturesEcx ecx = {cpu_info[2]};
+    ecx.fields.osxsave = cr4.fields.osxsave;
+    cpu_info[2] = static_cast<unsigned int>(ecx.all);
+  } else if (leaf == 7 && sub_function_id == 0) {
+    const auto cr4 = UtilVmRead(VmcsField::kGuestCr4);
+    if (cr4 & kCpuidCachepCr4Pke) {
+      cpu_info[2] |= kCpuidCachepOspke;
+    } else {
+      cpu_info[2] &= ~kCpuidCachepOspke;
+    }
+  }
+}
+
+// Returns true if a result of the leaf does not change over time on the same
+// processor. Leaves indexed by ECX are not cached except sub-leaf 0 of the
+// leaf 7. Topology leaves (0BH and 1FH) return a value of ECX as is and are
+// left to the processor, and so is the leaf 0DH that depends on XCR0.
+_Use_decl_annotations_ static bool CpuidCachepIsCacheable(
+    ULONG function_id, ULONG sub_function_id) {
+  switch (function_id) {
+    case 0x0:
+    case 0x1:
+    case 0x2:
+    case 0x3:
+    case 0x5:
+    case 0x6:
+    case 0xa:
+    case 0x15:
+    case 0x16:
+      return true;
+    case 0x7:
+      return sub_function_id == 0;
+    default:
+      return function_id >= kCpuidCachepExtendedBase &&
+             function_id <= kCpuidCachepExtendedBase + 8;
+  }
+}
+
+// Returns an entry for the leaf, or nullptr if the leaf is out of the ranges
+_Use_decl_annotations_ static CpuidCacheEntry* CpuidCachepGetEntry(
+    CpuidCache* cache, ULONG function_id) {
+  if (function_id < kCpuidCachepLeavesPerRange) {
+    return &cache->basic[function_id];
+  }
+  if (function_id >= kCpuidCachepExtendedBase &&
+      function_id < kCpuidCachepExtendedBase + kCpuidCachepLeavesPerRange) {
+    return &cache->extended[function_id - kCpuidCachepExtendedBase];
+  }
+  return nullptr;
+}
+
+// Executes CPUID for all cacheable leaves in a range that starts with
+// base_function_id, which also reports the maximum leaf in the range
+_Use_decl_annotations_ static void CpuidCachepFillRange(
+    CpuidCache* cache, ULONG base_function_id) {
+  int cpu_info[4] = {};
+  __cpuidex(cpu_info, static_cast<int>(base_function_id), 0);
+  const auto max_function_id = static_cast<ULONG>(cpu_info[0]);
+  if (max_function_id < base_function_id) {
+    return;
+  }
+
+  const auto count = min(max_function_id - base_function_id + 1,
+                         kCpuidCachepLeavesPerRange);
+  for (auto i = 0ul; i < count; ++i) {
+    const auto function_id = base_function_id + i;
+    if (!CpuidCachepIsCacheable(function_id, 0)) {
+      continue;
+    }
+    const auto entry = CpuidCachepGetEntry(cache, function_id);
+    __cpuidex(reinterpret_cast<int*>(entry->cpu_info),
+              static_cast<int>(function_id), 0);
+    entry->valid = true;
+  }
+}
+
+}  // extern "C"
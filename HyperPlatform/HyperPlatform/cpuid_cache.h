@@ -0,0 +1,87 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to CPUID cache functions.
+
+#ifndef HYPERPLATFORM_CPUID_CACHE_H_
+#define HYPERPLATFORM_CPUID_CACHE_H_
+
+#include <fltKernel.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct CpuidCache;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Executes CPUID for stable leaves on the current processor and returns a
+/// cache of the results
+/// @return An allocated CpuidCache on success, or nullptr
+///
+/// This function must be called on a processor using the cache before the
+/// processor is virtualized. A driver must call CpuidCacheTermination() with a
+/// returned value when this function succeeded.
+_IRQL_requires_(DISPATCH_LEVEL) CpuidCache* CpuidCacheInitialization();
+
+/// Reports a hit rate of \a cache and de-allocates it
+/// @param cache   A returned value of CpuidCacheInitialization()
+void CpuidCacheTermination(_In_ CpuidCache* cache);
+
+/// Looks up a cached result of CPUID
+/// @param cache   A cache of the current processor
+/// @param function_id   A value of EAX
+/// @param sub_function_id   A value of ECX
+/// @param cpu_info   A pointer to receive EAX, EBX, ECX and EDX
+/// @return true if the result was cached, or false if a caller has to execute
+///         CPUID
+///
+/// A cached result has been adjusted with CpuidCacheMaskLeaf(). A caller
+/// executing CPUID on a miss must pass the result to CpuidCacheMaskLeaf().
+_IRQL_requires_min_(DISPATCH_LEVEL) bool CpuidCacheQuery(
+    _Inout_ CpuidCache* cache, _In_ int function_id, _In_ int sub_function_id,
+    _Out_writes_(4) unsigned int* cpu_info);
+
+/// Adjusts a result of CPUID before it is returned to a guest
+/// @param function_id   A value of EAX
+/// @param sub_function_id   A value of ECX
+/// @param cpu_info   EAX, EBX, ECX and EDX to adjust
+///
+/// Both cached and uncached results pass through this function, so a leaf
+/// masked here is masked regardless of caching. Bits reflecting guest's CR4 are
+/// computed from the current guest state.
+_IRQL_requires_min_(DISPATCH_LEVEL) void CpuidCacheMaskLeaf(
+    _In_ int function_id, _In_ int sub_function_id,
+    _Inout_updates_(4) unsigned int* cpu_info);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_CPUID_CACHE_H_
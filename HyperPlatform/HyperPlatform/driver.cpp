@@ -16,7 +16,14 @@
 #ifndef HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER
 #define HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER 1
 #endif  // HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER
+#include "attribution.h"
+#include "memory_usage.h"
+#include "pdpte_cache.h"
 #include "performance.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "span_trace.h"
+#include "working_set.h"
 #include "../../DdiMon/ddi_mon.h"
 
 extern "C" {
@@ -30,6 +37,16 @@ extern "C" {
 // constants and macros
 //
 
+// A path of a file to save samples taken by the profiler
+static const wchar_t kDriverpSampleFilePath[] = L"\\SystemRoot\\DdiMon.prof";
+
+// A path of a file to save spans recorded by the span recorder
+static const wchar_t kDriverpSpanFilePath[] = L"\\SystemRoot\\DdiMon.spans";
+
+// A path of a file to save memory snapshots
+static const wchar_t kDriverpSnapshotFilePath[] =
+    L"\\SystemRoot\\DdiMon.snap";
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
@@ -65,7 +82,6 @@ _IRQL_requires_max_(PASSIVE_LEVEL) bool DriverpIsSuppoetedOS();
 // A driver entry point
 _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
                                             PUNICODE_STRING registry_path) {
-  UNREFERENCED_PARAMETER(registry_path);
   PAGED_CODE();
 
   static const wchar_t kLogFilePath[] = L"\\SystemRoot\\DdiMon.log";
@@ -111,18 +127,130 @@ _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
     return status;
   }
 
+  // Allocate PDPTE caches used on x86 PAE
+  status = PdcInitialization();
+  if (!NT_SUCCESS(status)) {
+    UtilTermination();
+    PerfTermination();
+    LogTermination();
+    return status;
+  }
+
+  // Start recording spans if a SpanTrace value under the registry key of the
+  // driver is non-zero. It is done before the VMM starts so that recording
+  // does not race with initialization.
+  if (UtilQueryRegistryDword(registry_path, L"SpanTrace")) {
+    status = SpanInitialization();
+    if (!NT_SUCCESS(status)) {
+      PdcTermination();
+      UtilTermination();
+      PerfTermination();
+      LogTermination();
+      return status;
+    }
+  }
+
   // Virtualize all processors
   status = VmInitialization();
   if (!NT_SUCCESS(status)) {
+    SpanTermination(nullptr);
+    PdcTermination();
     UtilTermination();
     PerfTermination();
     LogTermination();
     return status;
   }
 
-  status = DdimonInitialization(driver_object);
+  // Start sampling if the frequency is given via the SamplingFrequency value
+  // and optionally SamplingStack value under the registry key of the driver
+  const auto sampling_frequency =
+      UtilQueryRegistryDword(registry_path, L"SamplingFrequency");
+  if (sampling_frequency) {
+    const auto capture_stack =
+        UtilQueryRegistryDword(registry_path, L"SamplingStack") != 0;
+    status = ProfInitialization(sampling_frequency, capture_stack);
+    if (!NT_SUCCESS(status)) {
+      VmTermination();
+      SpanTermination(nullptr);
+      PdcTermination();
+      UtilTermination();
+      PerfTermination();
+      LogTermination();
+      return status;
+    }
+  }
+
+  // Start attributing VM-exits to processes if the interval in seconds is given
+  // via the AttributionInterval value under the registry key of the driver
+  const auto attribution_interval =
+      UtilQueryRegistryDword(registry_path, L"AttributionInterval");
+  if (attribution_interval) {
+    status = AttrInitialization(attribution_interval);
+    if (!NT_SUCCESS(status)) {
+      ProfTermination(nullptr);
+      VmTermination();
+      SpanTermination(nullptr);
+      PdcTermination();
+      UtilTermination();
+      PerfTermination();
+      LogTermination();
+      return status;
+    }
+  }
+
+  // Start taking memory snapshots if the interval in seconds is given via the
+  // SnapshotInterval value under the registry key of the driver. Snapshots and
+  // working-set estimation cannot be used together as both consume EPT dirty
+  // flags.
+  const auto snapshot_interval =
+      UtilQueryRegistryDword(registry_path, L"SnapshotInterval");
+  if (snapshot_interval) {
+    status = SnapInitialization(snapshot_interval, kDriverpSnapshotFilePath);
+    if (!NT_SUCCESS(status)) {
+      AttrTermination();
+      ProfTermination(nullptr);
+      VmTermination();
+      SpanTermination(nullptr);
+      PdcTermination();
+      UtilTermination();
+      PerfTermination();
+      LogTermination();
+      return status;
+    }
+  }
+
+  // Start estimating the working-set if the interval in seconds is given via
+  // the WorkingSetInterval value under the registry key of the driver
+  const auto working_set_interval =
+      UtilQueryRegistryDword(registry_path, L"WorkingSetInterval");
+  if (working_set_interval && snapshot_interval) {
+    HYPERPLATFORM_LOG_WARN(
+        "WorkingSetInterval is ignored while SnapshotInterval is set.");
+  } else if (working_set_interval) {
+    status = WsInitialization(working_set_interval);
+    if (!NT_SUCCESS(status)) {
+      SnapTermination();
+      AttrTermination();
+      ProfTermination(nullptr);
+      VmTermination();
+      SpanTermination(nullptr);
+      PdcTermination();
+      UtilTermination();
+      PerfTermination();
+      LogTermination();
+      return status;
+    }
+  }
+
+  status = DdimonInitialization(driver_object, registry_path);
   if (!NT_SUCCESS(status)) {
+    WsTermination();
+    SnapTermination();
+    AttrTermination();
+    ProfTermination(nullptr);
     VmTermination();
+    SpanTermination(nullptr);
+    PdcTermination();
     UtilTermination();
     PerfTermination();
     LogTermination();
@@ -135,6 +263,7 @@ _Use_decl_annotations_ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_object,
   }
 
   HYPERPLATFORM_LOG_INFO("The VMM has been installed.");
+  MemUsageReport();
   return status;
 }
 
@@ -147,9 +276,16 @@ _Use_decl_annotations_ static void DriverpDriverUnload(
   HYPERPLATFORM_COMMON_DBG_BREAK();
 
   DdimonTermination();
+  WsTermination();
+  SnapTermination();
+  AttrTermination();
+  ProfTermination(kDriverpSampleFilePath);
   VmTermination();
+  SpanTermination(kDriverpSpanFilePath);
+  PdcTermination();
   UtilTermination();
   PerfTermination();
+  MemUsageReport();
   LogTermination();
 }
 
@@ -9,12 +9,17 @@
 #include "asm.h"
 #include "common.h"
 #include "log.h"
+#include "memory_usage.h"
 #include "util.h"
 #ifndef HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER
 #define HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER 1
 #endif  // HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER
+#include "pdpte_cache.h"
 #include "performance.h"
 #include "../../DdiMon/shadow_bp.h"
+#include "../../DdiMon/watchpoint.h"
+#include "../../DdiMon/coverage.h"
+#include "../../DdiMon/integrity.h"
 
 extern "C" {
 ////////////////////////////////////////////////////////////////////////////////
@@ -50,22 +55,51 @@ static const auto kVmxpPtiShift = 12ull;
 // Use 9 bits; 0b0000_0000_0000_0000_0000_0000_0001_1111_1111
 static const auto kVmxpPtxMask = 0x1ffull;
 
-// How many EPT entries are preallocated. When the number exceeds it, the
+// How many EPT tables are left unused in chunks when EPT is built so that
+// tables can be added in VMX-root mode. When the number exceeds it, the
 // hypervisor issues a bugcheck.
-static const auto kVmxpNumberOfPreallocatedEntries = 50;
+static const auto kVmxpNumberOfPreallocatedEntries = 50l;
+
+// A size of a physically contiguous chunk EPT tables are carved from
+static const auto kEptpChunkSize = 2ul * 1024 * 1024;
+
+// How many EPT tables are carved from a chunk
+static const auto kEptpTablesPerChunk =
+    static_cast<long>(kEptpChunkSize / PAGE_SIZE);
+
+// How many chunks can be allocated. They hold enough tables to map 1 TB of
+// physical memory with 4 KB pages.
+static const auto kEptpMaxChunks = 512l;
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
 //
 
+// A physically contiguous chunk EPT tables are carved from
+struct EptTableChunk {
+  EptCommonEntry *va_base;  // A virtual address of the chunk
+  ULONG64 pa_base;          // A physical address of the chunk
+};
+
 // EPT related data stored in ProcessorSharedData
 struct EptData {
   EptPointer *ept_pointer;
   EptCommonEntry *ept_pml4;
 
-  EptCommonEntry **preallocated_entries;  // An array of pre-allocated entries
-  volatile long preallocated_entries_count;  // # of used pre-allocated entries
+  // Tables are carved from chunks in order, and none of them is freed until
+  // all chunks are freed at once
+  EptTableChunk chunks[kEptpMaxChunks];  // Allocated chunks
+  long chunk_count;                      // # of allocated chunks
+  volatile long used_tables;             // # of tables carved from chunks
+  long initial_used_tables;              // # of tables used when EPT was built
+
+  volatile long generation;  // Bumped on each change of EPT entries
+
+  // Generations each processor invalidated cached translations at, indexed by
+  // a processor number
+  volatile long *synchronized_generations;
+  ULONG processor_count;  // # of elements in synchronized_generations
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -73,25 +107,25 @@ struct EptData {
 // prototypes
 //
 
-_When_(ept_data == nullptr,
-       _IRQL_requires_max_(DISPATCH_LEVEL)) static EptCommonEntry
+_When_(can_grow, _IRQL_requires_max_(PASSIVE_LEVEL)) static EptCommonEntry
     *EptpConstructTables(_In_ EptCommonEntry *table, _In_ ULONG table_level,
-                         _In_ ULONG64 physical_address,
-                         _In_opt_ EptData *ept_data);
-
-static void EptpDestructTables(_In_ EptCommonEntry *table,
-                               _In_ ULONG table_level);
+                         _In_ ULONG64 physical_address, _In_ EptData *ept_data,
+                         _In_ bool can_grow);
 
-_Must_inspect_result_ __drv_allocatesMem(Mem)
-    _When_(ept_data == nullptr,
-           _IRQL_requires_max_(DISPATCH_LEVEL)) static EptCommonEntry
-        *EptpAllocateEptEntry(_In_opt_ EptData *ept_data);
+_Must_inspect_result_ _When_(
+    can_grow, _IRQL_requires_max_(PASSIVE_LEVEL)) static EptCommonEntry
+    *EptpAllocateEptEntry(_In_ EptData *ept_data, _In_ bool can_grow);
 
-static EptCommonEntry *EptpAllocateEptEntryFromPreAllocated(
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool EptpAddChunk(
     _In_ EptData *ept_data);
 
-_Must_inspect_result_ __drv_allocatesMem(Mem) _IRQL_requires_max_(
-    DISPATCH_LEVEL) static EptCommonEntry *EptpAllocateEptEntryFromPool();
+static void EptpFreeChunks(_In_ EptData *ept_data);
+
+static ULONG64 EptpPaFromTable(_In_ const EptData *ept_data,
+                               _In_ const EptCommonEntry *table);
+
+static EptCommonEntry *EptpTableFromPfn(_In_ const EptData *ept_data,
+                                        _In_ ULONG64 pfn);
 
 static void EptpInitTableEntry(_In_ EptCommonEntry *Entry,
                                _In_ ULONG table_level,
@@ -109,7 +143,8 @@ static bool EptpIsDeviceMemory(_In_ ULONG64 physical_address);
 
 static EptCommonEntry *EptpGetEptPtEntry(_In_ EptCommonEntry *table,
                                          _In_ ULONG table_level,
-                                         _In_ ULONG64 physical_address);
+                                         _In_ ULONG64 physical_address,
+                                         _In_ const EptData *ept_data);
 
 static bool EptpIsCopiedKiInterruptTemplate(_In_ void *virtual_address);
 
@@ -119,14 +154,27 @@ _IRQL_requires_min_(DISPATCH_LEVEL) static void EptpAddDisabledEntry(
 _IRQL_requires_min_(DISPATCH_LEVEL) static void EptpResetDisabledEntriesUnsafe(
     _In_ EptData *ept_data);
 
-static void EptpFreeUnusedPreAllocatedEntries(
-    _Pre_notnull_ __drv_freesMem(Mem) EptCommonEntry **preallocated_entries,
-    _In_ long used_count);
+_IRQL_requires_(DISPATCH_LEVEL) static NTSTATUS
+    EptpEnableDirtyTrackingCallback(_In_opt_ void *context);
+
+_IRQL_requires_(DISPATCH_LEVEL) static NTSTATUS
+    EptpDisableDirtyTrackingCallback(_In_opt_ void *context);
+
+_IRQL_requires_(DISPATCH_LEVEL) static NTSTATUS
+    EptpFlushTranslationsCallback(_In_opt_ void *context);
+
+_IRQL_requires_min_(DISPATCH_LEVEL) static void EptpSetAccessedAndDirtyFlags(
+    _In_ EptData *ept_data, _In_ bool enable);
 
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(INIT, EptIsEptAvailable)
 #pragma alloc_text(INIT, EptGetEptPointer)
 #pragma alloc_text(INIT, EptInitialization)
+#pragma alloc_text(INIT, EptpAddChunk)
+#pragma alloc_text(INIT, EptIsAccessedAndDirtyFlagsAvailable)
+#pragma alloc_text(PAGE, EptEnableDirtyTracking)
+#pragma alloc_text(PAGE, EptDisableDirtyTracking)
+#pragma alloc_text(PAGE, EptFlushTranslations)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -175,43 +223,41 @@ _Use_decl_annotations_ ULONG64 EptGetEptPointer(EptData *ept_data) {
   return ept_data->ept_pointer->all;
 }
 
-// Builds EPT, allocates pre-allocated enties, initializes and returns EptData
+// Builds EPT, leaves tables for VMX-root mode, initializes and returns EptData
 _Use_decl_annotations_ EptData *EptInitialization() {
   PAGED_CODE();
 
   static const auto kEptPageWalkLevel = 4ul;
 
   // Allocate ept_data
-  const auto ept_data = reinterpret_cast<EptData *>(ExAllocatePoolWithTag(
-      NonPagedPoolNx, sizeof(EptData), kHyperPlatformCommonPoolTag));
+  const auto ept_data = reinterpret_cast<EptData *>(MemUsageAllocate(
+      NonPagedPoolNx, sizeof(EptData), MemUsageSubsystem::kEpt));
   if (!ept_data) {
     return nullptr;
   }
   RtlZeroMemory(ept_data, sizeof(EptData));
 
   // Allocate EptPointer
-  const auto ept_poiner = reinterpret_cast<EptPointer *>(ExAllocatePoolWithTag(
-      NonPagedPoolNx, PAGE_SIZE, kHyperPlatformCommonPoolTag));
+  const auto ept_poiner = reinterpret_cast<EptPointer *>(
+      MemUsageAllocate(NonPagedPoolNx, PAGE_SIZE, MemUsageSubsystem::kEpt));
   if (!ept_poiner) {
-    ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
+    MemUsageFree(ept_data, sizeof(EptData), MemUsageSubsystem::kEpt);
     return nullptr;
   }
   RtlZeroMemory(ept_poiner, PAGE_SIZE);
 
   // Allocate EPT_PML4 and initialize EptPointer
-  const auto ept_pml4 =
-      reinterpret_cast<EptCommonEntry *>(ExAllocatePoolWithTag(
-          NonPagedPoolNx, PAGE_SIZE, kHyperPlatformCommonPoolTag));
+  const auto ept_pml4 = EptpAllocateEptEntry(ept_data, true);
   if (!ept_pml4) {
-    ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
-    ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
+    MemUsageFree(ept_poiner, PAGE_SIZE, MemUsageSubsystem::kEpt);
+    MemUsageFree(ept_data, sizeof(EptData), MemUsageSubsystem::kEpt);
     return nullptr;
   }
-  RtlZeroMemory(ept_pml4, PAGE_SIZE);
   ept_poiner->fields.memory_type =
       static_cast<ULONG64>(memory_type::kWriteBack);
   ept_poiner->fields.page_walk_length = kEptPageWalkLevel - 1;
-  ept_poiner->fields.pml4_address = UtilPfnFromPa(UtilPaFromVa(ept_pml4));
+  ept_poiner->fields.pml4_address =
+      UtilPfnFromPa(EptpPaFromTable(ept_data, ept_pml4));
 
   // Initialize all EPT entries for all physical memory pages
   const auto pm_ranges = UtilGetPhysicalMemoryRanges();
@@ -222,11 +268,11 @@ _Use_decl_annotations_ EptData *EptInitialization() {
     for (auto page_index = 0ull; page_index < run->page_count; ++page_index) {
       const auto indexed_addr = base_addr + page_index * PAGE_SIZE;
       const auto ept_pt_entry =
-          EptpConstructTables(ept_pml4, 4, indexed_addr, nullptr);
+          EptpConstructTables(ept_pml4, 4, indexed_addr, ept_data, true);
       if (!ept_pt_entry) {
-        EptpDestructTables(ept_pml4, 4);
-        ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
-        ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
+        EptpFreeChunks(ept_data);
+        MemUsageFree(ept_poiner, PAGE_SIZE, MemUsageSubsystem::kEpt);
+        MemUsageFree(ept_data, sizeof(EptData), MemUsageSubsystem::kEpt);
         return nullptr;
       }
     }
@@ -236,100 +282,101 @@ _Use_decl_annotations_ EptData *EptInitialization() {
   // for some reasons, or else, system hangs.
   const Ia32ApicBaseMsr apic_msr = {UtilReadMsr64(Msr::kIa32ApicBase)};
   if (!EptpConstructTables(ept_pml4, 4, apic_msr.fields.apic_base * PAGE_SIZE,
-                           nullptr)) {
-    EptpDestructTables(ept_pml4, 4);
-    ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
-    ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
+                           ept_data, true)) {
+    EptpFreeChunks(ept_data);
+    MemUsageFree(ept_poiner, PAGE_SIZE, MemUsageSubsystem::kEpt);
+    MemUsageFree(ept_data, sizeof(EptData), MemUsageSubsystem::kEpt);
     return nullptr;
   }
 
-  // Allocate preallocated_entries
-  const auto preallocated_entries_size =
-      sizeof(EptCommonEntry *) * kVmxpNumberOfPreallocatedEntries;
-  const auto preallocated_entries = reinterpret_cast<EptCommonEntry **>(
-      ExAllocatePoolWithTag(NonPagedPoolNx, preallocated_entries_size,
-                            kHyperPlatformCommonPoolTag));
-  if (!preallocated_entries) {
-    EptpDestructTables(ept_pml4, 4);
-    ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
-    ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
+  // Make sure that enough tables are left unused for VMX-root mode where no
+  // chunk can be allocated
+  const auto unused_tables =
+      ept_data->chunk_count * kEptpTablesPerChunk - ept_data->used_tables;
+  if (unused_tables < kVmxpNumberOfPreallocatedEntries &&
+      !EptpAddChunk(ept_data)) {
+    EptpFreeChunks(ept_data);
+    MemUsageFree(ept_poiner, PAGE_SIZE, MemUsageSubsystem::kEpt);
+    MemUsageFree(ept_data, sizeof(EptData), MemUsageSubsystem::kEpt);
     return nullptr;
   }
-  RtlZeroMemory(preallocated_entries, preallocated_entries_size);
-
-  // And fill preallocated_entries with newly created entries
-  for (auto i = 0ul; i < kVmxpNumberOfPreallocatedEntries; ++i) {
-    const auto ept_entry = EptpAllocateEptEntry(nullptr);
-    if (!ept_entry) {
-      EptpFreeUnusedPreAllocatedEntries(preallocated_entries, 0);
-      EptpDestructTables(ept_pml4, 4);
-      ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
-      ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
-      return nullptr;
-    }
-    preallocated_entries[i] = ept_entry;
+
+  const auto processor_count =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto generations_size = sizeof(long) * processor_count;
+  const auto generations = reinterpret_cast<long *>(MemUsageAllocate(
+      NonPagedPoolNx, generations_size, MemUsageSubsystem::kEpt));
+  if (!generations) {
+    EptpFreeChunks(ept_data);
+    MemUsageFree(ept_poiner, PAGE_SIZE, MemUsageSubsystem::kEpt);
+    MemUsageFree(ept_data, sizeof(EptData), MemUsageSubsystem::kEpt);
+    return nullptr;
   }
+  RtlZeroMemory(generations, generations_size);
 
   // Initialization completed
+  ept_data->synchronized_generations = generations;
+  ept_data->processor_count = processor_count;
   ept_data->ept_pointer = ept_poiner;
   ept_data->ept_pml4 = ept_pml4;
-  ept_data->preallocated_entries = preallocated_entries;
-  ept_data->preallocated_entries_count = 0;
+  ept_data->initial_used_tables = ept_data->used_tables;
+  HYPERPLATFORM_LOG_DEBUG("EPT tables = %ld in %ld chunks",
+                          ept_data->used_tables, ept_data->chunk_count);
   return ept_data;
 }
 
 // Allocate and initialize all EPT entries associated with the physical_address
 _Use_decl_annotations_ static EptCommonEntry *EptpConstructTables(
     EptCommonEntry *table, ULONG table_level, ULONG64 physical_address,
-    EptData *ept_data) {
+    EptData *ept_data, bool can_grow) {
   switch (table_level) {
     case 4: {
       // table == PML4 (512 GB)
       const auto pxe_index = EptpAddressToPxeIndex(physical_address);
       const auto ept_pml4_entry = &table[pxe_index];
       if (!ept_pml4_entry->all) {
-        const auto ept_pdpt = EptpAllocateEptEntry(ept_data);
+        const auto ept_pdpt = EptpAllocateEptEntry(ept_data, can_grow);
         if (!ept_pdpt) {
           return nullptr;
         }
-        EptpInitTableEntry(ept_pml4_entry, table_level, UtilPaFromVa(ept_pdpt));
+        EptpInitTableEntry(ept_pml4_entry, table_level,
+                           EptpPaFromTable(ept_data, ept_pdpt));
       }
       return EptpConstructTables(
-          reinterpret_cast<EptCommonEntry *>(
-              UtilVaFromPfn(ept_pml4_entry->fields.physial_address)),
-          table_level - 1, physical_address, ept_data);
+          EptpTableFromPfn(ept_data, ept_pml4_entry->fields.physial_address),
+          table_level - 1, physical_address, ept_data, can_grow);
     }
     case 3: {
       // table == PDPT (1 GB)
       const auto ppe_index = EptpAddressToPpeIndex(physical_address);
       const auto ept_pdpt_entry = &table[ppe_index];
       if (!ept_pdpt_entry->all) {
-        const auto ept_pdt = EptpAllocateEptEntry(ept_data);
+        const auto ept_pdt = EptpAllocateEptEntry(ept_data, can_grow);
         if (!ept_pdt) {
           return nullptr;
         }
-        EptpInitTableEntry(ept_pdpt_entry, table_level, UtilPaFromVa(ept_pdt));
+        EptpInitTableEntry(ept_pdpt_entry, table_level,
+                           EptpPaFromTable(ept_data, ept_pdt));
       }
       return EptpConstructTables(
-          reinterpret_cast<EptCommonEntry *>(
-              UtilVaFromPfn(ept_pdpt_entry->fields.physial_address)),
-          table_level - 1, physical_address, ept_data);
+          EptpTableFromPfn(ept_data, ept_pdpt_entry->fields.physial_address),
+          table_level - 1, physical_address, ept_data, can_grow);
     }
     case 2: {
       // table == PDT (2 MB)
       const auto pde_index = EptpAddressToPdeIndex(physical_address);
       const auto ept_pdt_entry = &table[pde_index];
       if (!ept_pdt_entry->all) {
-        const auto ept_pt = EptpAllocateEptEntry(ept_data);
+        const auto ept_pt = EptpAllocateEptEntry(ept_data, can_grow);
         if (!ept_pt) {
           return nullptr;
         }
-        EptpInitTableEntry(ept_pdt_entry, table_level, UtilPaFromVa(ept_pt));
+        EptpInitTableEntry(ept_pdt_entry, table_level,
+                           EptpPaFromTable(ept_data, ept_pt));
       }
       return EptpConstructTables(
-          reinterpret_cast<EptCommonEntry *>(
-              UtilVaFromPfn(ept_pdt_entry->fields.physial_address)),
-          table_level - 1, physical_address, ept_data);
+          EptpTableFromPfn(ept_data, ept_pdt_entry->fields.physial_address),
+          table_level - 1, physical_address, ept_data, can_grow);
     }
     case 1: {
       // table == PT (4 KB)
@@ -345,41 +392,88 @@ _Use_decl_annotations_ static EptCommonEntry *EptpConstructTables(
   }
 }
 
-// Return a new EPT entry either by creating new one or from pre-allocated ones
+// Return a new zeroed EPT table carved from chunks. A new chunk is allocated
+// when chunks are exhausted only if can_grow is true since it cannot be done
+// in VMX-root mode.
 _Use_decl_annotations_ static EptCommonEntry *EptpAllocateEptEntry(
-    EptData *ept_data) {
-  if (ept_data) {
-    return EptpAllocateEptEntryFromPreAllocated(ept_data);
-  } else {
-    return EptpAllocateEptEntryFromPool();
+    EptData *ept_data, bool can_grow) {
+  static_assert(512 * sizeof(EptCommonEntry) == PAGE_SIZE, "Size check");
+
+  const auto index = InterlockedIncrement(&ept_data->used_tables) - 1;
+  if (index >= ept_data->chunk_count * kEptpTablesPerChunk) {
+    if (!can_grow) {
+      HYPERPLATFORM_COMMON_BUG_CHECK(
+          HyperPlatformBugCheck::kExhaustedPreallocatedEntries,
+          index - ept_data->initial_used_tables,
+          reinterpret_cast<ULONG_PTR>(ept_data), 0);
+    }
+    if (!EptpAddChunk(ept_data)) {
+      InterlockedDecrement(&ept_data->used_tables);
+      return nullptr;
+    }
   }
+  const auto chunk = &ept_data->chunks[index / kEptpTablesPerChunk];
+  return chunk->va_base + (index % kEptpTablesPerChunk) * 512;
 }
 
-// Return a new EPT entry from pre-allocated ones.
-_Use_decl_annotations_ static EptCommonEntry *
-EptpAllocateEptEntryFromPreAllocated(EptData *ept_data) {
-  const auto count =
-      InterlockedIncrement(&ept_data->preallocated_entries_count);
-  if (count > kVmxpNumberOfPreallocatedEntries) {
-    HYPERPLATFORM_COMMON_BUG_CHECK(
-        HyperPlatformBugCheck::kExhaustedPreallocatedEntries, count,
-        reinterpret_cast<ULONG_PTR>(ept_data), 0);
+// Allocates a zeroed chunk and records its physical address
+_Use_decl_annotations_ static bool EptpAddChunk(EptData *ept_data) {
+  PAGED_CODE();
+
+  if (ept_data->chunk_count == kEptpMaxChunks) {
+    return false;
   }
-  return ept_data->preallocated_entries[count - 1];
+  const auto va_base = reinterpret_cast<EptCommonEntry *>(
+      MemUsageAllocateContiguous(kEptpChunkSize, MemUsageSubsystem::kEpt));
+  if (!va_base) {
+    return false;
+  }
+  RtlZeroMemory(va_base, kEptpChunkSize);
+
+  const auto chunk = &ept_data->chunks[ept_data->chunk_count];
+  chunk->va_base = va_base;
+  chunk->pa_base = UtilPaFromVa(va_base);
+  ept_data->chunk_count++;
+  return true;
 }
 
-// Return a new EPT entry either by creating new one
-_Use_decl_annotations_ static EptCommonEntry *EptpAllocateEptEntryFromPool() {
-  static const auto kAllocSize = 512 * sizeof(EptCommonEntry);
-  static_assert(kAllocSize == PAGE_SIZE, "Size check");
+// Frees all chunks and thereby all EPT tables at once
+_Use_decl_annotations_ static void EptpFreeChunks(EptData *ept_data) {
+  for (auto i = 0l; i < ept_data->chunk_count; ++i) {
+    MemUsageFreeContiguous(ept_data->chunks[i].va_base, kEptpChunkSize,
+                           MemUsageSubsystem::kEpt);
+  }
+  ept_data->chunk_count = 0;
+}
 
-  const auto entry = reinterpret_cast<EptCommonEntry *>(ExAllocatePoolWithTag(
-      NonPagedPoolNx, kAllocSize, kHyperPlatformCommonPoolTag));
-  if (!entry) {
-    return nullptr;
+// Returns a physical address of an EPT table carved from chunks
+_Use_decl_annotations_ static ULONG64 EptpPaFromTable(
+    const EptData *ept_data, const EptCommonEntry *table) {
+  for (auto i = 0l; i < ept_data->chunk_count; ++i) {
+    const auto chunk = &ept_data->chunks[i];
+    const auto offset = reinterpret_cast<ULONG_PTR>(table) -
+                        reinterpret_cast<ULONG_PTR>(chunk->va_base);
+    if (offset < kEptpChunkSize) {
+      return chunk->pa_base + offset;
+    }
+  }
+  HYPERPLATFORM_COMMON_DBG_BREAK();
+  return 0;
+}
+
+// Returns an EPT table carved from chunks by its page frame number
+_Use_decl_annotations_ static EptCommonEntry *EptpTableFromPfn(
+    const EptData *ept_data, ULONG64 pfn) {
+  const auto pa = UtilPaFromPfn(static_cast<PFN_NUMBER>(pfn));
+  for (auto i = 0l; i < ept_data->chunk_count; ++i) {
+    const auto chunk = &ept_data->chunks[i];
+    const auto offset = pa - chunk->pa_base;
+    if (offset < kEptpChunkSize) {
+      return chunk->va_base + offset / sizeof(EptCommonEntry);
+    }
   }
-  RtlZeroMemory(entry, kAllocSize);
-  return entry;
+  HYPERPLATFORM_COMMON_DBG_BREAK();
+  return nullptr;
 }
 
 // Initialize an EPT entry with a "pass through" attribute
@@ -440,7 +534,7 @@ _Use_decl_annotations_ void EptHandleEptViolation(EptData *ept_data) {
     HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE();
     // HYPERPLATFORM_LOG_DEBUG_SAFE(
     //    "[INIT] Dev VA = %p, PA = %016llx, Used = %d",
-    //    0, fault_pa, ept_data->preallocated_entries_count);
+    //    0, fault_pa, ept_data->used_tables);
 
     if (!IsReleaseBuild()) {
       const auto is_device_memory = EptpIsDeviceMemory(fault_pa);
@@ -452,17 +546,31 @@ _Use_decl_annotations_ void EptHandleEptViolation(EptData *ept_data) {
     // with the same fault_pa, this function may create multiple EPT entries for
     // one physical address and leads memory leak. This call should probably be
     // guarded by a spin-lock but is not yet just because impact is so small.
-    EptpConstructTables(ept_data->ept_pml4, 4, fault_pa, ept_data);
+    EptpConstructTables(ept_data->ept_pml4, 4, fault_pa, ept_data, false);
 
-    UtilInveptAll();
+    EptCommitChange(ept_data);
   } else if (exit_qualification.fields.caused_by_translation) {
-    // Tell EPT violation when it is caused due to read or write violation.
+    // Tell EPT violation when it is caused due to read, write or execute
+    // violation.
     const auto read_failure = exit_qualification.fields.read_access &&
                               !exit_qualification.fields.ept_readable;
     const auto write_failure = exit_qualification.fields.write_access &&
                                !exit_qualification.fields.ept_writeable;
+    const auto execute_failure = exit_qualification.fields.execute_access &&
+                                 !exit_qualification.fields.ept_executable;
     if (read_failure || write_failure) {
-      SbpHandleEptViolation(ept_data, fault_va);
+      const auto handled =
+          SbpHandleEptViolation(ept_data, fault_va, write_failure) ||
+          WpHandleEptViolation(ept_data, fault_va, fault_pa, write_failure) ||
+          (write_failure &&
+           (IntegHandleEptViolation(ept_data, fault_va, fault_pa) ||
+            PdcHandleEptViolation(ept_data, fault_pa)));
+      if (!handled) {
+        HYPERPLATFORM_LOG_DEBUG_SAFE("[IGNR] OTH VA = %p, PA = %016llx",
+                                     fault_va, fault_pa);
+      }
+    } else if (execute_failure) {
+      CovHandleEptViolation(ept_data, fault_va, fault_pa);
     } else {
       HYPERPLATFORM_LOG_DEBUG_SAFE("[IGNR] OTH VA = %p, PA = %016llx", fault_va,
         fault_pa);
@@ -493,36 +601,37 @@ _Use_decl_annotations_ static bool EptpIsDeviceMemory(
 // Returns an EPT entry corresponds to the physical_address
 _Use_decl_annotations_ EptCommonEntry *EptGetEptPtEntry(
     EptData *ept_data, ULONG64 physical_address) {
-  return EptpGetEptPtEntry(ept_data->ept_pml4, 4, physical_address);
+  return EptpGetEptPtEntry(ept_data->ept_pml4, 4, physical_address, ept_data);
 }
 
 // Returns an EPT entry corresponds to the physical_address
 _Use_decl_annotations_ static EptCommonEntry *EptpGetEptPtEntry(
-    EptCommonEntry *table, ULONG table_level, ULONG64 physical_address) {
+    EptCommonEntry *table, ULONG table_level, ULONG64 physical_address,
+    const EptData *ept_data) {
   switch (table_level) {
     case 4: {
       // table == PML4
       const auto pxe_index = EptpAddressToPxeIndex(physical_address);
       const auto ept_pml4_entry = &table[pxe_index];
-      return EptpGetEptPtEntry(reinterpret_cast<EptCommonEntry *>(UtilVaFromPfn(
-                                   ept_pml4_entry->fields.physial_address)),
-                               table_level - 1, physical_address);
+      return EptpGetEptPtEntry(
+          EptpTableFromPfn(ept_data, ept_pml4_entry->fields.physial_address),
+          table_level - 1, physical_address, ept_data);
     }
     case 3: {
       // table == PDPT
       const auto ppe_index = EptpAddressToPpeIndex(physical_address);
       const auto ept_pdpt_entry = &table[ppe_index];
-      return EptpGetEptPtEntry(reinterpret_cast<EptCommonEntry *>(UtilVaFromPfn(
-                                   ept_pdpt_entry->fields.physial_address)),
-                               table_level - 1, physical_address);
+      return EptpGetEptPtEntry(
+          EptpTableFromPfn(ept_data, ept_pdpt_entry->fields.physial_address),
+          table_level - 1, physical_address, ept_data);
     }
     case 2: {
       // table == PDT
       const auto pde_index = EptpAddressToPdeIndex(physical_address);
       const auto ept_pdt_entry = &table[pde_index];
-      return EptpGetEptPtEntry(reinterpret_cast<EptCommonEntry *>(UtilVaFromPfn(
-                                   ept_pdt_entry->fields.physial_address)),
-                               table_level - 1, physical_address);
+      return EptpGetEptPtEntry(
+          EptpTableFromPfn(ept_data, ept_pdt_entry->fields.physial_address),
+          table_level - 1, physical_address, ept_data);
     }
     case 1: {
       // table == PT
@@ -536,59 +645,137 @@ _Use_decl_annotations_ static EptCommonEntry *EptpGetEptPtEntry(
   }
 }
 
-// Frees all EPT stuff
-_Use_decl_annotations_ void EptTermination(EptData *ept_data) {
-  HYPERPLATFORM_LOG_DEBUG("Used pre-allocated entries  = %2d / %2d",
-                          ept_data->preallocated_entries_count,
-                          kVmxpNumberOfPreallocatedEntries);
-
-  EptpFreeUnusedPreAllocatedEntries(ept_data->preallocated_entries,
-                                    ept_data->preallocated_entries_count);
-  EptpDestructTables(ept_data->ept_pml4, 4);
-  ExFreePoolWithTag(ept_data->ept_pointer, kHyperPlatformCommonPoolTag);
-  ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
+// Bumps a generation so that all processors invalidate cached translations
+_Use_decl_annotations_ long EptCommitChange(EptData *ept_data) {
+  return InterlockedIncrement(&ept_data->generation);
 }
 
-// Frees all unused pre-allocated EPT entries. Other used entries should be
-// freed with EptpDestructTables().
-_Use_decl_annotations_ static void EptpFreeUnusedPreAllocatedEntries(
-    EptCommonEntry **preallocated_entries, long used_count) {
-  for (auto i = used_count; i < kVmxpNumberOfPreallocatedEntries; ++i) {
-    if (!preallocated_entries[i]) {
-      break;
-    }
-#pragma warning(push)
-#pragma warning(disable : 6001)
-    ExFreePoolWithTag(preallocated_entries[i], kHyperPlatformCommonPoolTag);
-#pragma warning(pop)
+// Invalidates cached translations with single-context INVEPT only when other
+// processors or the current one changed EPT
+_Use_decl_annotations_ void EptSynchronize(EptData *ept_data) {
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  const auto generation = ept_data->generation;
+  if (ept_data->synchronized_generations[processor] == generation) {
+    return;
   }
-  ExFreePoolWithTag(preallocated_entries, kHyperPlatformCommonPoolTag);
-}
-
-// Frees all used EPT entries by walking through whole EPT
-_Use_decl_annotations_ static void EptpDestructTables(EptCommonEntry *table,
-                                                      ULONG table_level) {
-  for (auto i = 0ul; i < 512; ++i) {
-    const auto entry = table[i];
-    if (entry.fields.physial_address) {
-      const auto sub_table = reinterpret_cast<EptCommonEntry *>(
-          UtilVaFromPfn(entry.fields.physial_address));
-
-      switch (table_level) {
-        case 4:  // table == PML4, sub_table == PDPT
-        case 3:  // table == PDPT, sub_table == PDT
-          EptpDestructTables(sub_table, table_level - 1);
-          break;
-        case 2:  // table == PDT, sub_table == PT
-          ExFreePoolWithTag(sub_table, kHyperPlatformCommonPoolTag);
-          break;
-        default:
-          HYPERPLATFORM_COMMON_DBG_BREAK();
-          break;
-      }
+  UtilInveptSingleContext(ept_data->ept_pointer->all);
+  InterlockedExchange(&ept_data->synchronized_generations[processor],
+                      generation);
+}
+
+// Returns a generation of EPT
+_Use_decl_annotations_ long EptGetGeneration(EptData *ept_data) {
+  return ept_data->generation;
+}
+
+// Checks if all processors invalidated cached translations at or after the
+// generation. The difference is taken as signed so that it works across
+// wraparound.
+_Use_decl_annotations_ bool EptIsSynchronized(EptData *ept_data,
+                                              long generation) {
+  for (auto i = 0ul; i < ept_data->processor_count; ++i) {
+    const auto synchronized = ept_data->synchronized_generations[i];
+    if (static_cast<long>(static_cast<ULONG>(synchronized) -
+                          static_cast<ULONG>(generation)) < 0) {
+      return false;
     }
   }
-  ExFreePoolWithTag(table, kHyperPlatformCommonPoolTag);
+  return true;
+}
+
+// Checks if the processor can set accessed and dirty flags of EPT
+_Use_decl_annotations_ bool EptIsAccessedAndDirtyFlagsAvailable() {
+  PAGED_CODE();
+
+  const Ia32VmxEptVpidCapMsr capability = {
+      UtilReadMsr64(Msr::kIa32VmxEptVpidCap)};
+  return capability.fields.support_accessed_and_dirty_flag;
+}
+
+// Enables accessed and dirty flags on all processors
+_Use_decl_annotations_ NTSTATUS EptEnableDirtyTracking(EptData **ept_data) {
+  PAGED_CODE();
+
+  return UtilForEachProcessor(EptpEnableDirtyTrackingCallback, ept_data);
+}
+
+// Disables accessed and dirty flags on all processors
+_Use_decl_annotations_ NTSTATUS EptDisableDirtyTracking() {
+  PAGED_CODE();
+
+  return UtilForEachProcessor(EptpDisableDirtyTrackingCallback, nullptr);
+}
+
+// Invalidates cached EPT translations on all processors
+_Use_decl_annotations_ NTSTATUS EptFlushTranslations() {
+  PAGED_CODE();
+
+  return UtilForEachProcessor(EptpFlushTranslationsCallback, nullptr);
+}
+
+// Enables accessed and dirty flags on the current processor
+_Use_decl_annotations_ static NTSTATUS EptpEnableDirtyTrackingCallback(
+    void *context) {
+  return UtilVmCall(HypercallNumber::kEnableDirtyTracking, context);
+}
+
+// Disables accessed and dirty flags on the current processor
+_Use_decl_annotations_ static NTSTATUS EptpDisableDirtyTrackingCallback(
+    void *context) {
+  return UtilVmCall(HypercallNumber::kDisableDirtyTracking, context);
+}
+
+// Invalidates cached EPT translations on the current processor
+_Use_decl_annotations_ static NTSTATUS EptpFlushTranslationsCallback(
+    void *context) {
+  return UtilVmCall(HypercallNumber::kFlushTranslations, context);
+}
+
+// Enables accessed and dirty flags and returns ept_data
+_Use_decl_annotations_ void EptVmCallEnableDirtyTracking(EptData *ept_data,
+                                                         void *context) {
+  EptpSetAccessedAndDirtyFlags(ept_data, true);
+  *reinterpret_cast<EptData **>(context) = ept_data;
+}
+
+// Disables accessed and dirty flags
+_Use_decl_annotations_ void EptVmCallDisableDirtyTracking(EptData *ept_data,
+                                                          void *context) {
+  UNREFERENCED_PARAMETER(context);
+
+  EptpSetAccessedAndDirtyFlags(ept_data, false);
+}
+
+// Invalidates cached EPT translations
+_Use_decl_annotations_ void EptVmCallFlushTranslations(void *context) {
+  UNREFERENCED_PARAMETER(context);
+
+  UtilInveptAll();
+}
+
+// Enables or disables accessed and dirty flags of EPT on the current processor
+_Use_decl_annotations_ static void EptpSetAccessedAndDirtyFlags(
+    EptData *ept_data, bool enable) {
+  // EptPointer is shared among all processors, but each processor has its own
+  // copy in VMCS. Update both and flush cached translations so that the
+  // processor sets the flags on the next access.
+  ept_data->ept_pointer->fields.enable_accessed_and_dirty_flags = enable;
+  UtilVmWrite64(VmcsField::kEptPointer, ept_data->ept_pointer->all);
+  UtilInveptAll();
+}
+
+// Frees all EPT stuff
+_Use_decl_annotations_ void EptTermination(EptData *ept_data) {
+  HYPERPLATFORM_LOG_DEBUG("Used pre-allocated entries  = %2d / %2d",
+                          ept_data->used_tables - ept_data->initial_used_tables,
+                          kVmxpNumberOfPreallocatedEntries);
+
+  EptpFreeChunks(ept_data);
+  MemUsageFree(const_cast<long *>(ept_data->synchronized_generations),
+               sizeof(long) * ept_data->processor_count,
+               MemUsageSubsystem::kEpt);
+  MemUsageFree(ept_data->ept_pointer, PAGE_SIZE, MemUsageSubsystem::kEpt);
+  MemUsageFree(ept_data, sizeof(EptData), MemUsageSubsystem::kEpt);
 }
 
 }  // extern "C"
@@ -80,6 +80,81 @@ _IRQL_requires_min_(DISPATCH_LEVEL) void EptHandleEptViolation(
 EptCommonEntry* EptGetEptPtEntry(_In_ EptData* ept_data,
                                  _In_ ULONG64 physical_address);
 
+/// Publishes changes made to EPT entries to all processors
+/// @param ept_data   EptData whose entries were changed
+/// @return A generation of EPT including the changes
+///
+/// It only bumps a generation of EPT. Each processor invalidates its cached
+/// translations with EptSynchronize() before it resumes a guest, so the
+/// current processor sees the changes on the next VM-entry and others on their
+/// next VM-exit. A revocation that must take effect on all processors before a
+/// caller in VMX non-root mode continues should be followed by
+/// EptFlushTranslations(). In VMX-root mode, EptIsSynchronized() tells when
+/// the returned generation reached all processors.
+long EptCommitChange(_In_ EptData* ept_data);
+
+/// Invalidates cached translations of the current processor if EPT was changed
+/// since the last call
+/// @param ept_data   EptData used by the current processor
+_IRQL_requires_min_(DISPATCH_LEVEL) void EptSynchronize(_In_ EptData* ept_data);
+
+/// Returns a generation of EPT including all changes committed so far
+/// @param ept_data   EptData to get a generation
+/// @return A generation to give EptIsSynchronized()
+long EptGetGeneration(_In_ EptData* ept_data);
+
+/// Checks if all processors invalidated cached translations after a change
+/// @param ept_data   EptData whose entries were changed
+/// @param generation   A returned value of EptCommitChange() or
+///                     EptGetGeneration()
+/// @return true if no processor can use translations older than \a generation
+bool EptIsSynchronized(_In_ EptData* ept_data, _In_ long generation);
+
+/// Checks if the processor can set accessed and dirty flags of EPT
+/// @return true if the processor supports accessed and dirty flags
+_IRQL_requires_max_(PASSIVE_LEVEL) bool EptIsAccessedAndDirtyFlagsAvailable();
+
+/// Enables accessed and dirty flags of EPT on all processors
+/// @param ept_data   A pointer to receive EptData whose entries get the flags
+/// @return STATUS_SUCCESS on success
+///
+/// A caller must call EptDisableDirtyTracking() even when this function failed
+/// since some processors may have enabled the flags. Only one user of the
+/// flags, ie, either memory snapshots or the working-set estimation, can be
+/// active at a time as each of them clears the flags.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    EptEnableDirtyTracking(_Out_ EptData** ept_data);
+
+/// Disables accessed and dirty flags of EPT on all processors
+/// @return STATUS_SUCCESS on success
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS EptDisableDirtyTracking();
+
+/// Invalidates cached EPT translations on all processors
+/// @return STATUS_SUCCESS on success
+///
+/// Call this after permissions of EPT entries are revoked so that no processor
+/// keeps using translations that allow the access. The processor also does not
+/// set accessed and dirty flags for translations cached in TLB, so call this
+/// after the flags are cleared so that next accesses are observed.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS EptFlushTranslations();
+
+/// Enables accessed and dirty flags of EPT on the current processor
+/// @param ept_data   EptData to update
+/// @param context  A pointer to receive \a ept_data
+_IRQL_requires_min_(DISPATCH_LEVEL) void EptVmCallEnableDirtyTracking(
+    _In_ EptData* ept_data, _Out_ void* context);
+
+/// Disables accessed and dirty flags of EPT on the current processor
+/// @param ept_data   EptData to update
+/// @param context  Unused
+_IRQL_requires_min_(DISPATCH_LEVEL) void EptVmCallDisableDirtyTracking(
+    _In_ EptData* ept_data, _In_opt_ void* context);
+
+/// Invalidates cached EPT translations on the current processor
+/// @param context  Unused
+_IRQL_requires_min_(DISPATCH_LEVEL) void EptVmCallFlushTranslations(
+    _In_opt_ void* context);
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // variables
@@ -9,6 +9,7 @@
 #define HYPERPLATFORM_KERNEL_STL_H_
 
 #include <fltKernel.h>
+#include "memory_usage.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -26,8 +27,12 @@
 #endif
 #define _HAS_EXCEPTIONS 0
 
-/// A pool tag for this module
-static const ULONG kKstlPoolTag = 'LTSK';
+// Declares std::nothrow_t after disabling exception as other STL headers
+#include <new>
+
+/// A size of a header recording a size of a block allocated by the operator
+/// new. It keeps alignment of a returned pointer.
+static const SIZE_T kKstlHeaderSize = MEMORY_ALLOCATION_ALIGNMENT;
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -89,15 +94,34 @@ DECLSPEC_NORETURN inline void __cdecl _Xruntime_error(_In_z_ const char *) {
 
 }  // namespace std
 
-/// An alternative implmentation of the new operator
+/// An alternative implmentation of the nothrow new operator
 /// @param size   A size to allocate in bytes
-/// @return An allocated pointer. The operator delete should be used to free it
-inline void *__cdecl operator new(_In_ size_t size) {
+/// @return An allocated pointer, or nullptr on failure. The operator delete
+///         should be used to free it
+inline void *__cdecl operator new(_In_ size_t size,
+                                  _In_ const std::nothrow_t &) noexcept {
   if (size == 0) {
     size = 1;
   }
 
-  void *p = ExAllocatePoolWithTag(NonPagedPool, size, kKstlPoolTag);
+  // Record the size in front of the block so that the operator delete can
+  // account it without a size
+  const auto block_size = size + kKstlHeaderSize;
+  const auto block = reinterpret_cast<SIZE_T *>(MemUsageAllocate(
+      NonPagedPool, block_size, MemUsageSubsystem::kKernelStl));
+  if (!block) {
+    return nullptr;
+  }
+  *block = block_size;
+  return reinterpret_cast<UCHAR *>(block) + kKstlHeaderSize;
+}
+
+/// An alternative implmentation of the new operator. Issues a bug check on
+/// failure.
+/// @param size   A size to allocate in bytes
+/// @return An allocated pointer. The operator delete should be used to free it
+inline void *__cdecl operator new(_In_ size_t size) {
+  const auto p = operator new(size, std::nothrow);
   if (!p) {
     KernelStlRaiseException(MUST_SUCCEED_POOL_EMPTY);
   }
@@ -108,7 +132,9 @@ inline void *__cdecl operator new(_In_ size_t size) {
 /// @param p   A pointer to delete
 inline void __cdecl operator delete(_In_ void *p) {
   if (p) {
-    ExFreePoolWithTag(p, kKstlPoolTag);
+    const auto block = reinterpret_cast<SIZE_T *>(
+        reinterpret_cast<UCHAR *>(p) - kKstlHeaderSize);
+    MemUsageFree(block, *block, MemUsageSubsystem::kKernelStl);
   }
 }
 
@@ -117,9 +143,7 @@ inline void __cdecl operator delete(_In_ void *p) {
 /// @param size   Ignored
 inline void __cdecl operator delete(_In_ void *p, _In_ size_t size) {
   UNREFERENCED_PARAMETER(size);
-  if (p) {
-    ExFreePoolWithTag(p, kKstlPoolTag);
-  }
+  operator delete(p);
 }
 
 /// An alternative implmentation of __stdio_common_vsprintf_s
@@ -8,6 +8,7 @@
 #include "log.h"
 #define NTSTRSAFE_NO_CB_FUNCTIONS
 #include <ntstrsafe.h>
+#include "memory_usage.h"
 
 extern "C" {
 ////////////////////////////////////////////////////////////////////////////////
@@ -35,7 +36,18 @@ static const auto kLogpBufferUsableSize = kLogpBufferSize - 1;
 // An interval to flush buffered log entries into a log file.
 static const auto kLogpLogFlushIntervalMsec = 50;
 
-static const ULONG kLogpPoolTag = ' gol';
+// A length of a bucket of a log index file in 100 nanoseconds (one second)
+static const LONG64 kLogpIndexBucketLength = 10 * 1000 * 1000;
+
+// A number of bits set in a Bloom filter at which a bucket is closed before
+// its period is over. With two bits per token, it keeps a false positive rate
+// of a query for a token at most (1/8)^2, about 1.6%, however many entries are
+// written in a second.
+static const ULONG kLogpIndexMaxBloomBitsSet = kLogIndexBloomBits / 8;
+
+// FNV-1a parameters used to hash tokens for a log index file
+static const ULONG kLogpFnvOffsetBasis = 2166136261ul;
+static const ULONG kLogpFnvPrime = 16777619ul;
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -57,6 +69,15 @@ struct LogBufferInfo {
   SIZE_T log_max_usage;
 
   HANDLE log_file_handle;
+
+  // An index file and a bucket being filled. log_file_offset is an offset at
+  // which the next entry is written to the log file. They are protected by
+  // resource.
+  HANDLE log_index_handle;
+  ULONG64 log_file_offset;
+  LogIndexBucket log_index_bucket;
+  ULONG log_index_bloom_bits_set;
+
   KSPIN_LOCK spin_lock;
   ERESOURCE resource;
   bool resource_initialized;
@@ -80,6 +101,16 @@ _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
     LogpInitializeLogFile(_Inout_ LogBufferInfo *info);
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LogpInitializeIndexFile(
+    _Inout_ LogBufferInfo *info, _In_ bool log_file_created);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    LogpOpenIndexFile(_In_ POBJECT_ATTRIBUTES oa, _In_ ULONG disposition,
+                      _Out_ HANDLE *handle, _Out_ ULONG_PTR *information);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool LogpIsValidIndexFile(
+    _In_ HANDLE handle);
+
 static DRIVER_REINITIALIZE LogpReinitializationRoutine;
 
 _IRQL_requires_max_(PASSIVE_LEVEL) static void LogpFinalizeBufferInfo(
@@ -99,7 +130,13 @@ _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
 
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
     LogpWriteMessageToFile(_In_ const char *message,
-                           _In_ const LogBufferInfo &info);
+                           _Inout_ LogBufferInfo *info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LogpIndexEntry(
+    _Inout_ LogBufferInfo *info, _In_ const char *entry, _In_ SIZE_T length);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LogpWriteIndexBucket(
+    _Inout_ LogBufferInfo *info);
 
 static NTSTATUS LogpBufferMessage(_In_ const char *message,
                                   _Inout_ LogBufferInfo *info);
@@ -127,6 +164,9 @@ static void LogpDbgBreak();
 #pragma alloc_text(INIT, LogInitialization)
 #pragma alloc_text(INIT, LogpInitializeBufferInfo)
 #pragma alloc_text(PAGE, LogpInitializeLogFile)
+#pragma alloc_text(PAGE, LogpInitializeIndexFile)
+#pragma alloc_text(PAGE, LogpOpenIndexFile)
+#pragma alloc_text(PAGE, LogpIsValidIndexFile)
 #pragma alloc_text(INIT, LogRegisterReinitialization)
 #pragma alloc_text(PAGE, LogpReinitializationRoutine)
 #pragma alloc_text(PAGE, LogIrpShutdownHandler)
@@ -211,15 +251,15 @@ _Use_decl_annotations_ static NTSTATUS LogpInitializeBufferInfo(
   info->resource_initialized = true;
 
   // Allocate two log buffers on NonPagedPool.
-  info->log_buffer1 = reinterpret_cast<char *>(
-      ExAllocatePoolWithTag(NonPagedPoolNx, kLogpBufferSize, kLogpPoolTag));
+  info->log_buffer1 = reinterpret_cast<char *>(MemUsageAllocate(
+      NonPagedPoolNx, kLogpBufferSize, MemUsageSubsystem::kLog));
   if (!info->log_buffer1) {
     LogpFinalizeBufferInfo(info);
     return STATUS_INSUFFICIENT_RESOURCES;
   }
 
-  info->log_buffer2 = reinterpret_cast<char *>(
-      ExAllocatePoolWithTag(NonPagedPoolNx, kLogpBufferSize, kLogpPoolTag));
+  info->log_buffer2 = reinterpret_cast<char *>(MemUsageAllocate(
+      NonPagedPoolNx, kLogpBufferSize, MemUsageSubsystem::kLog));
   if (!info->log_buffer2) {
     LogpFinalizeBufferInfo(info);
     return STATUS_INSUFFICIENT_RESOURCES;
@@ -275,6 +315,7 @@ _Use_decl_annotations_ static NTSTATUS LogpInitializeLogFile(
   if (!NT_SUCCESS(status)) {
     return status;
   }
+  LogpInitializeIndexFile(info, io_status.Information == FILE_CREATED);
 
   // Initialize a log buffer flush thread.
   info->buffer_flush_thread_should_be_alive = true;
@@ -282,6 +323,10 @@ _Use_decl_annotations_ static NTSTATUS LogpInitializeLogFile(
                                 nullptr, nullptr, nullptr,
                                 LogpBufferFlushThreadRoutine, info);
   if (!NT_SUCCESS(status)) {
+    if (info->log_index_handle) {
+      ZwClose(info->log_index_handle);
+      info->log_index_handle = nullptr;
+    }
     ZwClose(info->log_file_handle);
     info->log_file_handle = nullptr;
     info->buffer_flush_thread_should_be_alive = false;
@@ -365,16 +410,23 @@ _Use_decl_annotations_ static void LogpFinalizeBufferInfo(LogBufferInfo *info) {
   }
 
   // Cleaning up other things.
+  if (info->log_index_handle) {
+    if (info->log_index_bucket.entry_count) {
+      LogpWriteIndexBucket(info);
+    }
+    ZwClose(info->log_index_handle);
+    info->log_index_handle = nullptr;
+  }
   if (info->log_file_handle) {
     ZwClose(info->log_file_handle);
     info->log_file_handle = nullptr;
   }
   if (info->log_buffer2) {
-    ExFreePoolWithTag(info->log_buffer2, kLogpPoolTag);
+    MemUsageFree(info->log_buffer2, kLogpBufferSize, MemUsageSubsystem::kLog);
     info->log_buffer2 = nullptr;
   }
   if (info->log_buffer1) {
-    ExFreePoolWithTag(info->log_buffer1, kLogpPoolTag);
+    MemUsageFree(info->log_buffer1, kLogpBufferSize, MemUsageSubsystem::kLog);
     info->log_buffer1 = nullptr;
   }
 
@@ -542,7 +594,7 @@ _Use_decl_annotations_ static NTSTATUS LogpPut(char *message, ULONG attribute) {
       if (!KeAreAllApcsDisabled()) {
         // Yes, it can. Do it.
         LogpFlushLogBuffer(&info);
-        status = LogpWriteMessageToFile(message, info);
+        status = LogpWriteMessageToFile(message, &info);
       }
 #pragma warning(pop)
     } else {
@@ -602,7 +654,9 @@ _Use_decl_annotations_ static NTSTATUS LogpFlushLogBuffer(LogBufferInfo *info) {
                          &io_status, current_log_entry,
                          static_cast<ULONG>(current_log_entry_length), nullptr,
                          nullptr);
-    if (!NT_SUCCESS(status)) {
+    if (NT_SUCCESS(status)) {
+      LogpIndexEntry(info, current_log_entry, current_log_entry_length);
+    } else {
       // It could happen when you did not register IRP_SHUTDOWN and call
       // LogIrpShutdownHandler() and the system tried to log to a file after
       // a file system was unmounted.
@@ -622,26 +676,233 @@ _Use_decl_annotations_ static NTSTATUS LogpFlushLogBuffer(LogBufferInfo *info) {
   return status;
 }
 
-// Logs the current log entry to and flush the log file.
+// Logs the current log entry to and flush the log file. The resource is
+// acquired so that offsets in the index file are consistent with the order of
+// entries written by other threads.
 _Use_decl_annotations_ static NTSTATUS LogpWriteMessageToFile(
-    const char *message, const LogBufferInfo &info) {
+    const char *message, LogBufferInfo *info) {
   NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
 
+  ExEnterCriticalRegionAndAcquireResourceExclusive(&info->resource);
+  const auto message_length = strlen(message);
   IO_STATUS_BLOCK io_status = {};
   auto status =
-      ZwWriteFile(info.log_file_handle, nullptr, nullptr, nullptr, &io_status,
-                  const_cast<char *>(message),
-                  static_cast<ULONG>(strlen(message)), nullptr, nullptr);
-  if (!NT_SUCCESS(status)) {
+      ZwWriteFile(info->log_file_handle, nullptr, nullptr, nullptr,
+                  &io_status, const_cast<char *>(message),
+                  static_cast<ULONG>(message_length), nullptr, nullptr);
+  if (NT_SUCCESS(status)) {
+    LogpIndexEntry(info, message, message_length);
+  } else {
     // It could happen when you did not register IRP_SHUTDOWN and call
     // LogIrpShutdownHandler() and the system tried to log to a file after
     // a file system was unmounted.
     LogpDbgBreak();
   }
-  status = ZwFlushBuffersFile(info.log_file_handle, &io_status);
+  status = ZwFlushBuffersFile(info->log_file_handle, &io_status);
+  ExReleaseResourceAndLeaveCriticalRegion(&info->resource);
   return status;
 }
 
+// Opens an index file and determines where the next entry is written in the
+// log file. The index file is started over when the log file is new or the
+// existing index file is not in the current format, and otherwise appended
+// since the log file is also appended. The log works without an index when
+// the index file cannot be opened.
+_Use_decl_annotations_ static void LogpInitializeIndexFile(
+    LogBufferInfo *info, bool log_file_created) {
+  PAGED_CODE();
+
+  if (g_logp_debug_flag & kLogOptDisableIndex) {
+    return;
+  }
+
+  IO_STATUS_BLOCK io_status = {};
+  FILE_STANDARD_INFORMATION file_info = {};
+  auto status = ZwQueryInformationFile(info->log_file_handle, &io_status,
+                                       &file_info, sizeof(file_info),
+                                       FileStandardInformation);
+  if (!NT_SUCCESS(status)) {
+    return;
+  }
+  info->log_file_offset = file_info.EndOfFile.QuadPart;
+
+  wchar_t index_file_path[RTL_NUMBER_OF_FIELD(LogBufferInfo, log_file_path) +
+                          4] = {};
+  status = RtlStringCchPrintfW(index_file_path,
+                               RTL_NUMBER_OF(index_file_path), L"%s.idx",
+                               info->log_file_path);
+  if (!NT_SUCCESS(status)) {
+    return;
+  }
+  UNICODE_STRING index_file_path_u = {};
+  RtlInitUnicodeString(&index_file_path_u, index_file_path);
+
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, &index_file_path_u,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+  ULONG_PTR information = 0;
+  status = LogpOpenIndexFile(
+      &oa, (log_file_created) ? FILE_OVERWRITE_IF : FILE_OPEN_IF,
+      &info->log_index_handle, &information);
+  if (!NT_SUCCESS(status)) {
+    return;
+  }
+  if (information == FILE_OPENED) {
+    if (LogpIsValidIndexFile(info->log_index_handle)) {
+      return;
+    }
+
+    // Appending buckets to a file written by another version, or cut off in
+    // the middle of a bucket, would make the whole index unreadable
+    ZwClose(info->log_index_handle);
+    status = LogpOpenIndexFile(&oa, FILE_OVERWRITE_IF, &info->log_index_handle,
+                               &information);
+    if (!NT_SUCCESS(status)) {
+      return;
+    }
+  }
+
+  LogIndexFileHeader header = {};
+  header.magic = kLogIndexFileMagic;
+  header.version = kLogIndexFileVersion;
+  header.bucket_size = sizeof(LogIndexBucket);
+  header.bloom_bits = kLogIndexBloomBits;
+  header.bucket_length = kLogpIndexBucketLength;
+  status = ZwWriteFile(info->log_index_handle, nullptr, nullptr, nullptr,
+                       &io_status, &header, sizeof(header), nullptr, nullptr);
+  if (!NT_SUCCESS(status)) {
+    ZwClose(info->log_index_handle);
+    info->log_index_handle = nullptr;
+  }
+}
+
+// Opens an index file for appending. The handle is also readable so that a
+// header of an existing file can be checked.
+_Use_decl_annotations_ static NTSTATUS LogpOpenIndexFile(
+    POBJECT_ATTRIBUTES oa, ULONG disposition, HANDLE *handle,
+    ULONG_PTR *information) {
+  PAGED_CODE();
+
+  IO_STATUS_BLOCK io_status = {};
+  const auto status = ZwCreateFile(
+      handle, FILE_READ_DATA | FILE_APPEND_DATA | SYNCHRONIZE, oa, &io_status,
+      nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, disposition,
+      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+  if (!NT_SUCCESS(status)) {
+    *handle = nullptr;
+    *information = 0;
+    return status;
+  }
+  *information = io_status.Information;
+  return status;
+}
+
+// Checks that an existing index file has a header of the current format and
+// ends at a boundary of buckets
+_Use_decl_annotations_ static bool LogpIsValidIndexFile(HANDLE handle) {
+  PAGED_CODE();
+
+  IO_STATUS_BLOCK io_status = {};
+  FILE_STANDARD_INFORMATION file_info = {};
+  auto status = ZwQueryInformationFile(handle, &io_status, &file_info,
+                                       sizeof(file_info),
+                                       FileStandardInformation);
+  if (!NT_SUCCESS(status)) {
+    return false;
+  }
+  const auto file_size = static_cast<ULONG64>(file_info.EndOfFile.QuadPart);
+  if (file_size < sizeof(LogIndexFileHeader) ||
+      (file_size - sizeof(LogIndexFileHeader)) % sizeof(LogIndexBucket)) {
+    return false;
+  }
+
+  LogIndexFileHeader header = {};
+  LARGE_INTEGER offset = {};
+  status = ZwReadFile(handle, nullptr, nullptr, nullptr, &io_status, &header,
+                      sizeof(header), &offset, nullptr);
+  if (!NT_SUCCESS(status) || io_status.Information != sizeof(header)) {
+    return false;
+  }
+  return header.magic == kLogIndexFileMagic &&
+         header.version == kLogIndexFileVersion &&
+         header.bucket_size == sizeof(LogIndexBucket) &&
+         header.bloom_bits == kLogIndexBloomBits &&
+         header.bucket_length == kLogpIndexBucketLength;
+}
+
+// Adds an entry written to the log file to the current bucket, and writes the
+// bucket to the index file when its period is over. It is called with the
+// resource held.
+_Use_decl_annotations_ static void LogpIndexEntry(LogBufferInfo *info,
+                                                  const char *entry,
+                                                  SIZE_T length) {
+  const auto entry_offset = info->log_file_offset;
+  info->log_file_offset += length;
+  if (!info->log_index_handle) {
+    return;
+  }
+
+  LARGE_INTEGER now = {};
+  KeQuerySystemTime(&now);
+  auto &bucket = info->log_index_bucket;
+  if (bucket.entry_count &&
+      (now.QuadPart - bucket.start_time >= kLogpIndexBucketLength ||
+       info->log_index_bloom_bits_set >= kLogpIndexMaxBloomBitsSet)) {
+    LogpWriteIndexBucket(info);
+  }
+  if (!bucket.entry_count) {
+    bucket.start_time = now.QuadPart;
+    bucket.start_offset = entry_offset;
+  }
+  bucket.end_time = now.QuadPart;
+  bucket.end_offset = info->log_file_offset;
+  bucket.entry_count++;
+
+  // Hash each token as described in log.h and add it to the Bloom filter
+  auto hash = kLogpFnvOffsetBasis;
+  auto token_length = 0ul;
+  for (auto i = 0ul; i <= length; ++i) {
+    auto c = (i < length) ? entry[i] : '\0';
+    if (c >= 'a' && c <= 'z') {
+      c -= 'a' - 'A';
+    }
+    if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || c == '_') {
+      hash ^= static_cast<UCHAR>(c);
+      hash *= kLogpFnvPrime;
+      token_length++;
+      continue;
+    }
+    if (token_length >= 2) {
+      const ULONG bits[] = {hash % kLogIndexBloomBits,
+                            (hash >> 12) % kLogIndexBloomBits};
+      for (const auto bit : bits) {
+        const auto mask = static_cast<UCHAR>(1 << (bit % 8));
+        if (!(bucket.bloom[bit / 8] & mask)) {
+          bucket.bloom[bit / 8] |= mask;
+          info->log_index_bloom_bits_set++;
+        }
+      }
+    }
+    hash = kLogpFnvOffsetBasis;
+    token_length = 0;
+  }
+}
+
+// Writes the current bucket to the index file and clears it
+_Use_decl_annotations_ static void LogpWriteIndexBucket(LogBufferInfo *info) {
+  IO_STATUS_BLOCK io_status = {};
+  const auto status = ZwWriteFile(
+      info->log_index_handle, nullptr, nullptr, nullptr, &io_status,
+      &info->log_index_bucket, sizeof(info->log_index_bucket), nullptr,
+      nullptr);
+  if (!NT_SUCCESS(status)) {
+    LogpDbgBreak();
+  }
+  RtlZeroMemory(&info->log_index_bucket, sizeof(info->log_index_bucket));
+  info->log_index_bloom_bits_set = 0;
+}
+
 // Buffer the log entry to the log buffer.
 _Use_decl_annotations_ static NTSTATUS LogpBufferMessage(const char *message,
                                                          LogBufferInfo *info) {
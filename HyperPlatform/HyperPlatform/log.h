@@ -112,11 +112,61 @@ static const auto kLogOptDisableFunctionName = 0x200ul;
 /// For LogInitialization(). Do not log a current processor number.
 static const auto kLogOptDisableProcessorNumber = 0x400ul;
 
+/// For LogInitialization(). Do not write an index file next to a log file.
+static const auto kLogOptDisableIndex = 0x800ul;
+
+/// 'HPLI'; a magic value of a log index file
+static const ULONG kLogIndexFileMagic = 'ILPH';
+
+/// A version of a log index file format
+static const ULONG kLogIndexFileVersion = 2;
+
+/// A number of bits of a Bloom filter in LogIndexBucket
+static const ULONG kLogIndexBloomBits = 4096;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
 //
 
+/// A header of a log index file
+///
+/// An index file is created as a log file path with ".idx" appended, and
+/// consists of this header followed by LogIndexBucket for each period of
+/// \a bucket_length in which entries were written. A bucket is also closed
+/// early once an eighth of bits of its Bloom filter are set so that the filter
+/// stays selective on a busy system. All values are little endian. A tool can
+/// answer a query by a time window or a token by reading only buckets whose
+/// time range overlaps the window and whose Bloom filter may contain the token,
+/// and then seeking to \a start_offset of the log file.
+///
+/// A token is a run of two or more [0-9A-Za-z_] characters in an entry, such as
+/// a PID, a function name or a pool tag. Its hash is FNV-1a (32-bit) of the
+/// token converted to upper case, and bits (hash % 4096) and
+/// ((hash >> 12) % 4096) are set in \a bloom.
+#include <pshpack1.h>
+struct LogIndexFileHeader {
+  ULONG magic;           ///< kLogIndexFileMagic
+  ULONG version;         ///< kLogIndexFileVersion
+  ULONG bucket_size;     ///< sizeof(LogIndexBucket)
+  ULONG bloom_bits;      ///< kLogIndexBloomBits
+  LONG64 bucket_length;  ///< A length of a bucket in 100 nanoseconds
+};
+static_assert(sizeof(LogIndexFileHeader) == 24, "Size check");
+
+/// Entries written to a log file within a bucket
+struct LogIndexBucket {
+  LONG64 start_time;     ///< System time when the first entry was written
+  LONG64 end_time;       ///< System time when the last entry was written
+  ULONG64 start_offset;  ///< An offset of the first entry in the log file
+  ULONG64 end_offset;    ///< An offset next to the last entry in the log file
+  ULONG entry_count;     ///< A number of entries
+  ULONG reserved;
+  UCHAR bloom[kLogIndexBloomBits / 8];  ///< A Bloom filter of tokens
+};
+static_assert(sizeof(LogIndexBucket) == 552, "Size check");
+#include <poppack.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
@@ -0,0 +1,197 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements memory usage accounting functions.
+
+#include "memory_usage.h"
+#include "common.h"
+#include "log.h"
+#include "util.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A number of subsystems
+static const auto kMemUsagepNumberOfSubsystems =
+    static_cast<ULONG>(MemUsageSubsystem::kMaximum);
+
+// Pool tags of subsystems in order of MemUsageSubsystem
+static const ULONG kMemUsagepPoolTags[] = {
+    'VpyH', 'EpyH', 'SpyH', 'LTSK', ' gol', 'CpyH',
+};
+static_assert(RTL_NUMBER_OF(kMemUsagepPoolTags) ==
+                  kMemUsagepNumberOfSubsystems,
+              "Size check");
+
+// Names of subsystems in order of MemUsageSubsystem
+static const char* const kMemUsagepNames[] = {
+    "VM", "EPT", "Shadow pages", "STL", "Log", "Performance",
+};
+static_assert(RTL_NUMBER_OF(kMemUsagepNames) == kMemUsagepNumberOfSubsystems,
+              "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Live counters of a subsystem
+struct MemUsageState {
+  volatile LONG64 bytes;
+  volatile LONG64 peak_bytes;
+  volatile LONG64 objects;
+  volatile LONG64 peak_objects;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static void MemUsagepAddUsage(_In_ MemUsageSubsystem subsystem,
+                              _In_ SIZE_T number_of_bytes);
+
+static void MemUsagepRemoveUsage(_In_ MemUsageSubsystem subsystem,
+                                 _In_ SIZE_T number_of_bytes);
+
+static void MemUsagepUpdatePeak(_Inout_ volatile LONG64* peak,
+                                _In_ LONG64 value);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Counters are updated with interlocked operations only so that they can be
+// touched from any context without a lock
+static MemUsageState g_memusagep_states[kMemUsagepNumberOfSubsystems];
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates memory with a tag of the subsystem and adds it to counters
+_Use_decl_annotations_ void* MemUsageAllocate(POOL_TYPE pool_type,
+                                              SIZE_T number_of_bytes,
+                                              MemUsageSubsystem subsystem) {
+  const auto index = static_cast<ULONG>(subsystem);
+  NT_ASSERT(index < kMemUsagepNumberOfSubsystems);
+
+  const auto p = ExAllocatePoolWithTag(pool_type, number_of_bytes,
+                                       kMemUsagepPoolTags[index]);
+  if (!p) {
+    return nullptr;
+  }
+  MemUsagepAddUsage(subsystem, number_of_bytes);
+  return p;
+}
+
+// Frees memory and subtracts it from counters
+_Use_decl_annotations_ void MemUsageFree(void* p, SIZE_T number_of_bytes,
+                                         MemUsageSubsystem subsystem) {
+  const auto index = static_cast<ULONG>(subsystem);
+  NT_ASSERT(index < kMemUsagepNumberOfSubsystems);
+
+  ExFreePoolWithTag(p, kMemUsagepPoolTags[index]);
+  MemUsagepRemoveUsage(subsystem, number_of_bytes);
+}
+
+// Allocates physically contiguous memory and adds it to counters
+_Use_decl_annotations_ void* MemUsageAllocateContiguous(
+    SIZE_T number_of_bytes, MemUsageSubsystem subsystem) {
+  NT_ASSERT(static_cast<ULONG>(subsystem) < kMemUsagepNumberOfSubsystems);
+
+  const auto p = UtilAllocateContiguousMemory(number_of_bytes);
+  if (!p) {
+    return nullptr;
+  }
+  MemUsagepAddUsage(subsystem, number_of_bytes);
+  return p;
+}
+
+// Frees physically contiguous memory and subtracts it from counters
+_Use_decl_annotations_ void MemUsageFreeContiguous(
+    void* p, SIZE_T number_of_bytes, MemUsageSubsystem subsystem) {
+  NT_ASSERT(static_cast<ULONG>(subsystem) < kMemUsagepNumberOfSubsystems);
+
+  UtilFreeContiguousMemory(p);
+  MemUsagepRemoveUsage(subsystem, number_of_bytes);
+}
+
+// Adds a block to counters of the subsystem
+_Use_decl_annotations_ static void MemUsagepAddUsage(
+    MemUsageSubsystem subsystem, SIZE_T number_of_bytes) {
+  auto& state = g_memusagep_states[static_cast<ULONG>(subsystem)];
+  const auto size = static_cast<LONG64>(number_of_bytes);
+  MemUsagepUpdatePeak(&state.peak_bytes,
+                      InterlockedAdd64(&state.bytes, size));
+  MemUsagepUpdatePeak(&state.peak_objects,
+                      InterlockedIncrement64(&state.objects));
+}
+
+// Subtracts a block from counters of the subsystem
+_Use_decl_annotations_ static void MemUsagepRemoveUsage(
+    MemUsageSubsystem subsystem, SIZE_T number_of_bytes) {
+  auto& state = g_memusagep_states[static_cast<ULONG>(subsystem)];
+  InterlockedAdd64(&state.bytes, -static_cast<LONG64>(number_of_bytes));
+  InterlockedDecrement64(&state.objects);
+}
+
+// Raises the high-water mark to the value if it is higher
+_Use_decl_annotations_ static void MemUsagepUpdatePeak(volatile LONG64* peak,
+                                                       LONG64 value) {
+  for (auto current = *peak; value > current; current = *peak) {
+    if (InterlockedCompareExchange64(peak, value, current) == current) {
+      break;
+    }
+  }
+}
+
+// Copies counters. Each counter is read atomically but they are not
+// consistent with each other while other processors are allocating memory.
+_Use_decl_annotations_ void MemUsageQuery(MemUsageSubsystem subsystem,
+                                          MemUsageCounters* counters) {
+  const auto index = static_cast<ULONG>(subsystem);
+  NT_ASSERT(index < kMemUsagepNumberOfSubsystems);
+
+  auto& state = g_memusagep_states[index];
+  counters->pool_tag = kMemUsagepPoolTags[index];
+  counters->bytes = InterlockedCompareExchange64(&state.bytes, 0, 0);
+  counters->peak_bytes = InterlockedCompareExchange64(&state.peak_bytes, 0, 0);
+  counters->objects = InterlockedCompareExchange64(&state.objects, 0, 0);
+  counters->peak_objects =
+      InterlockedCompareExchange64(&state.peak_objects, 0, 0);
+}
+
+// Logs current and peak usage of each subsystem
+_Use_decl_annotations_ void MemUsageReport() {
+  LONG64 total_bytes = 0;
+  LONG64 total_peak_bytes = 0;
+  for (auto i = 0ul; i < kMemUsagepNumberOfSubsystems; ++i) {
+    MemUsageCounters counters = {};
+    MemUsageQuery(static_cast<MemUsageSubsystem>(i), &counters);
+    HYPERPLATFORM_LOG_INFO(
+        "%-12s (%.4s): %10lld bytes in %6lld blocks, peak %10lld bytes in "
+        "%6lld blocks",
+        kMemUsagepNames[i], reinterpret_cast<const char*>(&counters.pool_tag),
+        counters.bytes, counters.objects, counters.peak_bytes,
+        counters.peak_objects);
+    total_bytes += counters.bytes;
+    total_peak_bytes += counters.peak_bytes;
+  }
+  HYPERPLATFORM_LOG_INFO("%-12s       : %10lld bytes, peak %10lld bytes",
+                         "Total", total_bytes, total_peak_bytes);
+}
+
+}  // extern "C"
@@ -0,0 +1,117 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to memory usage accounting functions.
+
+#ifndef HYPERPLATFORM_MEMORY_USAGE_H_
+#define HYPERPLATFORM_MEMORY_USAGE_H_
+
+#include <fltKernel.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Subsystems owning memory. Each of them uses a distinct pool tag.
+enum class MemUsageSubsystem : ULONG {
+  kVm,           ///< Processor data, VMCS and MSR bitmaps ('VpyH')
+  kEpt,          ///< EPT data and tables ('EpyH')
+  kShadowPage,   ///< Shadow pages and hook counters of DdiMon ('SpyH')
+  kKernelStl,    ///< The operator new ('LTSK')
+  kLog,          ///< Log buffers (' gol')
+  kPerformance,  ///< PerfCollector ('CpyH')
+  kMaximum,
+};
+
+/// Counters of a subsystem
+struct MemUsageCounters {
+  ULONG pool_tag;       ///< A pool tag used by the subsystem
+  LONG64 bytes;         ///< Currently allocated bytes
+  LONG64 peak_bytes;    ///< The high-water mark of bytes
+  LONG64 objects;       ///< A number of currently allocated blocks
+  LONG64 peak_objects;  ///< The high-water mark of objects
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Allocates pool memory on behalf of a subsystem and accounts it
+/// @param pool_type   A type of pool memory to allocate
+/// @param number_of_bytes   A size to allocate in bytes
+/// @param subsystem   A subsystem owning the memory
+/// @return An allocated pointer, or nullptr
+///
+/// The memory must be freed with MemUsageFree() with the same size and
+/// subsystem.
+_IRQL_requires_max_(DISPATCH_LEVEL) void* MemUsageAllocate(
+    _In_ POOL_TYPE pool_type, _In_ SIZE_T number_of_bytes,
+    _In_ MemUsageSubsystem subsystem);
+
+/// Frees memory allocated by MemUsageAllocate()
+/// @param p   A pointer to free
+/// @param number_of_bytes   A size given to MemUsageAllocate()
+/// @param subsystem   A subsystem given to MemUsageAllocate()
+_IRQL_requires_max_(DISPATCH_LEVEL) void MemUsageFree(
+    _Pre_notnull_ __drv_freesMem(Mem) void* p, _In_ SIZE_T number_of_bytes,
+    _In_ MemUsageSubsystem subsystem);
+
+/// Allocates physically contiguous memory on behalf of a subsystem and
+/// accounts it
+/// @param number_of_bytes   A size to allocate in bytes
+/// @param subsystem   A subsystem owning the memory
+/// @return An allocated pointer, or nullptr
+///
+/// The memory must be freed with MemUsageFreeContiguous() with the same size
+/// and subsystem. It is not tagged since it is not pool memory.
+_Must_inspect_result_ _IRQL_requires_max_(DISPATCH_LEVEL) void*
+    MemUsageAllocateContiguous(_In_ SIZE_T number_of_bytes,
+                               _In_ MemUsageSubsystem subsystem);
+
+/// Frees memory allocated by MemUsageAllocateContiguous()
+/// @param p   A pointer to free
+/// @param number_of_bytes   A size given to MemUsageAllocateContiguous()
+/// @param subsystem   A subsystem given to MemUsageAllocateContiguous()
+_IRQL_requires_max_(DISPATCH_LEVEL) void MemUsageFreeContiguous(
+    _In_ void* p, _In_ SIZE_T number_of_bytes,
+    _In_ MemUsageSubsystem subsystem);
+
+/// Takes a snapshot of counters of a subsystem
+/// @param subsystem   A subsystem to query
+/// @param counters   A pointer to receive counters
+///
+/// This function can be called at any IRQL including in VMX-root mode.
+void MemUsageQuery(_In_ MemUsageSubsystem subsystem,
+                   _Out_ MemUsageCounters* counters);
+
+/// Logs counters of all subsystems
+_IRQL_requires_max_(PASSIVE_LEVEL) void MemUsageReport();
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_MEMORY_USAGE_H_
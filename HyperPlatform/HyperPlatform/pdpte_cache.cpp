@@ -0,0 +1,309 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements PDPTE cache functions.
+
+#include "pdpte_cache.h"
+#include "common.h"
+#include "ept.h"
+#include "util.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// How many CR3 values are cached per a processor
+static const auto kPdcpNumberOfEntries = 8ul;
+
+// Bits of CR3 specifying a physical address of a PDPT on PAE paging
+static const ULONG_PTR kPdcpPdptMask = ~static_cast<ULONG_PTR>(0x1f);
+
+// How many PDPT pages can be write-protected. PDPTEs in other pages are loaded
+// without caching.
+static const auto kPdcpMaxProtectedPages = 256ul;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// PDPTEs computed for a CR3 value
+struct PdcEntry {
+  ULONG_PTR pdpt_pa;    // 0 if the entry is unused
+  LONG generation;      // g_pdcp_generation when PDPTEs were computed
+  LONG ept_generation;  // EPT generation including write-protection of PDPT
+  bool verified;        // Computed after all processors saw the protection
+  ULONG64 pdptes[4];
+};
+
+// A cache of a processor. Entries are replaced in round-robin.
+struct PdcProcessorData {
+  ULONG next_index;
+  PdcEntry entries[kPdcpNumberOfEntries];
+};
+
+// Global state of PDPTE caches
+struct PdcData {
+  // An open addressing hash set of page frame numbers of PDPT pages that
+  // PdcLoadPdptes() write-protected. 0 means an unused slot. Pages are never
+  // removed since another processor may write-protect the page again at any
+  // time; a page that is no longer write-protected is harmless.
+  volatile LONG protected_pages[kPdcpMaxProtectedPages];
+
+  ULONG processor_count;
+  PdcProcessorData* processors[1];  // Has processor_count elements
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static PdcEntry* PdcpFindEntry(_In_ PdcProcessorData* processor_data,
+                               _In_ ULONG_PTR pdpt_pa);
+
+static bool PdcpAddProtectedPage(_In_ PdcData* data, _In_ ULONG64 page_pa);
+
+static bool PdcpIsProtectedPage(_In_ const PdcData* data,
+                                _In_ ULONG64 page_pa);
+
+static void PdcpFreePdcData(_In_ PdcData* data);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, PdcInitialization)
+#pragma alloc_text(PAGE, PdcTermination)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// PDPTE caches. nullptr if a system is not x86 PAE.
+static PdcData* g_pdcp_data;
+
+// Incremented whenever any PDPT page is modified. Entries computed with an
+// older generation are stale.
+static volatile LONG g_pdcp_generation;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates per-processor caches when a system is x86 PAE
+_Use_decl_annotations_ NTSTATUS PdcInitialization() {
+  PAGED_CODE();
+
+  if (!UtilIsX86Pae()) {
+    return STATUS_SUCCESS;
+  }
+
+  const auto processor_count =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto data_size =
+      sizeof(PdcData) + sizeof(PdcProcessorData*) * (processor_count - 1);
+  const auto data = reinterpret_cast<PdcData*>(ExAllocatePoolWithTag(
+      NonPagedPoolNx, data_size, kHyperPlatformCommonPoolTag));
+  if (!data) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(data, data_size);
+  data->processor_count = processor_count;
+  for (auto i = 0ul; i < processor_count; ++i) {
+    const auto processor_data =
+        reinterpret_cast<PdcProcessorData*>(ExAllocatePoolWithTag(
+            NonPagedPoolNx, sizeof(PdcProcessorData),
+            kHyperPlatformCommonPoolTag));
+    if (!processor_data) {
+      PdcpFreePdcData(data);
+      return STATUS_MEMORY_NOT_ALLOCATED;
+    }
+    RtlZeroMemory(processor_data, sizeof(PdcProcessorData));
+    data->processors[i] = processor_data;
+  }
+
+  g_pdcp_data = data;
+  return STATUS_SUCCESS;
+}
+
+// Frees per-processor caches. PDPT pages remain write-protected by EPT, but
+// EPT is already destroyed at this point.
+_Use_decl_annotations_ void PdcTermination() {
+  PAGED_CODE();
+
+  const auto data = g_pdcp_data;
+  if (!data) {
+    return;
+  }
+  g_pdcp_data = nullptr;
+  PdcpFreePdcData(data);
+}
+
+// Loads PDPTEs from a cache, or computes and caches them
+_Use_decl_annotations_ void PdcLoadPdptes(EptData* ept_data,
+                                          ULONG_PTR cr3_value) {
+  const auto data = g_pdcp_data;
+  if (!data) {
+    UtilLoadPdptes(cr3_value);
+    return;
+  }
+
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  const auto processor_data = data->processors[processor];
+  const auto pdpt_pa = cr3_value & kPdcpPdptMask;
+  auto entry = PdcpFindEntry(processor_data, pdpt_pa);
+  if (!entry) {
+    // Read the generation before computing PDPTEs so that modification of the
+    // PDPT page made after this point makes the entry stale.
+    const auto generation = g_pdcp_generation;
+    ULONG64 pdptes[4] = {};
+    UtilGetPdptes(cr3_value, pdptes);
+
+    // Write-protect the page containing the PDPT to get notified of
+    // modification of it. Do not cache PDPTEs if the page is already
+    // write-protected by someone else, since PdcHandleEptViolation() will not
+    // be called for writes to it, or if the page cannot be tracked. The page is
+    // tracked before write-protected so that PdcHandleEptViolation() always
+    // claims writes to it.
+    const auto page_pa =
+        static_cast<ULONG64>(pdpt_pa) & ~static_cast<ULONG64>(PAGE_SIZE - 1);
+    const auto ept_pt_entry = EptGetEptPtEntry(ept_data, page_pa);
+    const auto protected_by_pdc = (ept_pt_entry->fields.write_access)
+                                      ? PdcpAddProtectedPage(data, page_pa)
+                                      : PdcpIsProtectedPage(data, page_pa);
+    if (!protected_by_pdc) {
+      UtilVmWrite64(VmcsField::kGuestPdptr0, pdptes[0]);
+      UtilVmWrite64(VmcsField::kGuestPdptr1, pdptes[1]);
+      UtilVmWrite64(VmcsField::kGuestPdptr2, pdptes[2]);
+      UtilVmWrite64(VmcsField::kGuestPdptr3, pdptes[3]);
+      return;
+    }
+    auto ept_generation = 0l;
+    if (ept_pt_entry->fields.write_access) {
+      ept_pt_entry->fields.write_access = false;
+      ept_generation = EptCommitChange(ept_data);
+    } else {
+      ept_generation = EptGetGeneration(ept_data);
+    }
+
+    entry = &processor_data->entries[processor_data->next_index];
+    processor_data->next_index =
+        (processor_data->next_index + 1) % kPdcpNumberOfEntries;
+    entry->pdpt_pa = pdpt_pa;
+    entry->generation = generation;
+    entry->ept_generation = ept_generation;
+    entry->verified = false;
+    RtlCopyMemory(entry->pdptes, pdptes, sizeof(pdptes));
+  } else if (!entry->verified) {
+    // Other processors may write to the page without EPT violation until they
+    // invalidate translations cached before the page was write-protected, and
+    // such writes leave the entry stale. Compute PDPTEs on each load until all
+    // processors did so, and once more after that to use them from then on.
+    entry->verified = EptIsSynchronized(ept_data, entry->ept_generation);
+    entry->generation = g_pdcp_generation;
+    UtilGetPdptes(cr3_value, entry->pdptes);
+  }
+
+  UtilVmWrite64(VmcsField::kGuestPdptr0, entry->pdptes[0]);
+  UtilVmWrite64(VmcsField::kGuestPdptr1, entry->pdptes[1]);
+  UtilVmWrite64(VmcsField::kGuestPdptr2, entry->pdptes[2]);
+  UtilVmWrite64(VmcsField::kGuestPdptr3, entry->pdptes[3]);
+}
+
+// Invalidates all caches and removes write-protection of the faulting page if
+// it is a PDPT page write-protected by PdcLoadPdptes(). Entries for the page
+// may have been evicted already, so the page is looked up in tracked pages
+// rather than in caches.
+_Use_decl_annotations_ bool PdcHandleEptViolation(EptData* ept_data,
+                                                  ULONG64 fault_pa) {
+  const auto data = g_pdcp_data;
+  if (!data) {
+    return false;
+  }
+  const auto page_pa = fault_pa & ~static_cast<ULONG64>(PAGE_SIZE - 1);
+  if (!PdcpIsProtectedPage(data, page_pa)) {
+    return false;
+  }
+
+  // Entries are invalidated by the generation rather than by clearing them
+  // because they are owned by other processors. The page is write-protected
+  // again when any processor misses the cache for a CR3 in it.
+  InterlockedIncrement(&g_pdcp_generation);
+
+  const auto ept_pt_entry = EptGetEptPtEntry(ept_data, page_pa);
+  ept_pt_entry->fields.write_access = true;
+  EptCommitChange(ept_data);
+  return true;
+}
+
+// Returns an up-to-date entry for the PDPT, or nullptr
+_Use_decl_annotations_ static PdcEntry* PdcpFindEntry(
+    PdcProcessorData* processor_data, ULONG_PTR pdpt_pa) {
+  const auto generation = g_pdcp_generation;
+  for (auto& entry : processor_data->entries) {
+    if (entry.pdpt_pa == pdpt_pa && entry.generation == generation) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+// Adds the page to the tracked pages. Returns false if there is no room.
+_Use_decl_annotations_ static bool PdcpAddProtectedPage(PdcData* data,
+                                                        ULONG64 page_pa) {
+  // A PDPT is below 4GB on PAE paging since CR3 is 32 bits
+  if (page_pa > MAXULONG) {
+    return false;
+  }
+  const auto pfn = static_cast<LONG>(page_pa >> PAGE_SHIFT);
+  for (auto i = 0ul; i < kPdcpMaxProtectedPages; ++i) {
+    auto& slot = data->protected_pages[(pfn + i) % kPdcpMaxProtectedPages];
+    const auto old_pfn = InterlockedCompareExchange(&slot, pfn, 0);
+    if (old_pfn == 0 || old_pfn == pfn) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns true if the page was write-protected by PdcLoadPdptes() before
+_Use_decl_annotations_ static bool PdcpIsProtectedPage(const PdcData* data,
+                                                       ULONG64 page_pa) {
+  if (page_pa > MAXULONG) {
+    return false;
+  }
+  const auto pfn = static_cast<LONG>(page_pa >> PAGE_SHIFT);
+  for (auto i = 0ul; i < kPdcpMaxProtectedPages; ++i) {
+    const auto slot_pfn =
+        data->protected_pages[(pfn + i) % kPdcpMaxProtectedPages];
+    if (slot_pfn == pfn) {
+      return true;
+    }
+    if (slot_pfn == 0) {
+      return false;
+    }
+  }
+  return false;
+}
+
+// Frees per-processor caches and global state
+_Use_decl_annotations_ static void PdcpFreePdcData(PdcData* data) {
+  for (auto i = 0ul; i < data->processor_count; ++i) {
+    if (data->processors[i]) {
+      ExFreePoolWithTag(data->processors[i], kHyperPlatformCommonPoolTag);
+    }
+  }
+  ExFreePoolWithTag(data, kHyperPlatformCommonPoolTag);
+}
+
+}  // extern "C"
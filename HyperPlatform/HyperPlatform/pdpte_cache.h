@@ -0,0 +1,81 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to PDPTE cache functions.
+
+#ifndef HYPERPLATFORM_PDPTE_CACHE_H_
+#define HYPERPLATFORM_PDPTE_CACHE_H_
+
+#include <fltKernel.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct EptData;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Allocates per-processor PDPTE caches on an x86 PAE system
+/// @return STATUS_SUCCESS on success, including when caches are not needed
+///
+/// A driver must call PdcTermination() after virtualization is terminated when
+/// this function succeeded.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS PdcInitialization();
+
+/// Frees per-processor PDPTE caches
+_IRQL_requires_max_(PASSIVE_LEVEL) void PdcTermination();
+
+/// Loads the PDPTE registers for \a cr3_value to VMCS using a cache
+/// @param ept_data   EptData to write-protect a PDPT page
+/// @param cr3_value  CR3 value to load PDPTEs for
+///
+/// On a cache miss, PDPTEs are computed with UtilGetPdptes(), and a page
+/// containing the PDPT is write-protected with EPT so that modification of it
+/// invalidates caches. Falls back to UtilLoadPdptes() when caches are not
+/// allocated.
+_IRQL_requires_min_(DISPATCH_LEVEL) void PdcLoadPdptes(
+    _In_ EptData* ept_data, _In_ ULONG_PTR cr3_value);
+
+/// Handles EPT violation VM-exit due to write to a write-protected page
+/// @param ept_data   EptData to update
+/// @param fault_pa   A faulting physical address
+/// @return true if the violation was on a page write-protected by
+///         PdcLoadPdptes() and was handled
+///
+/// This should be called after all other handlers of write violation since a
+/// page once write-protected by PdcLoadPdptes() remains tracked even after
+/// write-protection is removed.
+_IRQL_requires_min_(DISPATCH_LEVEL) bool PdcHandleEptViolation(
+    _In_ EptData* ept_data, _In_ ULONG64 fault_pa);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_PDPTE_CACHE_H_
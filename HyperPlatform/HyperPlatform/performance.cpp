@@ -8,6 +8,7 @@
 #include "performance.h"
 #include "common.h"
 #include "log.h"
+#include "memory_usage.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -55,8 +56,9 @@ _Use_decl_annotations_ NTSTATUS PerfInitialization() {
   auto status = STATUS_SUCCESS;
 
   const auto perf_collector =
-      reinterpret_cast<PerfCollector*>(ExAllocatePoolWithTag(
-          NonPagedPoolNx, sizeof(PerfCollector), kHyperPlatformCommonPoolTag));
+      reinterpret_cast<PerfCollector*>(MemUsageAllocate(
+          NonPagedPoolNx, sizeof(PerfCollector),
+          MemUsageSubsystem::kPerformance));
   if (!perf_collector) {
     return STATUS_MEMORY_NOT_ALLOCATED;
   }
@@ -75,7 +77,8 @@ _Use_decl_annotations_ void PerfTermination() {
 
   if (g_performance_collector) {
     g_performance_collector->Terminate();
-    ExFreePoolWithTag(g_performance_collector, kHyperPlatformCommonPoolTag);
+    MemUsageFree(g_performance_collector, sizeof(PerfCollector),
+                 MemUsageSubsystem::kPerformance);
     g_performance_collector = nullptr;
   }
 }
@@ -9,6 +9,7 @@
 #define HYPERPLATFORM_PERFORMANCE_H_
 
 #include "perf_counter.h"
+#include "span_trace.h"
 
 extern "C" {
 ////////////////////////////////////////////////////////////////////////////////
@@ -20,11 +21,16 @@ extern "C" {
 
 /// Measures an elappsed time from execution of this macro to the end of a scope
 ///
+/// The scope is also recorded as a span when SpanInitialization() succeeded.
+///
 /// @warning
 /// This macro cannot be called from an INIT section. See
 /// #HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME() for details.
-#define HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE() \
-  HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME(g_performance_collector, PerfGetTime)
+#define HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE()            \
+  HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME(g_performance_collector, \
+                                         PerfGetTime);            \
+  HYPERPLATFORM_SPAN_RECORD_THIS_SCOPE(                           \
+      __FUNCTION__ "(" HYPERPLATFORM_PERFCOUNTER_P_TO_STRING(__LINE__) ")")
 
 #else
 #define HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE()
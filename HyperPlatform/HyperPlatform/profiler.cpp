@@ -0,0 +1,417 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements sampling profiler functions.
+
+#include "profiler.h"
+#include <intrin.h>
+#include "common.h"
+#include "log.h"
+#include "util.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// How many samples are kept per a processor. Older samples are overwritten.
+static const ULONG kProfpSamplesPerProcessor = 16 * 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Samples and statistics of a processor
+struct ProfProcessorData {
+  ULONG64 sample_count;    // A total number of samples taken
+  ULONG64 handler_cycles;  // TSC cycles spent in ProfHandlePreemptionTimer()
+  ProfSample samples[kProfpSamplesPerProcessor];
+};
+
+// Global state of the profiler
+struct ProfData {
+  ULONG frequency;
+  bool capture_stack;
+  ULONG timer_value;  // A value to set to the VMX-preemption timer
+  ULONG64 tsc_frequency;
+  ULONG64 start_tsc;
+  ULONG processor_count;
+  ProfProcessorData* processors[1];  // Has processor_count elements
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool
+    ProfpIsPreemptionTimerAvailable();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG64 ProfpEstimateTscFrequency();
+
+_IRQL_requires_(DISPATCH_LEVEL) static NTSTATUS
+    ProfpEnableSamplingCallback(_In_opt_ void* context);
+
+_IRQL_requires_(DISPATCH_LEVEL) static NTSTATUS
+    ProfpDisableSamplingCallback(_In_opt_ void* context);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ProfpReportOverhead(
+    _In_ const ProfData& data);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    ProfpWriteSampleFile(_In_ const ProfData& data,
+                         _In_ const wchar_t* file_path);
+
+static void ProfpFreeProfData(_In_ ProfData* data);
+
+static void ProfpCaptureStack(_In_ ULONG_PTR guest_sp,
+                              _Out_ ULONG64 (&stack)[kProfStackDepth]);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, ProfInitialization)
+#pragma alloc_text(INIT, ProfpIsPreemptionTimerAvailable)
+#pragma alloc_text(INIT, ProfpEstimateTscFrequency)
+#pragma alloc_text(PAGE, ProfTermination)
+#pragma alloc_text(PAGE, ProfpReportOverhead)
+#pragma alloc_text(PAGE, ProfpWriteSampleFile)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Profiler state. It is only modified while the timer is disarmed on all
+// processors.
+static ProfData* g_profp_data;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates per-processor sample rings and arms the VMX-preemption timer on all
+// processors
+_Use_decl_annotations_ NTSTATUS ProfInitialization(ULONG frequency,
+                                                   bool capture_stack) {
+  PAGED_CODE();
+
+  if (!frequency) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  if (!ProfpIsPreemptionTimerAvailable()) {
+    HYPERPLATFORM_LOG_ERROR("The VMX-preemption timer is not supported.");
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  const auto processor_count =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto data_size =
+      sizeof(ProfData) + sizeof(ProfProcessorData*) * (processor_count - 1);
+  const auto data = reinterpret_cast<ProfData*>(ExAllocatePoolWithTag(
+      NonPagedPoolNx, data_size, kHyperPlatformCommonPoolTag));
+  if (!data) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(data, data_size);
+  data->processor_count = processor_count;
+  for (auto i = 0ul; i < processor_count; ++i) {
+    const auto processor_data =
+        reinterpret_cast<ProfProcessorData*>(ExAllocatePoolWithTag(
+            NonPagedPoolNx, sizeof(ProfProcessorData),
+            kHyperPlatformCommonPoolTag));
+    if (!processor_data) {
+      ProfpFreeProfData(data);
+      return STATUS_MEMORY_NOT_ALLOCATED;
+    }
+    RtlZeroMemory(processor_data, sizeof(ProfProcessorData));
+    data->processors[i] = processor_data;
+  }
+
+  // See: VMX-Preemption Timer
+  // The timer counts down by 1 every time bit X in the TSC changes, where X is
+  // IA32_VMX_MISC[4:0].
+  const Ia32VmxMiscMsr vmx_misc = {UtilReadMsr64(Msr::kIa32VmxMisc)};
+  data->frequency = frequency;
+  data->capture_stack = capture_stack;
+  data->tsc_frequency = ProfpEstimateTscFrequency();
+  const auto timer_value =
+      (data->tsc_frequency / frequency) >> vmx_misc.fields.time_stamp;
+  data->timer_value = static_cast<ULONG>(
+      max(1ull, min(timer_value, static_cast<ULONG64>(MAXULONG))));
+  data->start_tsc = __rdtsc();
+
+  g_profp_data = data;
+  const auto status =
+      UtilForEachProcessor(ProfpEnableSamplingCallback, nullptr);
+  if (!NT_SUCCESS(status)) {
+    UtilForEachProcessor(ProfpDisableSamplingCallback, nullptr);
+    g_profp_data = nullptr;
+    ProfpFreeProfData(data);
+    return status;
+  }
+
+  HYPERPLATFORM_LOG_INFO(
+      "Sampling at %lu Hz (TSC %I64u Hz, timer value %lu) on %lu processors.",
+      frequency, data->tsc_frequency, data->timer_value, processor_count);
+  return status;
+}
+
+// Disarms the timer, then reports overhead and saves samples
+_Use_decl_annotations_ void ProfTermination(const wchar_t* file_path) {
+  PAGED_CODE();
+
+  const auto data = g_profp_data;
+  if (!data) {
+    return;
+  }
+
+  auto status = UtilForEachProcessor(ProfpDisableSamplingCallback, nullptr);
+  NT_VERIFY(NT_SUCCESS(status));
+  g_profp_data = nullptr;
+
+  ProfpReportOverhead(*data);
+  if (file_path) {
+    status = ProfpWriteSampleFile(*data, file_path);
+    if (!NT_SUCCESS(status)) {
+      HYPERPLATFORM_LOG_ERROR("Failed to save samples (%08x).", status);
+    }
+  }
+  ProfpFreeProfData(data);
+}
+
+// Checks if the VMX-preemption timer and saving its value on VM-exit are
+// supported
+_Use_decl_annotations_ static bool ProfpIsPreemptionTimerAvailable() {
+  PAGED_CODE();
+
+  // See: Algorithms for Determining VMX Capabilities
+  // Bits 63:32 indicate the allowed 1-settings of these controls.
+  const auto use_true_msrs = Ia32VmxBasicMsr{UtilReadMsr64(Msr::kIa32VmxBasic)}
+                                 .fields.vmx_capability_hint;
+  const VmxPinBasedControls vm_pinctl_allowed1 = {static_cast<unsigned int>(
+      UtilReadMsr64((use_true_msrs) ? Msr::kIa32VmxTruePinbasedCtls
+                                    : Msr::kIa32VmxPinbasedCtls) >>
+      32)};
+  const VmxVmExitControls vm_exitctl_allowed1 = {static_cast<unsigned int>(
+      UtilReadMsr64((use_true_msrs) ? Msr::kIa32VmxTrueExitCtls
+                                    : Msr::kIa32VmxExitCtls) >>
+      32)};
+  return vm_pinctl_allowed1.fields.activate_vmx_peemption_timer &&
+         vm_exitctl_allowed1.fields.save_vmx_preemption_timer_value;
+}
+
+// Estimates TSC frequency using the performance counter
+_Use_decl_annotations_ static ULONG64 ProfpEstimateTscFrequency() {
+  PAGED_CODE();
+
+  LARGE_INTEGER performance_frequency = {};
+  const auto counter_begin = KeQueryPerformanceCounter(&performance_frequency);
+  const auto tsc_begin = __rdtsc();
+  UtilSleep(100);
+  const auto counter_end = KeQueryPerformanceCounter(nullptr);
+  const auto tsc_end = __rdtsc();
+
+  const auto elapsed_counter = counter_end.QuadPart - counter_begin.QuadPart;
+  return (tsc_end - tsc_begin) * performance_frequency.QuadPart /
+         elapsed_counter;
+}
+
+// Arms the timer on the current processor
+_Use_decl_annotations_ static NTSTATUS ProfpEnableSamplingCallback(
+    void* context) {
+  return UtilVmCall(HypercallNumber::kEnableSampling, context);
+}
+
+// Disarms the timer on the current processor
+_Use_decl_annotations_ static NTSTATUS ProfpDisableSamplingCallback(
+    void* context) {
+  return UtilVmCall(HypercallNumber::kDisableSampling, context);
+}
+
+// Arms the VMX-preemption timer. The remaining value is saved on every VM-exit
+// so that other VM-exits do not reset the sampling period.
+_Use_decl_annotations_ void ProfVmCallEnableSampling(void* context) {
+  UNREFERENCED_PARAMETER(context);
+
+  UtilVmWrite(VmcsField::kVmxPreemptionTimerValue, g_profp_data->timer_value);
+
+  VmxVmExitControls vm_exitctl = {
+      static_cast<unsigned int>(UtilVmRead(VmcsField::kVmExitControls))};
+  vm_exitctl.fields.save_vmx_preemption_timer_value = true;
+  UtilVmWrite(VmcsField::kVmExitControls, vm_exitctl.all);
+
+  VmxPinBasedControls vm_pinctl = {
+      static_cast<unsigned int>(UtilVmRead(VmcsField::kPinBasedVmExecControl))};
+  vm_pinctl.fields.activate_vmx_peemption_timer = true;
+  UtilVmWrite(VmcsField::kPinBasedVmExecControl, vm_pinctl.all);
+}
+
+// Disarms the VMX-preemption timer
+_Use_decl_annotations_ void ProfVmCallDisableSampling(void* context) {
+  UNREFERENCED_PARAMETER(context);
+
+  VmxPinBasedControls vm_pinctl = {
+      static_cast<unsigned int>(UtilVmRead(VmcsField::kPinBasedVmExecControl))};
+  vm_pinctl.fields.activate_vmx_peemption_timer = false;
+  UtilVmWrite(VmcsField::kPinBasedVmExecControl, vm_pinctl.all);
+
+  VmxVmExitControls vm_exitctl = {
+      static_cast<unsigned int>(UtilVmRead(VmcsField::kVmExitControls))};
+  vm_exitctl.fields.save_vmx_preemption_timer_value = false;
+  UtilVmWrite(VmcsField::kVmExitControls, vm_exitctl.all);
+}
+
+// Records a sample into the ring of the current processor and re-arms the timer
+_Use_decl_annotations_ void ProfHandlePreemptionTimer(ULONG_PTR guest_ip,
+                                                      ULONG_PTR guest_sp) {
+  const auto tsc_begin = __rdtsc();
+  const auto data = g_profp_data;
+  if (!data) {
+    return;
+  }
+
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  auto& processor_data = *data->processors[processor];
+  auto& sample = processor_data.samples[processor_data.sample_count %
+                                        kProfpSamplesPerProcessor];
+  sample.tsc = tsc_begin;
+  sample.ip = guest_ip;
+  sample.cr3 = UtilVmRead(VmcsField::kGuestCr3);
+  sample.processor = processor;
+  sample.kernel_mode = (UtilVmRead(VmcsField::kGuestCsSelector) & 3) == 0;
+  RtlZeroMemory(sample.stack, sizeof(sample.stack));
+  if (data->capture_stack && sample.kernel_mode) {
+    ProfpCaptureStack(guest_sp, sample.stack);
+  }
+  processor_data.sample_count++;
+
+  UtilVmWrite(VmcsField::kVmxPreemptionTimerValue, data->timer_value);
+  processor_data.handler_cycles += __rdtsc() - tsc_begin;
+}
+
+// Copies the top of a kernel-mode stack. Only a system address is read since it
+// is accessible regardless of the current CR3.
+_Use_decl_annotations_ static void ProfpCaptureStack(
+    ULONG_PTR guest_sp, ULONG64 (&stack)[kProfStackDepth]) {
+  const auto stack_begin = reinterpret_cast<ULONG_PTR*>(guest_sp);
+  const auto stack_end = stack_begin + kProfStackDepth - 1;
+  if (stack_begin < MmSystemRangeStart ||
+      !UtilIsAccessibleAddress(stack_begin) ||
+      !UtilIsAccessibleAddress(stack_end)) {
+    return;
+  }
+  for (auto i = 0ul; i < kProfStackDepth; ++i) {
+    stack[i] = stack_begin[i];
+  }
+}
+
+// Prints out how much time was spent in the handler on each processor. It does
+// not include costs of VM-exit and VM-entry themselves.
+_Use_decl_annotations_ static void ProfpReportOverhead(const ProfData& data) {
+  PAGED_CODE();
+
+  const auto elapsed_cycles = __rdtsc() - data.start_tsc;
+  HYPERPLATFORM_LOG_INFO("%-10s,%10s,%20s,%20s,%20s,%15s", "Processor",
+                         "Frequency", "Samples", "Handler Cycles",
+                         "Cycles / Sample", "Overhead (ppm)");
+  for (auto i = 0ul; i < data.processor_count; ++i) {
+    const auto& processor_data = *data.processors[i];
+    const auto cycles_per_sample =
+        (processor_data.sample_count)
+            ? processor_data.handler_cycles / processor_data.sample_count
+            : 0;
+    const auto overhead_ppm =
+        (elapsed_cycles) ? processor_data.handler_cycles * 1000000 /
+                               elapsed_cycles
+                         : 0;
+    HYPERPLATFORM_LOG_INFO("%10lu,%10lu,%20I64u,%20I64u,%20I64u,%15I64u", i,
+                           data.frequency, processor_data.sample_count,
+                           processor_data.handler_cycles, cycles_per_sample,
+                           overhead_ppm);
+  }
+}
+
+// Writes samples to the file in the format described in profiler.h
+_Use_decl_annotations_ static NTSTATUS ProfpWriteSampleFile(
+    const ProfData& data, const wchar_t* file_path) {
+  PAGED_CODE();
+
+  UNICODE_STRING file_path_u = {};
+  RtlInitUnicodeString(&file_path_u, file_path);
+
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, &file_path_u,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+
+  HANDLE file = nullptr;
+  IO_STATUS_BLOCK io_status = {};
+  auto status = ZwCreateFile(
+      &file, GENERIC_WRITE | SYNCHRONIZE, &oa, &io_status, nullptr,
+      FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  ProfFileHeader header = {};
+  header.magic = kProfFileMagic;
+  header.version = kProfFileVersion;
+  header.frequency = data.frequency;
+  header.stack_depth = kProfStackDepth;
+  header.tsc_frequency = data.tsc_frequency;
+  header.processor_count = data.processor_count;
+  for (auto i = 0ul; i < data.processor_count; ++i) {
+    header.sample_count += static_cast<ULONG>(
+        min(data.processors[i]->sample_count,
+            static_cast<ULONG64>(kProfpSamplesPerProcessor)));
+  }
+  status = ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status, &header,
+                       sizeof(header), nullptr, nullptr);
+
+  // Write samples of each processor from the oldest one. When a ring has
+  // wrapped around, the oldest sample is at the next write position.
+  for (auto i = 0ul; NT_SUCCESS(status) && i < data.processor_count; ++i) {
+    const auto& processor_data = *data.processors[i];
+    const auto count = processor_data.sample_count;
+    const auto next = static_cast<ULONG>(count % kProfpSamplesPerProcessor);
+    if (count > kProfpSamplesPerProcessor) {
+      const auto tail_count = kProfpSamplesPerProcessor - next;
+      status = ZwWriteFile(
+          file, nullptr, nullptr, nullptr, &io_status,
+          const_cast<ProfSample*>(&processor_data.samples[next]),
+          tail_count * sizeof(ProfSample), nullptr, nullptr);
+    }
+    const auto head_count =
+        (count > kProfpSamplesPerProcessor) ? next : static_cast<ULONG>(count);
+    if (NT_SUCCESS(status) && head_count) {
+      status = ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+                           const_cast<ProfSample*>(processor_data.samples),
+                           head_count * sizeof(ProfSample), nullptr, nullptr);
+    }
+  }
+  ZwClose(file);
+  return status;
+}
+
+// Frees ProfData and all rings referenced from it
+_Use_decl_annotations_ static void ProfpFreeProfData(ProfData* data) {
+  for (auto i = 0ul; i < data->processor_count; ++i) {
+    if (data->processors[i]) {
+      ExFreePoolWithTag(data->processors[i], kHyperPlatformCommonPoolTag);
+    }
+  }
+  ExFreePoolWithTag(data, kHyperPlatformCommonPoolTag);
+}
+
+}  // extern "C"
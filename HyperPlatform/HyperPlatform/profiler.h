@@ -0,0 +1,116 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to sampling profiler functions.
+
+#ifndef HYPERPLATFORM_PROFILER_H_
+#define HYPERPLATFORM_PROFILER_H_
+
+#include <fltKernel.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// 'HPRF'; a magic value of a sample file
+static const ULONG kProfFileMagic = 'FRPH';
+
+/// A version of a sample file format
+static const ULONG kProfFileVersion = 1;
+
+/// How many stack entries are captured for each sample
+static const ULONG kProfStackDepth = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// A header of a sample file written by ProfTermination(). A file consists of
+/// this header followed by sample_count of ProfSample. All values are little
+/// endian and do not depend on the architecture of the system. Samples are
+/// grouped by processors and are sorted by tsc within each processor.
+#include <pshpack1.h>
+struct ProfFileHeader {
+  ULONG magic;            ///< kProfFileMagic
+  ULONG version;          ///< kProfFileVersion
+  ULONG frequency;        ///< Requested sampling frequency in Hz
+  ULONG stack_depth;      ///< kProfStackDepth
+  ULONG64 tsc_frequency;  ///< Estimated TSC frequency in Hz
+  ULONG processor_count;  ///< A number of processors sampled
+  ULONG sample_count;     ///< A number of ProfSample following this header
+};
+static_assert(sizeof(ProfFileHeader) == 32, "Size check");
+
+/// A sample taken on the VMX-preemption timer VM-exit
+struct ProfSample {
+  ULONG64 tsc;                     ///< TSC when the sample was taken
+  ULONG64 ip;                      ///< Guest IP
+  ULONG64 cr3;                     ///< Guest CR3
+  ULONG64 stack[kProfStackDepth];  ///< Guest stack contents, or zeros
+  ULONG processor;                 ///< A processor number
+  ULONG kernel_mode : 1;           ///< Set if the guest ran in kernel-mode
+  ULONG reserved : 31;             ///< Unused
+};
+static_assert(sizeof(ProfSample) == 64, "Size check");
+#include <poppack.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Starts sampling guest execution on all processors
+/// @param frequency  Sampling frequency in Hz per processor
+/// @param capture_stack  true to capture guest stack contents on kernel-mode
+/// @return STATUS_SUCCESS on success
+///
+/// Samples are taken on the VMX-preemption timer VM-exit and saved into a ring
+/// buffer of each processor. A driver must call ProfTermination() when this
+/// function succeeded.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    ProfInitialization(_In_ ULONG frequency, _In_ bool capture_stack);
+
+/// Stops sampling, reports overhead and saves samples
+/// @param file_path  A path to save samples, or nullptr
+_IRQL_requires_max_(PASSIVE_LEVEL) void ProfTermination(
+    _In_opt_ const wchar_t* file_path);
+
+/// Arms the VMX-preemption timer on the current processor
+/// @param context  Unused
+_IRQL_requires_min_(DISPATCH_LEVEL) void ProfVmCallEnableSampling(
+    _In_opt_ void* context);
+
+/// Disarms the VMX-preemption timer on the current processor
+/// @param context  Unused
+_IRQL_requires_min_(DISPATCH_LEVEL) void ProfVmCallDisableSampling(
+    _In_opt_ void* context);
+
+/// Handles VM-exit triggered by the VMX-preemption timer
+/// @param guest_ip   Guest IP
+/// @param guest_sp   Guest SP
+_IRQL_requires_min_(DISPATCH_LEVEL) void ProfHandlePreemptionTimer(
+    _In_ ULONG_PTR guest_ip, _In_ ULONG_PTR guest_sp);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_PROFILER_H_
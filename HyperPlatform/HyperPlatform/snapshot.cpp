@@ -0,0 +1,429 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements incremental memory snapshot functions.
+
+#include "snapshot.h"
+#include "common.h"
+#include "ept.h"
+#include "log.h"
+#include "util.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A bit of an EPT entry mapping a 4KB page set by the processor on write
+static const ULONG64 kSnappDirtyFlag = 1ull << 9;
+
+// How many EPT entries are in a single EPT page table
+static const auto kSnappEntriesPerTable = 512ul;
+
+// How many pages are buffered before written to a file
+static const auto kSnappPagesPerWrite = 16ul;
+
+// A size of a page record in a file
+static const auto kSnappPageRecordSize = sizeof(SnapPageHeader) + PAGE_SIZE;
+
+// See MM_COPY_MEMORY_PHYSICAL
+static const ULONG kSnappMmCopyMemoryPhysical = 0x1;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// See MM_COPY_ADDRESS
+union SnapCopyAddress {
+  void* virtual_address;
+  PHYSICAL_ADDRESS physical_address;
+};
+
+using MmCopyMemoryType = NTSTATUS(NTAPI)(_In_ void* target_address,
+                                         _In_ SnapCopyAddress source_address,
+                                         _In_ SIZE_T number_of_bytes,
+                                         _In_ ULONG flags,
+                                         _Out_ SIZE_T* number_of_bytes_copied);
+
+// Global state of snapshots
+struct SnapData {
+  EptData* ept_data;
+  ULONG snapshot_interval;  // In seconds
+  KEVENT stop_event;
+  HANDLE snapshot_thread_handle;
+  HANDLE file;
+  ULONG epoch;
+  MmCopyMemoryType* MmCopyMemory;
+
+  // Pages modified since the previous epoch in order of
+  // UtilGetPhysicalMemoryRanges()
+  RTL_BITMAP dirty_pages;
+  ULONG* dirty_pages_buffer;
+
+  // kSnappPagesPerWrite of page records to be written
+  UCHAR* write_buffer;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    SnappCreateSnapshotFile(_Inout_ SnapData* data,
+                            _In_ const wchar_t* file_path);
+
+static KSTART_ROUTINE SnappSnapshotThreadRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    SnappTakeSnapshot(_Inout_ SnapData* data);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void SnappHarvestDirtyFlags(
+    _Inout_ SnapData* data);
+
+static void SnappFreeSnapData(_In_ SnapData* data);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, SnapInitialization)
+#pragma alloc_text(INIT, SnappCreateSnapshotFile)
+#pragma alloc_text(PAGE, SnapTermination)
+#pragma alloc_text(PAGE, SnappSnapshotThreadRoutine)
+#pragma alloc_text(PAGE, SnappTakeSnapshot)
+#pragma alloc_text(PAGE, SnappHarvestDirtyFlags)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Snapshot state
+static SnapData* g_snapp_data;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Creates a snapshot file, enables EPT accessed and dirty flags on all
+// processors and starts a snapshot thread
+_Use_decl_annotations_ NTSTATUS SnapInitialization(ULONG snapshot_interval,
+                                                   const wchar_t* file_path) {
+  PAGED_CODE();
+
+  if (!snapshot_interval) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  if (!EptIsAccessedAndDirtyFlagsAvailable()) {
+    HYPERPLATFORM_LOG_ERROR("EPT accessed and dirty flags are not supported.");
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  // MmCopyMemory is the supported way to read arbitrary physical memory and
+  // is available on Windows 8.1 and later
+  const auto mm_copy_memory = reinterpret_cast<MmCopyMemoryType*>(
+      UtilGetSystemProcAddress(L"MmCopyMemory"));
+  if (!mm_copy_memory) {
+    HYPERPLATFORM_LOG_ERROR("MmCopyMemory is not available.");
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  const auto data = reinterpret_cast<SnapData*>(ExAllocatePoolWithTag(
+      NonPagedPoolNx, sizeof(SnapData), kHyperPlatformCommonPoolTag));
+  if (!data) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(data, sizeof(SnapData));
+  data->snapshot_interval = snapshot_interval;
+  data->MmCopyMemory = mm_copy_memory;
+  KeInitializeEvent(&data->stop_event, NotificationEvent, FALSE);
+
+  // The dirty page bitmap is only accessed by the snapshot thread
+  const auto pm_ranges = UtilGetPhysicalMemoryRanges();
+  const auto number_of_pages = static_cast<ULONG>(pm_ranges->number_of_pages);
+  const auto bitmap_size =
+      ((number_of_pages + sizeof(ULONG) * CHAR_BIT - 1) /
+       (sizeof(ULONG) * CHAR_BIT)) * sizeof(ULONG);
+  data->dirty_pages_buffer = reinterpret_cast<ULONG*>(ExAllocatePoolWithTag(
+      PagedPool, bitmap_size, kHyperPlatformCommonPoolTag));
+  if (!data->dirty_pages_buffer) {
+    SnappFreeSnapData(data);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlInitializeBitMap(&data->dirty_pages, data->dirty_pages_buffer,
+                      number_of_pages);
+
+  // MmCopyMemory requires a non-paged buffer
+  data->write_buffer = reinterpret_cast<UCHAR*>(
+      ExAllocatePoolWithTag(NonPagedPoolNx,
+                            kSnappPagesPerWrite * kSnappPageRecordSize,
+                            kHyperPlatformCommonPoolTag));
+  if (!data->write_buffer) {
+    SnappFreeSnapData(data);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+
+  auto status = SnappCreateSnapshotFile(data, file_path);
+  if (!NT_SUCCESS(status)) {
+    SnappFreeSnapData(data);
+    return status;
+  }
+
+  status = EptEnableDirtyTracking(&data->ept_data);
+  if (!NT_SUCCESS(status)) {
+    EptDisableDirtyTracking();
+    SnappFreeSnapData(data);
+    return status;
+  }
+
+  status = PsCreateSystemThread(&data->snapshot_thread_handle, GENERIC_ALL,
+                                nullptr, nullptr, nullptr,
+                                SnappSnapshotThreadRoutine, data);
+  if (!NT_SUCCESS(status)) {
+    EptDisableDirtyTracking();
+    SnappFreeSnapData(data);
+    return status;
+  }
+
+  g_snapp_data = data;
+  HYPERPLATFORM_LOG_INFO("Memory snapshots have been started.");
+  return status;
+}
+
+// Creates a snapshot file and writes a file header
+_Use_decl_annotations_ static NTSTATUS SnappCreateSnapshotFile(
+    SnapData* data, const wchar_t* file_path) {
+  PAGED_CODE();
+
+  UNICODE_STRING file_path_u = {};
+  RtlInitUnicodeString(&file_path_u, file_path);
+
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, &file_path_u,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+
+  HANDLE file = nullptr;
+  IO_STATUS_BLOCK io_status = {};
+  auto status = ZwCreateFile(
+      &file, GENERIC_WRITE | SYNCHRONIZE, &oa, &io_status, nullptr,
+      FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  SnapFileHeader header = {};
+  header.magic = kSnapFileMagic;
+  header.version = kSnapFileVersion;
+  header.page_size = PAGE_SIZE;
+  header.number_of_pages = UtilGetPhysicalMemoryRanges()->number_of_pages;
+  status = ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status, &header,
+                       sizeof(header), nullptr, nullptr);
+  if (!NT_SUCCESS(status)) {
+    ZwClose(file);
+    return status;
+  }
+
+  data->file = file;
+  return status;
+}
+
+// Takes the last snapshot, stops the snapshot thread and disables EPT accessed
+// and dirty flags on all processors
+_Use_decl_annotations_ void SnapTermination() {
+  PAGED_CODE();
+
+  const auto data = g_snapp_data;
+  if (!data) {
+    return;
+  }
+  g_snapp_data = nullptr;
+
+  KeSetEvent(&data->stop_event, IO_NO_INCREMENT, FALSE);
+  auto status = ZwWaitForSingleObject(data->snapshot_thread_handle, FALSE,
+                                      nullptr);
+  NT_VERIFY(NT_SUCCESS(status));
+  ZwClose(data->snapshot_thread_handle);
+
+  status = EptDisableDirtyTracking();
+  NT_VERIFY(NT_SUCCESS(status));
+  HYPERPLATFORM_LOG_INFO("%lu epochs of snapshots have been saved.",
+                         data->epoch);
+  SnappFreeSnapData(data);
+}
+
+// Takes a full snapshot, and then incremental snapshots periodically until the
+// stop event is signaled. The last snapshot is taken before exiting.
+_Use_decl_annotations_ static VOID SnappSnapshotThreadRoutine(
+    void* start_context) {
+  PAGED_CODE();
+
+  const auto data = reinterpret_cast<SnapData*>(start_context);
+  LARGE_INTEGER interval = {};
+  interval.QuadPart = -(10000000ll * data->snapshot_interval);  // sec
+
+  // Discard flags set before the first epoch. All pages are saved in it.
+  SnappHarvestDirtyFlags(data);
+  RtlSetAllBits(&data->dirty_pages);
+  auto status = SnappTakeSnapshot(data);
+
+  while (NT_SUCCESS(status)) {
+    const auto stopped =
+        KeWaitForSingleObject(&data->stop_event, Executive, KernelMode, FALSE,
+                              &interval) != STATUS_TIMEOUT;
+    SnappHarvestDirtyFlags(data);
+    status = SnappTakeSnapshot(data);
+    if (stopped) {
+      break;
+    }
+  }
+  if (!NT_SUCCESS(status)) {
+    HYPERPLATFORM_LOG_ERROR("Failed to write a snapshot (%08x).", status);
+  }
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Appends an epoch containing all pages in the dirty page bitmap to the
+// snapshot file, and clears the bitmap
+_Use_decl_annotations_ static NTSTATUS SnappTakeSnapshot(SnapData* data) {
+  PAGED_CODE();
+
+  LARGE_INTEGER system_time = {};
+  KeQuerySystemTime(&system_time);
+
+  SnapEpochHeader header = {};
+  header.magic = kSnapEpochMagic;
+  header.epoch = data->epoch;
+  header.timestamp = system_time.QuadPart;
+  header.page_count = RtlNumberOfSetBits(&data->dirty_pages);
+
+  IO_STATUS_BLOCK io_status = {};
+  auto status = ZwWriteFile(data->file, nullptr, nullptr, nullptr, &io_status,
+                            &header, sizeof(header), nullptr, nullptr);
+
+  // Copy contents of dirty pages to the buffer and flush it when it is full.
+  // A page that cannot be read is saved with zeros so that the number of pages
+  // matches the header.
+  auto buffered_count = 0ul;
+  auto failed_count = 0ul;
+  ULONG page_index = 0;
+  const auto pm_ranges = UtilGetPhysicalMemoryRanges();
+  for (auto run_index = 0ul;
+       NT_SUCCESS(status) && run_index < pm_ranges->number_of_runs;
+       ++run_index) {
+    const auto run = &pm_ranges->run[run_index];
+    const auto base_addr = static_cast<ULONG64>(run->base_page) * PAGE_SIZE;
+    for (auto i = 0ull; NT_SUCCESS(status) && i < run->page_count;
+         ++i, ++page_index) {
+      if (!RtlCheckBit(&data->dirty_pages, page_index)) {
+        continue;
+      }
+
+      const auto record =
+          data->write_buffer + buffered_count * kSnappPageRecordSize;
+      const auto page_header = reinterpret_cast<SnapPageHeader*>(record);
+      const auto contents = record + sizeof(SnapPageHeader);
+      page_header->physical_address = base_addr + i * PAGE_SIZE;
+
+      SnapCopyAddress source = {};
+      source.physical_address.QuadPart = page_header->physical_address;
+      SIZE_T copied = 0;
+      if (!NT_SUCCESS(data->MmCopyMemory(contents, source, PAGE_SIZE,
+                                         kSnappMmCopyMemoryPhysical,
+                                         &copied)) ||
+          copied != PAGE_SIZE) {
+        RtlZeroMemory(contents, PAGE_SIZE);
+        failed_count++;
+      }
+
+      if (++buffered_count == kSnappPagesPerWrite) {
+        status = ZwWriteFile(data->file, nullptr, nullptr, nullptr, &io_status,
+                             data->write_buffer,
+                             buffered_count * kSnappPageRecordSize, nullptr,
+                             nullptr);
+        buffered_count = 0;
+      }
+    }
+  }
+  if (NT_SUCCESS(status) && buffered_count) {
+    status = ZwWriteFile(data->file, nullptr, nullptr, nullptr, &io_status,
+                         data->write_buffer,
+                         buffered_count * kSnappPageRecordSize, nullptr,
+                         nullptr);
+  }
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  HYPERPLATFORM_LOG_INFO("Snapshot epoch %lu: %I64u pages (%lu unreadable)",
+                         data->epoch, header.page_count, failed_count);
+  RtlClearAllBits(&data->dirty_pages);
+  data->epoch++;
+  return status;
+}
+
+// Harvests and clears dirty flags of all EPT entries mapping physical memory
+// into the dirty page bitmap, and lets processors set them again
+_Use_decl_annotations_ static void SnappHarvestDirtyFlags(SnapData* data) {
+  PAGED_CODE();
+
+  ULONG page_index = 0;
+  const auto pm_ranges = UtilGetPhysicalMemoryRanges();
+  for (auto run_index = 0ul; run_index < pm_ranges->number_of_runs;
+       ++run_index) {
+    const auto run = &pm_ranges->run[run_index];
+    const auto base_addr = static_cast<ULONG64>(run->base_page) * PAGE_SIZE;
+
+    // Entries are contiguous only within the same page table
+    for (ULONG_PTR i = 0; i < run->page_count;) {
+      const auto indexed_addr = base_addr + i * PAGE_SIZE;
+      const auto table_index = static_cast<ULONG>(
+          (indexed_addr >> PAGE_SHIFT) % kSnappEntriesPerTable);
+      const auto count = static_cast<ULONG>(
+          min(kSnappEntriesPerTable - table_index, run->page_count - i));
+      const auto entries = EptGetEptPtEntry(data->ept_data, indexed_addr);
+      for (auto j = 0ul; j < count; ++j, ++page_index) {
+        // The processor may set flags concurrently. Clear it atomically.
+        if (!(entries[j].all & kSnappDirtyFlag)) {
+          continue;
+        }
+        const auto old_value = InterlockedAnd64(
+            reinterpret_cast<volatile LONG64*>(&entries[j].all),
+            ~static_cast<LONG64>(kSnappDirtyFlag));
+        if (old_value & kSnappDirtyFlag) {
+          RtlSetBit(&data->dirty_pages, page_index);
+        }
+      }
+      i += count;
+    }
+  }
+
+  // The processor does not set the dirty flag for translations cached in TLB
+  EptFlushTranslations();
+}
+
+// Closes the snapshot file and frees SnapData and buffers referenced from it
+_Use_decl_annotations_ static void SnappFreeSnapData(SnapData* data) {
+  if (data->file) {
+    ZwClose(data->file);
+  }
+  if (data->write_buffer) {
+    ExFreePoolWithTag(data->write_buffer, kHyperPlatformCommonPoolTag);
+  }
+  if (data->dirty_pages_buffer) {
+    ExFreePoolWithTag(data->dirty_pages_buffer, kHyperPlatformCommonPoolTag);
+  }
+  ExFreePoolWithTag(data, kHyperPlatformCommonPoolTag);
+}
+
+}  // extern "C"
@@ -0,0 +1,107 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to incremental memory snapshot functions.
+
+#ifndef HYPERPLATFORM_SNAPSHOT_H_
+#define HYPERPLATFORM_SNAPSHOT_H_
+
+#include <fltKernel.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// 'HSNP'; a magic value of a snapshot file
+static const ULONG kSnapFileMagic = 'PNSH';
+
+/// 'EPCH'; a magic value of an epoch record
+static const ULONG kSnapEpochMagic = 'HCPE';
+
+/// A version of a snapshot file format
+static const ULONG kSnapFileVersion = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// A header of a snapshot file. A file consists of this header followed by
+/// a sequence of epochs, and is only appended while snapshots are taken.
+///
+/// Each epoch begins with SnapEpochHeader followed by page_count of
+/// SnapPageHeader, each of which is followed by page_size bytes of contents of
+/// the page. The first epoch contains all physical memory pages, and each
+/// following epoch contains only pages modified since the previous epoch. An
+/// image at epoch N is reconstructed by applying epochs 0 through N in order.
+/// All values are little endian and do not depend on the architecture of the
+/// system.
+#include <pshpack1.h>
+struct SnapFileHeader {
+  ULONG magic;              ///< kSnapFileMagic
+  ULONG version;            ///< kSnapFileVersion
+  ULONG page_size;          ///< Size of a page in bytes
+  ULONG reserved;           ///< Zero
+  ULONG64 number_of_pages;  ///< A number of physical memory pages
+};
+static_assert(sizeof(SnapFileHeader) == 24, "Size check");
+
+/// A header of an epoch
+struct SnapEpochHeader {
+  ULONG magic;         ///< kSnapEpochMagic
+  ULONG epoch;         ///< A sequence number of the epoch starting from 0
+  ULONG64 timestamp;   ///< System time when the epoch started
+  ULONG64 page_count;  ///< A number of pages following this header
+};
+static_assert(sizeof(SnapEpochHeader) == 24, "Size check");
+
+/// A header of a page in an epoch
+struct SnapPageHeader {
+  ULONG64 physical_address;  ///< A physical address of the page
+};
+static_assert(sizeof(SnapPageHeader) == 8, "Size check");
+#include <poppack.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Enables EPT accessed and dirty flags and starts a snapshot thread
+/// @param snapshot_interval  An interval to take a snapshot in seconds
+/// @param file_path  A path to save snapshots
+/// @return STATUS_SUCCESS on success
+///
+/// The snapshot thread writes all physical memory pages to \a file_path first,
+/// and then periodically appends pages whose dirty flags of EPT are set. A
+/// driver must call SnapTermination() when this function succeeded.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    SnapInitialization(_In_ ULONG snapshot_interval,
+                       _In_ const wchar_t* file_path);
+
+/// Takes the last snapshot, stops the snapshot thread and disables EPT
+/// accessed and dirty flags
+_IRQL_requires_max_(PASSIVE_LEVEL) void SnapTermination();
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_SNAPSHOT_H_
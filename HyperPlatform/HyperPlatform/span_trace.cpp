@@ -0,0 +1,347 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements span recording functions.
+
+#include "span_trace.h"
+#define NTSTRSAFE_NO_CB_FUNCTIONS
+#include <ntstrsafe.h>
+#include "common.h"
+#include "log.h"
+#include "memory_usage.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// How many spans are kept per a processor. Older spans are overwritten.
+static const ULONG kSpanpSpansPerProcessor = 16 * 1024;
+
+// How many distinct names can be saved. Spans with other names are dropped.
+static const ULONG kSpanpMaxNames = 256;
+
+// How many spans are converted and written to a file at once
+static const ULONG kSpanpRecordsPerWrite = 256;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A span in a ring. A name is kept as a pointer and converted into an index of
+// a name table when it is saved.
+struct SpanEntry {
+  ULONG64 begin_tsc;
+  ULONG64 end_tsc;
+  ULONG64 arg;
+  const char* name;
+  SpanKind kind;
+};
+
+// Spans of a processor
+struct SpanProcessorData {
+  ULONG64 span_count;  // A total number of spans recorded
+  SpanEntry spans[kSpanpSpansPerProcessor];
+};
+
+// Global state of the span recorder
+struct SpanData {
+  ULONG64 start_tsc;
+  ULONG64 start_counter;
+  ULONG64 counter_frequency;
+  ULONG processor_count;
+  SpanProcessorData* processors[1];  // Has processor_count elements
+};
+
+// A work area to save spans
+struct SpanWriteContext {
+  const char* names[kSpanpMaxNames];
+  ULONG name_count;
+  SpanFileRecord records[kSpanpRecordsPerWrite];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    SpanpWriteSpanFile(_In_ const SpanData& data,
+                       _In_ const wchar_t* file_path);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG
+    SpanpCollectNames(_In_ const SpanData& data,
+                      _Inout_ SpanWriteContext* context);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG
+    SpanpFindName(_In_ const SpanWriteContext& context,
+                  _In_ const char* name);
+
+static void SpanpFreeSpanData(_In_ SpanData* data);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, SpanInitialization)
+#pragma alloc_text(PAGE, SpanTermination)
+#pragma alloc_text(PAGE, SpanpWriteSpanFile)
+#pragma alloc_text(PAGE, SpanpCollectNames)
+#pragma alloc_text(PAGE, SpanpFindName)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Span recorder state. It is set before the VMM starts recording spans and
+// cleared after it stops.
+static SpanData* g_spanp_data;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates per-processor span rings and starts recording
+_Use_decl_annotations_ NTSTATUS SpanInitialization() {
+  PAGED_CODE();
+
+  const auto processor_count =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto data_size =
+      sizeof(SpanData) + sizeof(SpanProcessorData*) * (processor_count - 1);
+  const auto data = reinterpret_cast<SpanData*>(MemUsageAllocate(
+      NonPagedPoolNx, data_size, MemUsageSubsystem::kPerformance));
+  if (!data) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(data, data_size);
+  data->processor_count = processor_count;
+  for (auto i = 0ul; i < processor_count; ++i) {
+    const auto processor_data =
+        reinterpret_cast<SpanProcessorData*>(MemUsageAllocate(
+            NonPagedPoolNx, sizeof(SpanProcessorData),
+            MemUsageSubsystem::kPerformance));
+    if (!processor_data) {
+      SpanpFreeSpanData(data);
+      return STATUS_MEMORY_NOT_ALLOCATED;
+    }
+    RtlZeroMemory(processor_data, sizeof(SpanProcessorData));
+    data->processors[i] = processor_data;
+  }
+
+  LARGE_INTEGER counter_frequency = {};
+  data->start_counter = KeQueryPerformanceCounter(&counter_frequency).QuadPart;
+  data->start_tsc = __rdtsc();
+  data->counter_frequency = counter_frequency.QuadPart;
+
+  g_spanp_data = data;
+  HYPERPLATFORM_LOG_INFO("Recording up to %lu spans on each of %lu processors.",
+                         kSpanpSpansPerProcessor, processor_count);
+  return STATUS_SUCCESS;
+}
+
+// Stops recording, then saves spans
+_Use_decl_annotations_ void SpanTermination(const wchar_t* file_path) {
+  PAGED_CODE();
+
+  const auto data = g_spanp_data;
+  if (!data) {
+    return;
+  }
+  g_spanp_data = nullptr;
+
+  if (file_path) {
+    const auto status = SpanpWriteSpanFile(*data, file_path);
+    if (!NT_SUCCESS(status)) {
+      HYPERPLATFORM_LOG_ERROR("Failed to save spans (%08x).", status);
+    }
+  }
+  SpanpFreeSpanData(data);
+}
+
+// Records a span into the ring of the current processor
+_Use_decl_annotations_ void SpanRecord(const char* name, SpanKind kind,
+                                       ULONG64 begin_tsc, ULONG64 end_tsc,
+                                       ULONG64 arg) {
+  const auto data = g_spanp_data;
+  if (!data) {
+    return;
+  }
+
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  if (processor >= data->processor_count) {
+    return;
+  }
+  auto& processor_data = *data->processors[processor];
+  auto& span = processor_data.spans[processor_data.span_count %
+                                    kSpanpSpansPerProcessor];
+  span.begin_tsc = begin_tsc;
+  span.end_tsc = end_tsc;
+  span.arg = arg;
+  span.name = name;
+  span.kind = kind;
+  processor_data.span_count++;
+}
+
+// Writes spans to the file in the format described in span_trace.h
+_Use_decl_annotations_ static NTSTATUS SpanpWriteSpanFile(
+    const SpanData& data, const wchar_t* file_path) {
+  PAGED_CODE();
+
+  LARGE_INTEGER end_counter = KeQueryPerformanceCounter(nullptr);
+  const auto end_tsc = __rdtsc();
+
+  const auto context = reinterpret_cast<SpanWriteContext*>(MemUsageAllocate(
+      PagedPool, sizeof(SpanWriteContext), MemUsageSubsystem::kPerformance));
+  if (!context) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(context, sizeof(SpanWriteContext));
+
+  UNICODE_STRING file_path_u = {};
+  RtlInitUnicodeString(&file_path_u, file_path);
+
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, &file_path_u,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+
+  HANDLE file = nullptr;
+  IO_STATUS_BLOCK io_status = {};
+  auto status = ZwCreateFile(
+      &file, GENERIC_WRITE | SYNCHRONIZE, &oa, &io_status, nullptr,
+      FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+  if (!NT_SUCCESS(status)) {
+    MemUsageFree(context, sizeof(SpanWriteContext),
+                 MemUsageSubsystem::kPerformance);
+    return status;
+  }
+
+  SpanFileHeader header = {};
+  header.magic = kSpanFileMagic;
+  header.version = kSpanFileVersion;
+  header.processor_count = data.processor_count;
+  header.span_count = SpanpCollectNames(data, context);
+  header.name_count = context->name_count;
+  header.name_size = kSpanNameLength;
+  header.start_tsc = data.start_tsc;
+  header.end_tsc = end_tsc;
+  header.start_counter = data.start_counter;
+  header.end_counter = end_counter.QuadPart;
+  header.counter_frequency = data.counter_frequency;
+  status = ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status, &header,
+                       sizeof(header), nullptr, nullptr);
+
+  // Write names. A longer name is truncated.
+  for (auto i = 0ul; NT_SUCCESS(status) && i < context->name_count; ++i) {
+    char name[kSpanNameLength] = {};
+    RtlStringCchCopyA(name, RTL_NUMBER_OF(name), context->names[i]);
+    status = ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status, name,
+                         sizeof(name), nullptr, nullptr);
+  }
+
+  // Write spans of each processor from the oldest one. When a ring has wrapped
+  // around, the oldest span is at the next write position.
+  for (auto i = 0ul; NT_SUCCESS(status) && i < data.processor_count; ++i) {
+    const auto& processor_data = *data.processors[i];
+    const auto count = min(processor_data.span_count,
+                           static_cast<ULONG64>(kSpanpSpansPerProcessor));
+    const auto first = processor_data.span_count - count;
+    auto record_count = 0ul;
+    for (auto j = first; NT_SUCCESS(status) && j < first + count; ++j) {
+      const auto& span = processor_data.spans[j % kSpanpSpansPerProcessor];
+      const auto name_index = SpanpFindName(*context, span.name);
+      if (name_index == kSpanpMaxNames) {
+        continue;
+      }
+      auto& record = context->records[record_count++];
+      record.begin_tsc = span.begin_tsc;
+      record.end_tsc = span.end_tsc;
+      record.arg = span.arg;
+      record.name_index = name_index;
+      record.processor = static_cast<USHORT>(i);
+      record.kind = span.kind;
+      if (record_count == kSpanpRecordsPerWrite) {
+        status = ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+                             context->records,
+                             record_count * sizeof(SpanFileRecord), nullptr,
+                             nullptr);
+        record_count = 0;
+      }
+    }
+    if (NT_SUCCESS(status) && record_count) {
+      status = ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+                           context->records,
+                           record_count * sizeof(SpanFileRecord), nullptr,
+                           nullptr);
+    }
+  }
+  ZwClose(file);
+  MemUsageFree(context, sizeof(SpanWriteContext),
+               MemUsageSubsystem::kPerformance);
+  return status;
+}
+
+// Builds a name table from spans in rings and returns a number of spans that
+// will be saved
+_Use_decl_annotations_ static ULONG SpanpCollectNames(
+    const SpanData& data, SpanWriteContext* context) {
+  PAGED_CODE();
+
+  auto span_count = 0ul;
+  for (auto i = 0ul; i < data.processor_count; ++i) {
+    const auto& processor_data = *data.processors[i];
+    const auto count = min(processor_data.span_count,
+                           static_cast<ULONG64>(kSpanpSpansPerProcessor));
+    for (auto j = 0ul; j < count; ++j) {
+      const auto name = processor_data.spans[j].name;
+      if (SpanpFindName(*context, name) == kSpanpMaxNames) {
+        if (context->name_count == kSpanpMaxNames) {
+          continue;
+        }
+        context->names[context->name_count++] = name;
+      }
+      span_count++;
+    }
+  }
+  return span_count;
+}
+
+// Returns an index of the name in the name table, or kSpanpMaxNames
+_Use_decl_annotations_ static ULONG SpanpFindName(
+    const SpanWriteContext& context, const char* name) {
+  PAGED_CODE();
+
+  for (auto i = 0ul; i < context.name_count; ++i) {
+    if (context.names[i] == name) {
+      return i;
+    }
+  }
+  return kSpanpMaxNames;
+}
+
+// Frees SpanData and all rings referenced from it
+_Use_decl_annotations_ static void SpanpFreeSpanData(SpanData* data) {
+  for (auto i = 0ul; i < data->processor_count; ++i) {
+    if (data->processors[i]) {
+      MemUsageFree(data->processors[i], sizeof(SpanProcessorData),
+                   MemUsageSubsystem::kPerformance);
+    }
+  }
+  MemUsageFree(data,
+               sizeof(SpanData) +
+                   sizeof(SpanProcessorData*) * (data->processor_count - 1),
+               MemUsageSubsystem::kPerformance);
+}
+
+}  // extern "C"
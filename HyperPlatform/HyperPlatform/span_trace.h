@@ -0,0 +1,166 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to span recording functions.
+
+#ifndef HYPERPLATFORM_SPAN_TRACE_H_
+#define HYPERPLATFORM_SPAN_TRACE_H_
+
+#include <fltKernel.h>
+#include <intrin.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+#define HYPERPLATFORM_SPAN_P_JOIN2(x, y) x##y
+#define HYPERPLATFORM_SPAN_P_JOIN1(x, y) HYPERPLATFORM_SPAN_P_JOIN2(x, y)
+
+/// Records TSC at execution of this macro and at the end of a scope as a span
+/// @param name   A string literal naming the span
+///
+/// @warning
+/// This macro cannot be used in an INIT section for the same reason as
+/// #HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME().
+#define HYPERPLATFORM_SPAN_RECORD_THIS_SCOPE(name)                     \
+  const SpanScope HYPERPLATFORM_SPAN_P_JOIN1(span_obj_, __COUNTER__)( \
+      (name), SpanKind::kScope, 0)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// 'HSPN'; a magic value of a span file
+static const ULONG kSpanFileMagic = 'NPSH';
+
+/// A version of a span file format
+static const ULONG kSpanFileVersion = 1;
+
+/// A size of each name in a span file, including a terminating null character
+static const ULONG kSpanNameLength = 64;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// What a span measured
+enum class SpanKind : USHORT {
+  kScope,        ///< A scope in the VMM; arg is 0
+  kPreHandler,   ///< A pre-handler of a hook; arg is a hooked address
+  kPostHandler,  ///< A post-handler of a hook; arg is a hooked address
+};
+
+/// A header of a span file written by SpanTermination(). A file is laid out as
+/// below, and all values are little endian:
+///
+///   SpanFileHeader
+///   char names[name_count][name_size]   // null-terminated
+///   SpanFileRecord spans[span_count]
+///
+/// Spans are grouped by processors and are in order of end_tsc within each
+/// processor, so that a span is preceded by spans nested in it. TSC can be
+/// converted into time using the pairs of TSC and the performance counter
+/// taken when recording started and ended.
+#include <pshpack1.h>
+struct SpanFileHeader {
+  ULONG magic;                ///< kSpanFileMagic
+  ULONG version;              ///< kSpanFileVersion
+  ULONG processor_count;      ///< A number of processors recorded
+  ULONG name_count;           ///< A number of names following this header
+  ULONG name_size;            ///< kSpanNameLength
+  ULONG span_count;           ///< A number of SpanFileRecord following names
+  ULONG64 start_tsc;          ///< TSC when recording started
+  ULONG64 end_tsc;            ///< TSC when recording ended
+  ULONG64 start_counter;      ///< The performance counter at start_tsc
+  ULONG64 end_counter;        ///< The performance counter at end_tsc
+  ULONG64 counter_frequency;  ///< Frequency of the performance counter in Hz
+};
+static_assert(sizeof(SpanFileHeader) == 64, "Size check");
+
+/// A span in a span file
+struct SpanFileRecord {
+  ULONG64 begin_tsc;  ///< TSC when the span began
+  ULONG64 end_tsc;    ///< TSC when the span ended
+  ULONG64 arg;        ///< A value depending on kind
+  ULONG name_index;   ///< An index of names
+  USHORT processor;   ///< A processor number
+  SpanKind kind;      ///< What the span measured
+};
+static_assert(sizeof(SpanFileRecord) == 32, "Size check");
+#include <poppack.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Starts recording spans on all processors
+/// @return STATUS_SUCCESS on success
+///
+/// Spans are saved into a ring buffer of each processor. A driver must call
+/// SpanTermination() when this function succeeded.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS SpanInitialization();
+
+/// Stops recording spans and saves them
+/// @param file_path  A path to save spans, or nullptr
+///
+/// This function must be called after no processor can record spans anymore,
+/// for example, after the VMM is terminated.
+_IRQL_requires_max_(PASSIVE_LEVEL) void SpanTermination(
+    _In_opt_ const wchar_t* file_path);
+
+/// Records a span on the current processor
+/// @param name   A string literal naming the span
+/// @param kind   What the span measured
+/// @param begin_tsc  TSC when the span began
+/// @param end_tsc  TSC when the span ended
+/// @param arg    A value depending on \a kind
+///
+/// It does nothing unless SpanInitialization() succeeded. It must be called
+/// with interrupts disabled, such as in VMX-root mode, since a ring buffer of a
+/// processor is updated without a lock.
+void SpanRecord(_In_ const char* name, _In_ SpanKind kind,
+                _In_ ULONG64 begin_tsc, _In_ ULONG64 end_tsc,
+                _In_ ULONG64 arg);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+/// Records a span from construction to destruction of an instance
+class SpanScope {
+ public:
+  /// Gets the current TSC
+  /// @param name   A string literal naming the span
+  /// @param kind   What the span measures
+  /// @param arg    A value depending on \a kind
+  ///
+  /// #HYPERPLATFORM_SPAN_RECORD_THIS_SCOPE() should be used to record a scope.
+  SpanScope(_In_ const char* name, _In_ SpanKind kind, _In_ ULONG64 arg)
+      : name_(name), kind_(kind), arg_(arg), begin_tsc_(__rdtsc()) {}
+
+  /// Records a span ending at the current TSC
+  ~SpanScope() { SpanRecord(name_, kind_, begin_tsc_, __rdtsc(), arg_); }
+
+ private:
+  const char* name_;
+  const SpanKind kind_;
+  const ULONG64 arg_;
+  const ULONG64 begin_tsc_;
+};
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_SPAN_TRACE_H_
@@ -132,13 +132,19 @@ static HardwarePte *UtilpAddressToPdePAE(_In_ const void *address);
 
 static HardwarePte *UtilpAddressToPtePAE(_In_ const void *address);
 
+_IRQL_requires_(DISPATCH_LEVEL) static NTSTATUS
+    UtilpQuiesceCallback(_In_opt_ void *context);
+
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(INIT, UtilInitialization)
 #pragma alloc_text(PAGE, UtilTermination)
 #pragma alloc_text(INIT, UtilpInitializePhysicalMemoryRanges)
 #pragma alloc_text(INIT, UtilpBuildPhysicalMemoryRanges)
+#pragma alloc_text(PAGE, UtilWaitForQuiescence)
 #pragma alloc_text(PAGE, UtilSleep)
 #pragma alloc_text(PAGE, UtilGetSystemProcAddress)
+#pragma alloc_text(PAGE, UtilQueryRegistryDword)
+#pragma alloc_text(PAGE, UtilQueryRegistryString)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -303,6 +309,20 @@ UtilForEachProcessor(NTSTATUS (*callback_routine)(void *), void *context) {
   return STATUS_SUCCESS;
 }
 
+// Runs a no-op on every processor. Getting scheduled on a processor means that
+// it left VMX-root mode at least once.
+_Use_decl_annotations_ NTSTATUS UtilWaitForQuiescence() {
+  PAGED_CODE();
+
+  return UtilForEachProcessor(UtilpQuiesceCallback, nullptr);
+}
+
+// Does nothing. Running this on a processor is the quiescent point.
+_Use_decl_annotations_ static NTSTATUS UtilpQuiesceCallback(void *context) {
+  UNREFERENCED_PARAMETER(context);
+  return STATUS_SUCCESS;
+}
+
 // Sleep the current thread's execution for Millisecond milli-seconds.
 _Use_decl_annotations_ NTSTATUS UtilSleep(LONG Millisecond) {
   PAGED_CODE();
@@ -338,6 +358,54 @@ _Use_decl_annotations_ void *UtilGetSystemProcAddress(
   return MmGetSystemRoutineAddress(&proc_name_U);
 }
 
+// Returns a REG_DWORD value under the registry key, or 0 if the value does not
+// exist
+_Use_decl_annotations_ ULONG UtilQueryRegistryDword(
+    PUNICODE_STRING registry_path, const wchar_t *value_name) {
+  PAGED_CODE();
+
+  ULONG value = 0;
+  RTL_QUERY_REGISTRY_TABLE query_table[2] = {};
+  query_table[0].Flags = RTL_QUERY_REGISTRY_DIRECT |
+                         RTL_QUERY_REGISTRY_TYPECHECK |
+                         RTL_QUERY_REGISTRY_REQUIRED;
+  query_table[0].Name = const_cast<wchar_t *>(value_name);
+  query_table[0].EntryContext = &value;
+  query_table[0].DefaultType = REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT;
+  auto status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE,
+                                       registry_path->Buffer, query_table,
+                                       nullptr, nullptr);
+  if (!NT_SUCCESS(status)) {
+    return 0;
+  }
+  return value;
+}
+
+// Copies a REG_SZ value under the registry key into the buffer. Returns false
+// if the value does not exist or does not fit in the buffer.
+_Use_decl_annotations_ bool UtilQueryRegistryString(
+    PUNICODE_STRING registry_path, const wchar_t *value_name,
+    wchar_t *buffer, USHORT buffer_size) {
+  PAGED_CODE();
+
+  // Leave room for a terminating null character
+  RtlZeroMemory(buffer, buffer_size);
+  UNICODE_STRING value = {};
+  RtlInitEmptyUnicodeString(&value, buffer, buffer_size - sizeof(wchar_t));
+
+  RTL_QUERY_REGISTRY_TABLE query_table[2] = {};
+  query_table[0].Flags = RTL_QUERY_REGISTRY_DIRECT |
+                         RTL_QUERY_REGISTRY_TYPECHECK |
+                         RTL_QUERY_REGISTRY_REQUIRED;
+  query_table[0].Name = const_cast<wchar_t *>(value_name);
+  query_table[0].EntryContext = &value;
+  query_table[0].DefaultType = REG_SZ << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT;
+  auto status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE,
+                                       registry_path->Buffer, query_table,
+                                       nullptr, nullptr);
+  return NT_SUCCESS(status) && value.Length;
+}
+
 // Returns true when a system is on the x86 PAE mode
 /*_Use_decl_annotations_*/ bool UtilIsX86Pae() {
   return (!IsX64() && Cr4{__readcr4()}.fields.pae);
@@ -688,27 +756,50 @@ _Use_decl_annotations_ void UtilWriteMsr64(Msr msr, ULONG64 value) {
   return vmx_status;
 }
 
-// Loads the PDPTE registers from CR3 to VMCS
-_Use_decl_annotations_ void UtilLoadPdptes(ULONG_PTR cr3_value) {
+// Executes the INVEPT instruction and invalidates EPT entry cache derived from
+// the EPT pointer
+_Use_decl_annotations_ VmxStatus UtilInveptSingleContext(ULONG64 ept_pointer) {
+  InvEptDescriptor desc = {};
+  desc.ept_pointer.all = ept_pointer;
+  const auto vmx_status = static_cast<VmxStatus>(
+      AsmInvept(InvEptType::kSingleContextInvalidation, &desc));
+  if (vmx_status != VmxStatus::kOk) {
+    HYPERPLATFORM_LOG_ERROR_SAFE(
+        "UtilInveptSingleContext() failed with an error %d", vmx_status);
+    HYPERPLATFORM_COMMON_DBG_BREAK();
+  }
+  return vmx_status;
+}
+
+// Computes values of the PDPTE registers from CR3
+_Use_decl_annotations_ void UtilGetPdptes(ULONG_PTR cr3_value,
+                                          ULONG64 *pdptes) {
   const auto current_cr3 = __readcr3();
 
   // Have to load cr3 to make UtilPfnFromVa() work properly.
   __writecr3(cr3_value);
 
   // Gets PDPTEs fomr CR3
-  PdptrRegister pd_pointers[4] = {};
   for (auto i = 0ul; i < 4; ++i) {
     const auto pd_addr = kUtilpPdeBasePae + i * PAGE_SIZE;
-    pd_pointers[i].fields.present = true;
-    pd_pointers[i].fields.page_directory_pa =
+    PdptrRegister pd_pointer = {};
+    pd_pointer.fields.present = true;
+    pd_pointer.fields.page_directory_pa =
         UtilPfnFromVa(reinterpret_cast<void *>(pd_addr));
+    pdptes[i] = pd_pointer.all;
   }
 
   __writecr3(current_cr3);
-  UtilVmWrite64(VmcsField::kGuestPdptr0, pd_pointers[0].all);
-  UtilVmWrite64(VmcsField::kGuestPdptr1, pd_pointers[1].all);
-  UtilVmWrite64(VmcsField::kGuestPdptr2, pd_pointers[2].all);
-  UtilVmWrite64(VmcsField::kGuestPdptr3, pd_pointers[3].all);
+}
+
+// Loads the PDPTE registers from CR3 to VMCS
+_Use_decl_annotations_ void UtilLoadPdptes(ULONG_PTR cr3_value) {
+  ULONG64 pdptes[4] = {};
+  UtilGetPdptes(cr3_value, pdptes);
+  UtilVmWrite64(VmcsField::kGuestPdptr0, pdptes[0]);
+  UtilVmWrite64(VmcsField::kGuestPdptr1, pdptes[1]);
+  UtilVmWrite64(VmcsField::kGuestPdptr2, pdptes[2]);
+  UtilVmWrite64(VmcsField::kGuestPdptr3, pdptes[3]);
 }
 
 // Does memcpy safely even if destination is a read only region
@@ -69,6 +69,17 @@ enum class HypercallNumber {
   kTerminateVmm,                ///< Terminates VMM
   kDdimonEnablePageShadowing,   ///< Calls SbpVmCallEnablePageShadowing()
   kDdimonDisablePageShadowing,  ///< Calls SbpVmCallDisablePageShadowing()
+  kDdimonEnableWatchpoints,     ///< Calls WpVmCallEnableWatchpoints()
+  kDdimonDisableWatchpoints,    ///< Calls WpVmCallDisableWatchpoints()
+  kDdimonEnableCoverage,        ///< Calls CovVmCallEnableCoverage()
+  kDdimonDisableCoverage,       ///< Calls CovVmCallDisableCoverage()
+  kDdimonEnableIntegrity,       ///< Calls IntegVmCallProtectPages()
+  kDdimonDisableIntegrity,      ///< Calls IntegVmCallUnprotectPages()
+  kEnableSampling,              ///< Calls ProfVmCallEnableSampling()
+  kDisableSampling,             ///< Calls ProfVmCallDisableSampling()
+  kEnableDirtyTracking,         ///< Calls EptVmCallEnableDirtyTracking()
+  kDisableDirtyTracking,        ///< Calls EptVmCallDisableDirtyTracking()
+  kFlushTranslations,           ///< Calls EptVmCallFlushTranslations()
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -97,6 +108,15 @@ _IRQL_requires_max_(APC_LEVEL) NTSTATUS
     UtilForEachProcessor(_In_ NTSTATUS (*callback_routine)(void *),
                          _In_opt_ void *context);
 
+/// Waits until every processor has executed guest code since the call
+/// @return STATUS_SUCCESS on success
+///
+/// VM-exit handlers run to completion before a processor resumes a guest.
+/// Once a caller stops publishing data to handlers, a return from this
+/// function guarantees that no handler that may have seen the data is still
+/// using it, and the data can be freed.
+_IRQL_requires_max_(APC_LEVEL) NTSTATUS UtilWaitForQuiescence();
+
 /// Suspends the execution of the current thread
 /// @param millisecond  Time to suspend in milliseconds
 /// @return STATUS_SUCCESS on success
@@ -116,6 +136,26 @@ void *UtilMemMem(_In_ const void *search_base, _In_ SIZE_T search_size,
 /// @return An address of the symbol or nullptr
 void *UtilGetSystemProcAddress(_In_ const wchar_t *proc_name);
 
+/// Reads a REG_DWORD value under a registry key
+/// @param registry_path  A full path of the registry key
+/// @param value_name   A name of the value to read
+/// @return The value, or 0 if the value does not exist
+_IRQL_requires_max_(PASSIVE_LEVEL) ULONG
+    UtilQueryRegistryDword(_In_ PUNICODE_STRING registry_path,
+                           _In_ const wchar_t *value_name);
+
+/// Reads a REG_SZ value under a registry key
+/// @param registry_path  A full path of the registry key
+/// @param value_name   A name of the value to read
+/// @param buffer   A buffer to receive the null-terminated value
+/// @param buffer_size  A size of \a buffer in bytes
+/// @return true if a non-empty value was read
+///
+/// false is returned if the value does not exist or does not fit in \a buffer.
+_IRQL_requires_max_(PASSIVE_LEVEL) bool UtilQueryRegistryString(
+    _In_ PUNICODE_STRING registry_path, _In_ const wchar_t *value_name,
+    _Out_writes_bytes_(buffer_size) wchar_t *buffer, _In_ USHORT buffer_size);
+
 /// Checks if the system is a PAE-enabled x86 system
 /// @return true if the system is a PAE-enabled x86 system
 bool UtilIsX86Pae();
@@ -233,6 +273,17 @@ void UtilWriteMsr64(_In_ Msr msr, _In_ ULONG64 value);
 /// @return A result of the INVEPT instruction
 VmxStatus UtilInveptAll();
 
+/// Executes the INVEPT instruction and invalidates EPT entry cache derived from
+/// an EPT pointer
+/// @param ept_pointer  An EPT pointer to invalidate cache derived from
+/// @return A result of the INVEPT instruction
+VmxStatus UtilInveptSingleContext(_In_ ULONG64 ept_pointer);
+
+/// Computes values of the PDPTE registers from CR3
+/// @param cr3_value  CR3 value to retrive PDPTEs
+/// @param pdptes   An array to receive four PDPTE values
+void UtilGetPdptes(_In_ ULONG_PTR cr3_value, _Out_writes_(4) ULONG64 *pdptes);
+
 /// Loads the PDPTE registers from CR3 to VMCS
 /// @param cr3_value  CR3 value to retrive PDPTEs
 void UtilLoadPdptes(_In_ ULONG_PTR cr3_value);
@@ -9,8 +9,10 @@
 #include <intrin.h>
 #include "asm.h"
 #include "common.h"
+#include "cpuid_cache.h"
 #include "ept.h"
 #include "log.h"
+#include "memory_usage.h"
 #include "util.h"
 #include "vmm.h"
 
@@ -213,8 +215,8 @@ _Use_decl_annotations_ static SharedProcessorData *VmpInitializeSharedData() {
   PAGED_CODE();
 
   const auto shared_data = reinterpret_cast<SharedProcessorData *>(
-      ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(SharedProcessorData),
-                            kHyperPlatformCommonPoolTag));
+      MemUsageAllocate(NonPagedPoolNx, sizeof(SharedProcessorData),
+                       MemUsageSubsystem::kVm));
   if (!shared_data) {
     return nullptr;
   }
@@ -222,10 +224,11 @@ _Use_decl_annotations_ static SharedProcessorData *VmpInitializeSharedData() {
   HYPERPLATFORM_LOG_DEBUG("SharedData=        %p", shared_data);
 
   // Set up the MSR bitmap
-  const auto msr_bitmap = ExAllocatePoolWithTag(NonPagedPoolNx, PAGE_SIZE,
-                                                kHyperPlatformCommonPoolTag);
+  const auto msr_bitmap =
+      MemUsageAllocate(NonPagedPoolNx, PAGE_SIZE, MemUsageSubsystem::kVm);
   if (!msr_bitmap) {
-    ExFreePoolWithTag(shared_data, kHyperPlatformCommonPoolTag);
+    MemUsageFree(shared_data, sizeof(SharedProcessorData),
+                 MemUsageSubsystem::kVm);
     return nullptr;
   }
   RtlZeroMemory(msr_bitmap, PAGE_SIZE);
@@ -270,8 +273,9 @@ _Use_decl_annotations_ static SharedProcessorData *VmpInitializeSharedData() {
   // Set up EPT
   shared_data->ept_data = EptInitialization();
   if (!shared_data->ept_data) {
-    ExFreePoolWithTag(msr_bitmap, kHyperPlatformCommonPoolTag);
-    ExFreePoolWithTag(shared_data, kHyperPlatformCommonPoolTag);
+    MemUsageFree(msr_bitmap, PAGE_SIZE, MemUsageSubsystem::kVm);
+    MemUsageFree(shared_data, sizeof(SharedProcessorData),
+                 MemUsageSubsystem::kVm);
     return nullptr;
   }
   return shared_data;
@@ -302,8 +306,8 @@ _Use_decl_annotations_ static void VmpInitializeVm(
 
   // Allocate related structures
   const auto processor_data =
-      reinterpret_cast<ProcessorData *>(ExAllocatePoolWithTag(
-          NonPagedPoolNx, sizeof(ProcessorData), kHyperPlatformCommonPoolTag));
+      reinterpret_cast<ProcessorData *>(MemUsageAllocate(
+          NonPagedPoolNx, sizeof(ProcessorData), MemUsageSubsystem::kVm));
   if (!processor_data) {
     return;
   }
@@ -311,18 +315,23 @@ _Use_decl_annotations_ static void VmpInitializeVm(
 
   const auto vmm_stack_limit = UtilAllocateContiguousMemory(KERNEL_STACK_SIZE);
   const auto vmcs_region =
-      reinterpret_cast<VmControlStructure *>(ExAllocatePoolWithTag(
-          NonPagedPoolNx, kVmxMaxVmcsSize, kHyperPlatformCommonPoolTag));
+      reinterpret_cast<VmControlStructure *>(MemUsageAllocate(
+          NonPagedPoolNx, kVmxMaxVmcsSize, MemUsageSubsystem::kVm));
   const auto vmxon_region =
-      reinterpret_cast<VmControlStructure *>(ExAllocatePoolWithTag(
-          NonPagedPoolNx, kVmxMaxVmcsSize, kHyperPlatformCommonPoolTag));
+      reinterpret_cast<VmControlStructure *>(MemUsageAllocate(
+          NonPagedPoolNx, kVmxMaxVmcsSize, MemUsageSubsystem::kVm));
+
+  // Execute CPUID before virtualization so that the VMM can answer stable
+  // leaves without CPUID that traps to an outer hypervisor if any
+  const auto cpuid_cache = CpuidCacheInitialization();
 
   // Initialize the management structure
   processor_data->vmm_stack_limit = vmm_stack_limit;
   processor_data->vmcs_region = vmcs_region;
   processor_data->vmxon_region = vmxon_region;
+  processor_data->cpuid_cache = cpuid_cache;
 
-  if (!vmm_stack_limit || !vmcs_region || !vmxon_region) {
+  if (!vmm_stack_limit || !vmcs_region || !vmxon_region || !cpuid_cache) {
     goto ReturnFalse;
   }
   RtlZeroMemory(vmm_stack_limit, KERNEL_STACK_SIZE);
@@ -819,11 +828,15 @@ _Use_decl_annotations_ static void VmpFreeProcessorData(
     UtilFreeContiguousMemory(processor_data->vmm_stack_limit);
   }
   if (processor_data->vmcs_region) {
-    ExFreePoolWithTag(processor_data->vmcs_region, kHyperPlatformCommonPoolTag);
+    MemUsageFree(processor_data->vmcs_region, kVmxMaxVmcsSize,
+                 MemUsageSubsystem::kVm);
   }
   if (processor_data->vmxon_region) {
-    ExFreePoolWithTag(processor_data->vmxon_region,
-                      kHyperPlatformCommonPoolTag);
+    MemUsageFree(processor_data->vmxon_region, kVmxMaxVmcsSize,
+                 MemUsageSubsystem::kVm);
+  }
+  if (processor_data->cpuid_cache) {
+    CpuidCacheTermination(processor_data->cpuid_cache);
   }
   if (processor_data->shared_data &&
       InterlockedDecrement(&processor_data->shared_data->reference_count) ==
@@ -831,14 +844,15 @@ _Use_decl_annotations_ static void VmpFreeProcessorData(
     // the last one
     HYPERPLATFORM_LOG_DEBUG("Freeing shared data...");
     if (processor_data->shared_data->msr_bitmap) {
-      ExFreePoolWithTag(processor_data->shared_data->msr_bitmap,
-                        kHyperPlatformCommonPoolTag);
+      MemUsageFree(processor_data->shared_data->msr_bitmap, PAGE_SIZE,
+                   MemUsageSubsystem::kVm);
     }
     EptTermination(processor_data->shared_data->ept_data);
-    ExFreePoolWithTag(processor_data->shared_data, kHyperPlatformCommonPoolTag);
+    MemUsageFree(processor_data->shared_data, sizeof(SharedProcessorData),
+                 MemUsageSubsystem::kVm);
   }
 
-  ExFreePoolWithTag(processor_data, kHyperPlatformCommonPoolTag);
+  MemUsageFree(processor_data, sizeof(ProcessorData), MemUsageSubsystem::kVm);
 }
 
 // Tests if the VMM is already installed using a backdoor command
@@ -9,14 +9,21 @@
 #include <intrin.h>
 #include "asm.h"
 #include "common.h"
+#include "cpuid_cache.h"
 #include "ept.h"
 #include "log.h"
 #include "util.h"
 #ifndef HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER
 #define HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER 1
 #endif  // HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER
+#include "attribution.h"
+#include "pdpte_cache.h"
 #include "performance.h"
+#include "profiler.h"
 #include "../../DdiMon/shadow_bp.h"
+#include "../../DdiMon/watchpoint.h"
+#include "../../DdiMon/coverage.h"
+#include "../../DdiMon/integrity.h"
 
 extern "C" {
 ////////////////////////////////////////////////////////////////////////////////
@@ -97,6 +104,8 @@ DECLSPEC_NORETURN static void VmmpHandleUnexpectedExit(
 
 static void VmmpHandleMonitorTrap(_Inout_ GuestContext *guest_context);
 
+static void VmmpHandlePreemptionTimer(_Inout_ GuestContext *guest_context);
+
 static void VmmpHandleException(_Inout_ GuestContext *guest_context);
 
 static void VmmpHandleCpuid(_Inout_ GuestContext *guest_context);
@@ -182,6 +191,11 @@ _Use_decl_annotations_ bool __stdcall VmmVmExitHandler(VmmInitialStack *stack) {
   // Dispatch the current VM-exit event
   VmmpHandleVmExit(&guest_context);
 
+  // Invalidate cached EPT translations if any processor changed EPT
+  if (guest_context.vm_continue) {
+    EptSynchronize(stack->processor_data->shared_data->ept_data);
+  }
+
   // Restore guest's context
   if (guest_context.irql < DISPATCH_LEVEL) {
     KeLowerIrql(guest_context.irql);
@@ -200,6 +214,10 @@ _Use_decl_annotations_ static void VmmpHandleVmExit(
     GuestContext *guest_context) {
   HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE();
 
+  // Read CR3 before handlers since it may be updated by them
+  const auto start_tsc = __rdtsc();
+  const auto guest_cr3 = UtilVmRead(VmcsField::kGuestCr3);
+
   const VmExitInformation exit_reason = {
       static_cast<ULONG32>(UtilVmRead(VmcsField::kVmExitReason))};
 
@@ -285,10 +303,16 @@ _Use_decl_annotations_ static void VmmpHandleVmExit(
     case VmxExitReason::kXsetbv:
       VmmpHandleXsetbv(guest_context);
       break;
+    case VmxExitReason::kVmxPreemptionTime:
+      VmmpHandlePreemptionTimer(guest_context);
+      break;
     default:
       VmmpHandleUnexpectedExit(guest_context);
       break;
   }
+
+  AttrRecordVmExit(guest_cr3, static_cast<USHORT>(exit_reason.fields.reason),
+                   __rdtsc() - start_tsc);
 }
 
 // Triple fault VM-exit. Fatal error.
@@ -313,8 +337,17 @@ _Use_decl_annotations_ static void VmmpHandleUnexpectedExit(
 _Use_decl_annotations_ static void VmmpHandleMonitorTrap(
     GuestContext *guest_context) {
   HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE();
-  SbpHandleMonitorTrapFlag(
-      guest_context->stack->processor_data->shared_data->ept_data);
+  const auto ept_data =
+      guest_context->stack->processor_data->shared_data->ept_data;
+  if (!SbpHandleMonitorTrapFlag(ept_data)) {
+    NT_VERIFY(WpHandleMonitorTrapFlag(ept_data));
+  }
+}
+
+// VMX-preemption timer VM-exit
+_Use_decl_annotations_ static void VmmpHandlePreemptionTimer(
+    GuestContext *guest_context) {
+  ProfHandlePreemptionTimer(guest_context->ip, guest_context->gp_regs->sp);
 }
 
 // Interrupt
@@ -410,7 +443,12 @@ _Use_decl_annotations_ static void VmmpHandleCpuid(
     guest_context->gp_regs->dx = ' yb ';
     guest_context->gp_regs->cx = '!MMV';
   } else {
-    __cpuidex(reinterpret_cast<int *>(cpu_info), function_id, sub_function_id);
+    if (!CpuidCacheQuery(guest_context->stack->processor_data->cpuid_cache,
+                         function_id, sub_function_id, cpu_info)) {
+      __cpuidex(reinterpret_cast<int *>(cpu_info), function_id,
+                sub_function_id);
+      CpuidCacheMaskLeaf(function_id, sub_function_id, cpu_info);
+    }
     guest_context->gp_regs->ax = cpu_info[0];
     guest_context->gp_regs->bx = cpu_info[1];
     guest_context->gp_regs->cx = cpu_info[2];
@@ -767,7 +805,9 @@ _Use_decl_annotations_ static void VmmpHandleCrAccess(
         // CR0 <- Reg
         case 0:
           if (UtilIsX86Pae()) {
-            UtilLoadPdptes(UtilVmRead(VmcsField::kGuestCr3));
+            PdcLoadPdptes(
+                guest_context->stack->processor_data->shared_data->ept_data,
+                UtilVmRead(VmcsField::kGuestCr3));
           }
           UtilVmWrite(VmcsField::kGuestCr0, *register_used);
           UtilVmWrite(VmcsField::kCr0ReadShadow, *register_used);
@@ -776,7 +816,9 @@ _Use_decl_annotations_ static void VmmpHandleCrAccess(
         // CR3 <- Reg
         case 3:
           if (UtilIsX86Pae()) {
-            UtilLoadPdptes(*register_used);
+            PdcLoadPdptes(
+                guest_context->stack->processor_data->shared_data->ept_data,
+                *register_used);
           }
           UtilVmWrite(VmcsField::kGuestCr3, *register_used);
           break;
@@ -784,7 +826,9 @@ _Use_decl_annotations_ static void VmmpHandleCrAccess(
         // CR4 <- Reg
         case 4:
           if (UtilIsX86Pae()) {
-            UtilLoadPdptes(UtilVmRead(VmcsField::kGuestCr3));
+            PdcLoadPdptes(
+                guest_context->stack->processor_data->shared_data->ept_data,
+                UtilVmRead(VmcsField::kGuestCr3));
           }
           UtilVmWrite(VmcsField::kGuestCr4, *register_used);
           UtilVmWrite(VmcsField::kCr4ReadShadow, *register_used);
@@ -918,6 +962,113 @@ _Use_decl_annotations_ static void VmmpHandleVmCall(
     guest_context->flag_reg.fields.zf = false;
     UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
 
+  } else if (hypercall_number == HypercallNumber::kDdimonEnableWatchpoints) {
+    WpVmCallEnableWatchpoints(
+        guest_context->stack->processor_data->shared_data->ept_data, context);
+
+    VmmpAdjustGuestInstructionPointer(guest_context->ip);
+    // Indicates successful VMCALL
+    guest_context->flag_reg.fields.cf = false;
+    guest_context->flag_reg.fields.zf = false;
+    UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
+
+  } else if (hypercall_number == HypercallNumber::kDdimonDisableWatchpoints) {
+    WpVmCallDisableWatchpoints(
+        guest_context->stack->processor_data->shared_data->ept_data, context);
+
+    VmmpAdjustGuestInstructionPointer(guest_context->ip);
+    // Indicates successful VMCALL
+    guest_context->flag_reg.fields.cf = false;
+    guest_context->flag_reg.fields.zf = false;
+    UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
+
+  } else if (hypercall_number == HypercallNumber::kDdimonEnableCoverage) {
+    CovVmCallEnableCoverage(
+        guest_context->stack->processor_data->shared_data->ept_data, context);
+
+    VmmpAdjustGuestInstructionPointer(guest_context->ip);
+    // Indicates successful VMCALL
+    guest_context->flag_reg.fields.cf = false;
+    guest_context->flag_reg.fields.zf = false;
+    UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
+
+  } else if (hypercall_number == HypercallNumber::kDdimonDisableCoverage) {
+    CovVmCallDisableCoverage(
+        guest_context->stack->processor_data->shared_data->ept_data, context);
+
+    VmmpAdjustGuestInstructionPointer(guest_context->ip);
+    // Indicates successful VMCALL
+    guest_context->flag_reg.fields.cf = false;
+    guest_context->flag_reg.fields.zf = false;
+    UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
+
+  } else if (hypercall_number == HypercallNumber::kDdimonEnableIntegrity) {
+    IntegVmCallProtectPages(
+        guest_context->stack->processor_data->shared_data->ept_data, context);
+
+    VmmpAdjustGuestInstructionPointer(guest_context->ip);
+    // Indicates successful VMCALL
+    guest_context->flag_reg.fields.cf = false;
+    guest_context->flag_reg.fields.zf = false;
+    UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
+
+  } else if (hypercall_number == HypercallNumber::kDdimonDisableIntegrity) {
+    IntegVmCallUnprotectPages(
+        guest_context->stack->processor_data->shared_data->ept_data, context);
+
+    VmmpAdjustGuestInstructionPointer(guest_context->ip);
+    // Indicates successful VMCALL
+    guest_context->flag_reg.fields.cf = false;
+    guest_context->flag_reg.fields.zf = false;
+    UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
+
+  } else if (hypercall_number == HypercallNumber::kEnableSampling) {
+    ProfVmCallEnableSampling(context);
+
+    VmmpAdjustGuestInstructionPointer(guest_context->ip);
+    // Indicates successful VMCALL
+    guest_context->flag_reg.fields.cf = false;
+    guest_context->flag_reg.fields.zf = false;
+    UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
+
+  } else if (hypercall_number == HypercallNumber::kDisableSampling) {
+    ProfVmCallDisableSampling(context);
+
+    VmmpAdjustGuestInstructionPointer(guest_context->ip);
+    // Indicates successful VMCALL
+    guest_context->flag_reg.fields.cf = false;
+    guest_context->flag_reg.fields.zf = false;
+    UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
+
+  } else if (hypercall_number == HypercallNumber::kEnableDirtyTracking) {
+    EptVmCallEnableDirtyTracking(
+        guest_context->stack->processor_data->shared_data->ept_data, context);
+
+    VmmpAdjustGuestInstructionPointer(guest_context->ip);
+    // Indicates successful VMCALL
+    guest_context->flag_reg.fields.cf = false;
+    guest_context->flag_reg.fields.zf = false;
+    UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
+
+  } else if (hypercall_number == HypercallNumber::kDisableDirtyTracking) {
+    EptVmCallDisableDirtyTracking(
+        guest_context->stack->processor_data->shared_data->ept_data, context);
+
+    VmmpAdjustGuestInstructionPointer(guest_context->ip);
+    // Indicates successful VMCALL
+    guest_context->flag_reg.fields.cf = false;
+    guest_context->flag_reg.fields.zf = false;
+    UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
+
+  } else if (hypercall_number == HypercallNumber::kFlushTranslations) {
+    EptVmCallFlushTranslations(context);
+
+    VmmpAdjustGuestInstructionPointer(guest_context->ip);
+    // Indicates successful VMCALL
+    guest_context->flag_reg.fields.cf = false;
+    guest_context->flag_reg.fields.zf = false;
+    UtilVmWrite(VmcsField::kGuestRflags, guest_context->flag_reg.all);
+
   } else {
     // Unsupported hypercall. Handle like other VMX instructions
     VmmpHandleVmx(guest_context);
@@ -41,6 +41,7 @@ struct ProcessorData {
   void* vmm_stack_limit;                    ///< A head of VA for VMM stack
   struct VmControlStructure* vmxon_region;  ///< VA of a VMXON region
   struct VmControlStructure* vmcs_region;   ///< VA of a VMCS region
+  struct CpuidCache* cpuid_cache;           ///< Cached results of CPUID
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,305 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements guest working-set estimation functions.
+
+#include "working_set.h"
+#include "common.h"
+#include "ept.h"
+#include "log.h"
+#include "util.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Bits of an EPT entry mapping a 4KB page set by the processor
+static const ULONG64 kWspAccessedFlag = 1ull << 8;
+static const ULONG64 kWspDirtyFlag = 1ull << 9;
+
+// How many EPT entries are in a single EPT page table
+static const auto kWspEntriesPerTable = 512ul;
+
+// How many EPT entries are checked at once before updating them. Entries in a
+// group are OR-ed together first so that groups without any flags set, which
+// are the majority, are skipped without locked operations.
+static const auto kWspEntriesPerGroup = 8ul;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Global state of working-set estimation
+struct WsData {
+  EptData* ept_data;
+  ULONG scan_interval;  // In seconds
+  KEVENT stop_event;
+  HANDLE scanner_thread_handle;
+  ULONG64 scan_count;
+
+  // Access history of each physical memory page in order of
+  // UtilGetPhysicalMemoryRanges(). Bit 0 is set when the page was accessed in
+  // the last interval, bit 1 is for the interval before that, and so on.
+  UCHAR* histories;
+};
+
+// Page counts of a physical memory range
+struct WsRangeStatistics {
+  ULONG_PTR hot;    // Accessed in the last interval
+  ULONG_PTR warm;   // Accessed in earlier intervals recorded in the history
+  ULONG_PTR cold;   // Not accessed in any intervals recorded in the history
+  ULONG_PTR dirty;  // Written in the last interval
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static KSTART_ROUTINE WspScannerThreadRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void WspScan(_Inout_ WsData* data);
+
+static void WspHarvestEntries(_Inout_updates_(count) EptCommonEntry* entries,
+                              _In_ ULONG count,
+                              _Inout_updates_(count) UCHAR* histories,
+                              _Inout_ WsRangeStatistics* statistics);
+
+static void WspFreeWsData(_In_ WsData* data);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, WsInitialization)
+#pragma alloc_text(PAGE, WsTermination)
+#pragma alloc_text(PAGE, WspScannerThreadRoutine)
+#pragma alloc_text(PAGE, WspScan)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Working-set estimation state
+static WsData* g_wsp_data;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Enables EPT accessed and dirty flags on all processors and starts a scanner
+// thread
+_Use_decl_annotations_ NTSTATUS WsInitialization(ULONG scan_interval) {
+  PAGED_CODE();
+
+  if (!scan_interval) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  if (!EptIsAccessedAndDirtyFlagsAvailable()) {
+    HYPERPLATFORM_LOG_ERROR("EPT accessed and dirty flags are not supported.");
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  const auto data = reinterpret_cast<WsData*>(ExAllocatePoolWithTag(
+      NonPagedPoolNx, sizeof(WsData), kHyperPlatformCommonPoolTag));
+  if (!data) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(data, sizeof(WsData));
+  data->scan_interval = scan_interval;
+  KeInitializeEvent(&data->stop_event, NotificationEvent, FALSE);
+
+  // Histories are only accessed by the scanner thread
+  const auto pm_ranges = UtilGetPhysicalMemoryRanges();
+  const auto histories_size = pm_ranges->number_of_pages * sizeof(UCHAR);
+  data->histories = reinterpret_cast<UCHAR*>(ExAllocatePoolWithTag(
+      PagedPool, histories_size, kHyperPlatformCommonPoolTag));
+  if (!data->histories) {
+    WspFreeWsData(data);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(data->histories, histories_size);
+
+  auto status = EptEnableDirtyTracking(&data->ept_data);
+  if (!NT_SUCCESS(status)) {
+    EptDisableDirtyTracking();
+    WspFreeWsData(data);
+    return status;
+  }
+
+  status = PsCreateSystemThread(&data->scanner_thread_handle, GENERIC_ALL,
+                                nullptr, nullptr, nullptr,
+                                WspScannerThreadRoutine, data);
+  if (!NT_SUCCESS(status)) {
+    EptDisableDirtyTracking();
+    WspFreeWsData(data);
+    return status;
+  }
+
+  g_wsp_data = data;
+  HYPERPLATFORM_LOG_INFO("Working-set estimation has been started.");
+  return status;
+}
+
+// Stops the scanner thread and disables EPT accessed and dirty flags on all
+// processors
+_Use_decl_annotations_ void WsTermination() {
+  PAGED_CODE();
+
+  const auto data = g_wsp_data;
+  if (!data) {
+    return;
+  }
+  g_wsp_data = nullptr;
+
+  KeSetEvent(&data->stop_event, IO_NO_INCREMENT, FALSE);
+  auto status = ZwWaitForSingleObject(data->scanner_thread_handle, FALSE,
+                                      nullptr);
+  NT_VERIFY(NT_SUCCESS(status));
+  ZwClose(data->scanner_thread_handle);
+
+  status = EptDisableDirtyTracking();
+  NT_VERIFY(NT_SUCCESS(status));
+  WspFreeWsData(data);
+}
+
+// Periodically scans EPT until the stop event is signaled
+_Use_decl_annotations_ static VOID WspScannerThreadRoutine(
+    void* start_context) {
+  PAGED_CODE();
+
+  const auto data = reinterpret_cast<WsData*>(start_context);
+  LARGE_INTEGER interval = {};
+  interval.QuadPart = -(10000000ll * data->scan_interval);  // sec
+
+  while (KeWaitForSingleObject(&data->stop_event, Executive, KernelMode, FALSE,
+                               &interval) == STATUS_TIMEOUT) {
+    WspScan(data);
+  }
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Harvests and clears accessed and dirty flags of all EPT entries mapping
+// physical memory, and prints out statistics of each physical memory range
+_Use_decl_annotations_ static void WspScan(WsData* data) {
+  PAGED_CODE();
+
+  data->scan_count++;
+  HYPERPLATFORM_LOG_INFO("Working-set scan #%I64u:", data->scan_count);
+  HYPERPLATFORM_LOG_INFO("%16s,%10s,%10s,%10s,%10s,%10s", "Base", "Pages",
+                         "Hot", "Warm", "Cold", "Dirty");
+
+  WsRangeStatistics total = {};
+  auto histories = data->histories;
+  const auto pm_ranges = UtilGetPhysicalMemoryRanges();
+  for (auto run_index = 0ul; run_index < pm_ranges->number_of_runs;
+       ++run_index) {
+    const auto run = &pm_ranges->run[run_index];
+    const auto base_addr = static_cast<ULONG64>(run->base_page) * PAGE_SIZE;
+
+    // Process entries one page table at a time since entries are contiguous
+    // only within the same table
+    WsRangeStatistics statistics = {};
+    for (ULONG_PTR page_index = 0; page_index < run->page_count;) {
+      const auto indexed_addr = base_addr + page_index * PAGE_SIZE;
+      const auto table_index =
+          static_cast<ULONG>((indexed_addr >> PAGE_SHIFT) %
+                             kWspEntriesPerTable);
+      const auto count = static_cast<ULONG>(
+          min(kWspEntriesPerTable - table_index,
+              run->page_count - page_index));
+      const auto entries = EptGetEptPtEntry(data->ept_data, indexed_addr);
+      WspHarvestEntries(entries, count, histories + page_index, &statistics);
+      page_index += count;
+    }
+    histories += run->page_count;
+
+    HYPERPLATFORM_LOG_INFO("%016llx,%10Iu,%10Iu,%10Iu,%10Iu,%10Iu", base_addr,
+                           run->page_count, statistics.hot, statistics.warm,
+                           statistics.cold, statistics.dirty);
+    total.hot += statistics.hot;
+    total.warm += statistics.warm;
+    total.cold += statistics.cold;
+    total.dirty += statistics.dirty;
+  }
+  HYPERPLATFORM_LOG_INFO("%16s,%10Iu,%10Iu,%10Iu,%10Iu,%10Iu", "Total",
+                         pm_ranges->number_of_pages, total.hot, total.warm,
+                         total.cold, total.dirty);
+
+  // Let the processors set flags again on next accesses
+  EptFlushTranslations();
+}
+
+// Harvests and clears accessed and dirty flags of contiguous EPT entries, and
+// updates histories of corresponding pages
+_Use_decl_annotations_ static void WspHarvestEntries(
+    EptCommonEntry* entries, ULONG count, UCHAR* histories,
+    WsRangeStatistics* statistics) {
+  static const auto kFlags = kWspAccessedFlag | kWspDirtyFlag;
+
+  for (auto i = 0ul; i < count; ++i) {
+    // Skip a whole group when none of entries has flags set
+    if (i % kWspEntriesPerGroup == 0 && count - i >= kWspEntriesPerGroup) {
+      ULONG64 group_flags = 0;
+      for (auto j = 0ul; j < kWspEntriesPerGroup; ++j) {
+        group_flags |= entries[i + j].all;
+      }
+      if (!(group_flags & kFlags)) {
+        for (auto j = 0ul; j < kWspEntriesPerGroup; ++j) {
+          auto& history = histories[i + j];
+          history <<= 1;
+          if (history) {
+            statistics->warm++;
+          } else {
+            statistics->cold++;
+          }
+        }
+        i += kWspEntriesPerGroup - 1;
+        continue;
+      }
+    }
+
+    // The processor may set flags concurrently. Clear them atomically.
+    ULONG64 flags = 0;
+    if (entries[i].all & kFlags) {
+      flags = InterlockedAnd64(reinterpret_cast<volatile LONG64*>(
+                                   &entries[i].all),
+                               ~static_cast<LONG64>(kFlags)) &
+              kFlags;
+    }
+
+    auto& history = histories[i];
+    history = static_cast<UCHAR>((history << 1) |
+                                 ((flags & kWspAccessedFlag) ? 1 : 0));
+    if (history & 1) {
+      statistics->hot++;
+    } else if (history) {
+      statistics->warm++;
+    } else {
+      statistics->cold++;
+    }
+    if (flags & kWspDirtyFlag) {
+      statistics->dirty++;
+    }
+  }
+}
+
+// Frees WsData and histories referenced from it
+_Use_decl_annotations_ static void WspFreeWsData(WsData* data) {
+  if (data->histories) {
+    ExFreePoolWithTag(data->histories, kHyperPlatformCommonPoolTag);
+  }
+  ExFreePoolWithTag(data, kHyperPlatformCommonPoolTag);
+}
+
+}  // extern "C"
@@ -0,0 +1,60 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to guest working-set estimation functions.
+
+#ifndef HYPERPLATFORM_WORKING_SET_H_
+#define HYPERPLATFORM_WORKING_SET_H_
+
+#include <fltKernel.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Enables EPT accessed and dirty flags and starts a scanner thread
+/// @param scan_interval  An interval to scan EPT in seconds
+/// @return STATUS_SUCCESS on success
+///
+/// The scanner thread periodically harvests and clears accessed and dirty flags
+/// of all EPT entries mapping physical memory, and reports how many pages are
+/// hot, warm and cold for each physical memory range. A driver must call
+/// WsTermination() when this function succeeded.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    WsInitialization(_In_ ULONG scan_interval);
+
+/// Stops the scanner thread and disables EPT accessed and dirty flags
+_IRQL_requires_max_(PASSIVE_LEVEL) void WsTermination();
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_WORKING_SET_H_
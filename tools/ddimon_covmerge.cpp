@@ -0,0 +1,187 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a command that merges coverage files written by DdiMon.
+///
+/// Files taken from the same image, ie, with the same time stamp, size and
+/// number of pages, are merged by OR-ing their bitmaps. The first executed
+/// offset of a page is taken from the first file that executed it. A merged
+/// file has the same format and can be merged again.
+
+#include <getopt.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "ddimon_formats.h"
+#include "mapped_file.h"
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Contents of a coverage file
+struct Coverage {
+  ddimon::CoverageFileHeader header;
+  std::vector<uint8_t> bitmap;
+  std::vector<uint16_t> first_offsets;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+void PrintUsage() {
+  fprintf(stderr,
+          "usage: ddimon_covmerge [-l] [-o merged.cov] DdiMon.cov...\n");
+}
+
+// Reads a coverage file. Returns false and sets a message to error on failure.
+bool ReadCoverage(const char* path, Coverage* coverage, std::string* error) {
+  ddimon::MappedFile file;
+  if (!file.Open(path, error)) {
+    return false;
+  }
+  auto& header = coverage->header;
+  if (file.size() < sizeof(header)) {
+    *error = std::string(path) + ": not a coverage file";
+    return false;
+  }
+  memcpy(&header, file.data(), sizeof(header));
+  const auto bitmap_size = (static_cast<uint64_t>(header.page_count) + 7) / 8;
+  const auto offsets_size =
+      static_cast<uint64_t>(header.page_count) * sizeof(uint16_t);
+  if (header.magic != ddimon::kCoverageFileMagic ||
+      header.version != ddimon::kCoverageFileVersion ||
+      file.size() != sizeof(header) + bitmap_size + offsets_size) {
+    *error = std::string(path) + ": not a coverage file";
+    return false;
+  }
+  header.image_name[sizeof(header.image_name) - 1] = '\0';
+
+  const auto bitmap = file.data() + sizeof(header);
+  coverage->bitmap.assign(bitmap, bitmap + bitmap_size);
+  coverage->first_offsets.resize(header.page_count);
+  memcpy(coverage->first_offsets.data(), bitmap + bitmap_size, offsets_size);
+  return true;
+}
+
+// ORs coverage of the source into the merged one. Returns false and sets a
+// message to error if they are not taken from the same image.
+bool MergeCoverage(const Coverage& source, const char* path, Coverage* merged,
+                   std::string* error) {
+  auto& header = merged->header;
+  if (source.header.time_date_stamp != header.time_date_stamp ||
+      source.header.size_of_image != header.size_of_image ||
+      source.header.page_count != header.page_count) {
+    *error = std::string(path) + ": taken from a different image than " +
+             header.image_name;
+    return false;
+  }
+  for (size_t i = 0; i < merged->bitmap.size(); ++i) {
+    merged->bitmap[i] |= source.bitmap[i];
+  }
+  for (size_t i = 0; i < merged->first_offsets.size(); ++i) {
+    if (merged->first_offsets[i] == ddimon::kCoverageNotExecuted) {
+      merged->first_offsets[i] = source.first_offsets[i];
+    }
+  }
+  // Pages monitored depend on which pages were present in each run, and only
+  // their numbers are recorded
+  if (source.header.covered_pages > header.covered_pages) {
+    header.covered_pages = source.header.covered_pages;
+  }
+  return true;
+}
+
+// Writes coverage in the same format as the driver does
+bool WriteCoverage(const char* path, const Coverage& coverage,
+                   std::string* error) {
+  const auto output = fopen(path, "wb");
+  if (!output) {
+    *error = std::string(path) + ": " + strerror(errno);
+    return false;
+  }
+  const auto written =
+      fwrite(&coverage.header, sizeof(coverage.header), 1, output) == 1 &&
+      fwrite(coverage.bitmap.data(), 1, coverage.bitmap.size(), output) ==
+          coverage.bitmap.size() &&
+      fwrite(coverage.first_offsets.data(), sizeof(uint16_t),
+             coverage.first_offsets.size(),
+             output) == coverage.first_offsets.size();
+  if (fclose(output) != 0 || !written) {
+    *error = std::string(path) + ": failed to write";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const char* output_path = nullptr;
+  auto list_pages = false;
+  int option = 0;
+  while ((option = getopt(argc, argv, "lo:")) != -1) {
+    switch (option) {
+      case 'l':
+        list_pages = true;
+        break;
+      case 'o':
+        output_path = optarg;
+        break;
+      default:
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind == argc) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  std::string error;
+  Coverage merged = {};
+  if (!ReadCoverage(argv[optind], &merged, &error)) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+  for (auto i = optind + 1; i < argc; ++i) {
+    Coverage coverage = {};
+    if (!ReadCoverage(argv[i], &coverage, &error) ||
+        !MergeCoverage(coverage, argv[i], &merged, &error)) {
+      fprintf(stderr, "error: %s\n", error.c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
+  uint32_t executed_pages = 0;
+  for (const auto byte : merged.bitmap) {
+    executed_pages += __builtin_popcount(byte);
+  }
+  merged.header.executed_pages = executed_pages;
+  if (output_path && !WriteCoverage(output_path, merged, &error)) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+
+  printf("%s: %u of %u pages executed in %d files\n", merged.header.image_name,
+         executed_pages, merged.header.covered_pages, argc - optind);
+  if (list_pages) {
+    for (uint32_t i = 0; i < merged.header.page_count; ++i) {
+      if (merged.bitmap[i / 8] & (1u << (i % 8))) {
+        printf("%s+0x%x (first at +0x%x)\n", merged.header.image_name,
+               i * 0x1000, i * 0x1000 + merged.first_offsets[i]);
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,245 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares file formats written by DdiMon for offline tools, and read by
+/// DdiMon from them. Layouts must be identical to the declarations in the
+/// driver.
+
+#ifndef DDIMON_TOOLS_DDIMON_FORMATS_H_
+#define DDIMON_TOOLS_DDIMON_FORMATS_H_
+
+#include <cstdint>
+
+namespace ddimon {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// See DdiMon/module_snapshot.h
+const uint32_t kModuleSnapshotFileMagic = 0x50534d44;  // 'PSMD'
+const uint32_t kModuleSnapshotFileVersion = 1;
+const uint32_t kModuleSnapshotFlagPreloaded = 1u << 0;
+const uint32_t kModuleSnapshotFlagHasPdbInfo = 1u << 1;
+
+// See DdiMon/coverage.h
+const uint32_t kCoverageFileMagic = 0x564f4344;  // 'VOCD'
+const uint32_t kCoverageFileVersion = 1;
+
+// A value of CoverageFileHeader::first_offsets for a page not executed
+const uint16_t kCoverageNotExecuted = 0xffff;
+
+// See HyperPlatform/HyperPlatform/log.h. Files of version 1 used Bloom filters
+// of 512 bits with the same hashing.
+const uint32_t kLogIndexFileMagic = 0x494c5048;  // 'ILPH'
+const uint32_t kLogIndexFileVersion = 2;
+
+// FNV-1a parameters used to hash tokens in a log index file
+const uint32_t kLogIndexFnvOffsetBasis = 2166136261u;
+const uint32_t kLogIndexFnvPrime = 16777619u;
+
+// See HyperPlatform/HyperPlatform/span_trace.h
+const uint32_t kSpanFileMagic = 0x4e505348;  // 'NPSH'
+const uint32_t kSpanFileVersion = 1;
+
+// SpanKind in HyperPlatform/HyperPlatform/span_trace.h
+enum class SpanKind : uint16_t {
+  kScope,
+  kPreHandler,
+  kPostHandler,
+};
+
+// See HyperPlatform/HyperPlatform/snapshot.h
+const uint32_t kSnapFileMagic = 0x504e5348;   // 'PNSH'
+const uint32_t kSnapEpochMagic = 0x48435045;  // 'HCPE'
+const uint32_t kSnapFileVersion = 1;
+
+// See DdiMon/hook_policy.h
+const uint32_t kPolicyManifestMagic = 0x50484444;  // 'PHDD'
+const uint16_t kPolicyManifestVersion = 2;
+
+// FNV-1a parameters used to prehash export names in a hook policy manifest
+const uint32_t kPolicyFnvOffsetBasis = 2166136261u;
+const uint32_t kPolicyFnvPrime = 16777619u;
+
+// PolicyHandlerId in DdiMon/hook_policy.h
+enum class PolicyHandlerId : uint16_t {
+  kExQueueWorkItem = 1,
+  kExAllocatePoolWithTag,
+  kExFreePool,
+  kExFreePoolWithTag,
+  kNtQuerySystemInformation,
+  kMaximum,
+};
+
+// PolicyFlags in DdiMon/hook_policy.h
+const uint32_t kPolicyFlagIncludeImageCallers = 1u << 0;
+
+// A number of 100-nanosecond intervals in a millisecond, for system time
+const int64_t kSystemTimePerMillisecond = 10000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+#pragma pack(push, 1)
+
+// GUID of Windows
+struct Guid {
+  uint32_t data1;
+  uint16_t data2;
+  uint16_t data3;
+  uint8_t data4[8];
+};
+static_assert(sizeof(Guid) == 16, "Size check");
+
+// CoverageFileHeader in DdiMon/coverage.h. It is followed by a bitmap of
+// (page_count + 7) / 8 bytes and page_count of 16-bit first offsets.
+struct CoverageFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t time_date_stamp;
+  uint32_t size_of_image;
+  uint64_t image_base;
+  uint32_t page_count;
+  uint32_t covered_pages;
+  uint32_t executed_pages;
+  char image_name[32];
+};
+static_assert(sizeof(CoverageFileHeader) == 68, "Size check");
+
+// ModuleSnapshotFileHeader in DdiMon/module_snapshot.h
+struct ModuleSnapshotFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t record_count;
+  int64_t start_time;
+};
+static_assert(sizeof(ModuleSnapshotFileHeader) == 24, "Size check");
+
+// ModuleSnapshotRecord in DdiMon/module_snapshot.h
+struct ModuleSnapshotRecord {
+  int64_t load_time;
+  uint64_t image_base;
+  uint32_t size_of_image;
+  uint32_t time_date_stamp;
+  uint32_t flags;
+  uint32_t pdb_age;
+  Guid pdb_guid;
+  char pdb_name[64];
+  char image_name[32];
+};
+static_assert(sizeof(ModuleSnapshotRecord) == 144, "Size check");
+
+// LogIndexFileHeader in HyperPlatform/HyperPlatform/log.h
+struct LogIndexFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t bucket_size;
+  uint32_t bloom_bits;
+  int64_t bucket_length;
+};
+static_assert(sizeof(LogIndexFileHeader) == 24, "Size check");
+
+// LogIndexBucket in HyperPlatform/HyperPlatform/log.h without the Bloom filter
+// following it. Its size is given by bloom_bits of the header.
+struct LogIndexBucketHeader {
+  int64_t start_time;
+  int64_t end_time;
+  uint64_t start_offset;
+  uint64_t end_offset;
+  uint32_t entry_count;
+  uint32_t reserved;
+};
+static_assert(sizeof(LogIndexBucketHeader) == 40, "Size check");
+
+// SpanFileHeader in HyperPlatform/HyperPlatform/span_trace.h
+struct SpanFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t processor_count;
+  uint32_t name_count;
+  uint32_t name_size;
+  uint32_t span_count;
+  uint64_t start_tsc;
+  uint64_t end_tsc;
+  uint64_t start_counter;
+  uint64_t end_counter;
+  uint64_t counter_frequency;
+};
+static_assert(sizeof(SpanFileHeader) == 64, "Size check");
+
+// SpanFileRecord in HyperPlatform/HyperPlatform/span_trace.h
+struct SpanFileRecord {
+  uint64_t begin_tsc;
+  uint64_t end_tsc;
+  uint64_t arg;
+  uint32_t name_index;
+  uint16_t processor;
+  SpanKind kind;
+};
+static_assert(sizeof(SpanFileRecord) == 32, "Size check");
+
+// SnapFileHeader in HyperPlatform/HyperPlatform/snapshot.h
+struct SnapFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t reserved;
+  uint64_t number_of_pages;
+};
+static_assert(sizeof(SnapFileHeader) == 24, "Size check");
+
+// SnapEpochHeader in HyperPlatform/HyperPlatform/snapshot.h. It is followed by
+// page_count of SnapPageHeader, each of which is followed by page_size bytes.
+struct SnapEpochHeader {
+  uint32_t magic;
+  uint32_t epoch;
+  int64_t timestamp;
+  uint64_t page_count;
+};
+static_assert(sizeof(SnapEpochHeader) == 24, "Size check");
+
+// SnapPageHeader in HyperPlatform/HyperPlatform/snapshot.h
+struct SnapPageHeader {
+  uint64_t physical_address;
+};
+static_assert(sizeof(SnapPageHeader) == 8, "Size check");
+
+// PolicyManifestHeader in DdiMon/hook_policy.h. It is followed by entry_count
+// of PolicyManifestEntry and a string table holding patterns and programs.
+struct PolicyManifestHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t entry_size;
+  uint32_t entry_count;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+  uint32_t total_size;
+};
+static_assert(sizeof(PolicyManifestHeader) == 24, "Size check");
+
+// PolicyManifestEntry in DdiMon/hook_policy.h
+struct PolicyManifestEntry {
+  uint32_t name_hash;
+  uint32_t pattern_offset;
+  uint16_t pattern_size;
+  uint16_t handler_id;
+  uint32_t flags;
+  uint32_t sample_every;
+  uint32_t max_per_second;
+  uint32_t program_offset;
+  uint32_t program_count;
+};
+static_assert(sizeof(PolicyManifestEntry) == 32, "Size check");
+
+#pragma pack(pop)
+
+}  // namespace ddimon
+
+#endif  // DDIMON_TOOLS_DDIMON_FORMATS_H_
@@ -0,0 +1,636 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a command that indexes and queries DdiMon logs.
+///
+/// An index is built in one pass over a memory-mapped log and saved next to
+/// it. It divides the log into blocks of lines and holds a sorted list of
+/// blocks (postings) for each PID, DDI name and pool tag, and a range of time
+/// of day for each block. A query intersects postings, skips blocks out of a
+/// time window and scans only the remaining blocks. Lines appended after the
+/// index was built are scanned as well. Without the index, Bloom filters in an
+/// index file written by the driver (.idx) are used to skip parts of the log.
+
+#include <getopt.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "ddimon_formats.h"
+#include "log_format.h"
+#include "mapped_file.h"
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// 'DLQI'; a magic value of a query index file
+const uint32_t kQueryIndexFileMagic = 0x49514c44;
+
+// A version of a query index file format
+const uint32_t kQueryIndexFileVersion = 1;
+
+// A number of lines in a block of a query index
+const uint32_t kQueryIndexLinesPerBlock = 128;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Fields that postings are built for
+enum class QueryField : uint32_t {
+  kPid,
+  kDdi,
+  kTag,
+};
+
+#pragma pack(push, 1)
+
+// A header of a query index file. A file is laid out as below:
+//
+//   QueryIndexFileHeader
+//   QueryIndexBlock blocks[block_count]
+//   QueryIndexKey keys[key_count]    // sorted by field and then name
+//   uint32_t postings[posting_count] // sorted block indexes of each key
+//   char strings[strings_size]       // names of keys
+struct QueryIndexFileHeader {
+  uint32_t magic;           // kQueryIndexFileMagic
+  uint32_t version;         // kQueryIndexFileVersion
+  uint64_t log_size;        // A size of the log when it was indexed
+  uint32_t block_count;
+  uint32_t key_count;
+  uint64_t posting_count;
+  uint64_t strings_size;
+};
+static_assert(sizeof(QueryIndexFileHeader) == 40, "Size check");
+
+// Lines of a block. A block ends where the next one starts, or at log_size.
+struct QueryIndexBlock {
+  uint64_t start_offset;
+  uint32_t min_ms_of_day;   // The earliest time of day of lines in the block
+  uint32_t max_ms_of_day;   // The latest time of day of lines in the block
+};
+static_assert(sizeof(QueryIndexBlock) == 16, "Size check");
+
+// A value of a field and blocks containing it
+struct QueryIndexKey {
+  QueryField field;
+  uint32_t name_offset;
+  uint32_t name_length;
+  uint32_t posting_count;
+  uint64_t first_posting;
+};
+static_assert(sizeof(QueryIndexKey) == 24, "Size check");
+
+#pragma pack(pop)
+
+// Conditions of a query. Empty strings and a negative PID match any line.
+struct Query {
+  int64_t pid = -1;
+  std::string ddi;
+  std::string tag;
+  bool has_window = false;
+  uint32_t from_ms_of_day = 0;
+  uint32_t to_ms_of_day = 0;
+};
+
+// Results of a query
+struct QueryResult {
+  uint64_t matched_lines = 0;
+  uint64_t scanned_bytes = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+void PrintUsage() {
+  fprintf(stderr,
+          "usage: ddimon_logq index [-o index] DdiMon.log\n"
+          "       ddimon_logq query [-x index] [-p pid] [-d ddi] [-t tag] "
+          "[-f HH:MM:SS[.mmm]] [-u HH:MM:SS[.mmm]] [-c] [-v] DdiMon.log\n");
+}
+
+// Returns a key of postings in an in-memory map
+std::string MakeKey(QueryField field, std::string_view name) {
+  std::string key(1, static_cast<char>(field));
+  key.append(name);
+  return key;
+}
+
+// Returns true if a time of day is in a window that may wrap around midnight
+bool IsInWindow(const Query& query, uint32_t ms_of_day) {
+  if (query.from_ms_of_day <= query.to_ms_of_day) {
+    return ms_of_day >= query.from_ms_of_day &&
+           ms_of_day <= query.to_ms_of_day;
+  }
+  return ms_of_day >= query.from_ms_of_day || ms_of_day <= query.to_ms_of_day;
+}
+
+// Returns true if a range of time of day may overlap with a window
+bool OverlapsWindow(const Query& query, uint32_t min_ms, uint32_t max_ms) {
+  if (!query.has_window) {
+    return true;
+  }
+  if (query.from_ms_of_day <= query.to_ms_of_day) {
+    return min_ms <= query.to_ms_of_day && max_ms >= query.from_ms_of_day;
+  }
+  return max_ms >= query.from_ms_of_day || min_ms <= query.to_ms_of_day;
+}
+
+// Returns true if a line satisfies the query
+bool MatchLine(const Query& query, const char* line, size_t length) {
+  ddimon::LogLine parsed = {};
+  if (!ddimon::ParseLogLine(line, length, &parsed)) {
+    return false;
+  }
+  if (query.pid >= 0 && parsed.pid != static_cast<uint64_t>(query.pid)) {
+    return false;
+  }
+  if (!query.ddi.empty() &&
+      ddimon::GetLoggedDdiName(parsed.message) != query.ddi) {
+    return false;
+  }
+  if (!query.tag.empty() &&
+      ddimon::GetLoggedPoolTag(parsed.message) != query.tag) {
+    return false;
+  }
+  if (query.has_window &&
+      (!parsed.has_time || !IsInWindow(query, parsed.ms_of_day))) {
+    return false;
+  }
+  return true;
+}
+
+// Prints lines in a range of the log that satisfy the query
+void ScanRange(const Query& query, const char* begin, const char* end,
+               bool count_only, QueryResult* result) {
+  result->scanned_bytes += end - begin;
+  for (auto line = begin; line < end;) {
+    const char* next = nullptr;
+    const auto line_end = ddimon::FindLineEnd(line, end, &next);
+    if (MatchLine(query, line, line_end - line)) {
+      result->matched_lines++;
+      if (!count_only) {
+        fwrite(line, 1, next - line, stdout);
+      }
+    }
+    line = next;
+  }
+}
+
+// Parses "HH:MM:SS" or "HH:MM:SS.mmm" into milliseconds of a day
+bool ParseTimeOfDay(const char* text, uint32_t* ms_of_day) {
+  std::string padded = text;
+  if (padded.size() == 8) {
+    padded += ".000";
+  }
+  return padded.size() == 12 &&
+         ddimon::ParseLogTime(padded.c_str(), padded.size(), ms_of_day);
+}
+
+int BuildIndex(int argc, char* argv[]) {
+  std::string index_path;
+  int option = 0;
+  while ((option = getopt(argc, argv, "o:")) != -1) {
+    if (option != 'o') {
+      PrintUsage();
+      return EXIT_FAILURE;
+    }
+    index_path = optarg;
+  }
+  if (optind + 1 != argc) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+  const auto log_path = argv[optind];
+  if (index_path.empty()) {
+    index_path = std::string(log_path) + ".qidx";
+  }
+
+  std::string error;
+  ddimon::MappedFile log;
+  if (!log.Open(log_path, &error)) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+
+  // Read lines once, adding a block index to postings of values in each line
+  std::vector<QueryIndexBlock> blocks;
+  std::unordered_map<std::string, std::vector<uint32_t>> postings;
+  const auto add_posting = [&postings](QueryField field,
+                                       std::string_view name, uint32_t block) {
+    auto& list = postings[MakeKey(field, name)];
+    if (list.empty() || list.back() != block) {
+      list.push_back(block);
+    }
+  };
+  const auto begin = reinterpret_cast<const char*>(log.data());
+  const auto end = begin + log.size();
+  auto line_count = 0ull;
+  for (auto line = begin; line < end; ++line_count) {
+    if (line_count % kQueryIndexLinesPerBlock == 0) {
+      blocks.push_back({static_cast<uint64_t>(line - begin), UINT32_MAX, 0});
+    }
+    const auto block_index = static_cast<uint32_t>(blocks.size() - 1);
+    auto& block = blocks.back();
+
+    const char* next = nullptr;
+    const auto line_end = ddimon::FindLineEnd(line, end, &next);
+    ddimon::LogLine parsed = {};
+    if (ddimon::ParseLogLine(line, line_end - line, &parsed)) {
+      if (parsed.has_time) {
+        block.min_ms_of_day = std::min(block.min_ms_of_day, parsed.ms_of_day);
+        block.max_ms_of_day = std::max(block.max_ms_of_day, parsed.ms_of_day);
+      } else {
+        block.min_ms_of_day = 0;
+        block.max_ms_of_day = ddimon::kMillisecondsPerDay - 1;
+      }
+      add_posting(QueryField::kPid, std::to_string(parsed.pid), block_index);
+      const auto ddi = ddimon::GetLoggedDdiName(parsed.message);
+      if (!ddi.empty()) {
+        add_posting(QueryField::kDdi, ddi, block_index);
+      }
+      const auto tag = ddimon::GetLoggedPoolTag(parsed.message);
+      if (!tag.empty()) {
+        add_posting(QueryField::kTag, tag, block_index);
+      }
+    }
+    line = next;
+  }
+  for (auto& block : blocks) {
+    // A block without any entry is not matched by any time window
+    if (block.min_ms_of_day > block.max_ms_of_day) {
+      block.min_ms_of_day = block.max_ms_of_day = UINT32_MAX;
+    }
+  }
+
+  // Sort keys by field and name, and lay out postings and names
+  std::vector<const std::pair<const std::string, std::vector<uint32_t>>*>
+      sorted_postings;
+  for (const auto& entry : postings) {
+    sorted_postings.push_back(&entry);
+  }
+  std::sort(sorted_postings.begin(), sorted_postings.end(),
+            [](const auto* lhs, const auto* rhs) {
+              return lhs->first < rhs->first;
+            });
+  std::vector<QueryIndexKey> keys;
+  std::vector<uint32_t> posting_list;
+  std::string strings;
+  for (const auto* entry : sorted_postings) {
+    const auto& name = entry->first;
+    keys.push_back({static_cast<QueryField>(name[0]),
+                    static_cast<uint32_t>(strings.size()),
+                    static_cast<uint32_t>(name.size() - 1),
+                    static_cast<uint32_t>(entry->second.size()),
+                    posting_list.size()});
+    strings.append(name, 1, std::string::npos);
+    posting_list.insert(posting_list.end(), entry->second.begin(),
+                        entry->second.end());
+  }
+
+  QueryIndexFileHeader header = {};
+  header.magic = kQueryIndexFileMagic;
+  header.version = kQueryIndexFileVersion;
+  header.log_size = log.size();
+  header.block_count = static_cast<uint32_t>(blocks.size());
+  header.key_count = static_cast<uint32_t>(keys.size());
+  header.posting_count = posting_list.size();
+  header.strings_size = strings.size();
+
+  const auto file = fopen(index_path.c_str(), "wb");
+  if (!file) {
+    fprintf(stderr, "error: %s: %s\n", index_path.c_str(), strerror(errno));
+    return EXIT_FAILURE;
+  }
+  const auto written =
+      fwrite(&header, sizeof(header), 1, file) == 1 &&
+      fwrite(blocks.data(), sizeof(QueryIndexBlock), blocks.size(), file) ==
+          blocks.size() &&
+      fwrite(keys.data(), sizeof(QueryIndexKey), keys.size(), file) ==
+          keys.size() &&
+      fwrite(posting_list.data(), sizeof(uint32_t), posting_list.size(),
+             file) == posting_list.size() &&
+      fwrite(strings.data(), 1, strings.size(), file) == strings.size();
+  if (fclose(file) != 0 || !written) {
+    fprintf(stderr, "error: %s: failed to write\n", index_path.c_str());
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "%llu lines, %u blocks, %u keys\n", line_count,
+          header.block_count, header.key_count);
+  return EXIT_SUCCESS;
+}
+
+// Answers a query with a query index. Returns false if the index is unusable.
+bool QueryWithIndex(const Query& query, const ddimon::MappedFile& log,
+                    const ddimon::MappedFile& index, bool count_only,
+                    QueryResult* result) {
+  const auto data = index.data();
+  const auto header = reinterpret_cast<const QueryIndexFileHeader*>(data);
+  if (index.size() < sizeof(*header) || header->magic != kQueryIndexFileMagic ||
+      header->version != kQueryIndexFileVersion) {
+    fprintf(stderr, "warning: not a query index file\n");
+    return false;
+  }
+  const auto expected_size = sizeof(*header) +
+                             header->block_count * sizeof(QueryIndexBlock) +
+                             header->key_count * sizeof(QueryIndexKey) +
+                             header->posting_count * sizeof(uint32_t) +
+                             header->strings_size;
+  if (index.size() != expected_size || header->log_size > log.size()) {
+    fprintf(stderr, "warning: the query index is corrupted or stale\n");
+    return false;
+  }
+  const auto blocks = reinterpret_cast<const QueryIndexBlock*>(header + 1);
+  const auto keys =
+      reinterpret_cast<const QueryIndexKey*>(blocks + header->block_count);
+  const auto postings =
+      reinterpret_cast<const uint32_t*>(keys + header->key_count);
+  const auto strings =
+      reinterpret_cast<const char*>(postings + header->posting_count);
+
+  // Look up postings of each condition
+  const auto find_postings = [&](QueryField field, std::string_view name,
+                                 std::vector<uint32_t>* list) {
+    const auto keys_end = keys + header->key_count;
+    const auto key = std::lower_bound(
+        keys, keys_end, std::make_pair(field, name),
+        [strings](const QueryIndexKey& k, const auto& value) {
+          if (k.field != value.first) {
+            return k.field < value.first;
+          }
+          return std::string_view(strings + k.name_offset, k.name_length) <
+                 value.second;
+        });
+    list->clear();
+    if (key == keys_end || key->field != field ||
+        std::string_view(strings + key->name_offset, key->name_length) !=
+            name ||
+        key->first_posting + key->posting_count > header->posting_count) {
+      return;
+    }
+    list->assign(postings + key->first_posting,
+                 postings + key->first_posting + key->posting_count);
+  };
+
+  std::vector<uint32_t> candidates(header->block_count);
+  for (auto i = 0u; i < header->block_count; ++i) {
+    candidates[i] = i;
+  }
+  std::vector<uint32_t> list;
+  std::vector<uint32_t> intersection;
+  const auto intersect = [&]() {
+    intersection.clear();
+    std::set_intersection(candidates.begin(), candidates.end(), list.begin(),
+                          list.end(), std::back_inserter(intersection));
+    candidates.swap(intersection);
+  };
+  if (query.pid >= 0) {
+    find_postings(QueryField::kPid, std::to_string(query.pid), &list);
+    intersect();
+  }
+  if (!query.ddi.empty()) {
+    find_postings(QueryField::kDdi, query.ddi, &list);
+    intersect();
+  }
+  if (!query.tag.empty()) {
+    find_postings(QueryField::kTag, query.tag, &list);
+    intersect();
+  }
+
+  // Scan candidate blocks within the window, then lines appended since
+  const auto log_begin = reinterpret_cast<const char*>(log.data());
+  for (const auto index_of_block : candidates) {
+    const auto& block = blocks[index_of_block];
+    if (!OverlapsWindow(query, block.min_ms_of_day, block.max_ms_of_day)) {
+      continue;
+    }
+    const auto block_end = (index_of_block + 1 < header->block_count)
+                               ? blocks[index_of_block + 1].start_offset
+                               : header->log_size;
+    ScanRange(query, log_begin + block.start_offset, log_begin + block_end,
+              count_only, result);
+  }
+  ScanRange(query, log_begin + header->log_size, log_begin + log.size(),
+            count_only, result);
+  return true;
+}
+
+// Adds a hash of each token of the text as the driver does to hashes
+void HashTokens(std::string_view text, std::vector<uint32_t>* hashes) {
+  auto hash = ddimon::kLogIndexFnvOffsetBasis;
+  auto token_length = 0u;
+  for (size_t i = 0; i <= text.size(); ++i) {
+    auto c = (i < text.size()) ? text[i] : '\0';
+    if (c >= 'a' && c <= 'z') {
+      c -= 'a' - 'A';
+    }
+    if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || c == '_') {
+      hash ^= static_cast<uint8_t>(c);
+      hash *= ddimon::kLogIndexFnvPrime;
+      token_length++;
+      continue;
+    }
+    if (token_length >= 2) {
+      hashes->push_back(hash);
+    }
+    hash = ddimon::kLogIndexFnvOffsetBasis;
+    token_length = 0;
+  }
+}
+
+// Answers a query with Bloom filters of an index file written by the driver.
+// Returns false if the index is unusable.
+bool QueryWithDriverIndex(const Query& query, const ddimon::MappedFile& log,
+                          const ddimon::MappedFile& index, bool count_only,
+                          QueryResult* result) {
+  const auto data = index.data();
+  ddimon::LogIndexFileHeader header = {};
+  if (index.size() < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  auto bloom_shift = 0u;
+  while ((1u << bloom_shift) < header.bloom_bits) {
+    bloom_shift++;
+  }
+  if (header.magic != ddimon::kLogIndexFileMagic ||
+      header.version > ddimon::kLogIndexFileVersion || !header.bloom_bits ||
+      (1u << bloom_shift) != header.bloom_bits ||
+      header.bucket_size !=
+          sizeof(ddimon::LogIndexBucketHeader) + header.bloom_bits / 8) {
+    fprintf(stderr, "warning: not a log index file\n");
+    return false;
+  }
+
+  std::vector<uint32_t> hashes;
+  if (query.pid >= 0) {
+    HashTokens(std::to_string(query.pid), &hashes);
+  }
+  HashTokens(query.ddi, &hashes);
+  HashTokens(query.tag, &hashes);
+
+  // Buckets are in order of offsets. Scan buckets whose filters may contain
+  // all tokens, then lines written after the last bucket.
+  const auto log_begin = reinterpret_cast<const char*>(log.data());
+  uint64_t indexed_end = 0;
+  for (auto offset = sizeof(header);
+       offset + header.bucket_size <= index.size();
+       offset += header.bucket_size) {
+    ddimon::LogIndexBucketHeader bucket = {};
+    memcpy(&bucket, data + offset, sizeof(bucket));
+    const auto bloom = data + offset + sizeof(bucket);
+    if (bucket.start_offset > bucket.end_offset ||
+        bucket.end_offset > log.size()) {
+      break;
+    }
+    indexed_end = bucket.end_offset;
+    const auto may_contain = std::all_of(
+        hashes.begin(), hashes.end(), [&](uint32_t hash) {
+          const auto bit1 = hash % header.bloom_bits;
+          const auto bit2 = (hash >> bloom_shift) % header.bloom_bits;
+          return (bloom[bit1 / 8] & (1 << (bit1 % 8))) &&
+                 (bloom[bit2 / 8] & (1 << (bit2 % 8)));
+        });
+    if (may_contain) {
+      ScanRange(query, log_begin + bucket.start_offset,
+                log_begin + bucket.end_offset, count_only, result);
+    }
+  }
+  ScanRange(query, log_begin + indexed_end, log_begin + log.size(), count_only,
+            result);
+  return true;
+}
+
+int RunQuery(int argc, char* argv[]) {
+  Query query;
+  std::string index_path;
+  auto count_only = false;
+  auto verbose = false;
+  auto has_from = false;
+  auto has_to = false;
+  int option = 0;
+  while ((option = getopt(argc, argv, "x:p:d:t:f:u:cv")) != -1) {
+    switch (option) {
+      case 'x':
+        index_path = optarg;
+        break;
+      case 'p':
+        query.pid = strtoll(optarg, nullptr, 10);
+        break;
+      case 'd':
+        query.ddi = optarg;
+        break;
+      case 't':
+        query.tag = optarg;
+        break;
+      case 'f':
+        has_from = ParseTimeOfDay(optarg, &query.from_ms_of_day);
+        if (!has_from) {
+          PrintUsage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'u':
+        has_to = ParseTimeOfDay(optarg, &query.to_ms_of_day);
+        if (!has_to) {
+          PrintUsage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'c':
+        count_only = true;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind + 1 != argc) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+  if (has_from || has_to) {
+    query.has_window = true;
+    if (!has_to) {
+      query.to_ms_of_day = ddimon::kMillisecondsPerDay - 1;
+    }
+  }
+  const std::string log_path = argv[optind];
+
+  const auto start = std::chrono::steady_clock::now();
+  std::string error;
+  ddimon::MappedFile log;
+  if (!log.Open(log_path.c_str(), &error)) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+
+  // Use the query index if present, then an index of the driver, and then
+  // scan the whole log
+  QueryResult result;
+  ddimon::MappedFile index;
+  const char* method = "full scan";
+  if (index.Open((index_path.empty()) ? (log_path + ".qidx").c_str()
+                                      : index_path.c_str(),
+                 &error) &&
+      QueryWithIndex(query, log, index, count_only, &result)) {
+    method = "query index";
+  } else if (index.Open((log_path + ".idx").c_str(), &error) &&
+             QueryWithDriverIndex(query, log, index, count_only, &result)) {
+    method = "driver index";
+  } else {
+    result = QueryResult();
+    const auto begin = reinterpret_cast<const char*>(log.data());
+    ScanRange(query, begin, begin + log.size(), count_only, &result);
+  }
+
+  if (count_only) {
+    printf("%llu\n", static_cast<unsigned long long>(result.matched_lines));
+  }
+  if (verbose) {
+    const auto elapsed = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start);
+    fprintf(stderr,
+            "%s: %llu lines matched, %llu of %zu bytes scanned, %.3f ms\n",
+            method, static_cast<unsigned long long>(result.matched_lines),
+            static_cast<unsigned long long>(result.scanned_bytes), log.size(),
+            elapsed.count());
+  }
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+  const std::string command = argv[1];
+  if (command == "index") {
+    return BuildIndex(argc - 1, argv + 1);
+  }
+  if (command == "query") {
+    return RunQuery(argc - 1, argv + 1);
+  }
+  PrintUsage();
+  return EXIT_FAILURE;
+}
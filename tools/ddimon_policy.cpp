@@ -0,0 +1,480 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a command that compiles a hook policy into a manifest for the
+/// HookPolicy value of DdiMon, and dumps a manifest.
+///
+/// A policy is a text file with one rule per line. Text after '#' is a comment.
+///
+///   <name> handler=<handler> [sample=N] [rate=N] [include_image_callers] [{]
+///
+/// A name is an export name, or an expression with '*' and '?' matched against
+/// all exports. A handler is one of ExQueueWorkItem, ExAllocatePoolWithTag,
+/// ExFreePool, ExFreePoolWithTag and NtQuerySystemInformation. sample=N handles
+/// one of N calls, rate=N handles up to N calls a second, and
+/// include_image_callers handles calls from inside images too. A rule ending
+/// with '{' is followed by a predicate program written as described in
+/// predicate.h, and a line '}'.
+
+#include <getopt.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ddimon_formats.h"
+#include "mapped_file.h"
+#include "predicate.h"
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A maximum length of an export name the driver compares with rules
+const size_t kMaxNameLength = 99;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A rule parsed from a policy
+struct Rule {
+  std::string pattern;  // Upper-case
+  ddimon::PolicyManifestEntry entry;
+  std::vector<ddimon::PredInstruction> program;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Names of PolicyHandlerId in order
+const char* const kHandlerNames[] = {
+    nullptr,
+    "ExQueueWorkItem",
+    "ExAllocatePoolWithTag",
+    "ExFreePool",
+    "ExFreePoolWithTag",
+    "NtQuerySystemInformation",
+};
+static_assert(sizeof(kHandlerNames) / sizeof(kHandlerNames[0]) ==
+                  static_cast<size_t>(ddimon::PolicyHandlerId::kMaximum),
+              "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+void PrintUsage() {
+  fprintf(stderr,
+          "usage: ddimon_policy compile [-o HookPolicy.bin] policy.txt\n"
+          "       ddimon_policy dump HookPolicy.bin\n");
+}
+
+std::string Trim(const std::string& text) {
+  const auto begin = text.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  const auto end = text.find_last_not_of(" \t\r");
+  return text.substr(begin, end - begin + 1);
+}
+
+// Hashes an export name in the same way as PolicyHashName() of the driver
+uint32_t HashName(const std::string& name) {
+  auto hash = ddimon::kPolicyFnvOffsetBasis;
+  for (const auto c : name) {
+    hash ^= static_cast<uint8_t>(toupper(static_cast<unsigned char>(c)));
+    hash *= ddimon::kPolicyFnvPrime;
+  }
+  return hash;
+}
+
+// Parses an unsigned 32-bit number
+bool ParseNumber(const std::string& text, uint32_t* number) {
+  if (text.empty() || !isdigit(static_cast<unsigned char>(text[0]))) {
+    return false;
+  }
+  char* end = nullptr;
+  errno = 0;
+  const auto value = strtoull(text.c_str(), &end, 0);
+  if (errno || *end || value > UINT32_MAX) {
+    return false;
+  }
+  *number = static_cast<uint32_t>(value);
+  return true;
+}
+
+// Parses a rule line except a '{' at the end
+bool ParseRule(std::istringstream* tokens, Rule* rule, std::string* error) {
+  std::string name;
+  *tokens >> name;
+  if (name.empty()) {
+    *error = "no name is given";
+    return false;
+  }
+  if (name.size() > kMaxNameLength) {
+    *error = "a name is longer than " + std::to_string(kMaxNameLength);
+    return false;
+  }
+  auto wildcard = false;
+  for (const auto c : name) {
+    if (c == '*' || c == '?') {
+      wildcard = true;
+    } else if (!isalnum(static_cast<unsigned char>(c)) && c != '_') {
+      *error = "invalid name '" + name + "'";
+      return false;
+    }
+    rule->pattern.push_back(
+        static_cast<char>(toupper(static_cast<unsigned char>(c))));
+  }
+  rule->entry.name_hash = wildcard ? 0 : HashName(name);
+
+  std::string token;
+  while (*tokens >> token) {
+    const auto equal = token.find('=');
+    const auto key = token.substr(0, equal);
+    const auto value =
+        equal == std::string::npos ? std::string() : token.substr(equal + 1);
+    auto valid = true;
+    if (key == "handler") {
+      const auto count = sizeof(kHandlerNames) / sizeof(kHandlerNames[0]);
+      for (size_t i = 1; i < count; ++i) {
+        if (value == kHandlerNames[i]) {
+          rule->entry.handler_id = static_cast<uint16_t>(i);
+        }
+      }
+      valid = rule->entry.handler_id != 0;
+    } else if (key == "sample") {
+      valid = ParseNumber(value, &rule->entry.sample_every);
+    } else if (key == "rate") {
+      valid = ParseNumber(value, &rule->entry.max_per_second);
+    } else if (token == "include_image_callers") {
+      rule->entry.flags |= ddimon::kPolicyFlagIncludeImageCallers;
+    } else {
+      valid = false;
+    }
+    if (!valid) {
+      *error = "invalid option '" + token + "'";
+      return false;
+    }
+  }
+  if (!rule->entry.handler_id) {
+    *error = "no handler is given";
+    return false;
+  }
+  return true;
+}
+
+// Parses a policy into rules
+bool ParsePolicy(std::istream* input, std::vector<Rule>* rules,
+                 std::string* error) {
+  std::string text;
+  for (auto line = 1; std::getline(*input, text); ++line) {
+    text = Trim(text.substr(0, text.find('#')));
+    if (text.empty()) {
+      continue;
+    }
+    const auto has_program = text.back() == '{';
+    if (has_program) {
+      text.pop_back();
+    }
+
+    Rule rule = {};
+    std::istringstream tokens(text);
+    if (!ParseRule(&tokens, &rule, error)) {
+      *error = "line " + std::to_string(line) + ": " + *error;
+      return false;
+    }
+    if (has_program) {
+      const auto first_line = line + 1;
+      std::string source;
+      auto closed = false;
+      while (!closed && std::getline(*input, text)) {
+        ++line;
+        closed = Trim(text.substr(0, text.find_first_of(";#"))) == "}";
+        if (!closed) {
+          source += text + "\n";
+        }
+      }
+      if (!closed) {
+        *error = "line " + std::to_string(first_line - 1) +
+                 ": a program is not closed with '}'";
+        return false;
+      }
+      if (!ddimon::AssemblePredicate(source, first_line, &rule.program,
+                                     error)) {
+        return false;
+      }
+    }
+    rules->push_back(rule);
+  }
+  if (rules->empty()) {
+    *error = "no rule is given";
+    return false;
+  }
+  return true;
+}
+
+// Lays out a manifest. Programs are placed at the beginning of the string
+// table so that they are aligned to instructions.
+std::vector<uint8_t> BuildManifest(std::vector<Rule>* rules) {
+  std::vector<uint8_t> strings;
+  for (auto& rule : *rules) {
+    if (rule.program.empty()) {
+      continue;
+    }
+    const auto bytes =
+        reinterpret_cast<const uint8_t*>(rule.program.data());
+    rule.entry.program_offset = static_cast<uint32_t>(strings.size());
+    rule.entry.program_count = static_cast<uint32_t>(rule.program.size());
+    strings.insert(strings.end(), bytes,
+                   bytes + rule.program.size() * sizeof(rule.program[0]));
+  }
+  for (auto& rule : *rules) {
+    rule.entry.pattern_offset = static_cast<uint32_t>(strings.size());
+    rule.entry.pattern_size =
+        static_cast<uint16_t>(rule.pattern.size() * sizeof(uint16_t));
+    for (const auto c : rule.pattern) {
+      strings.push_back(static_cast<uint8_t>(c));
+      strings.push_back(0);
+    }
+  }
+
+  ddimon::PolicyManifestHeader header = {};
+  header.magic = ddimon::kPolicyManifestMagic;
+  header.version = ddimon::kPolicyManifestVersion;
+  header.entry_size = sizeof(ddimon::PolicyManifestEntry);
+  header.entry_count = static_cast<uint32_t>(rules->size());
+  header.strings_offset = static_cast<uint32_t>(
+      sizeof(header) + rules->size() * sizeof(ddimon::PolicyManifestEntry));
+  header.strings_size = static_cast<uint32_t>(strings.size());
+  header.total_size = header.strings_offset + header.strings_size;
+
+  std::vector<uint8_t> manifest(header.total_size);
+  memcpy(manifest.data(), &header, sizeof(header));
+  auto entry = manifest.data() + sizeof(header);
+  for (const auto& rule : *rules) {
+    memcpy(entry, &rule.entry, sizeof(rule.entry));
+    entry += sizeof(rule.entry);
+  }
+  memcpy(manifest.data() + header.strings_offset, strings.data(),
+         strings.size());
+  return manifest;
+}
+
+// Checks a manifest with the same rules as PolicypIsValidManifest() of the
+// driver
+bool ValidateManifest(const uint8_t* manifest, size_t size,
+                      std::string* error) {
+  ddimon::PolicyManifestHeader header = {};
+  if (size < sizeof(header)) {
+    *error = "not a hook policy manifest";
+    return false;
+  }
+  memcpy(&header, manifest, sizeof(header));
+  if (header.magic != ddimon::kPolicyManifestMagic) {
+    *error = "not a hook policy manifest";
+    return false;
+  }
+  if (header.version != ddimon::kPolicyManifestVersion ||
+      header.entry_size != sizeof(ddimon::PolicyManifestEntry)) {
+    *error = "unsupported version " + std::to_string(header.version);
+    return false;
+  }
+  const auto entries_end =
+      sizeof(header) +
+      static_cast<uint64_t>(header.entry_count) * header.entry_size;
+  const auto strings_end =
+      static_cast<uint64_t>(header.strings_offset) + header.strings_size;
+  if (header.total_size != size || !header.entry_count ||
+      header.strings_offset % sizeof(uint16_t) ||
+      entries_end > header.strings_offset || strings_end > size) {
+    *error = "invalid header";
+    return false;
+  }
+
+  const auto strings = manifest + header.strings_offset;
+  for (uint32_t i = 0; i < header.entry_count; ++i) {
+    const auto where = "entry " + std::to_string(i) + ": ";
+    ddimon::PolicyManifestEntry entry = {};
+    memcpy(&entry, manifest + sizeof(header) + i * sizeof(entry),
+           sizeof(entry));
+    const auto pattern_end =
+        static_cast<uint64_t>(entry.pattern_offset) + entry.pattern_size;
+    if (!entry.pattern_size || entry.pattern_size % sizeof(uint16_t) ||
+        entry.pattern_offset % sizeof(uint16_t) ||
+        pattern_end > header.strings_size) {
+      *error = where + "invalid pattern";
+      return false;
+    }
+    if (!entry.handler_id ||
+        entry.handler_id >=
+            static_cast<uint16_t>(ddimon::PolicyHandlerId::kMaximum)) {
+      *error = where + "invalid handler " + std::to_string(entry.handler_id);
+      return false;
+    }
+    if (!entry.program_count) {
+      continue;
+    }
+    const auto program_end =
+        static_cast<uint64_t>(entry.program_offset) +
+        static_cast<uint64_t>(entry.program_count) *
+            sizeof(ddimon::PredInstruction);
+    if (program_end > header.strings_size) {
+      *error = where + "invalid program";
+      return false;
+    }
+    std::vector<ddimon::PredInstruction> program(entry.program_count);
+    memcpy(program.data(), strings + entry.program_offset,
+           program.size() * sizeof(program[0]));
+    if (!ddimon::VerifyPredicate(program.data(), program.size(), error)) {
+      *error = where + *error;
+      return false;
+    }
+  }
+  return true;
+}
+
+int CompilePolicy(int argc, char* argv[]) {
+  const char* output_path = nullptr;
+  int option = 0;
+  while ((option = getopt(argc, argv, "o:")) != -1) {
+    switch (option) {
+      case 'o':
+        output_path = optarg;
+        break;
+      default:
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind + 1 != argc) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  std::string error;
+  std::vector<Rule> rules;
+  std::ifstream input(argv[optind]);
+  if (!input) {
+    fprintf(stderr, "error: %s: %s\n", argv[optind], strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (!ParsePolicy(&input, &rules, &error)) {
+    fprintf(stderr, "error: %s: %s\n", argv[optind], error.c_str());
+    return EXIT_FAILURE;
+  }
+  const auto manifest = BuildManifest(&rules);
+  if (!ValidateManifest(manifest.data(), manifest.size(), &error)) {
+    fprintf(stderr, "error: built an invalid manifest: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+
+  // Print the manifest as data for reg add /t REG_BINARY /d unless a file is
+  // given
+  if (!output_path) {
+    for (const auto byte : manifest) {
+      printf("%02x", byte);
+    }
+    printf("\n");
+    return EXIT_SUCCESS;
+  }
+  const auto output = fopen(output_path, "wb");
+  if (!output) {
+    fprintf(stderr, "error: %s: %s\n", output_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  const auto written =
+      fwrite(manifest.data(), 1, manifest.size(), output) == manifest.size();
+  if (fclose(output) != 0 || !written) {
+    fprintf(stderr, "error: %s: failed to write\n", output_path);
+    return EXIT_FAILURE;
+  }
+  printf("%zu rules in %zu bytes\n", rules.size(), manifest.size());
+  return EXIT_SUCCESS;
+}
+
+// Prints a manifest as a policy that compiles into the same manifest
+int DumpManifest(int argc, char* argv[]) {
+  if (argc != 2) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  std::string error;
+  ddimon::MappedFile file;
+  if (!file.Open(argv[1], &error) ||
+      !ValidateManifest(file.data(), file.size(), &error)) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+
+  ddimon::PolicyManifestHeader header = {};
+  memcpy(&header, file.data(), sizeof(header));
+  const auto strings = file.data() + header.strings_offset;
+  for (uint32_t i = 0; i < header.entry_count; ++i) {
+    ddimon::PolicyManifestEntry entry = {};
+    memcpy(&entry, file.data() + sizeof(header) + i * sizeof(entry),
+           sizeof(entry));
+    std::string pattern;
+    for (uint32_t n = 0; n < entry.pattern_size; n += sizeof(uint16_t)) {
+      uint16_t c = 0;
+      memcpy(&c, strings + entry.pattern_offset + n, sizeof(c));
+      pattern.push_back(c < 0x80 ? static_cast<char>(c) : '?');
+    }
+
+    printf("# Entry %u, name hash 0x%08x\n", i, entry.name_hash);
+    printf("%s handler=%s", pattern.c_str(), kHandlerNames[entry.handler_id]);
+    if (entry.sample_every) {
+      printf(" sample=%u", entry.sample_every);
+    }
+    if (entry.max_per_second) {
+      printf(" rate=%u", entry.max_per_second);
+    }
+    if (entry.flags & ddimon::kPolicyFlagIncludeImageCallers) {
+      printf(" include_image_callers");
+    }
+    if (!entry.program_count) {
+      printf("\n");
+      continue;
+    }
+    std::vector<ddimon::PredInstruction> program(entry.program_count);
+    memcpy(program.data(), strings + entry.program_offset,
+           program.size() * sizeof(program[0]));
+    printf(" {\n%s}\n",
+           ddimon::DisassemblePredicate(program.data(), program.size())
+               .c_str());
+  }
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+  const std::string command = argv[1];
+  if (command == "compile") {
+    return CompilePolicy(argc - 1, argv + 1);
+  }
+  if (command == "dump") {
+    return DumpManifest(argc - 1, argv + 1);
+  }
+  PrintUsage();
+  return EXIT_FAILURE;
+}
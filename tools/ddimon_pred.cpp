@@ -0,0 +1,202 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a command that assembles, verifies and runs predicate programs
+/// outside of the driver.
+///
+/// A binary program is an array of PredInstruction as stored in a hook policy
+/// manifest. Programs are verified with the same rules as the driver before
+/// they are disassembled or run, and run by an interpreter identical to the
+/// one of the driver.
+
+#include <getopt.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "mapped_file.h"
+#include "predicate.h"
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+void PrintUsage() {
+  fprintf(stderr,
+          "usage: ddimon_pred assemble -o program.bin program.pred\n"
+          "       ddimon_pred verify program.bin\n"
+          "       ddimon_pred run [-f field=value]... program.bin\n");
+}
+
+// Reads and verifies a binary program
+bool ReadProgram(const char* path,
+                 std::vector<ddimon::PredInstruction>* program,
+                 std::string* error) {
+  ddimon::MappedFile file;
+  if (!file.Open(path, error)) {
+    return false;
+  }
+  if (file.size() % sizeof(ddimon::PredInstruction)) {
+    *error = std::string(path) + ": not a multiple of instructions";
+    return false;
+  }
+  program->resize(file.size() / sizeof(ddimon::PredInstruction));
+  memcpy(program->data(), file.data(), file.size());
+  if (!ddimon::VerifyPredicate(program->data(), program->size(), error)) {
+    *error = std::string(path) + ": rejected: " + *error;
+    return false;
+  }
+  return true;
+}
+
+// Parses field=value and sets it to the context
+bool ParseField(const std::string& text, ddimon::PredContext* context) {
+  const auto equal = text.find('=');
+  if (equal == std::string::npos) {
+    return false;
+  }
+  const auto name = text.substr(0, equal);
+  const auto value = text.substr(equal + 1);
+  char* end = nullptr;
+  errno = 0;
+  const auto number = strtoull(value.c_str(), &end, 0);
+  if (value.empty() || errno || *end) {
+    return false;
+  }
+  for (uint32_t i = 0; i < static_cast<uint32_t>(ddimon::PredField::kMaximum);
+       ++i) {
+    if (name == ddimon::GetPredicateFieldName(
+                    static_cast<ddimon::PredField>(i))) {
+      context->fields[i] = number;
+      return true;
+    }
+  }
+  return false;
+}
+
+int AssembleProgram(int argc, char* argv[]) {
+  const char* output_path = nullptr;
+  int option = 0;
+  while ((option = getopt(argc, argv, "o:")) != -1) {
+    switch (option) {
+      case 'o':
+        output_path = optarg;
+        break;
+      default:
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (!output_path || optind + 1 != argc) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  std::ifstream input(argv[optind]);
+  if (!input) {
+    fprintf(stderr, "error: %s: %s\n", argv[optind], strerror(errno));
+    return EXIT_FAILURE;
+  }
+  std::ostringstream source;
+  source << input.rdbuf();
+  std::string error;
+  std::vector<ddimon::PredInstruction> program;
+  if (!ddimon::AssemblePredicate(source.str(), 1, &program, &error)) {
+    fprintf(stderr, "error: %s: %s\n", argv[optind], error.c_str());
+    return EXIT_FAILURE;
+  }
+
+  const auto output = fopen(output_path, "wb");
+  if (!output) {
+    fprintf(stderr, "error: %s: %s\n", output_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  const auto written = fwrite(program.data(), sizeof(program[0]),
+                              program.size(), output) == program.size();
+  if (fclose(output) != 0 || !written) {
+    fprintf(stderr, "error: %s: failed to write\n", output_path);
+    return EXIT_FAILURE;
+  }
+  printf("%zu instructions\n", program.size());
+  return EXIT_SUCCESS;
+}
+
+int VerifyProgram(int argc, char* argv[]) {
+  if (argc != 2) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  std::string error;
+  std::vector<ddimon::PredInstruction> program;
+  if (!ReadProgram(argv[1], &program, &error)) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+  printf("%s",
+         ddimon::DisassemblePredicate(program.data(), program.size()).c_str());
+  return EXIT_SUCCESS;
+}
+
+int RunProgram(int argc, char* argv[]) {
+  ddimon::PredContext context = {};
+  int option = 0;
+  while ((option = getopt(argc, argv, "f:")) != -1) {
+    switch (option) {
+      case 'f':
+        if (!ParseField(optarg, &context)) {
+          fprintf(stderr, "error: invalid field '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind + 1 != argc) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  std::string error;
+  std::vector<ddimon::PredInstruction> program;
+  if (!ReadProgram(argv[optind], &program, &error)) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+  const auto verdict =
+      ddimon::ExecutePredicate(program.data(), program.size(), context);
+  printf("%s\n", ddimon::GetPredicateVerdictName(verdict));
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+  const std::string command = argv[1];
+  if (command == "assemble") {
+    return AssembleProgram(argc - 1, argv + 1);
+  }
+  if (command == "verify") {
+    return VerifyProgram(argc - 1, argv + 1);
+  }
+  if (command == "run") {
+    return RunProgram(argc - 1, argv + 1);
+  }
+  PrintUsage();
+  return EXIT_FAILURE;
+}
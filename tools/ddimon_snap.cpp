@@ -0,0 +1,262 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a command that reconstructs physical memory from DdiMon.snap.
+///
+/// The first epoch of a snapshot file holds all physical memory pages, and each
+/// following epoch holds pages modified since the previous one. The image at
+/// epoch N is made of the latest copy of each page in epochs 0 through N, and
+/// written as a raw file where a file offset equals a physical address. Ranges
+/// not backed by physical memory are left as holes of a sparse file.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "ddimon_formats.h"
+#include "mapped_file.h"
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// System time of 1970-01-01 00:00:00 UTC
+const int64_t kUnixEpochSystemTime = 116444736000000000ll;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// An epoch found in a snapshot file
+struct Epoch {
+  ddimon::SnapEpochHeader header;
+  uint64_t pages_offset;  // A file offset of the first SnapPageHeader
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+void PrintUsage() {
+  fprintf(stderr,
+          "usage: ddimon_snap list DdiMon.snap\n"
+          "       ddimon_snap extract [-e epoch] -o memory.raw DdiMon.snap\n");
+}
+
+// Formats system time as UTC
+std::string FormatSystemTime(int64_t system_time) {
+  const auto seconds =
+      static_cast<time_t>((system_time - kUnixEpochSystemTime) /
+                          (ddimon::kSystemTimePerMillisecond * 1000));
+  tm utc = {};
+  char text[32] = {};
+  if (!gmtime_r(&seconds, &utc) ||
+      !strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &utc)) {
+    return "-";
+  }
+  return text;
+}
+
+// Reads the file header and all complete epochs. An epoch cut off at the end
+// of the file, which happens when the system stopped while it was written, is
+// ignored with a warning.
+bool ReadEpochs(const ddimon::MappedFile& file,
+                ddimon::SnapFileHeader* file_header,
+                std::vector<Epoch>* epochs, std::string* error) {
+  if (file.size() < sizeof(*file_header)) {
+    *error = "not a snapshot file";
+    return false;
+  }
+  memcpy(file_header, file.data(), sizeof(*file_header));
+  if (file_header->magic != ddimon::kSnapFileMagic) {
+    *error = "not a snapshot file";
+    return false;
+  }
+  if (file_header->version != ddimon::kSnapFileVersion) {
+    *error = "unsupported version " + std::to_string(file_header->version);
+    return false;
+  }
+  const uint64_t page_size = file_header->page_size;
+  if (!page_size || (page_size & (page_size - 1))) {
+    *error = "invalid page size " + std::to_string(page_size);
+    return false;
+  }
+
+  const auto record_size = sizeof(ddimon::SnapPageHeader) + page_size;
+  uint64_t offset = sizeof(*file_header);
+  while (offset < file.size()) {
+    Epoch epoch = {};
+    if (file.size() - offset < sizeof(epoch.header)) {
+      fprintf(stderr, "warning: ignored incomplete epoch %zu\n",
+              epochs->size());
+      break;
+    }
+    memcpy(&epoch.header, file.data() + offset, sizeof(epoch.header));
+    if (epoch.header.magic != ddimon::kSnapEpochMagic ||
+        epoch.header.epoch != epochs->size() ||
+        epoch.header.page_count > file_header->number_of_pages) {
+      *error = "corrupted epoch " + std::to_string(epochs->size());
+      return false;
+    }
+    epoch.pages_offset = offset + sizeof(epoch.header);
+    const auto pages_size = epoch.header.page_count * record_size;
+    if (file.size() - epoch.pages_offset < pages_size) {
+      fprintf(stderr, "warning: ignored incomplete epoch %u\n",
+              epoch.header.epoch);
+      break;
+    }
+    epochs->push_back(epoch);
+    offset = epoch.pages_offset + pages_size;
+  }
+  if (epochs->empty()) {
+    *error = "no complete epoch";
+    return false;
+  }
+  return true;
+}
+
+int ListEpochs(int argc, char* argv[]) {
+  if (argc != 2) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  std::string error;
+  ddimon::MappedFile file;
+  ddimon::SnapFileHeader file_header = {};
+  std::vector<Epoch> epochs;
+  if (!file.Open(argv[1], &error) ||
+      !ReadEpochs(file, &file_header, &epochs, &error)) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+
+  printf("%" PRIu64 " pages of %u bytes\n", file_header.number_of_pages,
+         file_header.page_size);
+  printf("%6s,%-19s,%10s\n", "Epoch", "Time (UTC)", "Pages");
+  for (const auto& epoch : epochs) {
+    printf("%6u,%-19s,%10" PRIu64 "\n", epoch.header.epoch,
+           FormatSystemTime(epoch.header.timestamp).c_str(),
+           epoch.header.page_count);
+  }
+  return EXIT_SUCCESS;
+}
+
+int ExtractImage(int argc, char* argv[]) {
+  const char* output_path = nullptr;
+  auto last_epoch = -1l;
+  int option = 0;
+  while ((option = getopt(argc, argv, "e:o:")) != -1) {
+    switch (option) {
+      case 'e':
+        last_epoch = strtol(optarg, nullptr, 0);
+        break;
+      case 'o':
+        output_path = optarg;
+        break;
+      default:
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (!output_path || optind + 1 != argc) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  std::string error;
+  ddimon::MappedFile file;
+  ddimon::SnapFileHeader file_header = {};
+  std::vector<Epoch> epochs;
+  if (!file.Open(argv[optind], &error) ||
+      !ReadEpochs(file, &file_header, &epochs, &error)) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+  if (last_epoch == -1) {
+    last_epoch = static_cast<long>(epochs.size()) - 1;
+  }
+  if (last_epoch < 0 || static_cast<size_t>(last_epoch) >= epochs.size()) {
+    fprintf(stderr, "error: epoch %ld is not in the file\n", last_epoch);
+    return EXIT_FAILURE;
+  }
+
+  // Find the latest copy of each page so that each page is written once
+  const uint64_t page_size = file_header.page_size;
+  const auto record_size = sizeof(ddimon::SnapPageHeader) + page_size;
+  std::unordered_map<uint64_t, uint64_t> latest_copies;
+  for (auto i = 0l; i <= last_epoch; ++i) {
+    const auto& epoch = epochs[i];
+    for (uint64_t n = 0; n < epoch.header.page_count; ++n) {
+      const auto record_offset = epoch.pages_offset + n * record_size;
+      ddimon::SnapPageHeader page_header = {};
+      memcpy(&page_header, file.data() + record_offset, sizeof(page_header));
+      latest_copies[page_header.physical_address] =
+          record_offset + sizeof(page_header);
+    }
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> pages(latest_copies.begin(),
+                                                   latest_copies.end());
+  std::sort(pages.begin(), pages.end());
+
+  const auto output = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (output == -1) {
+    fprintf(stderr, "error: %s: %s\n", output_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  auto succeeded = true;
+  for (const auto& page : pages) {
+    if (pwrite(output, file.data() + page.second, page_size, page.first) !=
+        static_cast<ssize_t>(page_size)) {
+      succeeded = false;
+      break;
+    }
+  }
+  // Extend the file to the end of the last page in case it ends with a hole
+  if (succeeded && !pages.empty()) {
+    succeeded = ftruncate(output, pages.back().first + page_size) == 0;
+  }
+  if (close(output) != 0 || !succeeded) {
+    fprintf(stderr, "error: %s: failed to write\n", output_path);
+    return EXIT_FAILURE;
+  }
+
+  printf("%zu pages at epoch %ld (%s UTC)\n", pages.size(), last_epoch,
+         FormatSystemTime(epochs[last_epoch].header.timestamp).c_str());
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+  const std::string command = argv[1];
+  if (command == "list") {
+    return ListEpochs(argc - 1, argv + 1);
+  }
+  if (command == "extract") {
+    return ExtractImage(argc - 1, argv + 1);
+  }
+  PrintUsage();
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,287 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a command that resolves addresses in DdiMon logs offline.
+///
+/// An index is built once from DdiMon.mod and optional copies of images and
+/// PDB files, and then memory-mapped by each run that rewrites a log. Each
+/// hexadecimal token of 8 or 16 digits that falls in a loaded image is
+/// followed by "(image!symbol+0xoffset)" or "(image+0xoffset)".
+
+#include <getopt.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "log_format.h"
+#include "mapped_file.h"
+#include "symbol_index.h"
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A size of a chunk of a log processed by a thread at once
+const size_t kChunkSize = 16 * 1024 * 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A part of a log and its rewritten contents
+struct Chunk {
+  const char* begin;
+  const char* end;
+  std::string output;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+void PrintUsage() {
+  fprintf(stderr,
+          "usage: ddimon_symbolize index -m DdiMon.mod [-i image_dir] "
+          "[-s symbol_dir] -o DdiMon.sym\n"
+          "       ddimon_symbolize log -x DdiMon.sym [-j threads] "
+          "[-z utc_offset_minutes] [-o output] DdiMon.log\n");
+}
+
+bool IsTokenChar(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+// Parses a token if it looks like a pointer printed with %p
+bool ParsePointer(const char* token, size_t length, uint64_t* value) {
+  if (length != 8 && length != 16) {
+    return false;
+  }
+  uint64_t result = 0;
+  for (size_t i = 0; i < length; ++i) {
+    const auto c = token[i];
+    uint64_t digit = 0;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else {
+      return false;
+    }
+    result = (result << 4) | digit;
+  }
+  *value = result;
+  return true;
+}
+
+// Rewrites lines of the chunk
+void SymbolizeChunk(const ddimon::SymbolIndex& index,
+                    const ddimon::LogClock* clock, Chunk* chunk) {
+  auto& output = chunk->output;
+  output.reserve((chunk->end - chunk->begin) * 5 / 4);
+  for (auto line = chunk->begin; line < chunk->end;) {
+    const char* next = nullptr;
+    const auto line_end = ddimon::FindLineEnd(line, chunk->end, &next);
+
+    int64_t time = 0;
+    uint32_t ms_of_day = 0;
+    if (clock && ddimon::ParseLogTime(line, line_end - line, &ms_of_day)) {
+      time = clock->ToSystemTime(ms_of_day);
+    }
+
+    for (auto p = line; p < line_end;) {
+      if (!IsTokenChar(*p)) {
+        output.push_back(*p++);
+        continue;
+      }
+      const auto token = p;
+      while (p < line_end && IsTokenChar(*p)) {
+        p++;
+      }
+      output.append(token, p);
+
+      uint64_t address = 0;
+      ddimon::SymbolLocation location = {};
+      if (!ParsePointer(token, p - token, &address) ||
+          !index.Resolve(address, time, &location)) {
+        continue;
+      }
+      char annotation[32] = {};
+      if (location.offset) {
+        snprintf(annotation, sizeof(annotation), "+0x%" PRIx64,
+                 location.offset);
+      }
+      output.push_back('(');
+      output.append(location.image_name);
+      if (location.symbol_name) {
+        output.push_back('!');
+        output.append(location.symbol_name);
+      }
+      output.append(annotation);
+      output.push_back(')');
+    }
+    output.append(line_end, next);
+    line = next;
+  }
+}
+
+int BuildIndex(int argc, char* argv[]) {
+  const char* snapshot_path = nullptr;
+  const char* index_path = nullptr;
+  ddimon::SymbolSources sources;
+  int option = 0;
+  while ((option = getopt(argc, argv, "m:i:s:o:")) != -1) {
+    switch (option) {
+      case 'm':
+        snapshot_path = optarg;
+        break;
+      case 'i':
+        sources.image_directory = optarg;
+        break;
+      case 's':
+        sources.symbol_directory = optarg;
+        break;
+      case 'o':
+        index_path = optarg;
+        break;
+      default:
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (!snapshot_path || !index_path || optind != argc) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  std::string error;
+  if (!ddimon::BuildSymbolIndex(snapshot_path, sources, index_path, &error)) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int SymbolizeLog(int argc, char* argv[]) {
+  const char* index_path = nullptr;
+  const char* output_path = nullptr;
+  auto threads = std::max(1u, std::thread::hardware_concurrency());
+  auto has_utc_offset = false;
+  int64_t utc_offset = 0;
+  int option = 0;
+  while ((option = getopt(argc, argv, "x:j:z:o:")) != -1) {
+    switch (option) {
+      case 'x':
+        index_path = optarg;
+        break;
+      case 'j':
+        threads = std::max(1, atoi(optarg));
+        break;
+      case 'z':
+        has_utc_offset = true;
+        utc_offset = strtoll(optarg, nullptr, 10);
+        break;
+      case 'o':
+        output_path = optarg;
+        break;
+      default:
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (!index_path || optind + 1 != argc) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  std::string error;
+  ddimon::SymbolIndex index;
+  ddimon::MappedFile log;
+  if (!index.Open(index_path, &error) || !log.Open(argv[optind], &error)) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+  const auto output = (output_path) ? fopen(output_path, "wb") : stdout;
+  if (!output) {
+    fprintf(stderr, "error: %s: %s\n", output_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  // Without an offset from UTC, time of log lines cannot be compared with load
+  // time of images, and the image loaded last at the address is used
+  const ddimon::LogClock clock(index.start_time(), utc_offset);
+  const auto clock_to_use = (has_utc_offset) ? &clock : nullptr;
+
+  // Split the log into chunks at line boundaries and rewrite as many chunks as
+  // threads in parallel, then write them out in order
+  const auto begin = reinterpret_cast<const char*>(log.data());
+  const auto end = begin + log.size();
+  for (auto position = begin; position < end;) {
+    std::vector<Chunk> chunks;
+    while (position < end && chunks.size() < threads) {
+      auto chunk_end =
+          (static_cast<size_t>(end - position) > kChunkSize)
+              ? static_cast<const char*>(
+                    memchr(position + kChunkSize, '\n',
+                           end - position - kChunkSize))
+              : nullptr;
+      chunk_end = (chunk_end) ? chunk_end + 1 : end;
+      chunks.push_back({position, chunk_end, std::string()});
+      position = chunk_end;
+    }
+
+    std::vector<std::thread> workers;
+    for (auto& chunk : chunks) {
+      workers.emplace_back(SymbolizeChunk, std::cref(index), clock_to_use,
+                           &chunk);
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    for (const auto& chunk : chunks) {
+      if (fwrite(chunk.output.data(), 1, chunk.output.size(), output) !=
+          chunk.output.size()) {
+        fprintf(stderr, "error: failed to write output\n");
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  if (output != stdout && fclose(output) != 0) {
+    fprintf(stderr, "error: failed to write output\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+  const std::string command = argv[1];
+  if (command == "index") {
+    return BuildIndex(argc - 1, argv + 1);
+  }
+  if (command == "log") {
+    return SymbolizeLog(argc - 1, argv + 1);
+  }
+  PrintUsage();
+  return EXIT_FAILURE;
+}
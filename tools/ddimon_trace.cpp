@@ -0,0 +1,214 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a command that converts a span file into the Chrome trace event
+/// format.
+///
+/// Each span becomes a complete ("X") event on a thread named after the
+/// processor that recorded it, so chrome://tracing or the Perfetto UI shows a
+/// timeline of VMM scopes and hook handlers for each processor. Hooked
+/// addresses of handler spans are added as arguments and can be symbolized
+/// with an index built by ddimon_symbolize.
+
+#include <getopt.h>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "ddimon_formats.h"
+#include "mapped_file.h"
+#include "symbol_index.h"
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+void PrintUsage() {
+  fprintf(stderr,
+          "usage: ddimon_trace [-x DdiMon.sym] [-t tsc_mhz] [-o trace.json] "
+          "DdiMon.spans\n");
+}
+
+// Writes a string as a JSON string literal
+void WriteJsonString(FILE* output, const char* text) {
+  fputc('"', output);
+  for (auto p = text; *p; ++p) {
+    const auto c = static_cast<unsigned char>(*p);
+    if (c == '"' || c == '\\') {
+      fputc('\\', output);
+      fputc(c, output);
+    } else if (c < 0x20) {
+      fprintf(output, "\\u%04x", c);
+    } else {
+      fputc(c, output);
+    }
+  }
+  fputc('"', output);
+}
+
+// Returns a category of a span shown in a trace viewer
+const char* GetCategory(ddimon::SpanKind kind) {
+  switch (kind) {
+    case ddimon::SpanKind::kScope:
+      return "vmm";
+    case ddimon::SpanKind::kPreHandler:
+      return "pre_handler";
+    case ddimon::SpanKind::kPostHandler:
+      return "post_handler";
+  }
+  return "unknown";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const char* index_path = nullptr;
+  const char* output_path = nullptr;
+  auto tsc_per_us = 0.0;
+  int option = 0;
+  while ((option = getopt(argc, argv, "x:t:o:")) != -1) {
+    switch (option) {
+      case 'x':
+        index_path = optarg;
+        break;
+      case 't':
+        tsc_per_us = strtod(optarg, nullptr);
+        break;
+      case 'o':
+        output_path = optarg;
+        break;
+      default:
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind + 1 != argc) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  std::string error;
+  ddimon::MappedFile spans;
+  ddimon::SymbolIndex index;
+  if (!spans.Open(argv[optind], &error) ||
+      (index_path && !index.Open(index_path, &error))) {
+    fprintf(stderr, "error: %s\n", error.c_str());
+    return EXIT_FAILURE;
+  }
+
+  ddimon::SpanFileHeader header = {};
+  if (spans.size() < sizeof(header)) {
+    fprintf(stderr, "error: %s: not a span file\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+  memcpy(&header, spans.data(), sizeof(header));
+  const auto names_size =
+      static_cast<uint64_t>(header.name_count) * header.name_size;
+  const auto expected_size = sizeof(header) + names_size +
+                             static_cast<uint64_t>(header.span_count) *
+                                 sizeof(ddimon::SpanFileRecord);
+  if (header.magic != ddimon::kSpanFileMagic ||
+      header.version != ddimon::kSpanFileVersion || !header.name_size ||
+      spans.size() != expected_size) {
+    fprintf(stderr, "error: %s: not a span file\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+  const auto names =
+      reinterpret_cast<const char*>(spans.data() + sizeof(header));
+  const auto records = spans.data() + sizeof(header) + names_size;
+
+  // Convert TSC into microseconds with the performance counter taken at the
+  // beginning and end of recording unless a frequency is given
+  if (tsc_per_us <= 0.0) {
+    if (header.end_tsc <= header.start_tsc ||
+        header.end_counter <= header.start_counter ||
+        !header.counter_frequency) {
+      fprintf(stderr, "error: TSC frequency is unknown; give it with -t\n");
+      return EXIT_FAILURE;
+    }
+    const auto elapsed_us =
+        static_cast<double>(header.end_counter - header.start_counter) *
+        1000000.0 / static_cast<double>(header.counter_frequency);
+    tsc_per_us =
+        static_cast<double>(header.end_tsc - header.start_tsc) / elapsed_us;
+  }
+
+  const auto output = (output_path) ? fopen(output_path, "w") : stdout;
+  if (!output) {
+    fprintf(stderr, "error: %s: %s\n", output_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  // Name a process and a thread for each processor, then write spans
+  fprintf(output,
+          "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+          "\"args\":{\"name\":\"VMM\"}}");
+  for (auto i = 0u; i < header.processor_count; ++i) {
+    fprintf(output,
+            ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,"
+            "\"args\":{\"name\":\"Processor %u\"}}"
+            ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":0,"
+            "\"tid\":%u,\"args\":{\"sort_index\":%u}}",
+            i, i, i, i);
+  }
+
+  std::string name_buffer(header.name_size + 1, '\0');
+  for (auto i = 0u; i < header.span_count; ++i) {
+    ddimon::SpanFileRecord record = {};
+    memcpy(&record, records + i * sizeof(record), sizeof(record));
+    if (record.name_index < header.name_count) {
+      memcpy(&name_buffer[0], names + record.name_index * header.name_size,
+             header.name_size);
+    } else {
+      snprintf(&name_buffer[0], name_buffer.size(), "#%u", record.name_index);
+    }
+    const auto begin_us =
+        static_cast<double>(static_cast<int64_t>(record.begin_tsc -
+                                                 header.start_tsc)) /
+        tsc_per_us;
+    const auto duration_us =
+        static_cast<double>(record.end_tsc - record.begin_tsc) / tsc_per_us;
+
+    fprintf(output, ",\n{\"name\":");
+    WriteJsonString(output, name_buffer.c_str());
+    fprintf(output,
+            ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,"
+            "\"ts\":%.3f,\"dur\":%.3f",
+            GetCategory(record.kind), record.processor, begin_us,
+            duration_us);
+    if (record.kind != ddimon::SpanKind::kScope) {
+      fprintf(output, ",\"args\":{\"address\":\"0x%016" PRIx64 "\"",
+              record.arg);
+      ddimon::SymbolLocation location = {};
+      if (index_path && index.Resolve(record.arg, 0, &location)) {
+        std::string symbol = location.image_name;
+        if (location.symbol_name) {
+          symbol += std::string("!") + location.symbol_name;
+        }
+        if (location.offset) {
+          char offset[32] = {};
+          snprintf(offset, sizeof(offset), "+0x%" PRIx64, location.offset);
+          symbol += offset;
+        }
+        fprintf(output, ",\"symbol\":");
+        WriteJsonString(output, symbol.c_str());
+      }
+      fputc('}', output);
+    }
+    fputc('}', output);
+  }
+  fprintf(output, "\n]}\n");
+  if (output != stdout && fclose(output) != 0) {
+    fprintf(stderr, "error: failed to write output\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
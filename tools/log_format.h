@@ -0,0 +1,219 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares and implements parsing of log lines written by HyperPlatform.
+
+#ifndef DDIMON_TOOLS_LOG_FORMAT_H_
+#define DDIMON_TOOLS_LOG_FORMAT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include "ddimon_formats.h"
+
+namespace ddimon {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A number of milliseconds in a day
+const int64_t kMillisecondsPerDay = 24 * 60 * 60 * 1000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Fields of a log line. A line is laid out as below, where fields in brackets
+// are omitted depending on options given to LogInitialization():
+//
+//   [HH:MM:SS.mmm\t]LVL\t[#processor\t]pid\ttid\timage\t[function\t]message
+struct LogLine {
+  bool has_time;
+  uint32_t ms_of_day;
+  uint64_t pid;
+  uint64_t tid;
+  std::string_view level;
+  std::string_view image_name;
+  std::string_view function_name;  // Empty if not logged
+  std::string_view message;
+};
+
+// Converts local time of day in log lines into system time. A log line only
+// holds "HH:MM:SS.mmm", so it is placed within a day from an hour before a
+// known system time, such as start_time of a module snapshot.
+class LogClock {
+ public:
+  LogClock(int64_t base_time, int64_t utc_offset_minutes)
+      : base_time_(base_time) {
+    const auto local_time =
+        base_time + utc_offset_minutes * 60 * 1000 * kSystemTimePerMillisecond;
+    base_ms_of_day_ = (local_time / kSystemTimePerMillisecond) %
+                      kMillisecondsPerDay;
+  }
+
+  int64_t ToSystemTime(uint32_t ms_of_day) const {
+    auto delta = static_cast<int64_t>(ms_of_day) - base_ms_of_day_;
+    if (delta < -kMillisecondsPerDay / 24) {
+      delta += kMillisecondsPerDay;
+    } else if (delta >= kMillisecondsPerDay * 23 / 24) {
+      delta -= kMillisecondsPerDay;
+    }
+    return base_time_ + delta * kSystemTimePerMillisecond;
+  }
+
+ private:
+  int64_t base_time_;
+  int64_t base_ms_of_day_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Parses "HH:MM:SS.mmm" at the beginning of a line into milliseconds of a day.
+// Returns false if the line does not start with it.
+inline bool ParseLogTime(const char* line, size_t length, uint32_t* ms_of_day) {
+  static const char kPattern[] = "00:00:00.000";
+  if (length < sizeof(kPattern) - 1) {
+    return false;
+  }
+  uint32_t fields[4] = {};
+  auto field = 0;
+  for (auto i = 0u; i < sizeof(kPattern) - 1; ++i) {
+    if (kPattern[i] != '0') {
+      if (line[i] != kPattern[i]) {
+        return false;
+      }
+      field++;
+      continue;
+    }
+    if (line[i] < '0' || line[i] > '9') {
+      return false;
+    }
+    fields[field] = fields[field] * 10 + (line[i] - '0');
+  }
+  *ms_of_day = ((fields[0] * 60 + fields[1]) * 60 + fields[2]) * 1000 +
+               fields[3];
+  return true;
+}
+
+// Returns a leading field of text terminated by a tab and advances text
+inline std::string_view TakeLogField(std::string_view* text) {
+  const auto tab = text->find('\t');
+  const auto field = text->substr(0, tab);
+  text->remove_prefix((tab == std::string_view::npos) ? text->size() : tab + 1);
+  return field;
+}
+
+// Removes leading and trailing spaces that pad a field
+inline std::string_view TrimLogField(std::string_view field) {
+  while (!field.empty() && field.front() == ' ') {
+    field.remove_prefix(1);
+  }
+  while (!field.empty() && field.back() == ' ') {
+    field.remove_suffix(1);
+  }
+  return field;
+}
+
+// Parses a decimal field padded with spaces. Returns false if it is not.
+inline bool ParseLogNumber(std::string_view field, uint64_t* value) {
+  field = TrimLogField(field);
+  if (field.empty()) {
+    return false;
+  }
+  uint64_t result = 0;
+  for (const auto c : field) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    result = result * 10 + (c - '0');
+  }
+  *value = result;
+  return true;
+}
+
+// Splits a line without a line break into fields. Returns false if the line is
+// not a log entry, such as a continuation of a multi-line message.
+inline bool ParseLogLine(const char* line, size_t length, LogLine* parsed) {
+  std::string_view text(line, length);
+  *parsed = LogLine();
+  parsed->has_time = ParseLogTime(line, length, &parsed->ms_of_day);
+  if (parsed->has_time) {
+    TakeLogField(&text);
+  }
+  parsed->level = TakeLogField(&text);
+  if (parsed->level != "DBG" && parsed->level != "INF" &&
+      parsed->level != "WRN" && parsed->level != "ERR") {
+    return false;
+  }
+  auto field = TakeLogField(&text);
+  if (!field.empty() && field.front() == '#') {
+    field = TakeLogField(&text);
+  }
+  if (!ParseLogNumber(field, &parsed->pid) ||
+      !ParseLogNumber(TakeLogField(&text), &parsed->tid)) {
+    return false;
+  }
+  parsed->image_name = TrimLogField(TakeLogField(&text));
+
+  // A message rarely contains a tab, so the remaining text with a tab has a
+  // function name before it
+  if (text.find('\t') != std::string_view::npos) {
+    parsed->function_name = TrimLogField(TakeLogField(&text));
+  }
+  parsed->message = text;
+  return true;
+}
+
+// Returns a name of a DDI that a message of DdiMon starts with, such as
+// ExFreePool of "ExFreePool(P= ...) returning to ...", or an empty string
+inline std::string_view GetLoggedDdiName(std::string_view message) {
+  size_t length = 0;
+  while (length < message.size() &&
+         ((message[length] >= '0' && message[length] <= '9') ||
+          (message[length] >= 'A' && message[length] <= 'Z') ||
+          (message[length] >= 'a' && message[length] <= 'z') ||
+          message[length] == '_')) {
+    length++;
+  }
+  if (!length || length == message.size() || message[length] != '(') {
+    return std::string_view();
+  }
+  return message.substr(0, length);
+}
+
+// Returns a pool tag logged as "Tag= xxxx" in a message, or an empty string
+inline std::string_view GetLoggedPoolTag(std::string_view message) {
+  static const std::string_view kTagPrefix = "Tag= ";
+  const auto position = message.find(kTagPrefix);
+  if (position == std::string_view::npos) {
+    return std::string_view();
+  }
+  auto tag = message.substr(position + kTagPrefix.size(), 4);
+  const auto end = tag.find_first_of("),");
+  return tag.substr(0, end);
+}
+
+// Returns the end of a line that starts at begin, excluding "\r\n" or "\n"
+inline const char* FindLineEnd(const char* begin, const char* end,
+                               const char** next) {
+  auto newline = static_cast<const char*>(memchr(begin, '\n', end - begin));
+  if (!newline) {
+    *next = end;
+    return end;
+  }
+  *next = newline + 1;
+  return (newline > begin && newline[-1] == '\r') ? newline - 1 : newline;
+}
+
+}  // namespace ddimon
+
+#endif  // DDIMON_TOOLS_LOG_FORMAT_H_
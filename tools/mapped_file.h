@@ -0,0 +1,84 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares and implements a read-only memory-mapped file.
+
+#ifndef DDIMON_TOOLS_MAPPED_FILE_H_
+#define DDIMON_TOOLS_MAPPED_FILE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace ddimon {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Maps a whole file for reading. An empty file is mapped as nullptr and 0.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() { Close(); }
+
+  // Maps the file. Returns false and sets a message to error on failure.
+  bool Open(const char* path, std::string* error) {
+    Close();
+    const auto fd = open(path, O_RDONLY);
+    if (fd == -1) {
+      *error = std::string(path) + ": " + strerror(errno);
+      return false;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) == -1) {
+      *error = std::string(path) + ": " + strerror(errno);
+      close(fd);
+      return false;
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_) {
+      const auto address = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (address == MAP_FAILED) {
+        *error = std::string(path) + ": " + strerror(errno);
+        size_ = 0;
+        close(fd);
+        return false;
+      }
+      data_ = static_cast<const uint8_t*>(address);
+      // Files are mostly read from the beginning to the end
+      madvise(address, size_, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return true;
+  }
+
+  void Close() {
+    if (data_) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+}  // namespace ddimon
+
+#endif  // DDIMON_TOOLS_MAPPED_FILE_H_
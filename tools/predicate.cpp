@@ -0,0 +1,498 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements an assembler, a verifier and an interpreter of predicate
+/// programs.
+
+#include "predicate.h"
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <sstream>
+
+namespace ddimon {
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A mnemonic and how its operands are written
+struct Mnemonic {
+  const char* name;
+  PredOpcode opcode;
+  enum {
+    kRegisterField,      // rD, field
+    kRegisterImmediate,  // rD, imm
+    kRegisterRegister,   // rD, rS
+    kCompareAndJump,     // rD, rS, label
+    kJump,               // label
+    kReturn,             // verdict
+  } operands;
+};
+
+// A jump whose target is resolved after all labels are seen
+struct PendingJump {
+  size_t pc;
+  std::string label;
+  int line;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+const Mnemonic kMnemonics[] = {
+    {"ld", PredOpcode::kLoadContext, Mnemonic::kRegisterField},
+    {"li", PredOpcode::kLoadImmediate, Mnemonic::kRegisterImmediate},
+    {"add", PredOpcode::kAdd, Mnemonic::kRegisterRegister},
+    {"sub", PredOpcode::kSub, Mnemonic::kRegisterRegister},
+    {"and", PredOpcode::kAnd, Mnemonic::kRegisterRegister},
+    {"or", PredOpcode::kOr, Mnemonic::kRegisterRegister},
+    {"xor", PredOpcode::kXor, Mnemonic::kRegisterRegister},
+    {"shl", PredOpcode::kShiftLeft, Mnemonic::kRegisterRegister},
+    {"shr", PredOpcode::kShiftRight, Mnemonic::kRegisterRegister},
+    {"jeq", PredOpcode::kJumpIfEqual, Mnemonic::kCompareAndJump},
+    {"jne", PredOpcode::kJumpIfNotEqual, Mnemonic::kCompareAndJump},
+    {"ja", PredOpcode::kJumpIfAbove, Mnemonic::kCompareAndJump},
+    {"jb", PredOpcode::kJumpIfBelow, Mnemonic::kCompareAndJump},
+    {"jmp", PredOpcode::kJump, Mnemonic::kJump},
+    {"ret", PredOpcode::kReturn, Mnemonic::kReturn},
+};
+
+// Names of PredField in order
+const char* const kFieldNames[] = {
+    "arg1", "arg2", "arg3", "arg4", "retaddr", "cr3", "pid", "tid", "time",
+};
+static_assert(sizeof(kFieldNames) / sizeof(kFieldNames[0]) ==
+                  static_cast<size_t>(PredField::kMaximum),
+              "Size check");
+
+// Names of PredVerdict in order
+const char* const kVerdictNames[] = {
+    "drop", "count", "log", "log_post",
+};
+static_assert(sizeof(kVerdictNames) / sizeof(kVerdictNames[0]) ==
+                  static_cast<size_t>(PredVerdict::kMaximum),
+              "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+std::string Trim(const std::string& text) {
+  const auto begin = text.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  const auto end = text.find_last_not_of(" \t\r");
+  return text.substr(begin, end - begin + 1);
+}
+
+bool IsIdentifier(const std::string& text) {
+  if (text.empty() || isdigit(static_cast<unsigned char>(text[0]))) {
+    return false;
+  }
+  for (const auto c : text) {
+    if (!isalnum(static_cast<unsigned char>(c)) && c != '_') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Splits operands separated by commas
+std::vector<std::string> SplitOperands(const std::string& text) {
+  std::vector<std::string> operands;
+  if (text.empty()) {
+    return operands;
+  }
+  std::string::size_type begin = 0;
+  for (;;) {
+    const auto comma = text.find(',', begin);
+    operands.push_back(Trim(text.substr(begin, comma - begin)));
+    if (comma == std::string::npos) {
+      break;
+    }
+    begin = comma + 1;
+  }
+  return operands;
+}
+
+bool ParseRegister(const std::string& text, uint8_t* reg) {
+  if (text.size() != 2 || text[0] != 'r' || text[1] < '0' ||
+      text[1] >= '0' + static_cast<int>(kPredNumberOfRegisters)) {
+    return false;
+  }
+  *reg = static_cast<uint8_t>(text[1] - '0');
+  return true;
+}
+
+bool ParseName(const std::string& text, const char* const* names,
+               size_t count, int32_t* index) {
+  for (size_t i = 0; i < count; ++i) {
+    if (text == names[i]) {
+      *index = static_cast<int32_t>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parses a decimal or hexadecimal number in the range of int32_t
+bool ParseImmediate(const std::string& text, int32_t* imm) {
+  if (text.empty()) {
+    return false;
+  }
+  char* end = nullptr;
+  errno = 0;
+  const auto value = strtoll(text.c_str(), &end, 0);
+  if (errno || *end || value < INT32_MIN || value > INT32_MAX) {
+    return false;
+  }
+  *imm = static_cast<int32_t>(value);
+  return true;
+}
+
+// Assembles an instruction. Sets a label to jump to if it is a jump.
+bool AssembleInstruction(const std::string& text, PredInstruction* insn,
+                         std::string* label, std::string* error) {
+  const auto space = text.find_first_of(" \t");
+  const auto name = text.substr(0, space);
+  const auto operands = SplitOperands(
+      space == std::string::npos ? std::string() : Trim(text.substr(space)));
+
+  const Mnemonic* mnemonic = nullptr;
+  for (const auto& candidate : kMnemonics) {
+    if (name == candidate.name) {
+      mnemonic = &candidate;
+      break;
+    }
+  }
+  if (!mnemonic) {
+    *error = "unknown instruction '" + name + "'";
+    return false;
+  }
+
+  *insn = {};
+  insn->opcode = mnemonic->opcode;
+  auto valid = false;
+  switch (mnemonic->operands) {
+    case Mnemonic::kRegisterField:
+      valid = operands.size() == 2 &&
+              ParseRegister(operands[0], &insn->dst) &&
+              ParseName(operands[1], kFieldNames,
+                        static_cast<size_t>(PredField::kMaximum), &insn->imm);
+      break;
+    case Mnemonic::kRegisterImmediate:
+      valid = operands.size() == 2 &&
+              ParseRegister(operands[0], &insn->dst) &&
+              ParseImmediate(operands[1], &insn->imm);
+      break;
+    case Mnemonic::kRegisterRegister:
+      valid = operands.size() == 2 &&
+              ParseRegister(operands[0], &insn->dst) &&
+              ParseRegister(operands[1], &insn->src);
+      break;
+    case Mnemonic::kCompareAndJump:
+      valid = operands.size() == 3 &&
+              ParseRegister(operands[0], &insn->dst) &&
+              ParseRegister(operands[1], &insn->src) &&
+              IsIdentifier(operands[2]);
+      if (valid) {
+        *label = operands[2];
+      }
+      break;
+    case Mnemonic::kJump:
+      valid = operands.size() == 1 && IsIdentifier(operands[0]);
+      if (valid) {
+        *label = operands[0];
+      }
+      break;
+    case Mnemonic::kReturn:
+      valid = operands.size() == 1 &&
+              ParseName(operands[0], kVerdictNames,
+                        static_cast<size_t>(PredVerdict::kMaximum),
+                        &insn->imm);
+      break;
+  }
+  if (!valid) {
+    *error = "invalid operands of '" + name + "'";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool AssemblePredicate(const std::string& source, int first_line,
+                       std::vector<PredInstruction>* program,
+                       std::string* error) {
+  program->clear();
+  std::map<std::string, size_t> labels;
+  std::vector<PendingJump> jumps;
+  std::istringstream stream(source);
+  std::string text;
+  for (auto line = first_line; std::getline(stream, text); ++line) {
+    text = Trim(text.substr(0, text.find_first_of(";#")));
+    if (text.empty()) {
+      continue;
+    }
+    const auto where = "line " + std::to_string(line) + ": ";
+    if (text.back() == ':') {
+      const auto label = Trim(text.substr(0, text.size() - 1));
+      if (!IsIdentifier(label)) {
+        *error = where + "invalid label '" + label + "'";
+        return false;
+      }
+      if (!labels.emplace(label, program->size()).second) {
+        *error = where + "label '" + label + "' is already defined";
+        return false;
+      }
+      continue;
+    }
+    if (program->size() == kPredMaxInstructions) {
+      *error = where + "more than " + std::to_string(kPredMaxInstructions) +
+               " instructions";
+      return false;
+    }
+    PredInstruction insn = {};
+    std::string label;
+    if (!AssembleInstruction(text, &insn, &label, error)) {
+      *error = where + *error;
+      return false;
+    }
+    if (!label.empty()) {
+      jumps.push_back({program->size(), label, line});
+    }
+    program->push_back(insn);
+  }
+
+  for (const auto& jump : jumps) {
+    const auto where = "line " + std::to_string(jump.line) + ": ";
+    const auto label = labels.find(jump.label);
+    if (label == labels.end()) {
+      *error = where + "label '" + jump.label + "' is not defined";
+      return false;
+    }
+    if (label->second <= jump.pc) {
+      *error = where + "jumps backward to '" + jump.label + "'";
+      return false;
+    }
+    if (label->second >= program->size()) {
+      *error = where + "label '" + jump.label + "' is not followed by an "
+               "instruction";
+      return false;
+    }
+    (*program)[jump.pc].imm = static_cast<int32_t>(label->second - jump.pc - 1);
+  }
+  return VerifyPredicate(program->data(), program->size(), error);
+}
+
+bool VerifyPredicate(const PredInstruction* program, size_t count,
+                     std::string* error) {
+  if (!count || count > kPredMaxInstructions) {
+    *error = "a program must have 1 to " +
+             std::to_string(kPredMaxInstructions) + " instructions";
+    return false;
+  }
+  if (program[count - 1].opcode != PredOpcode::kReturn) {
+    *error = "the last instruction is not ret";
+    return false;
+  }
+
+  for (size_t pc = 0; pc < count; ++pc) {
+    const auto& insn = program[pc];
+    const auto where = "instruction " + std::to_string(pc) + ": ";
+    if (insn.dst >= kPredNumberOfRegisters ||
+        insn.src >= kPredNumberOfRegisters || insn.reserved) {
+      *error = where + "invalid register or reserved field";
+      return false;
+    }
+    switch (insn.opcode) {
+      case PredOpcode::kLoadContext:
+        if (insn.imm < 0 ||
+            insn.imm >= static_cast<int32_t>(PredField::kMaximum)) {
+          *error = where + "invalid field " + std::to_string(insn.imm);
+          return false;
+        }
+        break;
+      case PredOpcode::kLoadImmediate:
+      case PredOpcode::kAdd:
+      case PredOpcode::kSub:
+      case PredOpcode::kAnd:
+      case PredOpcode::kOr:
+      case PredOpcode::kXor:
+      case PredOpcode::kShiftLeft:
+      case PredOpcode::kShiftRight:
+        break;
+      case PredOpcode::kJumpIfEqual:
+      case PredOpcode::kJumpIfNotEqual:
+      case PredOpcode::kJumpIfAbove:
+      case PredOpcode::kJumpIfBelow:
+      case PredOpcode::kJump:
+        if (insn.imm < 0 || pc + 1 + insn.imm >= count) {
+          *error = where + "invalid jump offset " + std::to_string(insn.imm);
+          return false;
+        }
+        break;
+      case PredOpcode::kReturn:
+        if (insn.imm < 0 ||
+            insn.imm >= static_cast<int32_t>(PredVerdict::kMaximum)) {
+          *error = where + "invalid verdict " + std::to_string(insn.imm);
+          return false;
+        }
+        break;
+      default:
+        *error = where + "unknown opcode " +
+                 std::to_string(static_cast<int>(insn.opcode));
+        return false;
+    }
+  }
+  return true;
+}
+
+PredVerdict ExecutePredicate(const PredInstruction* program, size_t count,
+                             const PredContext& context) {
+  static_cast<void>(count);
+
+  uint64_t r[kPredNumberOfRegisters] = {};
+  for (size_t pc = 0; /**/; ++pc) {
+    const auto& insn = program[pc];
+    auto& dst = r[insn.dst];
+    const auto src = r[insn.src];
+    switch (insn.opcode) {
+      case PredOpcode::kLoadContext:
+        dst = context.fields[insn.imm];
+        break;
+      case PredOpcode::kLoadImmediate:
+        dst = static_cast<uint64_t>(static_cast<int64_t>(insn.imm));
+        break;
+      case PredOpcode::kAdd:
+        dst += src;
+        break;
+      case PredOpcode::kSub:
+        dst -= src;
+        break;
+      case PredOpcode::kAnd:
+        dst &= src;
+        break;
+      case PredOpcode::kOr:
+        dst |= src;
+        break;
+      case PredOpcode::kXor:
+        dst ^= src;
+        break;
+      case PredOpcode::kShiftLeft:
+        dst <<= (src & 63);
+        break;
+      case PredOpcode::kShiftRight:
+        dst >>= (src & 63);
+        break;
+      case PredOpcode::kJumpIfEqual:
+        if (dst == src) {
+          pc += insn.imm;
+        }
+        break;
+      case PredOpcode::kJumpIfNotEqual:
+        if (dst != src) {
+          pc += insn.imm;
+        }
+        break;
+      case PredOpcode::kJumpIfAbove:
+        if (dst > src) {
+          pc += insn.imm;
+        }
+        break;
+      case PredOpcode::kJumpIfBelow:
+        if (dst < src) {
+          pc += insn.imm;
+        }
+        break;
+      case PredOpcode::kJump:
+        pc += insn.imm;
+        break;
+      case PredOpcode::kReturn:
+      default:
+        return static_cast<PredVerdict>(insn.imm);
+    }
+  }
+}
+
+const char* GetPredicateFieldName(PredField field) {
+  if (field >= PredField::kMaximum) {
+    return nullptr;
+  }
+  return kFieldNames[static_cast<size_t>(field)];
+}
+
+const char* GetPredicateVerdictName(PredVerdict verdict) {
+  if (verdict >= PredVerdict::kMaximum) {
+    return nullptr;
+  }
+  return kVerdictNames[static_cast<size_t>(verdict)];
+}
+
+std::string DisassemblePredicate(const PredInstruction* program,
+                                 size_t count) {
+  std::vector<bool> targets(count);
+  for (size_t pc = 0; pc < count; ++pc) {
+    const auto& insn = program[pc];
+    if (insn.opcode >= PredOpcode::kJumpIfEqual &&
+        insn.opcode <= PredOpcode::kJump) {
+      targets[pc + 1 + insn.imm] = true;
+    }
+  }
+
+  std::string source;
+  char text[64] = {};
+  for (size_t pc = 0; pc < count; ++pc) {
+    const auto& insn = program[pc];
+    if (targets[pc]) {
+      snprintf(text, sizeof(text), "L%zu:\n", pc);
+      source += text;
+    }
+    const auto& mnemonic =
+        kMnemonics[static_cast<size_t>(insn.opcode) -
+                   static_cast<size_t>(PredOpcode::kLoadContext)];
+    const auto target = pc + 1 + insn.imm;
+    switch (mnemonic.operands) {
+      case Mnemonic::kRegisterField:
+        snprintf(text, sizeof(text), "  %s r%u, %s\n", mnemonic.name,
+                 insn.dst, kFieldNames[insn.imm]);
+        break;
+      case Mnemonic::kRegisterImmediate:
+        snprintf(text, sizeof(text), insn.imm < 0 ? "  %s r%u, %d\n"
+                                                  : "  %s r%u, 0x%x\n",
+                 mnemonic.name, insn.dst, insn.imm);
+        break;
+      case Mnemonic::kRegisterRegister:
+        snprintf(text, sizeof(text), "  %s r%u, r%u\n", mnemonic.name,
+                 insn.dst, insn.src);
+        break;
+      case Mnemonic::kCompareAndJump:
+        snprintf(text, sizeof(text), "  %s r%u, r%u, L%zu\n", mnemonic.name,
+                 insn.dst, insn.src, target);
+        break;
+      case Mnemonic::kJump:
+        snprintf(text, sizeof(text), "  %s L%zu\n", mnemonic.name, target);
+        break;
+      case Mnemonic::kReturn:
+        snprintf(text, sizeof(text), "  %s %s\n", mnemonic.name,
+                 kVerdictNames[insn.imm]);
+        break;
+    }
+    source += text;
+  }
+  return source;
+}
+
+}  // namespace ddimon
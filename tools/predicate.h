@@ -0,0 +1,142 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to assemble, verify and execute predicate programs of
+/// hook policy rules.
+///
+/// A program is written one instruction per line as below. Operands are
+/// registers r0 to r3, context fields, immediates and labels. Text after ';'
+/// or '#' is a comment, and a line "name:" defines a label.
+///
+///   ld   r0, arg3          ; r0 = context field (arg1-4, retaddr, cr3, pid,
+///                          ;      tid, time)
+///   li   r1, 0x6d696444    ; r1 = sign-extended 32-bit immediate
+///   add  r0, r1            ; also sub, and, or, xor, shl and shr
+///   jne  r0, r1, skip      ; also jeq, ja and jb (unsigned); forward only
+///   jmp  skip
+///   skip:
+///   ret  log               ; drop, count, log or log_post
+
+#ifndef DDIMON_TOOLS_PREDICATE_H_
+#define DDIMON_TOOLS_PREDICATE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ddimon {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// See DdiMon/predicate.h
+const uint32_t kPredMaxInstructions = 64;
+const uint32_t kPredNumberOfRegisters = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// PredOpcode in DdiMon/predicate.h
+enum class PredOpcode : uint8_t {
+  kLoadContext = 1,
+  kLoadImmediate,
+  kAdd,
+  kSub,
+  kAnd,
+  kOr,
+  kXor,
+  kShiftLeft,
+  kShiftRight,
+  kJumpIfEqual,
+  kJumpIfNotEqual,
+  kJumpIfAbove,
+  kJumpIfBelow,
+  kJump,
+  kReturn,
+  kMaximum,
+};
+
+#pragma pack(push, 1)
+
+// PredInstruction in DdiMon/predicate.h
+struct PredInstruction {
+  PredOpcode opcode;
+  uint8_t dst;
+  uint8_t src;
+  uint8_t reserved;
+  int32_t imm;
+};
+static_assert(sizeof(PredInstruction) == 8, "Size check");
+
+#pragma pack(pop)
+
+// PredField in DdiMon/predicate.h
+enum class PredField : uint32_t {
+  kArgument1,
+  kArgument2,
+  kArgument3,
+  kArgument4,
+  kReturnAddress,
+  kCr3,
+  kProcessId,
+  kThreadId,
+  kTimestamp,
+  kMaximum,
+};
+
+// PredContext in DdiMon/predicate.h
+struct PredContext {
+  uint64_t fields[static_cast<uint32_t>(PredField::kMaximum)];
+};
+
+// PredVerdict in DdiMon/predicate.h
+enum class PredVerdict : uint32_t {
+  kDrop,
+  kCount,
+  kLog,
+  kLogAndArmPost,
+  kMaximum,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+// Assembles source into a program. An error message has a line number
+// relative to first_line, which is the line number of the first line of source
+// in a file.
+bool AssemblePredicate(const std::string& source, int first_line,
+                       std::vector<PredInstruction>* program,
+                       std::string* error);
+
+// Checks a program with the same rules as PredVerify() of the driver, and sets
+// a reason to error when it is rejected
+bool VerifyPredicate(const PredInstruction* program, size_t count,
+                     std::string* error);
+
+// Converts a verified program into source that AssemblePredicate() accepts.
+// Jump targets are labeled as L<index>.
+std::string DisassemblePredicate(const PredInstruction* program, size_t count);
+
+// Interprets a program verified by VerifyPredicate() in the same way as
+// PredExecute() of the driver
+PredVerdict ExecutePredicate(const PredInstruction* program, size_t count,
+                             const PredContext& context);
+
+// Returns a name of a field used in source, or nullptr if it is invalid
+const char* GetPredicateFieldName(PredField field);
+
+// Returns a name of a verdict used in source, or nullptr if it is invalid
+const char* GetPredicateVerdictName(PredVerdict verdict);
+
+}  // namespace ddimon
+
+#endif  // DDIMON_TOOLS_PREDICATE_H_
@@ -0,0 +1,306 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests the predicate assembler, verifier and interpreter with known good and
+/// bad programs. Run with make test.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "predicate.h"
+
+namespace {
+
+using ddimon::PredContext;
+using ddimon::PredField;
+using ddimon::PredInstruction;
+using ddimon::PredOpcode;
+using ddimon::PredVerdict;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+// Reports a failure without stopping the remaining tests
+#define EXPECT(condition)                                          \
+  do {                                                             \
+    if (!(condition)) {                                            \
+      fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__,   \
+              #condition);                                         \
+      ++g_failures;                                                \
+    }                                                              \
+  } while (0)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A program that should be rejected and why
+struct BadProgram {
+  const char* description;
+  std::vector<PredInstruction> program;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+int g_failures;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Assembles source that must be accepted
+std::vector<PredInstruction> Assemble(const std::string& source) {
+  std::vector<PredInstruction> program;
+  std::string error;
+  if (!ddimon::AssemblePredicate(source, 1, &program, &error)) {
+    fprintf(stderr, "unexpected error: %s\n%s", error.c_str(),
+            source.c_str());
+    ++g_failures;
+  }
+  return program;
+}
+
+// Assembles source and runs it with the context
+PredVerdict Run(const std::string& source, const PredContext& context) {
+  const auto program = Assemble(source);
+  if (program.empty()) {
+    return PredVerdict::kMaximum;
+  }
+  return ddimon::ExecutePredicate(program.data(), program.size(), context);
+}
+
+PredContext MakeContext(PredField field, uint64_t value) {
+  PredContext context = {};
+  context.fields[static_cast<uint32_t>(field)] = value;
+  return context;
+}
+
+PredInstruction Insn(PredOpcode opcode, uint8_t dst, uint8_t src,
+                     int32_t imm) {
+  return {opcode, dst, src, 0, imm};
+}
+
+void TestPoolTagFilter() {
+  const auto source =
+      "  ld r0, arg3          ; Tag\n"
+      "  li r1, 0x6d696444    ; 'Ddim'\n"
+      "  jne r0, r1, other\n"
+      "  ret log_post\n"
+      "other:\n"
+      "  ret count\n";
+  EXPECT(Run(source, MakeContext(PredField::kArgument3, 0x6d696444)) ==
+         PredVerdict::kLogAndArmPost);
+  EXPECT(Run(source, MakeContext(PredField::kArgument3, 0x656e6f4e)) ==
+         PredVerdict::kCount);
+  EXPECT(Run(source, MakeContext(PredField::kArgument2, 0x6d696444)) ==
+         PredVerdict::kCount);
+}
+
+void TestFields() {
+  const char* const names[] = {
+      "arg1", "arg2", "arg3", "arg4", "retaddr", "cr3", "pid", "tid", "time",
+  };
+  for (uint32_t i = 0; i < static_cast<uint32_t>(PredField::kMaximum); ++i) {
+    const auto source = std::string("  ld r2, ") + names[i] +
+                        "\n"
+                        "  li r3, 7\n"
+                        "  jeq r2, r3, hit\n"
+                        "  ret drop\n"
+                        "hit:\n"
+                        "  ret log\n";
+    const auto field = static_cast<PredField>(i);
+    EXPECT(Run(source, MakeContext(field, 7)) == PredVerdict::kLog);
+    EXPECT(Run(source, MakeContext(field, 8)) == PredVerdict::kDrop);
+  }
+}
+
+void TestArithmetic() {
+  // li sign-extends, so -1 is the largest unsigned value
+  EXPECT(Run("  li r0, -1\n"
+             "  li r1, 0x7fffffff\n"
+             "  ja r0, r1, above\n"
+             "  ret drop\n"
+             "above:\n"
+             "  ret log\n",
+             {}) == PredVerdict::kLog);
+
+  // 0 - 1 wraps around and compares above 0
+  EXPECT(Run("  li r1, 1\n"
+             "  sub r0, r1\n"
+             "  jb r0, r1, below\n"
+             "  ret log\n"
+             "below:\n"
+             "  ret drop\n",
+             {}) == PredVerdict::kLog);
+
+  // Shift counts are masked with 63, so shifting by 65 shifts by 1
+  EXPECT(Run("  li r0, 1\n"
+             "  li r1, 65\n"
+             "  shl r0, r1\n"
+             "  li r2, 2\n"
+             "  jeq r0, r2, ok\n"
+             "  ret drop\n"
+             "ok:\n"
+             "  ret count\n",
+             {}) == PredVerdict::kCount);
+
+  // Extract the high byte of the process ID
+  EXPECT(Run("  ld r0, pid\n"
+             "  li r1, 8\n"
+             "  shr r0, r1\n"
+             "  li r1, 0xff\n"
+             "  and r0, r1\n"
+             "  li r2, 0x12\n"
+             "  xor r0, r2\n"
+             "  li r3, 0\n"
+             "  or r0, r3\n"
+             "  add r0, r3\n"
+             "  jne r0, r3, other\n"
+             "  ret log\n"
+             "other:\n"
+             "  ret drop\n",
+             MakeContext(PredField::kProcessId, 0x1234)) == PredVerdict::kLog);
+
+  // An unconditional jump skips instructions
+  EXPECT(Run("  jmp end\n"
+             "  ret drop\n"
+             "  ret count\n"
+             "end:\n"
+             "  ret log_post\n",
+             {}) == PredVerdict::kLogAndArmPost);
+}
+
+void TestRoundTrip() {
+  const auto program = Assemble(
+      "  ld r0, retaddr\n"
+      "  li r1, -16\n"
+      "  and r0, r1\n"
+      "  li r2, 0x1000\n"
+      "  jb r0, r2, low\n"
+      "  jmp high\n"
+      "low:\n"
+      "  ret drop\n"
+      "high:\n"
+      "  ret log\n");
+  const auto source =
+      ddimon::DisassemblePredicate(program.data(), program.size());
+  const auto reassembled = Assemble(source);
+  EXPECT(reassembled.size() == program.size());
+  for (size_t i = 0; i < program.size() && i < reassembled.size(); ++i) {
+    EXPECT(reassembled[i].opcode == program[i].opcode &&
+           reassembled[i].dst == program[i].dst &&
+           reassembled[i].src == program[i].src &&
+           reassembled[i].imm == program[i].imm);
+  }
+}
+
+void TestBadSources() {
+  std::string max_program;
+  for (uint32_t i = 0; i < ddimon::kPredMaxInstructions - 1; ++i) {
+    max_program += "  li r0, 0\n";
+  }
+  max_program += "  ret log\n";
+  EXPECT(Assemble(max_program).size() == ddimon::kPredMaxInstructions);
+
+  const char* const sources[] = {
+      "",                                           // Empty
+      "  li r0, 1\n",                               // Not ending with ret
+      "  li r4, 1\n  ret log\n",                    // No such register
+      "  ld r0, arg5\n  ret log\n",                 // No such field
+      "  li r0, 0x80000000\n  ret log\n",           // Out of int32_t
+      "  li r0, 1x\n  ret log\n",                   // Not a number
+      "  ret maybe\n",                              // No such verdict
+      "  mov r0, r1\n  ret log\n",                  // No such instruction
+      "  add r0\n  ret log\n",                      // Missing an operand
+      "  add r0, r1, r2\n  ret log\n",              // Extra operand
+      "  jmp nowhere\n  ret log\n",                 // Undefined label
+      "a:\n  jmp a\n  ret log\n",                   // Backward jump
+      "a:\n  li r0, 0\n  jeq r0, r0, a\n  ret log\n",
+      "  jmp end\n  ret log\nend:\n",               // Jump off the end
+      "a:\na:\n  ret log\n",                        // Duplicate label
+      "1a:\n  ret log\n",                           // Invalid label
+  };
+  for (const auto source : sources) {
+    std::vector<PredInstruction> program;
+    std::string error;
+    const auto accepted =
+        ddimon::AssemblePredicate(source, 1, &program, &error);
+    EXPECT(!accepted && !error.empty());
+    if (accepted) {
+      fprintf(stderr, "accepted:\n%s", source);
+    }
+  }
+
+  std::vector<PredInstruction> program;
+  std::string error;
+  EXPECT(!ddimon::AssemblePredicate(max_program + "  ret log\n", 1, &program,
+                                    &error));
+}
+
+void TestBadBinaries() {
+  const auto ret_log = Insn(PredOpcode::kReturn, 0, 0, 2);
+  std::vector<PredInstruction> too_long(ddimon::kPredMaxInstructions + 1,
+                                        ret_log);
+  auto reserved = ret_log;
+  reserved.reserved = 1;
+
+  const BadProgram programs[] = {
+      {"empty", {}},
+      {"too long", too_long},
+      {"no ret", {Insn(PredOpcode::kLoadImmediate, 0, 0, 0)}},
+      {"reserved", {reserved}},
+      {"dst", {Insn(PredOpcode::kAdd, 4, 0, 0), ret_log}},
+      {"src", {Insn(PredOpcode::kAdd, 0, 4, 0), ret_log}},
+      {"opcode 0", {Insn(static_cast<PredOpcode>(0), 0, 0, 0), ret_log}},
+      {"opcode max", {Insn(PredOpcode::kMaximum, 0, 0, 0), ret_log}},
+      {"field -1", {Insn(PredOpcode::kLoadContext, 0, 0, -1), ret_log}},
+      {"field max", {Insn(PredOpcode::kLoadContext, 0, 0, 9), ret_log}},
+      {"jump back", {Insn(PredOpcode::kJump, 0, 0, -1), ret_log}},
+      {"jump off", {Insn(PredOpcode::kJump, 0, 0, 1), ret_log}},
+      {"jeq off", {Insn(PredOpcode::kJumpIfEqual, 0, 0, 1), ret_log}},
+      {"verdict -1", {Insn(PredOpcode::kReturn, 0, 0, -1)}},
+      {"verdict max", {Insn(PredOpcode::kReturn, 0, 0, 4)}},
+  };
+  for (const auto& bad : programs) {
+    std::string error;
+    const auto accepted = ddimon::VerifyPredicate(bad.program.data(),
+                                                  bad.program.size(), &error);
+    EXPECT(!accepted && !error.empty());
+    if (accepted) {
+      fprintf(stderr, "accepted: %s\n", bad.description);
+    }
+  }
+
+  // The smallest valid jump lands on the last instruction
+  const std::vector<PredInstruction> good = {
+      Insn(PredOpcode::kJump, 0, 0, 0), ret_log};
+  std::string error;
+  EXPECT(ddimon::VerifyPredicate(good.data(), good.size(), &error));
+}
+
+}  // namespace
+
+int main() {
+  TestPoolTagFilter();
+  TestFields();
+  TestArithmetic();
+  TestRoundTrip();
+  TestBadSources();
+  TestBadBinaries();
+  if (g_failures) {
+    fprintf(stderr, "%d failures\n", g_failures);
+    return EXIT_FAILURE;
+  }
+  printf("All tests passed.\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,646 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a symbol index built from a module snapshot.
+
+#include "symbol_index.h"
+#include <dirent.h>
+#include <strings.h>
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "ddimon_formats.h"
+
+namespace ddimon {
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Signature at the beginning of an MSF 7.0 (PDB) file
+const char kMsfMagic[] = "Microsoft C/C++ MSF 7.00\r\n\x1a" "DS\0\0";
+
+// Fixed stream indexes of a PDB file
+const uint32_t kPdbInfoStream = 1;
+const uint32_t kPdbDbiStream = 3;
+
+// An index of a section header stream in the optional debug header of DBI
+const uint32_t kDbiSectionHeaderStreamIndex = 5;
+
+// S_PUB32; a kind of a public symbol record
+const uint16_t kSymbolKindPublic32 = 0x110e;
+
+// A stream index meaning no stream
+const uint16_t kPdbNilStream = 0xffff;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A symbol collected before an index is written. Lower priority wins when
+// multiple symbols share the same RVA.
+struct RawSymbol {
+  uint32_t rva;
+  int priority;
+  std::string name;
+};
+
+// A module collected before an index is written
+struct RawModule {
+  ModuleSnapshotRecord record;
+  std::vector<RawSymbol> symbols;
+};
+
+// Reads streams of an MSF 7.0 file
+class MsfFile {
+ public:
+  bool Open(const char* path, std::string* error);
+  bool ReadStream(uint32_t index, std::vector<uint8_t>* stream) const;
+
+ private:
+  bool ReadBlocks(const uint32_t* blocks, size_t block_count, size_t size,
+                  std::vector<uint8_t>* stream) const;
+
+  MappedFile file_;
+  uint32_t block_size_ = 0;
+  std::vector<uint32_t> stream_sizes_;
+  std::vector<std::vector<uint32_t>> stream_blocks_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Copies a value at the offset of the buffer. Returns false if out of bounds.
+template <typename T>
+bool ReadValue(const uint8_t* data, size_t size, size_t offset, T* value) {
+  if (offset > size || size - offset < sizeof(T)) {
+    return false;
+  }
+  memcpy(value, data + offset, sizeof(T));
+  return true;
+}
+
+template <typename T>
+bool ReadValue(const std::vector<uint8_t>& data, size_t offset, T* value) {
+  return ReadValue(data.data(), data.size(), offset, value);
+}
+
+// Returns a null-terminated string at the offset, or "" if out of bounds
+std::string ReadString(const uint8_t* data, size_t size, size_t offset) {
+  if (offset >= size) {
+    return std::string();
+  }
+  const auto begin = reinterpret_cast<const char*>(data + offset);
+  return std::string(begin, strnlen(begin, size - offset));
+}
+
+// Returns a path of a file in the directory whose name matches case
+// insensitively, or "" if not found
+std::string FindFile(const std::string& directory, const std::string& name) {
+  const auto dir = opendir(directory.c_str());
+  if (!dir) {
+    return std::string();
+  }
+  std::string path;
+  while (const auto entry = readdir(dir)) {
+    if (strcasecmp(entry->d_name, name.c_str()) == 0) {
+      path = directory + "/" + entry->d_name;
+      break;
+    }
+  }
+  closedir(dir);
+  return path;
+}
+
+// Returns a name of a directory for a PDB in the symbol store layout
+std::string GetSymbolStoreKey(const ModuleSnapshotRecord& record) {
+  char key[64] = {};
+  const auto& guid = record.pdb_guid;
+  snprintf(key, sizeof(key),
+           "%08X%04X%04X%02X%02X%02X%02X%02X%02X%02X%02X%X", guid.data1,
+           guid.data2, guid.data3, guid.data4[0], guid.data4[1], guid.data4[2],
+           guid.data4[3], guid.data4[4], guid.data4[5], guid.data4[6],
+           guid.data4[7], record.pdb_age);
+  return key;
+}
+
+// Converts an RVA of a PE image to a file offset. Returns false if the RVA is
+// not backed by file contents.
+bool RvaToFileOffset(const uint8_t* image, size_t size, size_t section_offset,
+                     uint16_t section_count, uint32_t rva, size_t* offset) {
+  for (auto i = 0u; i < section_count; ++i) {
+    const auto header = section_offset + i * 40;
+    uint32_t virtual_size = 0, virtual_address = 0, raw_size = 0, raw_ptr = 0;
+    if (!ReadValue(image, size, header + 8, &virtual_size) ||
+        !ReadValue(image, size, header + 12, &virtual_address) ||
+        !ReadValue(image, size, header + 16, &raw_size) ||
+        !ReadValue(image, size, header + 20, &raw_ptr)) {
+      return false;
+    }
+    const auto section_size = std::max(virtual_size, raw_size);
+    if (rva >= virtual_address && rva - virtual_address < section_size) {
+      if (rva - virtual_address >= raw_size) {
+        return false;
+      }
+      *offset = raw_ptr + (rva - virtual_address);
+      return *offset < size;
+    }
+  }
+  return false;
+}
+
+// Collects exported symbols of a PE image if it matches the record
+bool ReadExports(const char* path, const ModuleSnapshotRecord& record,
+                 std::vector<RawSymbol>* symbols, std::string* error) {
+  MappedFile file;
+  if (!file.Open(path, error)) {
+    return false;
+  }
+  const auto image = file.data();
+  const auto size = file.size();
+
+  uint32_t nt_offset = 0, signature = 0;
+  if (!ReadValue(image, size, 0x3c, &nt_offset) ||
+      !ReadValue(image, size, nt_offset, &signature) ||
+      signature != 0x00004550) {
+    *error = std::string(path) + ": not a PE image";
+    return false;
+  }
+  const auto file_header = nt_offset + 4;
+  const auto optional_header = file_header + 20;
+  uint16_t section_count = 0, optional_header_size = 0, magic = 0;
+  uint32_t time_date_stamp = 0, size_of_image = 0;
+  if (!ReadValue(image, size, file_header + 2, &section_count) ||
+      !ReadValue(image, size, file_header + 4, &time_date_stamp) ||
+      !ReadValue(image, size, file_header + 16, &optional_header_size) ||
+      !ReadValue(image, size, optional_header, &magic) ||
+      !ReadValue(image, size, optional_header + 56, &size_of_image)) {
+    *error = std::string(path) + ": truncated PE headers";
+    return false;
+  }
+  if (time_date_stamp != record.time_date_stamp ||
+      size_of_image != record.size_of_image) {
+    *error = std::string(path) + ": a different build of the image";
+    return false;
+  }
+
+  const auto data_directories = optional_header + ((magic == 0x20b) ? 112 : 96);
+  uint32_t export_rva = 0, export_size = 0;
+  if (!ReadValue(image, size, data_directories, &export_rva) ||
+      !ReadValue(image, size, data_directories + 4, &export_size)) {
+    *error = std::string(path) + ": truncated PE headers";
+    return false;
+  }
+  if (!export_rva) {
+    return true;
+  }
+
+  const auto sections = optional_header + optional_header_size;
+  size_t export_offset = 0;
+  uint32_t name_count = 0, functions_rva = 0, names_rva = 0, ordinals_rva = 0;
+  uint32_t function_count = 0;
+  if (!RvaToFileOffset(image, size, sections, section_count, export_rva,
+                       &export_offset) ||
+      !ReadValue(image, size, export_offset + 20, &function_count) ||
+      !ReadValue(image, size, export_offset + 24, &name_count) ||
+      !ReadValue(image, size, export_offset + 28, &functions_rva) ||
+      !ReadValue(image, size, export_offset + 32, &names_rva) ||
+      !ReadValue(image, size, export_offset + 36, &ordinals_rva)) {
+    *error = std::string(path) + ": corrupted export directory";
+    return false;
+  }
+
+  size_t functions = 0, names = 0, ordinals = 0;
+  if (!RvaToFileOffset(image, size, sections, section_count, functions_rva,
+                       &functions) ||
+      !RvaToFileOffset(image, size, sections, section_count, names_rva,
+                       &names) ||
+      !RvaToFileOffset(image, size, sections, section_count, ordinals_rva,
+                       &ordinals)) {
+    *error = std::string(path) + ": corrupted export directory";
+    return false;
+  }
+  for (auto i = 0u; i < name_count; ++i) {
+    uint32_t name_rva = 0, function_rva = 0;
+    uint16_t ordinal = 0;
+    size_t name_offset = 0;
+    if (!ReadValue(image, size, names + i * 4, &name_rva) ||
+        !ReadValue(image, size, ordinals + i * 2, &ordinal) ||
+        ordinal >= function_count ||
+        !ReadValue(image, size, functions + ordinal * 4, &function_rva) ||
+        !RvaToFileOffset(image, size, sections, section_count, name_rva,
+                         &name_offset)) {
+      continue;
+    }
+    // Forwarders point to strings in the export directory
+    if (function_rva >= export_rva && function_rva - export_rva < export_size) {
+      continue;
+    }
+    symbols->push_back(
+        {function_rva, 1, ReadString(image, size, name_offset)});
+  }
+  return true;
+}
+
+// Maps the file and reads the stream directory
+bool MsfFile::Open(const char* path, std::string* error) {
+  if (!file_.Open(path, error)) {
+    return false;
+  }
+  const auto data = file_.data();
+  const auto size = file_.size();
+  uint32_t directory_size = 0, block_map_address = 0;
+  if (size < sizeof(kMsfMagic) - 1 ||
+      memcmp(data, kMsfMagic, sizeof(kMsfMagic) - 1) != 0 ||
+      !ReadValue(data, size, 32, &block_size_) ||
+      !ReadValue(data, size, 44, &directory_size) ||
+      !ReadValue(data, size, 52, &block_map_address) || !block_size_) {
+    *error = std::string(path) + ": not a PDB file";
+    return false;
+  }
+
+  // The block map lists blocks holding the stream directory
+  const auto directory_block_count =
+      (directory_size + block_size_ - 1) / block_size_;
+  const auto block_map_offset =
+      static_cast<size_t>(block_map_address) * block_size_;
+  if (block_map_offset > size ||
+      (size - block_map_offset) / 4 < directory_block_count) {
+    *error = std::string(path) + ": corrupted stream directory";
+    return false;
+  }
+  std::vector<uint32_t> directory_blocks(directory_block_count);
+  memcpy(directory_blocks.data(), data + block_map_offset,
+         directory_block_count * 4);
+  std::vector<uint8_t> directory;
+  if (!ReadBlocks(directory_blocks.data(), directory_blocks.size(),
+                  directory_size, &directory)) {
+    *error = std::string(path) + ": corrupted stream directory";
+    return false;
+  }
+
+  uint32_t stream_count = 0;
+  if (!ReadValue(directory, 0, &stream_count) ||
+      (directory.size() - 4) / 4 < stream_count) {
+    *error = std::string(path) + ": corrupted stream directory";
+    return false;
+  }
+  stream_sizes_.resize(stream_count);
+  memcpy(stream_sizes_.data(), directory.data() + 4, stream_count * 4);
+  size_t offset = 4 + stream_count * 4;
+  stream_blocks_.resize(stream_count);
+  for (auto i = 0u; i < stream_count; ++i) {
+    if (stream_sizes_[i] == UINT32_MAX) {
+      stream_sizes_[i] = 0;
+    }
+    const auto block_count = (stream_sizes_[i] + block_size_ - 1) / block_size_;
+    if ((directory.size() - offset) / 4 < block_count) {
+      *error = std::string(path) + ": corrupted stream directory";
+      return false;
+    }
+    stream_blocks_[i].resize(block_count);
+    memcpy(stream_blocks_[i].data(), directory.data() + offset,
+           block_count * 4);
+    offset += block_count * 4;
+  }
+  return true;
+}
+
+// Concatenates blocks of a stream. Returns false if the stream does not exist.
+bool MsfFile::ReadStream(uint32_t index, std::vector<uint8_t>* stream) const {
+  if (index >= stream_sizes_.size()) {
+    return false;
+  }
+  return ReadBlocks(stream_blocks_[index].data(), stream_blocks_[index].size(),
+                    stream_sizes_[index], stream);
+}
+
+// Concatenates the blocks and truncates them to the size
+bool MsfFile::ReadBlocks(const uint32_t* blocks, size_t block_count,
+                         size_t size, std::vector<uint8_t>* stream) const {
+  stream->resize(block_count * block_size_);
+  for (size_t i = 0; i < block_count; ++i) {
+    const auto offset = static_cast<size_t>(blocks[i]) * block_size_;
+    if (offset > file_.size() || file_.size() - offset < block_size_) {
+      return false;
+    }
+    memcpy(stream->data() + i * block_size_, file_.data() + offset,
+           block_size_);
+  }
+  stream->resize(size);
+  return true;
+}
+
+// Collects public symbols from a PDB file if it matches the record
+bool ReadPublics(const char* path, const ModuleSnapshotRecord& record,
+                 std::vector<RawSymbol>* symbols, std::string* error) {
+  MsfFile pdb;
+  if (!pdb.Open(path, error)) {
+    return false;
+  }
+
+  // A PDB info stream holds a GUID at offset 12
+  std::vector<uint8_t> info;
+  Guid guid = {};
+  if (!pdb.ReadStream(kPdbInfoStream, &info) || !ReadValue(info, 12, &guid)) {
+    *error = std::string(path) + ": no PDB info stream";
+    return false;
+  }
+  if (memcmp(&guid, &record.pdb_guid, sizeof(guid)) != 0) {
+    *error = std::string(path) + ": a PDB for a different build";
+    return false;
+  }
+
+  // Locate a symbol record stream and a section header stream through DBI
+  std::vector<uint8_t> dbi;
+  uint16_t symbol_record_stream = 0;
+  int32_t substream_sizes[6] = {};
+  int32_t debug_header_size = 0;
+  if (!pdb.ReadStream(kPdbDbiStream, &dbi) ||
+      !ReadValue(dbi, 20, &symbol_record_stream) ||
+      !ReadValue(dbi, 24, &substream_sizes[0]) ||
+      !ReadValue(dbi, 28, &substream_sizes[1]) ||
+      !ReadValue(dbi, 32, &substream_sizes[2]) ||
+      !ReadValue(dbi, 36, &substream_sizes[3]) ||
+      !ReadValue(dbi, 40, &substream_sizes[4]) ||
+      !ReadValue(dbi, 52, &substream_sizes[5]) ||
+      !ReadValue(dbi, 48, &debug_header_size)) {
+    *error = std::string(path) + ": no DBI stream";
+    return false;
+  }
+  size_t debug_header = 64;
+  for (const auto substream_size : substream_sizes) {
+    debug_header += static_cast<uint32_t>(substream_size);
+  }
+  uint16_t section_header_stream = kPdbNilStream;
+  if (debug_header_size > 0 &&
+      static_cast<uint32_t>(debug_header_size) / 2 >
+          kDbiSectionHeaderStreamIndex) {
+    ReadValue(dbi, debug_header + kDbiSectionHeaderStreamIndex * 2,
+              &section_header_stream);
+  }
+  std::vector<uint8_t> sections;
+  if (section_header_stream == kPdbNilStream ||
+      !pdb.ReadStream(section_header_stream, &sections)) {
+    *error = std::string(path) + ": no section headers";
+    return false;
+  }
+
+  std::vector<uint8_t> records;
+  if (symbol_record_stream == kPdbNilStream ||
+      !pdb.ReadStream(symbol_record_stream, &records)) {
+    *error = std::string(path) + ": no symbol records";
+    return false;
+  }
+  for (size_t offset = 0; offset + 4 <= records.size();) {
+    uint16_t length = 0, kind = 0;
+    ReadValue(records, offset, &length);
+    ReadValue(records, offset + 2, &kind);
+    const auto next = offset + 2 + length;
+    if (next > records.size()) {
+      break;
+    }
+    uint32_t symbol_offset = 0, section_va = 0;
+    uint16_t segment = 0;
+    if (kind == kSymbolKindPublic32 &&
+        ReadValue(records, offset + 8, &symbol_offset) &&
+        ReadValue(records, offset + 12, &segment) && segment &&
+        ReadValue(sections, (segment - 1) * 40 + 12, &section_va)) {
+      symbols->push_back({section_va + symbol_offset, 0,
+                          ReadString(records.data(), next, offset + 14)});
+    }
+    offset = next;
+  }
+  return true;
+}
+
+// Collects symbols of the image from the sources. Failures are not fatal and
+// only reported.
+void CollectSymbols(const SymbolSources& sources, RawModule* module) {
+  const auto& record = module->record;
+  std::string error;
+  if (!sources.image_directory.empty()) {
+    const auto path = FindFile(sources.image_directory, record.image_name);
+    if (!path.empty() &&
+        !ReadExports(path.c_str(), record, &module->symbols, &error)) {
+      fprintf(stderr, "warning: %s\n", error.c_str());
+    }
+  }
+  if (!sources.symbol_directory.empty() &&
+      (record.flags & kModuleSnapshotFlagHasPdbInfo)) {
+    auto path = FindFile(sources.symbol_directory, record.pdb_name);
+    if (!path.empty()) {
+      // Either a PDB file itself, or a directory of the symbol store layout
+      const auto store_path =
+          FindFile(path + "/" + GetSymbolStoreKey(record), record.pdb_name);
+      if (!store_path.empty()) {
+        path = store_path;
+      }
+      if (!ReadPublics(path.c_str(), record, &module->symbols, &error)) {
+        fprintf(stderr, "warning: %s\n", error.c_str());
+      }
+    }
+  }
+
+  // Sort by RVA and keep one symbol for each RVA
+  auto& symbols = module->symbols;
+  std::sort(symbols.begin(), symbols.end(),
+            [](const RawSymbol& lhs, const RawSymbol& rhs) {
+              return (lhs.rva != rhs.rva) ? lhs.rva < rhs.rva
+                                          : lhs.priority < rhs.priority;
+            });
+  symbols.erase(std::unique(symbols.begin(), symbols.end(),
+                            [](const RawSymbol& lhs, const RawSymbol& rhs) {
+                              return lhs.rva == rhs.rva;
+                            }),
+                symbols.end());
+}
+
+}  // namespace
+
+// Builds an index file from a module snapshot file and symbols in the sources
+bool BuildSymbolIndex(const char* snapshot_path, const SymbolSources& sources,
+                      const char* index_path, std::string* error) {
+  MappedFile snapshot;
+  if (!snapshot.Open(snapshot_path, error)) {
+    return false;
+  }
+  ModuleSnapshotFileHeader snapshot_header = {};
+  if (!ReadValue(snapshot.data(), snapshot.size(), 0, &snapshot_header) ||
+      snapshot_header.magic != kModuleSnapshotFileMagic ||
+      snapshot_header.version != kModuleSnapshotFileVersion ||
+      snapshot_header.record_size != sizeof(ModuleSnapshotRecord) ||
+      (snapshot.size() - sizeof(snapshot_header)) /
+              sizeof(ModuleSnapshotRecord) <
+          snapshot_header.record_count) {
+    *error = std::string(snapshot_path) + ": not a module snapshot file";
+    return false;
+  }
+
+  std::vector<RawModule> modules(snapshot_header.record_count);
+  for (auto i = 0u; i < snapshot_header.record_count; ++i) {
+    auto& module = modules[i];
+    memcpy(&module.record,
+           snapshot.data() + sizeof(snapshot_header) +
+               i * sizeof(ModuleSnapshotRecord),
+           sizeof(ModuleSnapshotRecord));
+    module.record.image_name[sizeof(module.record.image_name) - 1] = '\0';
+    module.record.pdb_name[sizeof(module.record.pdb_name) - 1] = '\0';
+    CollectSymbols(sources, &module);
+  }
+  std::stable_sort(modules.begin(), modules.end(),
+                   [](const RawModule& lhs, const RawModule& rhs) {
+                     return (lhs.record.image_base != rhs.record.image_base)
+                                ? lhs.record.image_base < rhs.record.image_base
+                                : lhs.record.load_time < rhs.record.load_time;
+                   });
+
+  // Lay out modules, symbols and strings
+  SymbolIndexFileHeader header = {};
+  header.magic = kSymbolIndexFileMagic;
+  header.version = kSymbolIndexFileVersion;
+  header.module_count = static_cast<uint32_t>(modules.size());
+  header.start_time = snapshot_header.start_time;
+  std::vector<SymbolIndexModule> index_modules;
+  std::vector<SymbolIndexSymbol> index_symbols;
+  std::string strings;
+  const auto add_string = [&strings](const std::string& value) {
+    const auto offset = static_cast<uint32_t>(strings.size());
+    strings.append(value.c_str(), value.size() + 1);
+    return offset;
+  };
+  for (const auto& module : modules) {
+    const auto& record = module.record;
+    header.max_image_size = std::max(header.max_image_size,
+                                     record.size_of_image);
+    index_modules.push_back({record.image_base, record.size_of_image,
+                             add_string(record.image_name), record.load_time,
+                             index_symbols.size(),
+                             static_cast<uint32_t>(module.symbols.size()),
+                             record.flags});
+    for (const auto& symbol : module.symbols) {
+      index_symbols.push_back({symbol.rva, add_string(symbol.name)});
+    }
+  }
+  header.symbol_count = index_symbols.size();
+  header.strings_size = strings.size();
+
+  const auto file = fopen(index_path, "wb");
+  if (!file) {
+    *error = std::string(index_path) + ": " + strerror(errno);
+    return false;
+  }
+  const auto written =
+      fwrite(&header, sizeof(header), 1, file) == 1 &&
+      fwrite(index_modules.data(), sizeof(SymbolIndexModule),
+             index_modules.size(), file) == index_modules.size() &&
+      fwrite(index_symbols.data(), sizeof(SymbolIndexSymbol),
+             index_symbols.size(), file) == index_symbols.size() &&
+      fwrite(strings.data(), 1, strings.size(), file) == strings.size();
+  if (fclose(file) != 0 || !written) {
+    *error = std::string(index_path) + ": failed to write";
+    return false;
+  }
+  return true;
+}
+
+// Maps and validates an index file
+bool SymbolIndex::Open(const char* path, std::string* error) {
+  if (!file_.Open(path, error)) {
+    return false;
+  }
+  const auto data = file_.data();
+  const auto size = file_.size();
+  header_ = reinterpret_cast<const SymbolIndexFileHeader*>(data);
+  if (size < sizeof(*header_) || header_->magic != kSymbolIndexFileMagic ||
+      header_->version != kSymbolIndexFileVersion) {
+    *error = std::string(path) + ": not a symbol index file";
+    return false;
+  }
+  const auto expected_size = sizeof(*header_) +
+                             header_->module_count * sizeof(SymbolIndexModule) +
+                             header_->symbol_count * sizeof(SymbolIndexSymbol) +
+                             header_->strings_size;
+  if (size != expected_size ||
+      (header_->strings_size && data[size - 1] != '\0')) {
+    *error = std::string(path) + ": corrupted symbol index file";
+    return false;
+  }
+  modules_ = reinterpret_cast<const SymbolIndexModule*>(header_ + 1);
+  symbols_ = reinterpret_cast<const SymbolIndexSymbol*>(modules_ +
+                                                        header_->module_count);
+  strings_ = reinterpret_cast<const char*>(symbols_ + header_->symbol_count);
+  for (auto i = 0u; i < header_->module_count; ++i) {
+    if (modules_[i].first_symbol > header_->symbol_count ||
+        header_->symbol_count - modules_[i].first_symbol <
+            modules_[i].symbol_count) {
+      *error = std::string(path) + ": corrupted symbol index file";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Resolves an address to an image and the nearest preceding symbol
+bool SymbolIndex::Resolve(uint64_t address, int64_t time,
+                          SymbolLocation* location) const {
+  // Modules are sorted by image_base. Walk back from the last module starting
+  // at or below the address while its range may still contain the address.
+  const auto end = modules_ + header_->module_count;
+  auto it = std::upper_bound(modules_, end, address,
+                             [](uint64_t value, const SymbolIndexModule& m) {
+                               return value < m.image_base;
+                             });
+  const SymbolIndexModule* latest = nullptr;
+  const SymbolIndexModule* latest_before = nullptr;
+  while (it != modules_) {
+    --it;
+    if (address - it->image_base >= header_->max_image_size) {
+      break;
+    }
+    if (address - it->image_base >= it->size_of_image) {
+      continue;
+    }
+    if (!latest || it->load_time > latest->load_time) {
+      latest = it;
+    }
+    // Images loaded before the snapshot started match entries of any time
+    const auto preloaded = (it->flags & kModuleSnapshotFlagPreloaded) != 0;
+    if ((preloaded || it->load_time <= time) &&
+        (!latest_before || it->load_time > latest_before->load_time)) {
+      latest_before = it;
+    }
+  }
+  const auto module = (time && latest_before) ? latest_before : latest;
+  if (!module) {
+    return false;
+  }
+
+  const auto rva = static_cast<uint32_t>(address - module->image_base);
+  const auto first = symbols_ + module->first_symbol;
+  const auto last = first + module->symbol_count;
+  const auto symbol = std::upper_bound(
+      first, last, rva, [](uint32_t value, const SymbolIndexSymbol& s) {
+        return value < s.rva;
+      });
+  location->image_name = strings_ + module->name_offset;
+  if (symbol == first) {
+    location->symbol_name = nullptr;
+    location->offset = rva;
+  } else {
+    location->symbol_name = strings_ + (symbol - 1)->name_offset;
+    location->offset = rva - (symbol - 1)->rva;
+  }
+  return true;
+}
+
+}  // namespace ddimon
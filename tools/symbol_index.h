@@ -0,0 +1,127 @@
+// Copyright (c) 2015-2016, tandasat. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to a symbol index built from a module snapshot.
+
+#ifndef DDIMON_TOOLS_SYMBOL_INDEX_H_
+#define DDIMON_TOOLS_SYMBOL_INDEX_H_
+
+#include <cstdint>
+#include <string>
+#include "mapped_file.h"
+
+namespace ddimon {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// 'DSYM'; a magic value of a symbol index file
+const uint32_t kSymbolIndexFileMagic = 0x4d595344;
+
+// A version of a symbol index file format
+const uint32_t kSymbolIndexFileVersion = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+#pragma pack(push, 1)
+
+// A header of a symbol index file. A file is laid out as below so that it can
+// be memory-mapped and searched in place:
+//
+//   SymbolIndexFileHeader
+//   SymbolIndexModule modules[module_count]   // sorted by image_base
+//   SymbolIndexSymbol symbols[symbol_count]   // sorted by rva in each module
+//   char strings[strings_size]                // null-terminated names
+struct SymbolIndexFileHeader {
+  uint32_t magic;            // kSymbolIndexFileMagic
+  uint32_t version;          // kSymbolIndexFileVersion
+  uint32_t module_count;
+  uint32_t max_image_size;   // The largest size_of_image of modules
+  uint64_t symbol_count;
+  uint64_t strings_size;
+  int64_t start_time;        // start_time of the module snapshot
+};
+static_assert(sizeof(SymbolIndexFileHeader) == 40, "Size check");
+
+// An image taken from ModuleSnapshotRecord
+struct SymbolIndexModule {
+  uint64_t image_base;
+  uint32_t size_of_image;
+  uint32_t name_offset;      // An offset of an image name in strings
+  int64_t load_time;
+  uint64_t first_symbol;     // An index of the first symbol of the module
+  uint32_t symbol_count;
+  uint32_t flags;            // ModuleSnapshotRecord::flags
+};
+static_assert(sizeof(SymbolIndexModule) == 40, "Size check");
+
+// An exported or public symbol
+struct SymbolIndexSymbol {
+  uint32_t rva;
+  uint32_t name_offset;      // An offset of a symbol name in strings
+};
+static_assert(sizeof(SymbolIndexSymbol) == 8, "Size check");
+
+#pragma pack(pop)
+
+// Where symbols of images are looked up when an index is built
+struct SymbolSources {
+  // A directory containing copies of images, such as ntoskrnl.exe, to read
+  // export tables from. Images whose time stamps and sizes differ from the
+  // snapshot are ignored.
+  std::string image_directory;
+
+  // A directory containing PDB files either directly or in the symbol store
+  // layout (<pdb name>/<GUID><age>/<pdb name>) to read public symbols from
+  std::string symbol_directory;
+};
+
+// A location that an address was resolved to
+struct SymbolLocation {
+  const char* image_name;
+  const char* symbol_name;   // nullptr if no symbol precedes the address
+  uint64_t offset;           // From the symbol, or from the image base
+};
+
+// A memory-mapped symbol index
+class SymbolIndex {
+ public:
+  // Maps and validates an index file
+  bool Open(const char* path, std::string* error);
+
+  // Resolves an address that appeared at system time. When time is 0, or no
+  // image loaded before time contains the address, the image loaded last is
+  // used.
+  bool Resolve(uint64_t address, int64_t time, SymbolLocation* location) const;
+
+  int64_t start_time() const { return header_->start_time; }
+
+ private:
+  MappedFile file_;
+  const SymbolIndexFileHeader* header_ = nullptr;
+  const SymbolIndexModule* modules_ = nullptr;
+  const SymbolIndexSymbol* symbols_ = nullptr;
+  const char* strings_ = nullptr;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+// Builds an index file from a module snapshot file (DdiMon.mod) and symbols
+// found in sources. Warnings about images without symbols are printed to
+// stderr.
+bool BuildSymbolIndex(const char* snapshot_path, const SymbolSources& sources,
+                      const char* index_path, std::string* error);
+
+}  // namespace ddimon
+
+#endif  // DDIMON_TOOLS_SYMBOL_INDEX_H_